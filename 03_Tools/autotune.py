@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+#
+# Run the PI gain auto-tuning, the motor identification and the hall sensor calibration of the firmware (COMMISSION_ENABLE, see Inc/commission.h) over
+# the parameter protocol (PARAM_SERIAL_USARTx, see Inc/param.h) and print the gains before and after.
+#
+# LIFT THE WHEELS first. Validate the settings on the Linux port before the board:
+#   04_Sim/build/hover_sim -J 0.03 &                          (prints the pseudo-terminal of the parameter port)
+#   python3 autotune.py --port /dev/pts/3 hall motor speed
+# then on the board, storing the results in Flash:
+#   python3 autotune.py --port /dev/ttyUSB0 --store current speed
+#
+# Needs a POSIX serial port (Linux, macOS), no extra package.
+
+import argparse
+import os
+import struct
+import sys
+import termios
+import time
+
+PARAM_START_FRAME = 0xABBA
+PARAM_FMT         = '<HBBiHH'
+PARAM_SIZE        = struct.calcsize(PARAM_FMT)
+
+CMD_READ, CMD_WRITE, CMD_STORE, CMD_REPLY = 1, 2, 3, 0x80
+
+ID_GAINS = [('cf_idKp', 8), ('cf_idKi', 9), ('cf_iqKp', 10), ('cf_iqKi', 11), ('cf_nKp', 12), ('cf_nKi', 13)]
+ID_TUNE  = 14
+ID_MOTOR = [('R', 15, 'mOhm'), ('L', 16, 'uH'), ('flux', 17, 'uWb')]
+
+ROUTINES = {'current': 1, 'speed': 2, 'motor': 3, 'hall': 4}
+STATES   = {0: 'idle', 1: 'busy', 2: 'done', 3: 'not ready (motors disabled, error or wheels turning)',
+            4: 'aborted (motors disabled, error, over current or injection current not reached)',
+            5: 'timeout', 6: 'oscillation, measurement or hall sectors not usable', 7: 'applied but not stored (Flash)'}
+STATUS   = {0: 'ok', 1: 'unknown parameter', 2: 'out of range', 3: 'read only', 4: 'command', 5: 'flash'}
+
+
+def crc16(data, crc=0xFFFF):
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) & 0xFFFF if crc & 0x8000 else (crc << 1) & 0xFFFF
+    return crc
+
+
+class ParamPort:
+    def __init__(self, path, baud):
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK)
+        attr = termios.tcgetattr(self.fd)
+        speed = getattr(termios, 'B%d' % baud)
+        attr[0] = 0                                         # iflag: raw
+        attr[1] = 0                                         # oflag
+        attr[2] = termios.CS8 | termios.CREAD | termios.CLOCAL
+        attr[3] = 0                                         # lflag
+        attr[4] = attr[5] = speed
+        termios.tcsetattr(self.fd, termios.TCSANOW, attr)
+        termios.tcflush(self.fd, termios.TCIOFLUSH)
+        self.rx = b''
+
+    def request(self, cmd, pid, value=0, timeout=0.5):
+        frame = struct.pack('<HBBiH', PARAM_START_FRAME, cmd, pid, value, 0)
+        os.write(self.fd, frame + struct.pack('<H', crc16(frame)))
+        end = time.time() + timeout
+        while time.time() < end:
+            try:
+                self.rx += os.read(self.fd, 256)
+            except BlockingIOError:
+                time.sleep(0.005)
+            pos = self.rx.find(struct.pack('<H', PARAM_START_FRAME))
+            while pos >= 0 and pos + PARAM_SIZE <= len(self.rx):
+                raw = self.rx[pos:pos + PARAM_SIZE]
+                _, rcmd, rid, rvalue, rstatus, rcrc = struct.unpack(PARAM_FMT, raw)
+                if crc16(raw[:-2]) == rcrc and rcmd == cmd | CMD_REPLY and rid == pid:
+                    self.rx = self.rx[pos + PARAM_SIZE:]
+                    return rvalue, rstatus
+                pos = self.rx.find(struct.pack('<H', PARAM_START_FRAME), pos + 1)
+            self.rx = self.rx[-PARAM_SIZE:]
+        raise TimeoutError('no reply for parameter %d' % pid)
+
+
+def print_gains(port, title):
+    values = ['%s %5d' % (name, port.request(CMD_READ, pid)[0]) for name, pid in ID_GAINS]
+    print('%-8s %s' % (title, '  '.join(values)))
+
+
+def main():
+    ap = argparse.ArgumentParser(description='PI gain auto-tuning over the parameter protocol')
+    ap.add_argument('--port', required=True, help='serial port of PARAM_SERIAL_USARTx, or the pseudo-terminal of 04_Sim')
+    ap.add_argument('--baud', type=int, default=38400)
+    ap.add_argument('--store', action='store_true', help='store the results in Flash (the motors are disabled for the write)')
+    ap.add_argument('routines', nargs='+', choices=sorted(ROUTINES),
+                    help='routines to run, in this order. motor: R, L, flux and the current loop gains derived from them, '
+                         'hall: hall sensor mapping and edge angles (run it first)')
+    args = ap.parse_args()
+
+    port = ParamPort(args.port, args.baud)
+    print_gains(port, 'before')
+    for name in args.routines:
+        value, status = port.request(CMD_STORE if args.store else CMD_WRITE, ID_TUNE, ROUTINES[name])
+        if status != 0:
+            sys.exit('%s: %s' % (name, STATUS.get(status, status)))
+        start = time.time()
+        while value == 1:
+            time.sleep(0.2)
+            value, _ = port.request(CMD_READ, ID_TUNE)
+        print('%-8s %s after %.1f s' % (name, STATES.get(value, value), time.time() - start))
+        if value not in (2, 7):
+            sys.exit(1)
+        if name == 'motor':
+            values = ['%s %d %s' % (par, port.request(CMD_READ, pid)[0], unit) for par, pid, unit in ID_MOTOR]
+            print('%-8s %s' % ('', '  '.join(values)))
+        time.sleep(1.0)                                     # the motors go back to the normal inputs
+    print_gains(port, 'after')
+
+
+if __name__ == '__main__':
+    main()
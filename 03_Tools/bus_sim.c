@@ -0,0 +1,351 @@
+/*
+* Host simulator of the multi-drop RS-485 bus: one host and several
+* virtual boards running the protocol core of the firmware on one
+* half-duplex line. It reports driver collisions, lost replies, the
+* achieved command rate and, with the sync frame, how far apart the
+* boards apply the same command.
+*
+* Build and run on Linux:
+*   gcc -O2 -Wall -I../Inc -o bus_sim bus_sim.c ../Src/bus_proto.c ../Src/crc.c
+*   ./bus_sim [-n nodes] [-b baud] [-g guard_us] [-p poll_us] [-t time_ms] [-s sync] [-d delay_us] [-c ppm]
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bus_proto.h"
+
+/* The time unit is 0.1 us. A node models the firmware: the idle line interrupt stamps the end of each frame with
+ * the local clock, the housekeeping interrupt parses the received bytes every poll period (with a random phase per
+ * node) with that stamp, starts the reply when it is due and releases the driver at the first poll after the last
+ * stop bit. The main loop runs every LOOP_US and applies the commands like Bus_WaitLoop(). The node clocks run
+ * off by -ppm to +ppm. The host is a PC with an automatic direction control adapter */
+#define TICKS_PER_US  10
+#define FIFO_SIZE     256
+#define HOST          0
+#define LOOP_US       5000            // DELAY_IN_MAIN_LOOP
+#define MAX_CYCLES    20000
+
+typedef struct {
+  // transmitter
+  uint8_t   tx[BUS_FRAME_SIZE(BUS_MAX_PAYLOAD)];
+  uint16_t  txLen, txPos;
+  uint32_t  byteEnd;                  // end of the byte being sent, 0 = idle
+  uint8_t   byteBad;                  // another driver was enabled during this byte
+  uint8_t   de;                       // driver enabled
+  // receiver
+  uint8_t   fifo[FIFO_SIZE];
+  uint16_t  fifoHead, fifoTail;
+  // node model
+  BusNode   node;
+  uint32_t  nextPoll;
+  uint8_t   txDone;                   // last stop bit sent, driver released at the next poll
+  double    ppm;                      // local clock error
+  uint32_t  rxEnd;                    // end of the last received byte, 0 = idle reported
+  uint32_t  idleStamp;                // local time of the last idle line
+  uint8_t   idleNew;
+  // main loop model
+  uint32_t  loopAt;                   // local time of the next iteration
+  uint8_t   syncReq, apply;
+  uint32_t  syncAt;
+  int16_t   cmdLatched, cmdApply;
+} Agent;
+
+static Agent    agents[1 + BUS_MAX_NODES];
+static int      nbNodes = 3;
+static uint32_t baud    = 115200;
+static uint32_t guardUs = 500;
+static uint32_t pollUs  = 125;        // housekeeping period: 16 kHz / ADC_HK_DIV
+static uint32_t timeMs  = 1000;
+static int      syncOn  = 1;
+static uint32_t delayUs = 2000;       // BUS_SYNC_DELAY_US
+static double   ppmMax  = 100;
+
+static uint32_t byteTicks;
+static uint32_t applyTime[1 + BUS_MAX_NODES][MAX_CYCLES];   // host time + 1 at which a node applied the command of a cycle
+
+static uint32_t localTime(const Agent *a, uint32_t t) {
+  return (uint32_t)(t + t * a->ppm / 1e6);
+}
+
+static void startTx(Agent *a, const uint8_t *frame, uint16_t len) {
+  memcpy(a->tx, frame, len);
+  a->txLen  = len;
+  a->txPos  = 0;
+  a->de     = 1;
+  a->txDone = 0;
+}
+
+/* Advance the transmitter of agent i at time t. Returns 1 when a byte is complete, with the byte in *c */
+static int stepTx(int i, uint32_t t, uint8_t *c, uint8_t *bad) {
+  Agent *a = &agents[i];
+
+  if (a->byteEnd && t >= a->byteEnd) {
+    *c          = a->tx[a->txPos++];
+    *bad        = a->byteBad;
+    a->byteEnd  = 0;
+    a->byteBad  = 0;
+    if (a->txPos >= a->txLen) {
+      a->txLen  = 0;
+      a->txDone = 1;
+      if (i == HOST) {
+        a->de   = 0;
+      }
+    } else {
+      a->byteEnd = t + byteTicks;                         // back to back, as the USART does
+    }
+    return 1;
+  }
+  if (!a->byteEnd && a->txPos < a->txLen) {
+    a->byteEnd = t + byteTicks;
+  }
+  return 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-n nodes] [-b baud] [-g guard_us] [-p poll_us] [-t time_ms] [-s sync] [-d delay_us] [-c ppm]\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  uint8_t  frame[BUS_FRAME_SIZE(BUS_MAX_PAYLOAD)];
+  uint8_t  payload[BUS_MAX_PAYLOAD];
+  BusRx    hostRx;
+  BusStatus status, nodeStatus[1 + BUS_MAX_NODES];
+  uint32_t slotTicks, turnTicks, loopTicks, syncStart, cycleTicks, t, tEnd, cycleStart = 0, syncTime = 0;
+  uint32_t collisions = 0, contention = 0, cycles = 0, requests = 0, replies = 0, lostReplies = 0;
+  uint32_t cycleReplies = 0, spreadMax = 0, spreadCnt = 0;
+  double   spreadSum = 0;
+  uint16_t len;
+  int      opt, i, active;
+
+  while ((opt = getopt(argc, argv, "n:b:g:p:t:s:d:c:")) != -1) {
+    switch (opt) {
+      case 'n': nbNodes = atoi(optarg); break;
+      case 'b': baud    = (uint32_t)atoi(optarg); break;
+      case 'g': guardUs = (uint32_t)atoi(optarg); break;
+      case 'p': pollUs  = (uint32_t)atoi(optarg); break;
+      case 't': timeMs  = (uint32_t)atoi(optarg); break;
+      case 's': syncOn  = atoi(optarg); break;
+      case 'd': delayUs = (uint32_t)atoi(optarg); break;
+      case 'c': ppmMax  = atof(optarg); break;
+      default:  usage(argv[0]);
+    }
+  }
+  if (nbNodes < 1 || nbNodes > BUS_MAX_NODES || baud == 0 || pollUs == 0 || timeMs > 400000) {
+    usage(argv[0]);
+  }
+
+  // Same timing as bus.h: slot = reply frame time + guard time. The nodes time the slots from the idle line,
+  // one character after the end of the request. The sync frame follows the last slot
+  byteTicks   = 10 * 1000000 * TICKS_PER_US / baud;
+  slotTicks   = BUS_FRAME_SIZE(BUS_STATUS_LEN) * byteTicks + guardUs * TICKS_PER_US;
+  turnTicks   = guardUs * TICKS_PER_US;
+  loopTicks   = LOOP_US * TICKS_PER_US;
+  syncStart   = (BUS_FRAME_SIZE(4 * nbNodes) + 1) * byteTicks + turnTicks + nbNodes * slotTicks;
+  cycleTicks  = syncStart + pollUs * TICKS_PER_US;
+  if (syncOn) {
+    cycleTicks += (BUS_FRAME_SIZE(4) + 1) * byteTicks + turnTicks;
+  }
+
+  srand(1);
+  memset(agents, 0, sizeof(agents));
+  memset(&hostRx, 0, sizeof(hostRx));
+  memset(nodeStatus, 0, sizeof(nodeStatus));
+  for (i = 1; i <= nbNodes; i++) {
+    busNodeInit(&agents[i].node, (uint8_t)i, TICKS_PER_US, slotTicks, turnTicks);
+    agents[i].nextPoll  = (uint32_t)rand() % (pollUs * TICKS_PER_US);
+    agents[i].loopAt    = (uint32_t)rand() % loopTicks;
+    agents[i].ppm       = nbNodes > 1 ? ppmMax * (2.0 * (i - 1) / (nbNodes - 1) - 1.0) : ppmMax;
+  }
+
+  printf("nodes %d, %u baud, guard %u us, poll %u us: slot %u us, cycle %u us\n",
+         nbNodes, baud, guardUs, pollUs, slotTicks / TICKS_PER_US, cycleTicks / TICKS_PER_US);
+  printf("clocks +/-%.0f ppm, %s\n", ppmMax, syncOn ? "sync" : "no sync");
+
+  tEnd = timeMs * 1000 * TICKS_PER_US;
+  for (t = 0; t < tEnd; t++) {
+
+    // Host: broadcast the commands of all nodes every cycle, once the previous replies had their time,
+    // then the sync frame after the last reply slot
+    if (t == cycleStart) {
+      if (cycles > 0) {
+        lostReplies += (uint32_t)nbNodes - cycleReplies;
+      }
+      for (i = 0; i < nbNodes; i++) {
+        payload[4 * i + 0] = (uint8_t)cycles;               // steer = speed = cycle number, checked below
+        payload[4 * i + 1] = (uint8_t)(cycles >> 8);
+        payload[4 * i + 2] = (uint8_t)cycles;
+        payload[4 * i + 3] = (uint8_t)(cycles >> 8);
+      }
+      len = busFrame(frame, BUS_ADDR_BROADCAST, BUS_ADDR_HOST, BUS_T_CMD_ALL, payload, (uint8_t)(4 * nbNodes));
+      startTx(&agents[HOST], frame, len);
+      syncTime      = cycleStart + syncStart;
+      cycleStart   += cycleTicks;
+      cycleReplies  = 0;
+      cycles++;
+      requests++;
+    }
+    if (syncOn && t == syncTime) {
+      uint32_t hostUs = t / TICKS_PER_US;
+      len = busFrame(frame, BUS_ADDR_BROADCAST, BUS_ADDR_HOST, BUS_T_SYNC, (const uint8_t *)&hostUs, 4);
+      startTx(&agents[HOST], frame, len);
+    }
+
+    // Line: detect driver contention, then move the bytes
+    active = 0;
+    for (i = 0; i <= nbNodes; i++) {
+      active += agents[i].de;
+    }
+    if (active > 1) {
+      if (!contention) {
+        collisions++;
+      }
+      for (i = 0; i <= nbNodes; i++) {
+        if (agents[i].byteEnd) {
+          agents[i].byteBad = 1;
+        }
+      }
+    }
+    contention = active > 1;
+
+    for (i = 0; i <= nbNodes; i++) {
+      uint8_t c, bad;
+      int     j;
+
+      if (!stepTx(i, t, &c, &bad)) {
+        continue;
+      }
+      if (bad) {
+        c ^= 0x5A;                                        // corrupted by the other driver
+      }
+      for (j = 0; j <= nbNodes; j++) {                    // DE and /RE are tied: a driver does not hear itself
+        if (j == i) {
+          continue;
+        }
+        if (j == HOST) {
+          if (busRx(&hostRx, c) && hostRx.buf[4] == BUS_T_STATUS && hostRx.buf[3] <= BUS_MAX_NODES) {
+            busStatusUnpack(&nodeStatus[hostRx.buf[3]], &hostRx.buf[BUS_HEADER_SIZE]);
+            replies++;
+            cycleReplies++;
+          }
+        } else {
+          agents[j].fifo[agents[j].fifoHead++ % FIFO_SIZE] = c;
+          agents[j].rxEnd = t;
+        }
+      }
+    }
+
+    for (i = 1; i <= nbNodes; i++) {
+      Agent   *a    = &agents[i];
+      uint32_t now  = localTime(a, t);
+
+      // Idle line interrupt: one character time without a new byte
+      if (a->rxEnd && t == a->rxEnd + byteTicks) {
+        a->rxEnd      = 0;
+        a->idleStamp  = now;
+        a->idleNew    = 1;
+      }
+
+      // Housekeeping interrupt, as Bus_Tick()
+      if (t >= a->nextPoll) {
+        a->nextPoll += pollUs * TICKS_PER_US;
+        if (a->idleNew) {
+          a->idleNew = 0;
+          while (a->fifoTail != a->fifoHead) {
+            busNodeRx(&a->node, a->fifo[a->fifoTail++ % FIFO_SIZE], a->idleStamp);
+          }
+        }
+        if (a->node.cmdNew) {
+          a->node.cmdNew  = 0;
+          a->cmdLatched   = a->node.cmd.speed;
+          if (!syncOn) {
+            a->cmdApply   = a->cmdLatched;
+            a->apply      = 1;
+          }
+        }
+        if (a->node.syncNew) {
+          a->node.syncNew = 0;
+          a->cmdApply     = a->cmdLatched;
+          a->syncAt       = a->node.sync.localTicks + delayUs * TICKS_PER_US;
+          a->syncReq      = 1;
+        }
+        if (a->de && a->txDone) {
+          a->de = 0;
+        }
+        if (busNodeReplyDue(&a->node, now) && !a->de) {
+          memset(&status, 0, sizeof(status));
+          status.speedL   = a->node.cmd.speed;
+          status.skewUs   = a->node.sync.skewUs;
+          status.driftPpm = (int16_t)(a->node.sync.drift >> 8);
+          len = busNodeReply(&a->node, frame, &status);
+          startTx(a, frame, len);
+        }
+      }
+
+      // Main loop, as Bus_WaitLoop(): the iteration itself takes no time
+      if (a->syncReq) {
+        a->syncReq  = 0;
+        a->loopAt   = a->syncAt;
+        a->apply    = 1;
+      }
+      if ((int32_t)(now - a->loopAt) >= 0) {
+        if (a->apply) {
+          if ((uint16_t)a->cmdApply < MAX_CYCLES && !applyTime[i][(uint16_t)a->cmdApply]) {
+            applyTime[i][(uint16_t)a->cmdApply] = t + 1;
+          }
+          a->apply  = 0;
+        }
+        a->loopAt  += loopTicks + (syncOn ? (int32_t)((int64_t)loopTicks * a->node.sync.drift / 1000000 >> 8) : 0);
+      }
+    }
+  }
+
+  // Spread of the moments at which the nodes applied the same command
+  for (t = 1; t < cycles && t < MAX_CYCLES; t++) {
+    uint32_t tMin = 0xFFFFFFFF, tMax = 0;
+    for (i = 1; i <= nbNodes && applyTime[i][t]; i++) {
+      tMin = applyTime[i][t] < tMin ? applyTime[i][t] : tMin;
+      tMax = applyTime[i][t] > tMax ? applyTime[i][t] : tMax;
+    }
+    if (i > nbNodes) {
+      spreadMax  = tMax - tMin > spreadMax ? tMax - tMin : spreadMax;
+      spreadSum += tMax - tMin;
+      spreadCnt++;
+    }
+  }
+
+  printf("requests          %u (%.1f per s)\n", requests, requests * 1000.0 / timeMs);
+  printf("replies           %u, lost %u\n", replies, lostReplies);
+  printf("driver collisions %u\n", collisions);
+  printf("CRC errors        host %u", hostRx.crcErr);
+  for (i = 1; i <= nbNodes; i++) {
+    printf(", node%d %u", i, agents[i].node.rx.crcErr);
+  }
+  printf("\napply spread      max %.1f us, mean %.1f us over %u commands\n",
+         (double)spreadMax / TICKS_PER_US, spreadCnt ? spreadSum / spreadCnt / TICKS_PER_US : 0.0, spreadCnt);
+  for (i = 1; i <= nbNodes; i++) {
+    printf("node%d clock       %+6.1f ppm, reported drift %+d ppm, skew %+d us\n",
+           i, agents[i].ppm, nodeStatus[i].driftPpm, nodeStatus[i].skewUs);
+  }
+  printf("bus load          %.1f %%\n", 100.0 * (BUS_FRAME_SIZE(4 * nbNodes) + nbNodes * BUS_FRAME_SIZE(BUS_STATUS_LEN) +
+         (syncOn ? BUS_FRAME_SIZE(4) : 0)) * byteTicks / cycleTicks);
+
+  return (collisions || lostReplies) ? 2 : 0;
+}
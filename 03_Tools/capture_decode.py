@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+#
+# Decode a capture dump (see Inc/capture.h) into CSV.
+#
+# Record the dump from the DEBUG_SERIAL_USARTx port, e.g. with:
+#   python3 capture_decode.py --port /dev/ttyUSB0 --baud 38400 -o capture.csv
+# (sends 'd' and waits for the dump, needs pyserial), or decode a raw file:
+#   python3 capture_decode.py dump.bin -o capture.csv
+#
+# The ASCII debug output around the dump is skipped.
+
+import argparse
+import struct
+import sys
+
+START_FRAME = 0xCAFE
+HEADER_FMT  = '<HHIBBHH'
+HEADER_SIZE = struct.calcsize(HEADER_FMT)
+
+CHANNELS = ['curL_phaA', 'curL_phaB', 'curR_phaB', 'curR_phaC', 'curL_DC', 'curR_DC', 'hall',
+            'DC_phaA_L', 'DC_phaB_L', 'DC_phaC_L', 'DC_phaA_R', 'DC_phaB_R', 'DC_phaC_R',
+            'n_mot_L', 'n_mot_R', 'a_elecAngle_L', 'a_elecAngle_R']
+
+TRIGGERS = {0: 'none', 1: 'manual', 2: 'errCode', 3: 'current', 4: 'overrun'}
+
+
+def crc16(data, crc=0xFFFF):
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) & 0xFFFF if crc & 0x8000 else (crc << 1) & 0xFFFF
+    return crc
+
+
+def find_dump(raw):
+    """Return (header, samples) of the first dump with a valid CRC in raw, None if there is none."""
+    start = struct.pack('<H', START_FRAME)
+    pos = raw.find(start)
+    while pos >= 0:
+        if pos + HEADER_SIZE <= len(raw):
+            hdr = struct.unpack_from(HEADER_FMT, raw, pos)
+            _, depth, ch_mask, nb_ch, _, _, _ = hdr
+            size = HEADER_SIZE + 2 * depth * nb_ch
+            if nb_ch > 0 and pos + size + 2 <= len(raw):
+                crc, = struct.unpack_from('<H', raw, pos + size)
+                if crc16(raw[pos:pos + size]) == crc:
+                    data = struct.unpack_from('<%dh' % (depth * nb_ch), raw, pos + HEADER_SIZE)
+                    return hdr, [data[i * nb_ch:(i + 1) * nb_ch] for i in range(depth)]
+        pos = raw.find(start, pos + 1)
+    return None
+
+
+def read_port(port, baud, timeout):
+    import serial
+    with serial.Serial(port, baud, timeout=timeout) as ser:
+        ser.reset_input_buffer()
+        ser.write(b'd')
+        raw = b''
+        while True:
+            chunk = ser.read(4096)
+            if not chunk:
+                return raw
+            raw += chunk
+            if find_dump(raw):
+                return raw
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode a hoverboard capture dump into CSV')
+    parser.add_argument('file', nargs='?', help='raw dump file (default: read from --port)')
+    parser.add_argument('--port', help='serial port of DEBUG_SERIAL_USARTx')
+    parser.add_argument('--baud', type=int, default=38400)
+    parser.add_argument('--timeout', type=float, default=2.0, help='[s] serial read timeout')
+    parser.add_argument('-o', '--output', help='CSV output file (default: stdout)')
+    args = parser.parse_args()
+
+    if args.file:
+        with open(args.file, 'rb') as f:
+            raw = f.read()
+    elif args.port:
+        raw = read_port(args.port, args.baud, args.timeout)
+    else:
+        parser.error('give a dump file or --port')
+
+    dump = find_dump(raw)
+    if dump is None:
+        sys.exit('no valid capture dump found')
+    (_, depth, ch_mask, nb_ch, trig_src, trig_idx, pwm_freq), samples = dump
+    names = [CHANNELS[i] if i < len(CHANNELS) else 'ch%d' % i for i in range(32) if ch_mask >> i & 1]
+    if len(names) != nb_ch:
+        sys.exit('channel mask 0x%08X does not match %d channels' % (ch_mask, nb_ch))
+
+    out = open(args.output, 'w') if args.output else sys.stdout
+    out.write('# trigger: %s, trigger sample: %d, sample rate: %d Hz\n' % (TRIGGERS.get(trig_src, trig_src), trig_idx, pwm_freq))
+    out.write(','.join(['sample', 't_us'] + names) + '\n')
+    for i, s in enumerate(samples):
+        t_us = round((i - trig_idx) * 1000000 / pwm_freq) if pwm_freq else 0
+        out.write(','.join([str(i - trig_idx), str(t_us)] + [str(v) for v in s]) + '\n')
+    if args.output:
+        out.close()
+        print('%d samples, trigger: %s' % (depth, TRIGGERS.get(trig_src, trig_src)), file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,200 @@
+/*
+* Host benchmark of the integer formatter (Src/format.c) against sprintf
+* and the former double arithmetic of LCD_WriteFloat(). It first checks
+* the outputs against sprintf, then times the DEBUG_SERIAL_ASCII scope
+* line, a single LCD number with one decimal and a padded LCD field.
+*
+* Build and run on Linux:
+*   gcc -O2 -Wall -I../Inc -o format_bench format_bench.c ../Src/format.c
+*   ./format_bench [iterations]
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include "format.h"
+
+static volatile int16_t ch_buf[8] = { -1000, 345, 1337, 0, -42, 32767, -32768, 7 };
+static volatile uint8_t decimals  = 1;          // of the LCD number
+static volatile int     sink;
+static char             out[200];
+
+/* LCD_WriteNumber() of hd44780.c, writing to a buffer instead of the LCD */
+static __attribute__((noinline)) int writeNumber(char *dst, unsigned long n, uint8_t base) {
+  char  buf[8 * sizeof(long) + 1];
+  char *str = &buf[sizeof(buf) - 1];
+  int   len = 0;
+
+  *str = '\0';
+  do {
+    unsigned long m = n;
+    n     /= base;
+    char c = (char)(m - base * n);
+    *--str = c < 10 ? c + '0' : c + 'A' - 10;
+  } while (n);
+  while (*str) {
+    dst[len++] = *str++;
+  }
+  dst[len] = '\0';
+  return len;
+}
+
+/* The removed LCD_WriteFloat(), writing to a buffer instead of the LCD */
+static int floatPath(char *buf, double number, uint8_t digits) {
+  int           len      = 0;
+  double        rounding = 0.5;
+  unsigned long intPart;
+  double        remainder;
+
+  if (number < 0.0) {
+    buf[len++] = '-';
+    number     = -number;
+  }
+  for (uint8_t i = 0; i < digits; ++i) {
+    rounding /= 10.0;
+  }
+  number   += rounding;
+  intPart   = (unsigned long)number;
+  remainder = number - (double)intPart;
+  len      += writeNumber(&buf[len], intPart, 10);
+  if (digits > 0) {
+    buf[len++] = '.';
+  }
+  while (digits-- > 0) {
+    int d;
+    remainder *= 10.0;
+    d          = (int)remainder;
+    buf[len++] = (char)('0' + d);
+    remainder -= d;
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+/* consoleScope() of comms.c */
+static int scopeLine(char *buf) {
+  int len = 0;
+
+  for (int i = 0; i < 8; i++) {
+    buf[len++] = (char)('1' + i);
+    buf[len++] = ':';
+    len       += fmtInt(&buf[len], ch_buf[i]);
+    buf[len++] = (i < 7) ? ' ' : '\r';
+  }
+  buf[len++] = '\n';
+  buf[len]   = '\0';
+  return len;
+}
+
+static int scopeLineSprintf(char *buf) {
+  return sprintf(buf, "1:%i 2:%i 3:%i 4:%i 5:%i 6:%i 7:%i 8:%i\r\n",
+                 ch_buf[0], ch_buf[1], ch_buf[2], ch_buf[3], ch_buf[4], ch_buf[5], ch_buf[6], ch_buf[7]);
+}
+
+static int check(void) {
+  static const int32_t ints[] = { 0, 1, -1, 9, 10, -10, 1234, -5, 32767, -32768, INT32_MAX, INT32_MIN };
+  static const struct { int32_t v; uint8_t d; const char *s; } fixed[] = {
+    { 1234, 2, "12.34" }, { -5, 2, "-0.05" }, { 5, 1, "0.5" }, { 100, 2, "1.00" }, { -1000, 0, "-1000" }, { INT32_MIN, 3, "-2147483.648" }
+  };
+  char a[64], b[64];
+
+  for (unsigned i = 0; i < sizeof(ints) / sizeof(ints[0]); i++) {
+    fmtInt(a, ints[i]);
+    sprintf(b, "%ld", (long)ints[i]);
+    if (strcmp(a, b)) {
+      printf("fmtInt: '%s', sprintf: '%s'\n", a, b);
+      return 0;
+    }
+    fmtPad(a, ints[i], 8, ' ');
+    sprintf(b, "%8ld", (long)ints[i]);
+    if (strcmp(a, b)) {
+      printf("fmtPad: '%s', sprintf: '%s'\n", a, b);
+      return 0;
+    }
+  }
+  for (unsigned i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++) {
+    fmtFixed(a, fixed[i].v, fixed[i].d);
+    if (strcmp(a, fixed[i].s)) {
+      printf("fmtFixed: '%s', expected: '%s'\n", a, fixed[i].s);
+      return 0;
+    }
+  }
+  scopeLine(a);
+  scopeLineSprintf(b);
+  if (strcmp(a, b)) {
+    printf("scope line: '%s', sprintf: '%s'\n", a, b);
+    return 0;
+  }
+  return 1;
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  int    n = (argc > 1) ? atoi(argv[1]) : 2000000;
+  double t, tSprintf, tScope, tFloat, tFixed, tPad;
+
+  if (n <= 0 || !check()) {
+    return 1;
+  }
+  printf("all outputs match sprintf\n");
+
+  t = now();
+  for (int i = 0; i < n; i++) {
+    ch_buf[0] = (int16_t)(i & 0x7FFF);
+    sink     += scopeLineSprintf(out);
+  }
+  tSprintf = (now() - t) / n * 1e9;
+
+  t = now();
+  for (int i = 0; i < n; i++) {
+    ch_buf[0] = (int16_t)(i & 0x7FFF);
+    sink     += scopeLine(out);
+  }
+  tScope = (now() - t) / n * 1e9;
+
+  t = now();
+  for (int i = 0; i < n; i++) {
+    sink += floatPath(out, ((i & 0x7FFF) - 16384) / 10.0, decimals);
+  }
+  tFloat = (now() - t) / n * 1e9;
+
+  t = now();
+  for (int i = 0; i < n; i++) {
+    sink += fmtFixed(out, (i & 0x7FFF) - 16384, decimals);
+  }
+  tFixed = (now() - t) / n * 1e9;
+
+  t = now();
+  for (int i = 0; i < n; i++) {
+    sink += fmtPad(out, (i & 0x7FFF) - 16384, 6, ' ');
+  }
+  tPad = (now() - t) / n * 1e9;
+
+  printf("scope line:  sprintf %.0f ns, fmtInt %.0f ns (%.1fx)\n", tSprintf, tScope, tSprintf / tScope);
+  printf("LCD number:  double path %.0f ns, fmtFixed %.0f ns (%.1fx), one decimal\n", tFloat, tFixed, tFloat / tFixed);
+  printf("LCD field:   fmtPad width 6 %.0f ns\n", tPad);
+  return 0;
+}
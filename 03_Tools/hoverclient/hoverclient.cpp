@@ -0,0 +1,426 @@
+/*
+* This file implements the Linux host client, see hoverclient.h.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "hoverclient.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace hover {
+
+static uint16_t get16(const uint8_t *p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+double nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+uint16_t crc16(uint16_t crc, const uint8_t *data, size_t len) {
+  while (len--) {
+    crc ^= (uint16_t)(*data++ << 8);
+    for (int i = 0; i < 8; i++) {
+      crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+  }
+  return crc;
+}
+
+uint16_t xorChecksum(const uint8_t *frame, size_t size) {
+  uint16_t sum = 0;
+  for (size_t i = 0; i + 2 < size; i += 2) {
+    sum ^= get16(&frame[i]);
+  }
+  return sum;
+}
+
+Command makeCommand(int16_t steer, int16_t speed) {
+  Command cmd;
+  cmd.start     = START_FRAME;
+  cmd.steer     = steer;
+  cmd.speed     = speed;
+  cmd.checksum  = xorChecksum(reinterpret_cast<const uint8_t *>(&cmd), sizeof(cmd));
+  return cmd;
+}
+
+ParamFrame makeParam(uint8_t cmd, uint8_t id, int32_t value) {
+  ParamFrame frame;
+  frame.start   = PARAM_START_FRAME;
+  frame.cmd     = cmd;
+  frame.id      = id;
+  frame.value   = value;
+  frame.status  = 0;
+  frame.crc     = crc16(0xFFFF, reinterpret_cast<const uint8_t *>(&frame), sizeof(frame) - 2);
+  return frame;
+}
+
+int16_t FrameView::telemetrySample(unsigned smp, unsigned ch) const {
+  return (int16_t)get16(&data[sizeof(TelemetryHeader) + 2 * (smp * telemetry().nbCh + ch)]);
+}
+
+
+// ########################## FRAME PARSER ##########################
+
+static size_t feedbackSize(const uint8_t *) {
+  return sizeof(Feedback);
+}
+
+static bool feedbackCheck(const uint8_t *frame, size_t size) {
+  return xorChecksum(frame, size) == get16(&frame[size - 2]);
+}
+
+static size_t telemetrySize(const uint8_t *header) {
+  const TelemetryHeader *h = reinterpret_cast<const TelemetryHeader *>(header);
+  if (h->nbCh == 0 || h->nbSmp == 0 || __builtin_popcount(h->chMask) != h->nbCh) {
+    return 0;
+  }
+  return sizeof(TelemetryHeader) + 2u * h->nbCh * h->nbSmp + 2;
+}
+
+static size_t paramSize(const uint8_t *) {
+  return sizeof(ParamFrame);
+}
+
+static bool crcCheck(const uint8_t *frame, size_t size) {
+  return crc16(0xFFFF, frame, size - 2) == get16(&frame[size - 2]);
+}
+
+FrameParser::FrameParser(bool defaultFrames) {
+  buf_.resize(4096);
+  if (!defaultFrames) {
+    return;
+  }
+  addFrame({FRAME_FEEDBACK,  START_FRAME,       2,                       sizeof(Feedback),   feedbackSize,  feedbackCheck});
+  addFrame({FRAME_TELEMETRY, TELEM_START_FRAME, sizeof(TelemetryHeader), sizeof(TelemetryHeader) + 2 * 32 * 255 + 2, telemetrySize, crcCheck});
+  addFrame({FRAME_PARAM,     PARAM_START_FRAME, 2,                       sizeof(ParamFrame), paramSize,     crcCheck});
+}
+
+void FrameParser::addFrame(const FrameSpec &spec) {
+  specs_.push_back(spec);
+  size_t maxSize = 0;
+  for (const FrameSpec &s : specs_) {
+    maxSize = s.maxSize > maxSize ? s.maxSize : maxSize;
+  }
+  buf_.resize(maxSize + 4096);        // room for one partial frame plus a full read
+}
+
+uint8_t *FrameParser::writePtr(size_t *avail) {
+  if (head_ > 0) {                    // move the partial frame to the front, the complete ones were delivered in place
+    memmove(buf_.data(), buf_.data() + head_, tail_ - head_);
+    tail_ -= head_;
+    head_  = 0;
+  }
+  *avail = buf_.size() - tail_;
+  return buf_.data() + tail_;
+}
+
+void FrameParser::commit(size_t len, const std::function<void(const FrameView &)> &onFrame) {
+  tail_ += len;
+
+  while (tail_ - head_ >= 2) {
+    const uint8_t   *p     = buf_.data() + head_;
+    size_t           avail = tail_ - head_;
+    uint16_t         start = get16(p);
+    const FrameSpec *spec  = nullptr;
+    size_t           size;
+
+    for (const FrameSpec &s : specs_) {
+      if (s.start == start) {
+        spec = &s;
+        break;
+      }
+    }
+    if (!spec) {                      // synchronize byte by byte
+      head_++;
+      skippedBytes++;
+      continue;
+    }
+    if (avail < spec->headerSize) {
+      break;
+    }
+    size = spec->size(p);
+    if (size < spec->headerSize || size > spec->maxSize) {
+      head_++;
+      skippedBytes++;
+      continue;
+    }
+    if (avail < size) {
+      break;
+    }
+    if (!spec->check(p, size)) {      // a start frame inside the data, or a corrupted frame
+      head_++;
+      checkErrors++;
+      continue;
+    }
+    onFrame(FrameView{spec->type, p, size});
+    head_ += size;
+  }
+}
+
+void FrameParser::feed(const uint8_t *data, size_t len, const std::function<void(const FrameView &)> &onFrame) {
+  while (len > 0) {
+    size_t   avail;
+    uint8_t *dst = writePtr(&avail);
+    size_t   n   = len < avail ? len : avail;
+    memcpy(dst, data, n);
+    commit(n, onFrame);
+    data += n;
+    len  -= n;
+  }
+}
+
+
+// ########################## STATISTICS ##########################
+
+void LatencyStats::add(double ms) {
+  minMs   = (count == 0 || ms < minMs) ? ms : minMs;
+  maxMs   = ms > maxMs ? ms : maxMs;
+  sumMs  += ms;
+  count++;
+  hist[ms < 255 ? (unsigned)ms : 255]++;
+}
+
+double LatencyStats::percentileMs(double p) const {
+  uint64_t n = 0;
+  for (unsigned i = 0; i < 256; i++) {
+    n += hist[i];
+    if (n >= p / 100 * count) {
+      return std::min(i + 1.0, maxMs);  // upper edge of the bin, at most the measured maximum
+    }
+  }
+  return maxMs;
+}
+
+
+// ########################## CLIENT ##########################
+
+int Client::openSerial(const std::string &path, unsigned baud) {
+  static const struct { unsigned baud; speed_t speed; } speeds[] = {
+    {9600, B9600}, {19200, B19200}, {38400, B38400}, {57600, B57600}, {115200, B115200},
+    {230400, B230400}, {460800, B460800}, {921600, B921600},
+  };
+  struct termios tio;
+  speed_t speed = 0;
+  int     fd;
+
+  for (const auto &s : speeds) {
+    if (s.baud == baud) {
+      speed = s.speed;
+    }
+  }
+  if (!speed || (fd = open(path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+    return -1;
+  }
+  if (tcgetattr(fd, &tio) < 0) {
+    close(fd);
+    return -1;
+  }
+  cfmakeraw(&tio);
+  tio.c_cflag    |= CLOCAL | CREAD;
+  tio.c_cflag    &= ~(CSTOPB | CRTSCTS);
+  tio.c_cc[VMIN]  = 0;
+  tio.c_cc[VTIME] = 0;
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+    close(fd);
+    return -1;
+  }
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+}
+
+Client::Client(int fd) : fd_(fd) {
+  struct epoll_event ev = {};
+
+  cmd_      = makeCommand(0, 0);
+  epfd_     = epoll_create1(EPOLL_CLOEXEC);
+  timerFd_  = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  ev.events   = EPOLLIN;
+  ev.data.fd  = fd_;
+  epoll_ctl(epfd_, EPOLL_CTL_ADD, fd_, &ev);
+  ev.data.fd  = timerFd_;
+  epoll_ctl(epfd_, EPOLL_CTL_ADD, timerFd_, &ev);
+}
+
+Client::~Client() {
+  close(timerFd_);
+  close(epfd_);
+}
+
+void Client::setCommand(int16_t steer, int16_t speed) {
+  if (steer != steer_ || speed != speed_) {
+    steer_      = steer;
+    speed_      = speed;
+    cmdChanged_ = true;
+  }
+}
+
+void Client::setCommandRate(unsigned rateHz) {
+  struct itimerspec its = {};
+  if (rateHz > 0) {
+    its.it_interval.tv_sec  = 1 / rateHz;
+    its.it_interval.tv_nsec = 1000000000L / rateHz % 1000000000L;
+    its.it_value            = its.it_interval;
+  }
+  timerfd_settime(timerFd_, 0, &its, nullptr);
+}
+
+/* The frames are small: a frame is either not sent at all when the kernel buffer is full, or completed once started
+ * so that the board never sees a truncated frame */
+static bool writeFrame(int fd, const void *frame, size_t size) {
+  const uint8_t *p = static_cast<const uint8_t *>(frame);
+  ssize_t n = write(fd, p, size);
+
+  if (n <= 0) {
+    return false;
+  }
+  while ((size_t)n < size) {
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    ssize_t m;
+    if (::poll(&pfd, 1, 100) <= 0 || (m = write(fd, p + n, size - (size_t)n)) < 0) {
+      return false;
+    }
+    n += m;
+  }
+  return true;
+}
+
+void Client::sendCommand() {
+  if (cmdChanged_) {
+    cmd_ = makeCommand(steer_, speed_);
+  }
+  if (!writeFrame(fd_, &cmd_, sizeof(cmd_))) {
+    stats_.txSkipped++;
+    return;
+  }
+  stats_.txCommands++;
+  if (cmdChanged_) {                  // latency of a new value: until the board echoes it in the feedback
+    cmdChanged_ = false;
+    cmdPending_ = true;
+    cmdSentAt_  = nowMs();
+  }
+}
+
+bool Client::requestParam(uint8_t cmd, uint8_t id, int32_t value) {
+  ParamFrame frame = makeParam(cmd, id, value);
+
+  if (paramPending_ || !writeFrame(fd_, &frame, sizeof(frame))) {
+    return false;
+  }
+  paramPending_ = true;
+  paramSentAt_  = nowMs();
+  return true;
+}
+
+void Client::handleFrame(const FrameView &frame) {
+  if (frame.type < 3) {
+    stats_.rxFrames[frame.type]++;
+  }
+  switch (frame.type) {
+    case FRAME_FEEDBACK: {
+      const Feedback &fb = frame.feedback();
+      if (cmdPending_ && fb.cmd1 == cmd_.steer && fb.cmd2 == cmd_.speed) {
+        cmdPending_ = false;
+        stats_.cmdLatency.add(nowMs() - cmdSentAt_);
+      }
+      if (onFeedback_) {
+        onFeedback_(fb);
+      }
+      break;
+    }
+    case FRAME_TELEMETRY: {
+      const TelemetryHeader &h = frame.telemetry();
+      if (telemSeqValid_) {
+        stats_.telemLost += (uint16_t)(h.seq - telemSeq_ - 1);
+      }
+      telemSeq_           = h.seq;
+      telemSeqValid_      = true;
+      stats_.telemDropped = h.dropCnt;
+      if (onTelemetry_) {
+        onTelemetry_(frame);
+      }
+      break;
+    }
+    case FRAME_PARAM:
+      if (paramPending_ && (frame.param().cmd & PARAM_CMD_REPLY)) {
+        paramPending_ = false;
+        stats_.paramLatency.add(nowMs() - paramSentAt_);
+      }
+      if (onParam_) {
+        onParam_(frame.param());
+      }
+      break;
+    default:
+      break;
+  }
+  if (onFrame_) {
+    onFrame_(frame);
+  }
+}
+
+void Client::handleRx() {
+  for (;;) {
+    size_t   avail;
+    uint8_t *dst = parser_.writePtr(&avail);
+    ssize_t  n   = read(fd_, dst, avail);
+    if (n <= 0) {
+      break;
+    }
+    stats_.rxBytes += (uint64_t)n;
+    parser_.commit((size_t)n, [this](const FrameView &frame) { handleFrame(frame); });
+  }
+}
+
+int Client::poll(int timeoutMs) {
+  struct epoll_event events[2];
+  int n = epoll_wait(epfd_, events, 2, timeoutMs);
+
+  if (n < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+  for (int i = 0; i < n; i++) {
+    if (events[i].data.fd == fd_) {
+      handleRx();
+    } else if (events[i].data.fd == timerFd_) {
+      uint64_t expirations = 0;
+      if (read(timerFd_, &expirations, sizeof(expirations)) == sizeof(expirations) && expirations > 1) {
+        stats_.txSkipped += expirations - 1;   // the loop was late: no burst, just the latest value
+      }
+      sendCommand();
+    }
+  }
+  if (paramPending_ && nowMs() - paramSentAt_ > paramTimeoutMs_) {
+    paramPending_ = false;
+    stats_.paramTimeouts++;
+  }
+  return n;
+}
+
+}  // namespace hover
@@ -0,0 +1,216 @@
+/*
+* Linux host client of the serial protocols of the firmware: sends the
+* control commands and receives the feedback, telemetry and parameter
+* frames. See hoverclient_demo.cpp for an example and an end-to-end
+* check against a simulated board on a pseudo-terminal.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace hover {
+
+// Frame layouts, identical to the firmware: little endian, no padding. See Src/main.c, Inc/telemetry.h, Inc/param.h
+constexpr uint16_t START_FRAME        = 0xAAAA;   // command and feedback, config.h START_FRAME
+constexpr uint16_t TELEM_START_FRAME  = 0xABCD;
+constexpr uint16_t PARAM_START_FRAME  = 0xABBA;
+
+struct __attribute__((packed)) Command {
+  uint16_t  start;
+  int16_t   steer;
+  int16_t   speed;
+  uint16_t  checksum;                 // XOR of the previous fields
+};
+
+struct __attribute__((packed)) Feedback {
+  uint16_t  start;
+  int16_t   cmd1;                     // command taken over by the board: echo of steer
+  int16_t   cmd2;                     // echo of speed
+  int16_t   speedR;
+  int16_t   speedL;
+  int16_t   speedR_meas;
+  int16_t   speedL_meas;
+  int16_t   batVoltage;
+  int16_t   boardTemp;
+  uint16_t  checksum;                 // XOR of the previous fields
+};
+
+struct __attribute__((packed)) TelemetryHeader {
+  uint16_t  start;
+  uint16_t  seq;
+  uint32_t  chMask;
+  uint8_t   nbCh;
+  uint8_t   nbSmp;
+  uint16_t  dropCnt;
+  // int16_t data[nbSmp][nbCh], uint16_t crc
+};
+
+struct __attribute__((packed)) ParamFrame {
+  uint16_t  start;
+  uint8_t   cmd;
+  uint8_t   id;
+  int32_t   value;
+  uint16_t  status;
+  uint16_t  crc;
+};
+
+// Parameter commands and status codes, see Inc/param.h
+constexpr uint8_t PARAM_CMD_READ  = 1;
+constexpr uint8_t PARAM_CMD_WRITE = 2;
+constexpr uint8_t PARAM_CMD_STORE = 3;
+constexpr uint8_t PARAM_CMD_REPLY = 0x80;
+
+uint16_t crc16(uint16_t crc, const uint8_t *data, size_t len);   // CRC-16/CCITT-FALSE, as Src/crc.c
+uint16_t xorChecksum(const uint8_t *frame, size_t size);        // XOR of the 16 bit words before the checksum
+
+Command     makeCommand(int16_t steer, int16_t speed);
+ParamFrame  makeParam(uint8_t cmd, uint8_t id, int32_t value);
+
+/* A validated frame inside the receive buffer. No copy is made: the view is only valid during the callback */
+struct FrameView {
+  int             type;               // FRAME_xxx, or the type given to FrameParser::addFrame()
+  const uint8_t  *data;
+  size_t          size;
+
+  const Feedback        &feedback()   const { return *reinterpret_cast<const Feedback *>(data); }
+  const TelemetryHeader &telemetry()  const { return *reinterpret_cast<const TelemetryHeader *>(data); }
+  const ParamFrame      &param()      const { return *reinterpret_cast<const ParamFrame *>(data); }
+  int16_t telemetrySample(unsigned smp, unsigned ch) const;
+};
+
+enum { FRAME_FEEDBACK = 0, FRAME_TELEMETRY, FRAME_PARAM, FRAME_USER = 16 };
+
+/* Frame description for the parser. size() returns the frame size from the first headerSize bytes, or 0 when the
+ * header is invalid. check() validates a complete frame */
+struct FrameSpec {
+  int       type;
+  uint16_t  start;
+  size_t    headerSize;
+  size_t    maxSize;
+  size_t  (*size)(const uint8_t *header);
+  bool    (*check)(const uint8_t *frame, size_t size);
+};
+
+/* Stream parser: synchronizes on the start frames of the registered frame types and delivers the valid frames.
+ * The bytes are read straight into its buffer with writePtr()/commit(). The start frames must be unique: the
+ * default types are the frames sent by the board */
+class FrameParser {
+ public:
+  explicit FrameParser(bool defaultFrames = true);
+
+  void      addFrame(const FrameSpec &spec);
+  uint8_t  *writePtr(size_t *avail);
+  void      commit(size_t len, const std::function<void(const FrameView &)> &onFrame);
+  void      feed(const uint8_t *data, size_t len, const std::function<void(const FrameView &)> &onFrame);
+
+  uint64_t  skippedBytes  = 0;        // bytes dropped while searching a start frame
+  uint64_t  checkErrors   = 0;        // frames dropped because of a CRC or checksum error
+
+ private:
+  std::vector<FrameSpec>  specs_;
+  std::vector<uint8_t>    buf_;
+  size_t                  head_ = 0;  // first unparsed byte
+  size_t                  tail_ = 0;  // end of the received bytes
+};
+
+struct LatencyStats {
+  uint64_t  count   = 0;
+  double    minMs   = 0;
+  double    maxMs   = 0;
+  double    sumMs   = 0;
+  uint32_t  hist[256] = {};           // 1 ms bins, the last one collects everything above
+
+  void      add(double ms);
+  double    meanMs() const { return count ? sumMs / count : 0; }
+  double    percentileMs(double p) const;
+};
+
+struct ClientStats {
+  uint64_t      rxBytes       = 0;
+  uint64_t      rxFrames[3]   = {};   // per FRAME_xxx
+  uint64_t      txCommands    = 0;
+  uint64_t      txSkipped     = 0;    // command periods skipped because the port was still busy
+  uint64_t      telemLost     = 0;    // telemetry frames missing in the sequence numbers (line losses and board drops)
+  uint64_t      telemDropped  = 0;    // telemetry frames dropped by the board, last dropCnt
+  uint64_t      paramTimeouts = 0;
+  LatencyStats  cmdLatency;           // new command value sent -> first feedback echoing it
+  LatencyStats  paramLatency;         // parameter request -> reply
+};
+
+/* Serial port client driven by epoll. All callbacks run inside poll() */
+class Client {
+ public:
+  explicit Client(int fd);            // an open serial port or pseudo-terminal, see openSerial()
+  ~Client();
+
+  static int openSerial(const std::string &path, unsigned baud);   // raw 8N1, non blocking. Returns -1 on error
+
+  void  onFeedback(std::function<void(const Feedback &)> cb)                 { onFeedback_ = std::move(cb); }
+  void  onTelemetry(std::function<void(const FrameView &)> cb)               { onTelemetry_ = std::move(cb); }
+  void  onParam(std::function<void(const ParamFrame &)> cb)                  { onParam_ = std::move(cb); }
+  void  onFrame(std::function<void(const FrameView &)> cb)                   { onFrame_ = std::move(cb); }
+  FrameParser &parser()                                                      { return parser_; }
+
+  /* The command is sent at the command rate, always with the latest value: a period is skipped rather than
+   * queued when the port is busy. rateHz = 0 stops sending. The firmware times out after SERIAL_TIMEOUT main
+   * loop periods without a command */
+  void  setCommand(int16_t steer, int16_t speed);
+  void  setCommandRate(unsigned rateHz);
+
+  bool  requestParam(uint8_t cmd, uint8_t id, int32_t value = 0);  // one request at a time, false while busy
+  void  setParamTimeout(unsigned ms)                                         { paramTimeoutMs_ = ms; }
+
+  int   poll(int timeoutMs);          // waits for and handles the events once. Returns -1 on error
+  int   fd() const                                                           { return fd_; }
+  const ClientStats &stats() const                                           { return stats_; }
+
+ private:
+  void  handleRx();
+  void  handleFrame(const FrameView &frame);
+  void  sendCommand();
+
+  int           fd_;
+  int           epfd_;
+  int           timerFd_;
+  FrameParser   parser_;
+  ClientStats   stats_;
+  Command       cmd_;
+  int16_t       steer_ = 0, speed_ = 0;
+  bool          cmdChanged_ = false;
+  bool          cmdPending_ = false;  // the last new value was not echoed yet
+  double        cmdSentAt_  = 0;
+  bool          telemSeqValid_ = false;
+  uint16_t      telemSeq_ = 0;
+  bool          paramPending_ = false;
+  double        paramSentAt_ = 0;
+  unsigned      paramTimeoutMs_ = 100;
+
+  std::function<void(const Feedback &)>   onFeedback_;
+  std::function<void(const FrameView &)>  onTelemetry_;
+  std::function<void(const ParamFrame &)> onParam_;
+  std::function<void(const FrameView &)>  onFrame_;
+};
+
+double nowMs();                       // CLOCK_MONOTONIC
+
+}  // namespace hover
@@ -0,0 +1,240 @@
+/*
+* Example and end-to-end check of the host client: a simulated board runs
+* on the master side of a pseudo-terminal, the client opens the slave
+* side like a serial port. No hardware is needed.
+*
+* Build and run on Linux:
+*   g++ -std=c++17 -O2 -Wall -pthread -o hoverclient_demo hoverclient_demo.cpp hoverclient.cpp
+*   ./hoverclient_demo [-t time_s] [-r cmd_rate_hz] [-f feedback_ms] [-T] [-l loss_permille]
+* or against a board: ./hoverclient_demo -p /dev/ttyUSB0 [-b baud]
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "hoverclient.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <random>
+#include <thread>
+#include <unistd.h>
+
+using namespace hover;
+
+static std::atomic<bool> running(true);
+
+/* Simulated board: the main loop of the firmware every 5 ms, with the serial command parser, the feedback every
+ * feedbackMs and optionally the telemetry stream and the parameter protocol. lossPermille corrupts sent bytes */
+static void board(int fd, unsigned feedbackMs, bool telemetry, unsigned lossPermille) {
+  std::mt19937          rng(1);
+  FrameParser           parser(false);
+  std::vector<uint8_t>  out;
+  int16_t               cmd1 = 0, cmd2 = 0, speed = 0;
+  int32_t               params[8] = {16000, 0, 1000, 15, 3600, 0, 0, 0};
+  unsigned              loop = 0;
+  uint16_t              telemSeq = 0;
+  auto                  next = std::chrono::steady_clock::now();
+
+  // The board receives commands and parameter requests
+  parser.addFrame({FRAME_USER, START_FRAME, 2, sizeof(Command),
+                   [](const uint8_t *) { return sizeof(Command); },
+                   [](const uint8_t *p, size_t size) { return xorChecksum(p, size) == (uint16_t)(p[size - 2] | p[size - 1] << 8); }});
+  parser.addFrame({FRAME_PARAM, PARAM_START_FRAME, 2, sizeof(ParamFrame),
+                   [](const uint8_t *) { return sizeof(ParamFrame); },
+                   [](const uint8_t *p, size_t size) { return crc16(0xFFFF, p, size - 2) == (uint16_t)(p[size - 2] | p[size - 1] << 8); }});
+
+  auto send = [&](const void *frame, size_t size) {
+    const uint8_t *p = static_cast<const uint8_t *>(frame);
+    for (size_t i = 0; i < size; i++) {
+      out.push_back(rng() % 1000 < lossPermille ? (uint8_t)(p[i] ^ 0x10) : p[i]);
+    }
+  };
+
+  while (running) {
+    uint8_t buf[256];
+    ssize_t n;
+
+    next += std::chrono::milliseconds(5);
+    std::this_thread::sleep_until(next);
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+      parser.feed(buf, (size_t)n, [&](const FrameView &frame) {
+        if (frame.type == FRAME_USER) {
+          const Command *cmd = reinterpret_cast<const Command *>(frame.data);
+          cmd1 = cmd->steer < -1000 ? -1000 : (cmd->steer > 1000 ? 1000 : cmd->steer);   // INPUT_MIN, INPUT_MAX
+          cmd2 = cmd->speed < -1000 ? -1000 : (cmd->speed > 1000 ? 1000 : cmd->speed);
+        } else if (frame.type == FRAME_PARAM && !(frame.param().cmd & PARAM_CMD_REPLY)) {
+          ParamFrame reply = frame.param();
+          reply.status = reply.id < 8 ? 0 : 1;
+          if (reply.id < 8 && reply.cmd == PARAM_CMD_WRITE) {
+            params[reply.id] = reply.value;
+          }
+          reply.value  = reply.id < 8 ? params[reply.id] : 0;
+          reply.cmd   |= PARAM_CMD_REPLY;
+          reply.crc    = crc16(0xFFFF, reinterpret_cast<const uint8_t *>(&reply), sizeof(reply) - 2);
+          send(&reply, sizeof(reply));
+        }
+      });
+    }
+
+    speed += (cmd2 - speed) / 8;                      // crude speed response
+
+    if (++loop % (feedbackMs / 5 ? feedbackMs / 5 : 1) == 0) {
+      Feedback fb = {};
+      fb.start        = START_FRAME;
+      fb.cmd1         = cmd1;
+      fb.cmd2         = cmd2;
+      fb.speedR       = cmd2;
+      fb.speedL       = cmd2;
+      fb.speedR_meas  = speed;
+      fb.speedL_meas  = speed;
+      fb.batVoltage   = 3600;
+      fb.boardTemp    = 250;
+      fb.checksum     = xorChecksum(reinterpret_cast<const uint8_t *>(&fb), sizeof(fb));
+      send(&fb, sizeof(fb));
+    }
+
+    if (telemetry && loop % 2 == 0) {                 // 10 samples of 2 channels every 10 ms: 1 kHz
+      uint8_t frame[sizeof(TelemetryHeader) + 2 * 10 * 2 + 2];
+      TelemetryHeader *h = reinterpret_cast<TelemetryHeader *>(frame);
+      h->start    = TELEM_START_FRAME;
+      h->seq      = telemSeq++;
+      h->chMask   = 0x3;
+      h->nbCh     = 2;
+      h->nbSmp    = 10;
+      h->dropCnt  = 0;
+      for (unsigned i = 0; i < 20; i++) {
+        int16_t v = speed;
+        memcpy(&frame[sizeof(TelemetryHeader) + 2 * i], &v, 2);
+      }
+      uint16_t crc = crc16(0xFFFF, frame, sizeof(frame) - 2);
+      memcpy(&frame[sizeof(frame) - 2], &crc, 2);
+      send(frame, sizeof(frame));
+    }
+
+    if (!out.empty() && (n = write(fd, out.data(), out.size())) > 0) {
+      out.erase(out.begin(), out.begin() + n);
+    }
+  }
+}
+
+static void printLatency(const char *name, const LatencyStats &s) {
+  printf("%-18s %llu samples, min %.1f ms, mean %.1f ms, p99 %.0f ms, max %.1f ms\n", name,
+         (unsigned long long)s.count, s.minMs, s.meanMs(), s.percentileMs(99), s.maxMs);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-t time_s] [-r cmd_rate_hz] [-f feedback_ms] [-T] [-l loss_permille] [-p port] [-b baud]\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  unsigned    timeS = 5, rateHz = 50, feedbackMs = 100, lossPermille = 0, baud = 38400;
+  bool        telemetry = false;
+  std::string port;
+  std::thread boardThread;
+  int         opt, master = -1, fd;
+
+  while ((opt = getopt(argc, argv, "t:r:f:Tl:p:b:")) != -1) {
+    switch (opt) {
+      case 't': timeS         = (unsigned)atoi(optarg); break;
+      case 'r': rateHz        = (unsigned)atoi(optarg); break;
+      case 'f': feedbackMs    = (unsigned)atoi(optarg); break;
+      case 'T': telemetry     = true; break;
+      case 'l': lossPermille  = (unsigned)atoi(optarg); break;
+      case 'p': port          = optarg; break;
+      case 'b': baud          = (unsigned)atoi(optarg); break;
+      default:  usage(argv[0]);
+    }
+  }
+
+  if (port.empty()) {                                 // simulated board on a pseudo-terminal
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+      perror("posix_openpt");
+      return 1;
+    }
+    port = ptsname(master);
+  }
+  fd = Client::openSerial(port, baud);
+  if (fd < 0) {
+    perror(port.c_str());
+    return 1;
+  }
+  if (master >= 0) {
+    fcntl(master, F_SETFL, O_NONBLOCK);
+    boardThread = std::thread(board, master, feedbackMs, telemetry, lossPermille);
+  }
+
+  Client client(fd);
+  int16_t lastSpeed = 0;
+  int32_t paramValue = -1;
+  client.onFeedback([&](const Feedback &fb) { lastSpeed = fb.speedL_meas; });
+  client.onParam([&](const ParamFrame &p) { paramValue = p.value; });
+  client.setCommandRate(rateHz);
+
+  // Speed steps every 200 ms, a parameter read every 500 ms
+  double start = nowMs(), nextStep = start, nextParam = start;
+  int    step = 0;
+  while (nowMs() - start < timeS * 1000.0) {
+    if (client.poll(10) < 0) {
+      perror("epoll_wait");
+      break;
+    }
+    if (nowMs() >= nextStep) {
+      client.setCommand(0, (int16_t)((step++ % 2) ? 300 : -300));
+      nextStep += 200;
+    }
+    if (nowMs() >= nextParam) {
+      client.requestParam(PARAM_CMD_READ, 0);
+      nextParam += 500;
+    }
+  }
+  client.setCommandRate(0);
+
+  running = false;
+  if (boardThread.joinable()) {
+    boardThread.join();
+  }
+
+  const ClientStats &s = client.stats();
+  printf("port               %s, %s\n", port.c_str(), master >= 0 ? "simulated board" : "board");
+  printf("commands           %llu sent, %llu periods skipped\n", (unsigned long long)s.txCommands, (unsigned long long)s.txSkipped);
+  printf("received           %llu bytes: %llu feedback, %llu telemetry, %llu param frames\n", (unsigned long long)s.rxBytes,
+         (unsigned long long)s.rxFrames[FRAME_FEEDBACK], (unsigned long long)s.rxFrames[FRAME_TELEMETRY], (unsigned long long)s.rxFrames[FRAME_PARAM]);
+  printf("errors             %llu checksum, %llu bytes skipped, %llu telemetry lost, %llu param timeouts\n",
+         (unsigned long long)client.parser().checkErrors, (unsigned long long)client.parser().skippedBytes,
+         (unsigned long long)s.telemLost, (unsigned long long)s.paramTimeouts);
+  printLatency("command latency", s.cmdLatency);
+  printLatency("param latency", s.paramLatency);
+  printf("last speed         %d rpm, PWM frequency %d Hz\n", lastSpeed, paramValue);
+
+  close(fd);
+  if (master >= 0) {
+    close(master);
+  }
+
+  // Without injected losses the simulated link must be clean
+  if (s.rxFrames[FRAME_FEEDBACK] == 0 || s.cmdLatency.count == 0 ||
+      (master >= 0 && lossPermille == 0 && (client.parser().checkErrors || client.parser().skippedBytes || s.telemLost || s.paramTimeouts))) {
+    return 2;
+  }
+  return 0;
+}
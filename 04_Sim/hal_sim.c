@@ -0,0 +1,392 @@
+/*
+* HAL of the Linux port. Only the HAL functions used by the firmware,
+* reduced to their effect on the registers that sim.c models. The
+* firmware code that accesses the registers directly runs as it is.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <time.h>
+
+#include "stm32f1xx_hal.h"
+#include "sim.h"
+
+#define FLASH_PROG_NS     50000               // [ns] halfword programming, the CPU stalls (code runs from the Flash)
+#define FLASH_ERASE_NS    20000000            // [ns] page erase
+
+static volatile uint32_t uwTick;
+
+/* Absolute deadline: the interrupts (signals) come faster than a relative sleep restarted with the remaining time */
+static void sleepNs(long ns) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ts.tv_nsec += ns;
+  ts.tv_sec  += ts.tv_nsec / 1000000000L;
+  ts.tv_nsec %= 1000000000L;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+  }
+}
+
+/* The CPU is stalled by the Flash operations: the interrupts are late */
+static void flashStall(long ns) {
+  uint32_t masked = Sim_IrqMasked();
+
+  Sim_IrqDisable();
+  sleepNs(ns);
+  if (!masked) {
+    Sim_IrqEnable();
+  }
+}
+
+// =================================
+// HAL, Cortex
+// =================================
+HAL_StatusTypeDef HAL_Init(void) {
+  Sim_Start();
+  return HAL_OK;
+}
+
+void HAL_IncTick(void) {
+  uwTick++;
+}
+
+uint32_t HAL_GetTick(void) {
+  return uwTick;
+}
+
+void HAL_Delay(__IO uint32_t Delay) {
+  uint32_t start = HAL_GetTick();
+  uint32_t wait  = Delay;
+
+  if (wait < HAL_MAX_DELAY) {
+    wait++;                                   // at least the requested time, as the HAL
+  }
+  while ((HAL_GetTick() - start) < wait) {
+    sleepNs(100000);
+  }
+}
+
+void HAL_NVIC_SetPriorityGrouping(uint32_t PriorityGroup) {
+  (void)PriorityGroup;                        // NVIC_PRIORITYGROUP_4: 4 bits of preemption priority
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority) {
+  Sim_IrqSetPriority(IRQn, PreemptPriority, SubPriority);
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn) {
+  Sim_IrqSetEnable(IRQn, 1);
+}
+
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn) {
+  Sim_IrqSetEnable(IRQn, 0);
+}
+
+uint32_t HAL_SYSTICK_Config(uint32_t TicksNumb) {
+  SysTick->LOAD = TicksNumb - 1;
+  SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+  return 0;
+}
+
+void HAL_SYSTICK_CLKSourceConfig(uint32_t CLKSource) {
+  (void)CLKSource;
+}
+
+void HAL_SYSTICK_IRQHandler(void) {
+}
+
+// =================================
+// RCC
+// =================================
+HAL_StatusTypeDef HAL_RCC_OscConfig(RCC_OscInitTypeDef *RCC_OscInitStruct) {
+  (void)RCC_OscInitStruct;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RCC_ClockConfig(RCC_ClkInitTypeDef *RCC_ClkInitStruct, uint32_t FLatency) {
+  (void)RCC_ClkInitStruct;
+  (void)FLatency;
+  SystemCoreClock = SIM_CPU_FREQ;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RCCEx_PeriphCLKConfig(RCC_PeriphCLKInitTypeDef *PeriphClkInit) {
+  (void)PeriphClkInit;
+  return HAL_OK;
+}
+
+uint32_t HAL_RCC_GetHCLKFreq(void) {
+  return SystemCoreClock;
+}
+
+// =================================
+// GPIO
+// =================================
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init) {
+  (void)GPIOx;
+  (void)GPIO_Init;
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin) {
+  return (GPIOx->IDR & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState) {
+  if (PinState != GPIO_PIN_RESET) {
+    __atomic_fetch_or(&GPIOx->ODR, GPIO_Pin, __ATOMIC_SEQ_CST);
+  } else {
+    __atomic_fetch_and(&GPIOx->ODR, ~(uint32_t)GPIO_Pin, __ATOMIC_SEQ_CST);
+  }
+}
+
+void HAL_GPIO_TogglePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin) {
+  __atomic_fetch_xor(&GPIOx->ODR, GPIO_Pin, __ATOMIC_SEQ_CST);
+}
+
+// =================================
+// TIM
+// =================================
+static void timInit(TIM_HandleTypeDef *htim) {
+  TIM_TypeDef *tim = htim->Instance;
+
+  tim->PSC = htim->Init.Prescaler;
+  tim->ARR = htim->Init.Period;
+  tim->CR1 = (tim->CR1 & ~(TIM_CR1_CMS | TIM_CR1_DIR)) | htim->Init.CounterMode;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_Init(TIM_HandleTypeDef *htim) {
+  timInit(htim);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Init(TIM_HandleTypeDef *htim) {
+  timInit(htim);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_ConfigChannel(TIM_HandleTypeDef *htim, TIM_OC_InitTypeDef *sConfig, uint32_t Channel) {
+  (void)htim;
+  (void)sConfig;
+  (void)Channel;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIMEx_MasterConfigSynchronization(TIM_HandleTypeDef *htim, TIM_MasterConfigTypeDef *sMasterConfig) {
+  (void)htim;
+  (void)sMasterConfig;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_SlaveConfigSynchronization(TIM_HandleTypeDef *htim, TIM_SlaveConfigTypeDef *sSlaveConfig) {
+  (void)htim;
+  (void)sSlaveConfig;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIMEx_ConfigBreakDeadTime(TIM_HandleTypeDef *htim, TIM_BreakDeadTimeConfigTypeDef *sBreakDeadTimeConfig) {
+  htim->Instance->BDTR = (htim->Instance->BDTR & ~TIM_BDTR_DTG) | sBreakDeadTimeConfig->DeadTime;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_Start(TIM_HandleTypeDef *htim, uint32_t Channel) {
+  (void)Channel;
+  htim->Instance->CR1 |= TIM_CR1_CEN;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIMEx_PWMN_Start(TIM_HandleTypeDef *htim, uint32_t Channel) {
+  (void)Channel;
+  htim->Instance->CR1 |= TIM_CR1_CEN;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Start(TIM_HandleTypeDef *htim) {
+  htim->Instance->CR1 |= TIM_CR1_CEN;
+  return HAL_OK;
+}
+
+// =================================
+// ADC: the firmware sets the trigger, enable and interrupt bits itself
+// =================================
+HAL_StatusTypeDef HAL_ADC_Init(ADC_HandleTypeDef *hadc) {
+  (void)hadc;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_ConfigChannel(ADC_HandleTypeDef *hadc, ADC_ChannelConfTypeDef *sConfig) {
+  (void)hadc;
+  (void)sConfig;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADCEx_InjectedConfigChannel(ADC_HandleTypeDef *hadc, ADC_InjectionConfTypeDef *sConfigInjected) {
+  (void)hadc;
+  (void)sConfigInjected;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADCEx_MultiModeConfigChannel(ADC_HandleTypeDef *hadc, ADC_MultiModeTypeDef *multimode) {
+  (void)hadc;
+  (void)multimode;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_Start(ADC_HandleTypeDef *hadc) {
+  hadc->Instance->CR2 |= ADC_CR2_ADON;
+  return HAL_OK;
+}
+
+// =================================
+// DMA
+// =================================
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma) {
+  hdma->Instance->CCR = hdma->Init.Direction | hdma->Init.PeriphInc | hdma->Init.MemInc | hdma->Init.PeriphDataAlignment |
+                        hdma->Init.MemDataAlignment | hdma->Init.Mode | hdma->Init.Priority;
+  hdma->State         = HAL_DMA_STATE_READY;
+  return HAL_OK;
+}
+
+/* The channel flags are in DMA1->ISR at 4 bits per channel */
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma) {
+  uint32_t ch = ((uint32_t)hdma->Instance - (uint32_t)DMA1_Channel1) / ((uint32_t)DMA1_Channel2 - (uint32_t)DMA1_Channel1);
+
+  DMA1->IFCR = (DMA_IFCR_CGIF1 | DMA_IFCR_CTCIF1 | DMA_IFCR_CHTIF1 | DMA_IFCR_CTEIF1) << (4 * ch);
+}
+
+// =================================
+// UART
+// =================================
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart) {
+  huart->Instance->CR1 |= USART_CR1_UE | USART_CR1_TE | USART_CR1_RE;
+  huart->gState         = HAL_UART_STATE_READY;
+  huart->RxState        = HAL_UART_STATE_READY;
+  Sim_UartSetBaud((uint32_t)huart->Instance, huart->Init.BaudRate);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size) {
+  DMA_Channel_TypeDef *ch = huart->hdmarx->Instance;
+
+  ch->CCR            &= ~DMA_CCR_EN;
+  ch->CPAR            = (uint32_t)&huart->Instance->DR;
+  ch->CMAR            = (uint32_t)pData;
+  ch->CNDTR           = Size;
+  ch->CCR            |= DMA_CCR_EN;
+  huart->Instance->CR3 |= USART_CR3_DMAR;
+  huart->pRxBuffPtr   = pData;
+  huart->RxXferSize   = Size;
+  huart->RxState      = HAL_UART_STATE_BUSY_RX;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_DMAStop(UART_HandleTypeDef *huart) {
+  // The TX ring buffer of serial.c drives the TX DMA without the HAL: gState stays ready and the TX is left alone
+  if ((huart->Instance->CR3 & USART_CR3_DMAT) && huart->gState == HAL_UART_STATE_BUSY_TX) {
+    huart->Instance->CR3 &= ~USART_CR3_DMAT;
+    huart->hdmatx->Instance->CCR &= ~DMA_CCR_EN;
+    huart->gState = HAL_UART_STATE_READY;
+  }
+  if ((huart->Instance->CR3 & USART_CR3_DMAR) && huart->RxState == HAL_UART_STATE_BUSY_RX) {
+    huart->Instance->CR3 &= ~USART_CR3_DMAR;
+    huart->hdmarx->Instance->CCR &= ~DMA_CCR_EN;
+    huart->RxState = HAL_UART_STATE_READY;
+  }
+  return HAL_OK;
+}
+
+// =================================
+// FLASH: programmed and erased as the real one, the Flash image is mapped by sim.c
+// =================================
+HAL_StatusTypeDef HAL_FLASH_Unlock(void) {
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void) {
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data) {
+  volatile uint16_t *dst = (volatile uint16_t *)(uintptr_t)Address;
+  int n = (TypeProgram == FLASH_TYPEPROGRAM_HALFWORD) ? 1 : (TypeProgram == FLASH_TYPEPROGRAM_WORD) ? 2 : 4;
+
+  if (Address < SIM_FLASH_BASE || Address + 2 * n > SIM_FLASH_BASE + SIM_FLASH_SIZE || (Address & 1)) {
+    return HAL_ERROR;
+  }
+  for (int i = 0; i < n; i++, Data >>= 16) {
+    if (dst[i] != 0xFFFF && (uint16_t)Data != 0) {      // programming error (PGERR): only an erased halfword or 0 can be written
+      return HAL_ERROR;
+    }
+    dst[i] = (uint16_t)Data;
+    flashStall(FLASH_PROG_NS);
+  }
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError) {
+  uint32_t addr = pEraseInit->PageAddress;
+
+  *PageError = 0xFFFFFFFFU;
+  for (uint32_t i = 0; i < pEraseInit->NbPages; i++, addr += SIM_FLASH_PAGE) {
+    if (addr < SIM_FLASH_BASE || addr + SIM_FLASH_PAGE > SIM_FLASH_BASE + SIM_FLASH_SIZE) {
+      *PageError = addr;
+      return HAL_ERROR;
+    }
+    memset((void *)(uintptr_t)addr, 0xFF, SIM_FLASH_PAGE);
+    flashStall(FLASH_ERASE_NS);
+  }
+  return HAL_OK;
+}
+
+// =================================
+// I2C: no device on the bus
+// =================================
+HAL_StatusTypeDef HAL_I2C_Init(I2C_HandleTypeDef *hi2c) {
+  (void)hi2c;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_I2C_DeInit(I2C_HandleTypeDef *hi2c) {
+  (void)hi2c;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_I2C_Master_Transmit(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData, uint16_t Size, uint32_t Timeout) {
+  (void)hi2c;
+  (void)DevAddress;
+  (void)pData;
+  (void)Size;
+  (void)Timeout;
+  return HAL_ERROR;
+}
+
+HAL_StatusTypeDef HAL_I2C_Master_Receive(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData, uint16_t Size, uint32_t Timeout) {
+  (void)hi2c;
+  (void)DevAddress;
+  (void)pData;
+  (void)Size;
+  (void)Timeout;
+  return HAL_ERROR;
+}
+
+void HAL_I2C_EV_IRQHandler(I2C_HandleTypeDef *hi2c) {
+  (void)hi2c;
+}
+
+void HAL_I2C_ER_IRQHandler(I2C_HandleTypeDef *hi2c) {
+  (void)hi2c;
+}
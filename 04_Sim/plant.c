@@ -0,0 +1,124 @@
+/*
+* Motor plant of the Linux port, see plant.h. The motor equations are
+* integrated in the stationary alpha/beta frame with explicit Euler
+* steps, well below the electrical time constant L/R.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include "plant.h"
+
+#define PLANT_DT_MAX    10e-6                   // [s] integration step
+#define SQRT3_2         0.86602540378443865
+
+// Hall code (A << 2 | B << 1 | C) of each hall position, inverse of vec_hallToPos in BLDC_controller_data.c
+static const uint8_t hallCode[6] = {2, 3, 1, 5, 4, 6};
+
+/* Typical 10 inch hoverboard hub motor */
+void Plant_Init(PlantMotor *m) {
+  m->polePairs  = 15;
+  m->R          = 0.25;
+  m->L          = 0.4e-3;
+  m->psi        = 0.016;
+  m->J          = 0.01;
+  m->B          = 0.002;
+  m->tLoad      = 0;
+  m->hallOfs    = M_PI / 6;                     // hall edges 30 deg from the angles of the controller
+  m->tDead      = 0;
+  m->cOss       = 2e-9;
+  m->iAlpha     = 0;
+  m->iBeta      = 0;
+  m->w          = 0;
+  m->theta      = 0;
+  m->iPha[0]    = m->iPha[1] = m->iPha[2] = 0;
+  m->iDc        = 0;
+}
+
+/* duty: high side on-time of each half bridge [0, 1], tPwm: PWM period. With the bridge off (MOE cleared) all the switches are
+ * open: the currents are taken to zero, the rectification through the diodes above the battery voltage is ignored.
+ * Dead time: the phase node follows the current while both switches are off. A current out of the bridge holds it low (the
+ * high side turn-on comes tDead late), a current into the bridge holds it high. Below 2 cOss vBat / tDead the current does
+ * not swing the node within the dead time: the voltage error is linear in the current */
+void Plant_Step(PlantMotor *m, const double duty[3], uint8_t bridgeOn, double vBat, double tPwm, double dt) {
+  int     n = (int)ceil(dt / PLANT_DT_MAX);
+  double  h = dt / n;
+  double  d[3], iBand, x, vn, va, vb, vc, vAlpha, vBeta, eAlpha, eBeta, s, c, te, tl;
+
+  for (int k = 0; k < 3; k++) {
+    d[k] = duty[k];
+    if (m->tDead > 0 && tPwm > 0 && duty[k] > 0 && duty[k] < 1) {
+      iBand = 2 * m->cOss * vBat / m->tDead;
+      x     = iBand > 0 ? m->iPha[k] / iBand : (m->iPha[k] > 0) - (m->iPha[k] < 0);
+      x     = x > 1 ? 1 : (x < -1 ? -1 : x);
+      d[k] -= x * m->tDead / tPwm;
+      d[k]  = d[k] > 1 ? 1 : (d[k] < 0 ? 0 : d[k]);
+    }
+  }
+
+  vn      = (d[0] + d[1] + d[2]) * vBat / 3;
+  va      = d[0] * vBat - vn;
+  vb      = d[1] * vBat - vn;
+  vc      = d[2] * vBat - vn;
+  vAlpha  = (2 * va - vb - vc) / 3;
+  vBeta   = (vb - vc) / sqrt(3);
+
+  for (int i = 0; i < n; i++) {
+    s       = sin(m->theta);
+    c       = cos(m->theta);
+    if (bridgeOn) {
+      eAlpha    = -m->psi * m->polePairs * m->w * s;
+      eBeta     =  m->psi * m->polePairs * m->w * c;
+      m->iAlpha += h * (vAlpha - m->R * m->iAlpha - eAlpha) / m->L;
+      m->iBeta  += h * (vBeta  - m->R * m->iBeta  - eBeta)  / m->L;
+    } else {
+      m->iAlpha = 0;
+      m->iBeta  = 0;
+    }
+    te      = 1.5 * m->polePairs * m->psi * (m->iBeta * c - m->iAlpha * s);
+    tl      = m->B * m->w;
+    if (m->w > 1e-3) {
+      tl   += m->tLoad;
+    } else if (m->w < -1e-3) {
+      tl   -= m->tLoad;
+    } else if (fabs(te) <= m->tLoad) {            // static friction: stays at rest
+      tl    = te;
+    } else {
+      tl   += te > 0 ? m->tLoad : -m->tLoad;
+    }
+    m->w   += h * (te - tl) / m->J;
+    m->theta = fmod(m->theta + h * m->polePairs * m->w, 2 * M_PI);
+    if (m->theta < 0) {
+      m->theta += 2 * M_PI;
+    }
+  }
+
+  m->iPha[0]  = m->iAlpha;
+  m->iPha[1]  = -0.5 * m->iAlpha + SQRT3_2 * m->iBeta;
+  m->iPha[2]  = -0.5 * m->iAlpha - SQRT3_2 * m->iBeta;
+  m->iDc      = bridgeOn ? d[0] * m->iPha[0] + d[1] * m->iPha[1] + d[2] * m->iPha[2] : 0;
+}
+
+uint8_t Plant_Hall(const PlantMotor *m) {
+  double a = fmod(m->theta - m->hallOfs + 4 * M_PI, 2 * M_PI);
+  int    pos = (int)(a / (M_PI / 3));
+
+  return hallCode[pos > 5 ? 5 : pos];
+}
+
+double Plant_Rpm(const PlantMotor *m) {
+  return m->w * 60 / (2 * M_PI);
+}
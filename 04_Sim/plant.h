@@ -0,0 +1,51 @@
+/*
+* Motor plant of the Linux port: a hub motor (surface PMSM) with hall
+* sensors, driven by the three half bridges of the inverter.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+typedef struct {
+  // Parameters
+  int     polePairs;
+  double  R;                  // [Ohm] phase resistance
+  double  L;                  // [H] phase inductance
+  double  psi;                // [Wb] permanent magnet flux linkage
+  double  J;                  // [kg m^2] inertia of the wheel (and load)
+  double  B;                  // [Nm s/rad] viscous friction
+  double  tLoad;              // [Nm] load torque, opposed to the rotation
+  double  hallOfs;            // [rad] electrical angle of the hall position 0
+  double  tDead;              // [s] dead time of the half bridges
+  double  cOss;               // [F] output capacitance of a half bridge node, charged by the phase current during the dead time
+
+  // State
+  double  iAlpha, iBeta;      // [A] stator currents
+  double  w;                  // [rad/s] mechanical speed
+  double  theta;              // [rad] electrical angle, [0, 2 pi)
+
+  // Outputs of the last step
+  double  iPha[3];            // [A] phase currents A, B, C, positive into the motor
+  double  iDc;                // [A] DC link current, positive from the battery
+} PlantMotor;
+
+void    Plant_Init(PlantMotor *m);
+void    Plant_Step(PlantMotor *m, const double duty[3], uint8_t bridgeOn, double vBat, double tPwm, double dt);
+uint8_t Plant_Hall(const PlantMotor *m);          // hall levels, bit 2 = A, bit 1 = B, bit 0 = C
+double  Plant_Rpm(const PlantMotor *m);
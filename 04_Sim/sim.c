@@ -0,0 +1,913 @@
+/*
+* Firmware-in-the-loop: the unmodified firmware (main loop, interrupt
+* handlers, BLDC controller) runs as a Linux process.
+*
+*  - Registers: the peripheral, core and Flash address ranges of the
+*    STM32F103 are mapped at their real addresses, so the firmware
+*    register accesses run as they are. The HAL is stubbed in hal_sim.c.
+*  - Interrupts: the main thread is the CPU. A pending interrupt is a
+*    SIGUSR1 sent to it, the signal handler runs the highest priority
+*    pending handler with the Cortex-M preemption rules. __disable_irq()
+*    blocks the signal, see sim_cmsis.h.
+*  - Hardware: a second thread wakes up at every PWM period of the real
+*    time. It steps the motor plants (plant.c) with the duty cycles of
+*    TIM1/TIM8, writes the injected ADC results and the hall sensor
+*    inputs and pends the ADC interrupt. It also runs the regular ADC
+*    sequence and its DMA, SysTick, and USART2/3 with their DMA channels
+*    on pseudo-terminals.
+*
+* DWT->CYCCNT counts the host time at 64 MHz: the cycle counts measured
+* by the firmware are host time, not target cycles.
+*
+* Build: make -C 04_Sim (host gcc, the firmware configuration is Inc/config.h)
+* Run:   04_Sim/build/hover_sim [options]
+*   -t time_s     run time, 0 = until the firmware powers off or Ctrl-C (default 0)
+*   -v volt       battery voltage, a value or a profile "t:volt,t:volt,..." for voltage dips (default 38)
+*   -L load_nm    load torque of both wheels, a value or a profile "t:nm,t:nm,..." for load steps (default 0)
+*   -J inertia    inertia of both wheels [kg m^2] (default 0.01)
+*   -a profile    ADC input PA2 (l_tx2) over time, "t:adc,t:adc,...", linear in between (default 0)
+*   -A profile    ADC input PA3 (l_rx2) over time (default 0)
+*   -b t:dur      press the power button at t for dur seconds
+*   -n lsb        ADC noise amplitude (default 0)
+*   -d ns         dead time of the inverter (default DEAD_TIME of config.h at 64 MHz = 500 ns)
+*   -H t0:t1      harmonic distortion of the left motor phase A current between t0 and t1 s, over whole electrical periods
+*   -e file       Flash image, keeps the EEPROM emulation between runs (default: erased Flash)
+*   -o file.csv   log the motors every -r ms (default 10): speeds, currents (iq and id in A), battery, errors
+* The serial ports print the pseudo-terminal to open, e.g. with 03_Tools/hoverclient: hoverclient_demo -p /dev/pts/3
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#undef  CR1                         // termios.h output delays, the register names of stm32f103xe.h
+#undef  CR2
+#undef  CR3
+
+#include "stm32f1xx_hal.h"
+#include "defines.h"
+#include "config.h"
+#include "BLDC_controller.h"
+#include "sim.h"
+#include "plant.h"
+
+#define NB_IRQ          (16 + 60)           // core exceptions + STM32F103xE interrupts, index = IRQn + 16
+#define PRIO_THREAD     0x1000              // priority of the main loop, below all the interrupts
+#define NB_PROFILE_PTS  32
+#define RXNE_HOLD_NS    ((2 * DELAY_IN_MAIN_LOOP + 2) * 1000000ULL)   // polled RX byte: seen by at least one main loop iteration
+#define BAT_RES         0.1                 // [Ohm] battery internal resistance
+#define ADC_LSB_A       (1.0 / A2BIT_CONV)
+#define SHUNT_WIN_MIN   100                 // [counts] low side on time a phase current sample needs around the counter peak
+#define NB_HARM         13                  // current harmonics analysed by -H
+
+// Firmware
+extern ExtY              rtY_Left, rtY_Right;
+extern uint8_t           errCode_Left, errCode_Right, enable;
+extern volatile int      pwml, pwmr;
+extern int16_t           batVoltage;
+extern volatile adc_buf_t adc_buffer;
+
+// Interrupt handlers of the firmware, weak: the ones not built in the current configuration stay NULL
+#define WEAK __attribute__((weak))
+void SysTick_Handler(void) WEAK;
+void ADC1_2_IRQHandler(void) WEAK;
+void DMA1_Channel1_IRQHandler(void) WEAK;
+void DMA1_Channel2_IRQHandler(void) WEAK;
+void DMA1_Channel3_IRQHandler(void) WEAK;
+void DMA1_Channel6_IRQHandler(void) WEAK;
+void DMA1_Channel7_IRQHandler(void) WEAK;
+void USART2_IRQHandler(void) WEAK;
+void USART3_IRQHandler(void) WEAK;
+
+static void (*const irqHandler[NB_IRQ])(void) = {
+  [SysTick_IRQn + 16]       = SysTick_Handler,
+  [ADC1_2_IRQn + 16]        = ADC1_2_IRQHandler,
+  [DMA1_Channel1_IRQn + 16] = DMA1_Channel1_IRQHandler,
+  [DMA1_Channel2_IRQn + 16] = DMA1_Channel2_IRQHandler,
+  [DMA1_Channel3_IRQn + 16] = DMA1_Channel3_IRQHandler,
+  [DMA1_Channel6_IRQn + 16] = DMA1_Channel6_IRQHandler,
+  [DMA1_Channel7_IRQn + 16] = DMA1_Channel7_IRQHandler,
+  [USART2_IRQn + 16]        = USART2_IRQHandler,
+  [USART3_IRQn + 16]        = USART3_IRQHandler,
+};
+
+typedef struct {
+  uint64_t  calls;
+  uint64_t  sumNs;
+  uint64_t  maxNs;
+  uint64_t  overruns;                       // pended again before it ran
+} IrqStats;
+
+typedef struct {
+  int       n;
+  double    t[NB_PROFILE_PTS];
+  double    v[NB_PROFILE_PTS];
+} Profile;
+
+/* Integrals over the electrical angle of the phase current i: i^2, i, i cos(k theta), i sin(k theta) */
+typedef struct {
+  double    ang;
+  double    sq, dc;
+  double    a[NB_HARM + 1], b[NB_HARM + 1];
+} HarmSums;
+
+typedef struct {
+  const char           *name;
+  USART_TypeDef        *usart;
+  DMA_Channel_TypeDef  *txDma;
+  DMA_Channel_TypeDef  *rxDma;
+  int                   txCh, rxCh;         // DMA1 channel numbers
+  IRQn_Type             irqn, txIrqn, rxIrqn;
+  int                   master;             // pseudo-terminal
+  int                   slave;              // kept open: the line settings stay when the client closes
+  char                  path[64];
+  uint64_t              byteNs;             // 0 = not initialized by the firmware
+  uint32_t              sr;                 // SR flags set by the hardware
+  volatile uint8_t      irqDone;            // the USART interrupt ran: SR then DR read, IDLE cleared
+  // TX DMA
+  uint32_t              txCndtr, txTotal, txBase;
+  uint64_t              txNextNs;
+  // RX
+  uint8_t               rxStage[64];
+  int                   rxStageLen, rxStagePos;
+  uint64_t              rxNextNs, rxLastNs, rxneUntil;
+  uint8_t               rxIdlePending;
+  uint32_t              rxCndtr, rxCmar, rxTotal;
+  // Statistics
+  uint64_t              rxBytes, txBytes, rxLost, txLost;
+} SimUart;
+
+// Interrupt controller
+static pthread_t          mainThread;
+static volatile uint32_t  primask;
+static volatile uint8_t   irqPending[NB_IRQ];
+static volatile uint8_t   irqEnabled[NB_IRQ];
+static volatile uint16_t  irqPrio[NB_IRQ];
+static volatile uint16_t  activePrio = PRIO_THREAD;
+static IrqStats           irqStats[NB_IRQ];
+static sigset_t           irqSigSet;
+
+// Time base
+static struct timespec    startTs;
+
+// Options
+static double             optTime     = 0;
+static Profile            optVbat     = { 1, { 0 }, { 38 } };
+static double             optInertia  = 0.01;
+static Profile            optLoad, optAdc1, optAdc2;
+static double             optButtonAt = -1, optButtonDur = 0;
+static int                optNoise    = 0;
+static double             optDeadNs   = DEAD_TIME * 1e9 / SIM_CPU_FREQ;
+static double             optHarmFrom = -1, optHarmTo = -1;
+static const char        *optFlash    = NULL;
+static const char        *optLog      = NULL;
+static int                optLogMs    = 10;
+
+// Hardware
+static pthread_t          hwThread;
+static volatile int       stopReq     = 0;
+static PlantMotor         motorL, motorR;
+static uint32_t           adcSr;
+static uint32_t           timSr;              // LEFT_TIM->SR
+static uint32_t           dmaIsr;
+static uint64_t           pwmPeriods, latePeriods;
+static uint64_t           shuntShort;         // current samples of a measured phase without the low side window
+static uint64_t           bootShort;          // PWM periods with a phase closer than PWM_LOW_MIN to the top (bootstrap recharge)
+static HarmSums           harmPer, harmSum;   // the electrical period in progress, the sum of the whole periods analysed
+static double             vBatEff;
+static FILE              *logFile;
+
+static SimUart uart2 = { "USART2", USART2, DMA1_Channel7, DMA1_Channel6, 7, 6, USART2_IRQn, DMA1_Channel7_IRQn, DMA1_Channel6_IRQn };
+static SimUart uart3 = { "USART3", USART3, DMA1_Channel2, DMA1_Channel3, 2, 3, USART3_IRQn, DMA1_Channel2_IRQn, DMA1_Channel3_IRQn };
+
+static void die(const char *what) {
+  perror(what);
+  _exit(1);
+}
+
+// =================================
+// Time base
+// =================================
+uint64_t Sim_TimeNs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)(ts.tv_sec - startTs.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec - (uint64_t)startTs.tv_nsec;
+}
+
+/* Called by both threads: DWT->CYCCNT only moves forward, so the firmware never sees a negative duration */
+void Sim_CycUpdate(void) {
+  uint32_t cyc = (uint32_t)(Sim_TimeNs() * (SIM_CPU_FREQ / 1000000) / 1000);
+  uint32_t cur = DWT->CYCCNT;
+
+  while ((int32_t)(cyc - cur) > 0 && !__atomic_compare_exchange_n(&DWT->CYCCNT, &cur, cyc, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+  }
+}
+
+// =================================
+// Interrupts
+// =================================
+/* Runs the pending interrupts that can preempt the active one, highest priority first */
+static void irqDispatch(void) {
+  for (;;) {
+    int       best = -1;
+    uint16_t  prio, saved;
+    uint64_t  t0, dt;
+
+    if (primask) {
+      return;
+    }
+    for (int i = 0; i < NB_IRQ; i++) {
+      if (irqPending[i] && (i < 16 || irqEnabled[i]) && (best < 0 || irqPrio[i] < irqPrio[best])) {
+        best = i;
+      }
+    }
+    if (best < 0 || (irqPrio[best] >> 4) >= (activePrio >> 4)) {  // only a higher preemption priority preempts
+      return;
+    }
+    if (!__atomic_exchange_n(&irqPending[best], 0, __ATOMIC_SEQ_CST)) {
+      continue;                                           // taken by a nested dispatch
+    }
+    prio        = irqPrio[best];
+    saved       = activePrio;
+    activePrio  = prio;
+    Sim_CycUpdate();
+    t0          = Sim_TimeNs();
+    if (irqHandler[best]) {
+      irqHandler[best]();
+    }
+    dt          = Sim_TimeNs() - t0;
+    activePrio  = saved;
+
+    irqStats[best].calls++;
+    irqStats[best].sumNs += dt;
+    if (dt > irqStats[best].maxNs) {
+      irqStats[best].maxNs = dt;
+    }
+    if (best == USART2_IRQn + 16) {
+      uart2.irqDone = 1;
+    } else if (best == USART3_IRQn + 16) {
+      uart3.irqDone = 1;
+    }
+  }
+}
+
+static void irqSignal(int sig) {
+  int err = errno;
+
+  (void)sig;
+  irqDispatch();
+  errno = err;
+}
+
+void Sim_IrqPend(int irqn) {
+  if (__atomic_exchange_n(&irqPending[irqn + 16], 1, __ATOMIC_SEQ_CST)) {
+    irqStats[irqn + 16].overruns++;
+  }
+  pthread_kill(mainThread, SIGUSR1);
+}
+
+void Sim_IrqSetEnable(int irqn, uint8_t en) {
+  irqEnabled[irqn + 16] = en;
+  if (en && irqPending[irqn + 16]) {
+    pthread_kill(mainThread, SIGUSR1);
+  }
+}
+
+void Sim_IrqSetPriority(int irqn, uint32_t preempt, uint32_t sub) {
+  irqPrio[irqn + 16] = (uint16_t)((preempt & 0xF) << 4 | (sub & 0xF));
+}
+
+void Sim_IrqDisable(void) {
+  pthread_sigmask(SIG_BLOCK, &irqSigSet, NULL);
+  primask = 1;
+}
+
+/* A signal received while masked is delivered when unblocked */
+void Sim_IrqEnable(void) {
+  primask = 0;
+  pthread_sigmask(SIG_UNBLOCK, &irqSigSet, NULL);
+  Sim_CycUpdate();
+}
+
+uint32_t Sim_IrqMasked(void) {
+  return primask;
+}
+
+// =================================
+// Register helpers
+// =================================
+/* Status register with rc_w0 flags: the firmware clears a flag by writing 0, writing 1 has no effect.
+ * *model holds the flags as set by the hardware, the flags cleared in the register since are dropped */
+static void regFlags(volatile uint32_t *reg, uint32_t *model, uint32_t set, uint32_t clear) {
+  uint32_t cur = *reg, val;
+
+  do {
+    val = ((*model & cur) & ~clear) | set;
+  } while (!__atomic_compare_exchange_n(reg, &cur, val, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+  *model = val;
+}
+
+/* DMA1 ISR, cleared by writing DMA1->IFCR */
+static void dmaFlags(uint32_t set) {
+  uint32_t ifcr = __atomic_exchange_n(&DMA1->IFCR, 0, __ATOMIC_SEQ_CST);
+
+  dmaIsr    = (dmaIsr & ~ifcr) | set;
+  DMA1->ISR = dmaIsr;
+}
+
+#define DMA_TC(ch)  ((DMA_ISR_GIF1 | DMA_ISR_TCIF1) << (4 * ((ch) - 1)))
+
+static void pinSet(GPIO_TypeDef *port, uint16_t pin, uint8_t level) {
+  if (level) {
+    __atomic_fetch_or(&port->IDR, pin, __ATOMIC_SEQ_CST);
+  } else {
+    __atomic_fetch_and(&port->IDR, ~(uint32_t)pin, __ATOMIC_SEQ_CST);
+  }
+}
+
+// =================================
+// Motors and ADC
+// =================================
+static double profileAt(const Profile *p, double t) {
+  if (p->n == 0) {
+    return 0;
+  }
+  if (t <= p->t[0]) {
+    return p->v[0];
+  }
+  for (int i = 1; i < p->n; i++) {
+    if (t < p->t[i]) {
+      return p->v[i - 1] + (p->v[i] - p->v[i - 1]) * (t - p->t[i - 1]) / (p->t[i] - p->t[i - 1]);
+    }
+  }
+  return p->v[p->n - 1];
+}
+
+static uint32_t adcValue(double v) {
+  if (optNoise) {
+    v += rand() % (2 * optNoise + 1) - optNoise;
+  }
+  return (uint32_t)(v < 0 ? 0 : (v > 4095 ? 4095 : lround(v)));
+}
+
+/* Phase and DC link current sensing: the firmware current is the ADC offset minus the sample */
+static uint32_t adcCurrent(double i) {
+  return adcValue(2048 - i / ADC_LSB_A);
+}
+
+static void motorStep(PlantMotor *m, TIM_TypeDef *tim, double dt) {
+  double duty[3], arr = tim->ARR ? tim->ARR : 1;
+  double tPwm = ((tim->CR1 & TIM_CR1_CMS) ? 2 * arr : arr + 1) / SIM_CPU_FREQ;
+
+  duty[0] = tim->CCR1 / arr;
+  duty[1] = tim->CCR2 / arr;
+  duty[2] = tim->CCR3 / arr;
+  for (int i = 0; i < 3; i++) {
+    duty[i] = duty[i] > 1 ? 1 : duty[i];
+  }
+  Plant_Step(m, duty, (tim->BDTR & TIM_BDTR_MOE) != 0, vBatEff, tPwm, dt);
+}
+
+/* Harmonic analysis of the left motor phase A current over the plant electrical angle, see -H */
+static void harmStep(double t, double dt) {
+  double i = motorL.iPha[0], dAng = fabs(motorL.polePairs * motorL.w * dt);
+
+  if (t < optHarmFrom || t >= optHarmTo) {
+    return;
+  }
+  harmPer.ang  += dAng;
+  harmPer.sq   += i * i * dAng;
+  harmPer.dc   += i * dAng;
+  for (int k = 1; k <= NB_HARM; k++) {
+    harmPer.a[k] += i * cos(k * motorL.theta) * dAng;
+    harmPer.b[k] += i * sin(k * motorL.theta) * dAng;
+  }
+  if (harmPer.ang >= 2 * M_PI) {
+    harmSum.ang  += harmPer.ang;
+    harmSum.sq   += harmPer.sq;
+    harmSum.dc   += harmPer.dc;
+    for (int k = 1; k <= NB_HARM; k++) {
+      harmSum.a[k] += harmPer.a[k];
+      harmSum.b[k] += harmPer.b[k];
+    }
+    memset(&harmPer, 0, sizeof(harmPer));
+  }
+}
+
+/* THD of the harmonics 2..NB_HARM. The rest: all the other components but DC (higher harmonics, control noise, host timing glitches) */
+static void harmPrint(void) {
+  const HarmSums *h = &harmSum;
+  double amp[NB_HARM + 1], dc, rms1, sumSq = 0, rest;
+
+  if (h->ang < 2 * M_PI) {
+    printf("phase current      left A: no whole electrical period between %.2f and %.2f s\n", optHarmFrom, optHarmTo);
+    return;
+  }
+  for (int k = 1; k <= NB_HARM; k++) {
+    amp[k]  = 2 * sqrt(h->a[k] * h->a[k] + h->b[k] * h->b[k]) / h->ang;
+    sumSq  += (k > 1) ? amp[k] * amp[k] / 2 : 0;
+  }
+  dc    = h->dc / h->ang;
+  rms1  = amp[1] / sqrt(2);
+  rest  = sqrt(fmax(h->sq / h->ang - dc * dc - rms1 * rms1 - sumSq, 0));
+  printf("phase current      left A: fundamental %.2f A rms, THD %.2f %%, rest %.2f %% over %.0f electrical periods\n",
+         rms1, rms1 > 0 ? 100 * sqrt(sumSq) / rms1 : 0, rms1 > 0 ? 100 * rest / rms1 : 0, h->ang / (2 * M_PI));
+  printf("                   harmonics [%% of the fundamental]:");
+  for (int k = 2; k <= NB_HARM; k++) {
+    printf(" %d: %.2f", k, amp[1] > 0 ? 100 * amp[k] / amp[1] : 0);
+  }
+  printf("\n");
+}
+
+static void hallSet(const PlantMotor *m, GPIO_TypeDef *port, uint16_t pinA, uint16_t pinB, uint16_t pinC) {
+  uint8_t code = Plant_Hall(m);
+
+  // The sensor outputs are active low: hall_xx = !(IDR & pin) in bldc.c
+  pinSet(port, pinA, !(code & 4));
+  pinSet(port, pinB, !(code & 2));
+  pinSet(port, pinC, !(code & 1));
+}
+
+/* Injected sequences, see MX_ADC1_Init(): ADC1 = dcr, rl1 (left A), rr1 (right B), ADC2 = dcl, rl2 (left B), rr2 (right C) */
+static void adcInjected(void) {
+  uint32_t arr = LEFT_TIM->ARR;
+
+  if (((LEFT_TIM->BDTR & TIM_BDTR_MOE) && (LEFT_TIM->CCR1 + SHUNT_WIN_MIN > arr || LEFT_TIM->CCR2 + SHUNT_WIN_MIN > arr)) ||
+      ((RIGHT_TIM->BDTR & TIM_BDTR_MOE) && (RIGHT_TIM->CCR2 + SHUNT_WIN_MIN > arr || RIGHT_TIM->CCR3 + SHUNT_WIN_MIN > arr))) {
+    shuntShort++;
+  }
+  if (((LEFT_TIM->BDTR & TIM_BDTR_MOE) && MAX3(LEFT_TIM->CCR1, LEFT_TIM->CCR2, LEFT_TIM->CCR3) + PWM_LOW_MIN > arr) ||
+      ((RIGHT_TIM->BDTR & TIM_BDTR_MOE) && MAX3(RIGHT_TIM->CCR1, RIGHT_TIM->CCR2, RIGHT_TIM->CCR3) + PWM_LOW_MIN > arr)) {
+    bootShort++;
+  }
+  ADC1->JDR1 = adcCurrent(motorR.iDc);
+  ADC1->JDR2 = adcCurrent(motorL.iPha[0]);
+  ADC1->JDR3 = adcCurrent(motorR.iPha[1]);
+  if ((ADC2->CR2 & ADC_CR2_ADON) && (ADC2->CR2 & ADC_CR2_JEXTTRIG)) {   // dual mode slave: needs its external trigger enabled
+    ADC2->JDR1 = adcCurrent(motorL.iDc);
+    ADC2->JDR2 = adcCurrent(motorL.iPha[1]);
+    ADC2->JDR3 = adcCurrent(motorR.iPha[2]);
+  }
+  regFlags(&ADC1->SR, &adcSr, ADC_SR_JEOC, 0);
+  if (ADC1->CR1 & ADC_CR1_JEOCIE) {
+    Sim_IrqPend(ADC1_2_IRQn);
+  }
+}
+
+/* Regular sequence started by the firmware (SWSTART): ADC1 = battery, temperature, ADC2 = PA2, PA3 in dual mode,
+ * two 32 bit words transferred by DMA1_Channel1 */
+static void adcRegular(double t) {
+  volatile uint32_t *dst;
+  int               slave;
+
+  if (!(__atomic_fetch_and(&ADC1->CR2, ~(uint32_t)ADC_CR2_SWSTART, __ATOMIC_SEQ_CST) & ADC_CR2_SWSTART)) {
+    return;
+  }
+  if (!(DMA1_Channel1->CCR & DMA_CCR_EN)) {
+    return;
+  }
+  slave   = (ADC2->CR2 & ADC_CR2_ADON) && (ADC2->CR2 & ADC_CR2_EXTTRIG);   // dual mode slave: needs its external trigger enabled
+  dst     = (volatile uint32_t *)(uintptr_t)DMA1_Channel1->CMAR;
+  dst[0]  = adcValue(vBatEff * 100 * BAT_CALIB_ADC / BAT_CALIB_REAL_VOLTAGE) | (slave ? adcValue(profileAt(&optAdc1, t)) << 16 : 0);
+  dst[1]  = adcValue(TEMP_CAL_LOW_ADC) | (slave ? adcValue(profileAt(&optAdc2, t)) << 16 : 0);
+  dmaFlags(DMA_TC(1));
+  if (DMA1_Channel1->CCR & DMA_CCR_TCIE) {
+    Sim_IrqPend(DMA1_Channel1_IRQn);
+  }
+}
+
+// =================================
+// Serial ports
+// =================================
+static void uartOpen(SimUart *u) {
+  struct termios tio;
+
+  u->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (u->master < 0 || grantpt(u->master) < 0 || unlockpt(u->master) < 0) {
+    die("posix_openpt");
+  }
+  snprintf(u->path, sizeof(u->path), "%s", ptsname(u->master));
+  u->slave = open(u->path, O_RDWR | O_NOCTTY);
+  if (u->slave < 0 || tcgetattr(u->slave, &tio) < 0) {
+    die(u->path);
+  }
+  cfmakeraw(&tio);
+  tcsetattr(u->slave, TCSANOW, &tio);
+}
+
+/* Called by HAL_UART_Init() */
+void Sim_UartSetBaud(uint32_t usartBase, uint32_t baud) {
+  SimUart *u = (usartBase == (uint32_t)USART2_BASE) ? &uart2 : &uart3;
+
+  u->byteNs = 10ULL * 1000000000ULL / baud;              // 8N1
+  printf("%s: %s, %u baud\n", u->name, u->path, (unsigned)baud);
+  fflush(stdout);
+}
+
+static void uartRxByte(SimUart *u, uint8_t c, uint64_t t) {
+  DMA_Channel_TypeDef *ch = u->rxDma;
+  uint32_t cndtr;
+
+  u->rxBytes++;
+  u->rxLastNs       = t;
+  u->rxIdlePending  = 1;
+
+  if ((u->usart->CR3 & USART_CR3_DMAR) && (ch->CCR & DMA_CCR_EN)) {
+    cndtr = ch->CNDTR;
+    if (cndtr != u->rxCndtr || ch->CMAR != u->rxCmar) {  // (re)started by the firmware
+      u->rxTotal  = cndtr;
+      u->rxCmar   = ch->CMAR;
+    }
+    if (cndtr == 0 || cndtr > u->rxTotal) {
+      u->rxLost++;
+      return;
+    }
+    *(volatile uint8_t *)(uintptr_t)(ch->CMAR + u->rxTotal - cndtr) = c;
+    if (--cndtr == 0) {
+      if (ch->CCR & DMA_CCR_CIRC) {
+        cndtr = u->rxTotal;
+      }
+      dmaFlags(DMA_TC(u->rxCh));
+      if (ch->CCR & DMA_CCR_TCIE) {
+        Sim_IrqPend(u->rxIrqn);
+      }
+    }
+    ch->CNDTR   = cndtr;
+    u->rxCndtr  = cndtr;
+  } else if (u->usart->CR1 & USART_CR1_RE) {
+    if (u->sr & USART_SR_RXNE) {
+      u->rxLost++;                                        // overrun
+    }
+    u->usart->DR  = c;
+    u->rxneUntil  = t + RXNE_HOLD_NS;
+    regFlags(&u->usart->SR, &u->sr, USART_SR_RXNE, 0);
+  } else {
+    u->rxLost++;
+  }
+}
+
+static void uartService(SimUart *u, uint64_t t) {
+  DMA_Channel_TypeDef *ch = u->txDma;
+  uint8_t   out[64];
+  int       n = 0;
+  ssize_t   r;
+
+  if (u->byteNs == 0) {
+    return;
+  }
+
+  // Flags cleared by a register read sequence
+  if (u->irqDone) {
+    u->irqDone = 0;
+    regFlags(&u->usart->SR, &u->sr, 0, USART_SR_IDLE);
+  }
+  if (u->rxneUntil && t >= u->rxneUntil) {
+    u->rxneUntil = 0;
+    regFlags(&u->usart->SR, &u->sr, 0, USART_SR_RXNE);
+  }
+
+  // TX DMA: a new transfer is detected by the CNDTR written by the firmware
+  if ((u->usart->CR3 & USART_CR3_DMAT) && (ch->CCR & DMA_CCR_EN)) {
+    if (ch->CNDTR != u->txCndtr) {
+      u->txCndtr  = ch->CNDTR;
+      u->txTotal  = u->txCndtr;
+      u->txBase   = ch->CMAR;
+      if (u->txNextNs < t) {
+        u->txNextNs = t + u->byteNs;
+      }
+      regFlags(&u->usart->SR, &u->sr, 0, USART_SR_TC);
+    }
+    while (u->txCndtr > 0 && t >= u->txNextNs && n < (int)sizeof(out)) {
+      out[n++]      = *(volatile uint8_t *)(uintptr_t)(u->txBase + u->txTotal - u->txCndtr);
+      u->txNextNs  += u->byteNs;
+      ch->CNDTR     = --u->txCndtr;
+      if (u->txCndtr == 0) {
+        regFlags(&u->usart->SR, &u->sr, USART_SR_TC, 0);
+        dmaFlags(DMA_TC(u->txCh));
+        if (ch->CCR & DMA_CCR_TCIE) {
+          Sim_IrqPend(u->txIrqn);
+        }
+      }
+    }
+  }
+  if (n > 0) {
+    u->txBytes += n;
+    r = write(u->master, out, n);
+    if (r < n) {
+      u->txLost += n - (r > 0 ? r : 0);                   // nobody reads the pseudo-terminal
+    }
+  }
+
+  // RX: the bytes written by the client arrive at the baud rate
+  if (u->rxStagePos == u->rxStageLen) {
+    r = read(u->master, u->rxStage, sizeof(u->rxStage));
+    u->rxStageLen = r > 0 ? (int)r : 0;
+    u->rxStagePos = 0;
+    if (r > 0 && u->rxNextNs < t) {
+      u->rxNextNs = t + u->byteNs;
+    }
+  }
+  while (u->rxStagePos < u->rxStageLen && t >= u->rxNextNs) {
+    uartRxByte(u, u->rxStage[u->rxStagePos++], t);
+    u->rxNextNs += u->byteNs;
+  }
+
+  // Idle line one character after the last byte
+  if (u->rxIdlePending && u->rxStagePos == u->rxStageLen && t >= u->rxLastNs + u->byteNs) {
+    u->rxIdlePending = 0;
+    regFlags(&u->usart->SR, &u->sr, USART_SR_IDLE, 0);
+    if (u->usart->CR1 & USART_CR1_IDLEIE) {
+      Sim_IrqPend(u->irqn);
+    }
+  }
+}
+
+// =================================
+// Hardware thread
+// =================================
+static void logLine(double t) {
+  fprintf(logFile, "%.3f,%d,%d,%d,%d,%.1f,%.1f,%.2f,%.2f,%.2f,%u,%u,%u,%.2f,%.2f,%.2f,%.2f\n", t, pwml, pwmr,
+          rtY_Left.n_mot, rtY_Right.n_mot, Plant_Rpm(&motorL), Plant_Rpm(&motorR),
+          motorL.iDc, motorR.iDc, vBatEff, enable, errCode_Left, errCode_Right,
+          (double)rtY_Left.r_devSignal1 / A2BIT_CONV, (double)rtY_Left.r_devSignal2 / A2BIT_CONV,
+          (double)rtY_Right.r_devSignal1 / A2BIT_CONV, (double)rtY_Right.r_devSignal2 / A2BIT_CONV);
+}
+
+static void simExit(const char *reason, double t) {
+  const int adc = ADC1_2_IRQn + 16;
+
+  printf("\n-- %s after %.2f s --\n", reason, t);
+  printf("PWM periods        %llu, %llu late (host too slow)\n", (unsigned long long)pwmPeriods, (unsigned long long)latePeriods);
+  printf("motor control ISR  %llu runs, %llu overruns, mean %.2f us, max %.2f us (host)\n",
+         (unsigned long long)irqStats[adc].calls, (unsigned long long)irqStats[adc].overruns,
+         irqStats[adc].calls ? irqStats[adc].sumNs / 1000.0 / irqStats[adc].calls : 0, irqStats[adc].maxNs / 1000.0);
+  printf("current samples    %llu without the low side window of a measured phase (left A/B, right B/C)\n", (unsigned long long)shuntShort);
+  printf("PWM periods        %llu with a phase less than PWM_LOW_MIN below the top (no bootstrap recharge)\n", (unsigned long long)bootShort);
+  printf("left motor         n_mot %d rpm, plant %.0f rpm, error %u\n", rtY_Left.n_mot, Plant_Rpm(&motorL), errCode_Left);
+  printf("right motor        n_mot %d rpm, plant %.0f rpm, error %u\n", rtY_Right.n_mot, Plant_Rpm(&motorR), errCode_Right);
+  printf("battery            %.2f V, firmware %d (V*100)\n", vBatEff, batVoltage * BAT_CALIB_REAL_VOLTAGE / BAT_CALIB_ADC);
+  if (optHarmTo > optHarmFrom) {
+    harmPrint();
+  }
+  for (SimUart *u = &uart2; u; u = (u == &uart2) ? &uart3 : NULL) {
+    if (u->byteNs) {
+      printf("%-18s rx %llu bytes (%llu lost), tx %llu bytes (%llu not read)\n", u->name, (unsigned long long)u->rxBytes,
+             (unsigned long long)u->rxLost, (unsigned long long)u->txBytes, (unsigned long long)u->txLost);
+    }
+  }
+  fflush(stdout);
+  if (logFile) {
+    fclose(logFile);
+  }
+  _exit(0);
+}
+
+static void *hwMain(void *arg) {
+  uint64_t  t, next = 0, nextTick = 1000000, nextLog = 0, plantAt = 0, step;
+  uint8_t   phase = 0, offPrev = 0;
+  struct timespec ts;
+
+  (void)arg;
+  prctl(PR_SET_TIMERSLACK, 1UL);
+
+  for (;;) {
+    TIM_TypeDef *tim  = LEFT_TIM;
+    uint32_t ticks    = (tim->CR1 & TIM_CR1_CMS) ? 2 * tim->ARR : tim->ARR + 1;
+    uint8_t  running  = (tim->CR1 & TIM_CR1_CEN) && (RIGHT_TIM->CR1 & TIM_CR1_CEN) && ticks > 0;
+    uint8_t  twoSmp   = (tim->CR1 & TIM_CR1_CMS) == TIM_CR1_CMS;   // center-aligned mode 3: injected trigger counting up and down
+
+    // Wake up at every PWM period (every half period with two current samples), 20 kHz without PWM
+    step  = running ? (uint64_t)ticks * 1000000000ULL / SIM_CPU_FREQ / (twoSmp ? 2 : 1) : 50000;
+    next += step;
+    t     = Sim_TimeNs();
+    if (t > next + 4 * step) {
+      latePeriods += (t - next) / step;
+      next = t;
+    }
+    ts.tv_sec   = startTs.tv_sec + (time_t)((next + startTs.tv_nsec) / 1000000000ULL);
+    ts.tv_nsec  = (long)((next + startTs.tv_nsec) % 1000000000ULL);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+    t = Sim_TimeNs();
+    Sim_CycUpdate();
+
+    if (stopReq) {
+      simExit("stopped", t / 1e9);
+    }
+    if (optTime > 0 && t >= optTime * 1e9) {
+      simExit("end of run time", t / 1e9);
+    }
+
+    // Motors: plant step over the elapsed time, then the injected conversions
+    vBatEff = profileAt(&optVbat, t / 1e9) - BAT_RES * (motorL.iDc + motorR.iDc);
+    motorL.tLoad = motorR.tLoad = profileAt(&optLoad, t / 1e9);
+    if (running && (!twoSmp || phase == 0)) {
+      // A host stall is no stall of the target: the plant steps at most 2 PWM periods with the same duty cycles
+      double dt = MIN(t - plantAt, 2 * step * (twoSmp ? 2 : 1)) / 1e9;
+      motorStep(&motorL, LEFT_TIM, dt);
+      motorStep(&motorR, RIGHT_TIM, dt);
+      harmStep(t / 1e9, dt);
+      hallSet(&motorL, LEFT_HALL_U_PORT, LEFT_HALL_U_PIN, LEFT_HALL_V_PIN, LEFT_HALL_W_PIN);
+      hallSet(&motorR, RIGHT_HALL_U_PORT, RIGHT_HALL_U_PIN, RIGHT_HALL_V_PIN, RIGHT_HALL_W_PIN);
+      pwmPeriods++;
+      plantAt = t;
+    }
+    if (running && (ADC1->CR2 & ADC_CR2_ADON) && (ADC1->CR2 & ADC_CR2_JEXTTRIG)) {
+      tim->CNT = (twoSmp && phase) ? tim->ARR / 2 : tim->ARR - 1;
+      if (!phase) {                   // update events at the valley and at the peak, before the (first) sample ends
+        regFlags(&tim->SR, &timSr, TIM_SR_UIF, 0);
+      }
+      adcInjected();
+    }
+    phase = twoSmp ? !phase : 0;
+    adcRegular(t / 1e9);
+
+    // SysTick, 1 kHz
+    while (t >= nextTick) {
+      nextTick += 1000000;
+      if ((SysTick->CTRL & (SysTick_CTRL_ENABLE_Msk | SysTick_CTRL_TICKINT_Msk)) == (SysTick_CTRL_ENABLE_Msk | SysTick_CTRL_TICKINT_Msk)) {
+        Sim_IrqPend(SysTick_IRQn);
+      }
+    }
+
+    uartService(&uart2, t);
+    uartService(&uart3, t);
+
+    // Power button, power latch
+    pinSet(BUTTON_PORT, BUTTON_PIN, optButtonAt >= 0 && t >= optButtonAt * 1e9 && t < (optButtonAt + optButtonDur) * 1e9);
+    if (offPrev && !(OFF_PORT->ODR & OFF_PIN)) {
+      simExit("power off by the firmware", t / 1e9);
+    }
+    offPrev = (OFF_PORT->ODR & OFF_PIN) != 0;
+
+    if (logFile && t >= nextLog) {
+      nextLog += (uint64_t)optLogMs * 1000000;
+      logLine(t / 1e9);
+    }
+  }
+  return NULL;
+}
+
+static void stopSignal(int sig) {
+  (void)sig;
+  stopReq = 1;
+}
+
+/* Called by HAL_Init(), in the main thread */
+void Sim_Start(void) {
+  sigset_t set;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);                // inherited by the hardware thread
+  if (pthread_create(&hwThread, NULL, hwMain, NULL) != 0) {
+    die("pthread_create");
+  }
+  pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+}
+
+// =================================
+// Start up, before main()
+// =================================
+static void *mapFixed(uintptr_t addr, size_t size, int fd) {
+  void *p = mmap((void *)addr, size, PROT_READ | PROT_WRITE,
+                 MAP_FIXED_NOREPLACE | (fd >= 0 ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS), fd, 0);
+
+  if (p != (void *)addr) {
+    die("mmap of the STM32 address space");
+  }
+  return p;
+}
+
+static void parseProfile(Profile *p, const char *s) {
+  char *end;
+
+  p->n = 0;
+  if (!strchr(s, ':')) {                    // a single value: constant
+    p->t[p->n]   = 0;
+    p->v[p->n++] = atof(s);
+    return;
+  }
+  while (*s && p->n < NB_PROFILE_PTS) {
+    p->t[p->n] = strtod(s, &end);
+    if (*end != ':') {
+      fprintf(stderr, "bad profile: t:value,t:value,...\n");
+      exit(1);
+    }
+    p->v[p->n++] = strtod(end + 1, &end);
+    s = (*end == ',') ? end + 1 : end;
+  }
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-t time_s] [-v volt|t:volt,...] [-L load_nm|t:nm,...] [-J inertia] [-a t:adc,...] [-A t:adc,...] [-b t:dur]\n"
+                  "       [-n lsb] [-d dead_ns] [-H t0:t1] [-e flash.bin] [-o log.csv] [-r log_ms]\n", name);
+  exit(1);
+}
+
+__attribute__((constructor)) static void simInit(int argc, char **argv) {
+  struct sigaction sa;
+  int opt, fd = -1;
+
+  while ((opt = getopt(argc, argv, "t:v:L:J:a:A:b:n:d:H:e:o:r:")) != -1) {
+    switch (opt) {
+      case 't': optTime     = atof(optarg); break;
+      case 'v': parseProfile(&optVbat, optarg); break;
+      case 'L': parseProfile(&optLoad, optarg); break;
+      case 'J': optInertia  = atof(optarg); break;
+      case 'a': parseProfile(&optAdc1, optarg); break;
+      case 'A': parseProfile(&optAdc2, optarg); break;
+      case 'b': if (sscanf(optarg, "%lf:%lf", &optButtonAt, &optButtonDur) != 2) usage(argv[0]); break;
+      case 'n': optNoise    = atoi(optarg); break;
+      case 'd': optDeadNs   = atof(optarg); break;
+      case 'H': if (sscanf(optarg, "%lf:%lf", &optHarmFrom, &optHarmTo) != 2) usage(argv[0]); break;
+      case 'e': optFlash    = optarg; break;
+      case 'o': optLog      = optarg; break;
+      case 'r': optLogMs    = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+      default:  usage(argv[0]);
+    }
+  }
+
+  // Peripherals (APB1, APB2, AHB), core peripherals (DWT, SysTick, NVIC, SCB) and the Flash
+  mapFixed(PERIPH_BASE, 0x30000, -1);
+  mapFixed(0xE0000000U, 0x100000, -1);
+  if (optFlash) {
+    fd = open(optFlash, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+      die(optFlash);
+    }
+    if (lseek(fd, 0, SEEK_END) < SIM_FLASH_SIZE) {       // new image: erased Flash
+      static uint8_t erased[SIM_FLASH_SIZE];
+      memset(erased, 0xFF, sizeof(erased));
+      if (pwrite(fd, erased, sizeof(erased), 0) != sizeof(erased)) {
+        die(optFlash);
+      }
+    }
+    mapFixed(SIM_FLASH_BASE, SIM_FLASH_SIZE, fd);
+  } else {
+    memset(mapFixed(SIM_FLASH_BASE, SIM_FLASH_SIZE, -1), 0xFF, SIM_FLASH_SIZE);
+  }
+
+  Plant_Init(&motorL);
+  Plant_Init(&motorR);
+  motorL.tLoad  = motorR.tLoad  = profileAt(&optLoad, 0);
+  motorL.J      = motorR.J      = optInertia;
+  motorL.tDead  = motorR.tDead  = optDeadNs * 1e-9;
+  vBatEff       = profileAt(&optVbat, 0);
+  hallSet(&motorL, LEFT_HALL_U_PORT, LEFT_HALL_U_PIN, LEFT_HALL_V_PIN, LEFT_HALL_W_PIN);
+  hallSet(&motorR, RIGHT_HALL_U_PORT, RIGHT_HALL_U_PIN, RIGHT_HALL_V_PIN, RIGHT_HALL_W_PIN);
+
+  if (optLog) {
+    logFile = fopen(optLog, "w");
+    if (!logFile) {
+      die(optLog);
+    }
+    fprintf(logFile, "t,pwml,pwmr,n_mot_l,n_mot_r,plant_rpm_l,plant_rpm_r,i_dc_l,i_dc_r,v_bat,enable,err_l,err_r,iq_l,id_l,iq_r,id_r\n");
+  }
+
+  uartOpen(&uart2);
+  uartOpen(&uart3);
+
+  mainThread = pthread_self();
+  sigemptyset(&irqSigSet);
+  sigaddset(&irqSigSet, SIGUSR1);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = irqSignal;
+  sa.sa_flags   = SA_NODEFER | SA_RESTART;               // nested signals: interrupt preemption
+  sigaction(SIGUSR1, &sa, NULL);
+  sa.sa_handler = stopSignal;
+  sa.sa_flags   = 0;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &startTs);
+  optind = 1;
+}
@@ -0,0 +1,41 @@
+/*
+* Internal interface of the Linux port: the simulated core (interrupts,
+* time base) and peripherals in sim.c, the HAL stubs in hal_sim.c.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#define SIM_CPU_FREQ        64000000        // [Hz] DWT->CYCCNT rate. The cycle counts are host time at this rate
+#define SIM_FLASH_BASE      0x08000000U
+#define SIM_FLASH_SIZE      0x40000U        // 256 KByte
+#define SIM_FLASH_PAGE      0x800U
+
+// Interrupt controller. IRQn is the CMSIS number, the core exceptions are negative
+void      Sim_IrqPend(int irqn);
+void      Sim_IrqSetEnable(int irqn, uint8_t enable);
+void      Sim_IrqSetPriority(int irqn, uint32_t preempt, uint32_t sub);
+
+// Time base
+uint64_t  Sim_TimeNs(void);                 // host time since the start
+void      Sim_CycUpdate(void);              // refresh DWT->CYCCNT from the host time
+
+// Peripherals
+void      Sim_Start(void);                  // called by HAL_Init(): starts the hardware thread
+void      Sim_UartSetBaud(uint32_t usartBase, uint32_t baud);
@@ -0,0 +1,54 @@
+/*
+* Core intrinsics of the Linux port, included before every firmware
+* source file (gcc -include). It replaces cmsis_gcc.h, whose inline
+* assembly is Cortex-M only: the interrupt mask is the signal mask of
+* the main thread, see sim.c.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIM_CMSIS_H
+#define SIM_CMSIS_H
+
+#include <stdint.h>
+
+#ifdef SIM_ILP32_LIMITS
+/* BLDC_controller.c checks the 32 bit long of the target. The generated code only uses the rtwtypes.h types */
+#include <limits.h>
+#undef  ULONG_MAX
+#undef  LONG_MAX
+#define ULONG_MAX   0xFFFFFFFFUL
+#define LONG_MAX    0x7FFFFFFFL
+#endif
+
+#define __CMSIS_GCC_H                   // the Cortex-M version is not used
+
+void      Sim_IrqDisable(void);
+void      Sim_IrqEnable(void);
+uint32_t  Sim_IrqMasked(void);
+
+static inline void      __enable_irq(void)              { Sim_IrqEnable(); }
+static inline void      __disable_irq(void)             { Sim_IrqDisable(); }
+static inline uint32_t  __get_PRIMASK(void)             { return Sim_IrqMasked(); }
+static inline void      __set_PRIMASK(uint32_t priMask) { if (priMask) Sim_IrqDisable(); else Sim_IrqEnable(); }
+
+static inline void      __NOP(void)                     { }
+static inline void      __WFI(void)                     { }
+static inline void      __DSB(void)                     { __sync_synchronize(); }
+static inline void      __ISB(void)                     { __sync_synchronize(); }
+static inline void      __DMB(void)                     { __sync_synchronize(); }
+
+#endif
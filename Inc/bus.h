@@ -0,0 +1,45 @@
+/*
+* This file is part of the hoverboard-firmware-hack project.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stm32f1xx_hal.h"
+#include "config.h"
+#include "bus_proto.h"
+
+/* Multi-drop RS-485 bus node on USART2, enabled with CONTROL_BUS_USART2. The protocol is in bus_proto.h.
+ * Wiring: USART2 TX/RX (left sensor cable) to DI/RO of an RS-485 transceiver, BUS_DE_PIN to DE and /RE tied
+ * together, so the node does not receive its own replies.
+ * The USART idle line interrupt time stamps the end of each received frame, the housekeeping interrupt then parses
+ * the frames and starts the replies at their slot time. A node starts its reply up to one polling period late and
+ * releases the driver up to one period after the last stop bit: the reply slot is the reply frame time plus
+ * BUS_GUARD_US, at least 2 housekeeping periods. 03_Tools/bus_sim.c checks this timing.
+ *
+ * With BUS_SYNC = 1 the received commands are latched and applied by the next BUS_T_SYNC frame: the main loop is
+ * paced by Bus_WaitLoop() instead of HAL_Delay() and its next iteration starts BUS_SYNC_DELAY_US after the end of the
+ * sync frame, on all boards at the same moment. The host sends a sync after each command broadcast (after the
+ * replies), at most once per DELAY_IN_MAIN_LOOP. The clock skew and drift estimates are reported in BusStatus.
+ */
+#define BUS_REPLY_US            (BUS_FRAME_SIZE(BUS_STATUS_LEN) * 10 * 1000000UL / USART2_BAUD)
+#define BUS_SLOT_US             (BUS_REPLY_US + BUS_GUARD_US)
+
+void    Bus_Init(void);
+void    Bus_Tick(void);
+void    Bus_WaitLoop(void);
+uint8_t Bus_GetCmd(int16_t *steer, int16_t *speed);
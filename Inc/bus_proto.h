@@ -0,0 +1,118 @@
+/*
+* This file is part of the hoverboard-firmware-hack project.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+/* Multi-drop RS-485 bus protocol, core part. It has no hardware dependency: the firmware uses it in bus.c and
+ * the host simulator 03_Tools/bus_sim.c runs several nodes on a virtual bus with it.
+ *
+ * One host (address 0) and up to BUS_MAX_NODES boards (addresses 1 to BUS_MAX_NODES) share a half-duplex line.
+ * Only the host talks unprompted. A node transmits only as an answer:
+ *   BUS_T_POLL     the addressed node replies after the turnaround time
+ *   BUS_T_CMD_ALL  every node replies in its own time slot: node n starts (n - 1) slots after the turnaround time
+ * The time reference is the end of the request frame, seen by all nodes at the same moment.
+ *
+ * Synchronization: BUS_T_SYNC carries the host time. The nodes use it to estimate the drift of their clock relative
+ * to the host clock, and the firmware applies the commands received since the previous sync at a common moment
+ * after the sync frame (see bus.h). The skew is the error of the local clock at a sync, predicted from the previous
+ * sync with the drift estimate: it tells how far the boards would drift apart without a sync.
+ *
+ * Frame format (little endian):
+ *   uint16_t start      BUS_START_FRAME
+ *   uint8_t  dst        destination address, BUS_ADDR_BROADCAST for all nodes
+ *   uint8_t  src        source address
+ *   uint8_t  type       BUS_T_xxx
+ *   uint8_t  len        payload length, at most BUS_MAX_PAYLOAD
+ *   uint8_t  payload[len]
+ *   uint16_t crc        CRC-16/CCITT-FALSE over all previous bytes
+ */
+#define BUS_START_FRAME         0xA55A
+#define BUS_ADDR_HOST           0
+#define BUS_ADDR_BROADCAST      0xFF
+#define BUS_MAX_NODES           8
+#define BUS_HEADER_SIZE         6
+#define BUS_MAX_PAYLOAD         (4 * BUS_MAX_NODES)
+#define BUS_FRAME_SIZE(len)     (BUS_HEADER_SIZE + (len) + 2)
+
+// Frame types
+#define BUS_T_CMD               1     // host -> node: int16 steer, int16 speed. No reply
+#define BUS_T_CMD_ALL           2     // host -> all: int16 steer, int16 speed for nodes 1..n. Slotted replies
+#define BUS_T_POLL              3     // host -> node: empty. Immediate reply
+#define BUS_T_STATUS            4     // node -> host: BusStatus
+#define BUS_T_SYNC              5     // host -> all: uint32 host time [us]. No reply
+
+#define BUS_STATUS_LEN          12
+#define BUS_SYNC_MAX_GAP_US     1000000   // [us] longer sync intervals restart the skew measurement
+#define BUS_DRIFT_FILT          3         // [-] drift estimate filter: 2^3 = 8 syncs
+
+typedef struct {
+  int16_t   steer;
+  int16_t   speed;
+} BusCmd;
+
+typedef struct {
+  int16_t   speedL;                   // [rpm]
+  int16_t   speedR;                   // [rpm]
+  int16_t   batVoltage;               // [V*100]
+  uint8_t   errCodeL;
+  uint8_t   errCodeR;
+  int16_t   skewUs;                   // [us] clock skew at the last sync
+  int16_t   driftPpm;                 // [ppm] clock drift estimate, positive = local clock faster than the host clock
+} BusStatus;
+
+typedef struct {
+  uint32_t  hostUs;                   // host time of the last sync
+  uint32_t  localTicks;               // local time of the last sync
+  int32_t   drift;                    // clock drift estimate fixdt(1,32,8) [ppm]
+  int16_t   skewUs;                   // [us] local time at the last sync minus the time predicted from the previous sync
+  uint16_t  count;                    // number of syncs received
+} BusSync;
+
+// Frame receiver: byte-wise synchronization on the start frame and CRC check
+typedef struct {
+  uint8_t   buf[BUS_FRAME_SIZE(BUS_MAX_PAYLOAD)];
+  uint8_t   len;
+  uint16_t  crcErr;                   // frames dropped because of a CRC error
+} BusRx;
+
+typedef struct {
+  uint8_t   addr;
+  uint32_t  ticksPerUs;               // unit of the now arguments
+  uint32_t  slotTicks;                // reply slot length, including the guard time
+  uint32_t  turnTicks;                // turnaround time between the end of the request and the first reply
+  BusRx     rx;
+  BusCmd    cmd;
+  uint8_t   cmdNew;                   // set when a command is received, cleared by the user
+  uint8_t   replyPending;
+  uint32_t  replyAt;                  // tick at which the reply must start
+  uint16_t  rxFrames;                 // valid frames addressed to this node
+  BusSync   sync;
+  uint8_t   syncNew;                  // set when a sync is received, cleared by the user
+} BusNode;
+
+uint16_t busFrame(uint8_t *buf, uint8_t dst, uint8_t src, uint8_t type, const uint8_t *payload, uint8_t len);
+uint8_t  busRx(BusRx *rx, uint8_t c);
+void     busStatusPack(uint8_t *p, const BusStatus *status);
+void     busStatusUnpack(BusStatus *status, const uint8_t *p);
+void     busNodeInit(BusNode *node, uint8_t addr, uint32_t ticksPerUs, uint32_t slotTicks, uint32_t turnTicks);
+void     busNodeRx(BusNode *node, uint8_t c, uint32_t now);
+uint8_t  busNodeReplyDue(BusNode *node, uint32_t now);
+uint16_t busNodeReply(BusNode *node, uint8_t *buf, const BusStatus *status);
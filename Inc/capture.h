@@ -0,0 +1,88 @@
+/*
+* This file is part of the hoverboard-firmware-hack project.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stm32f1xx_hal.h"
+#include "config.h"
+
+/* In-RAM oscilloscope, enabled with CAPTURE_ENABLE.
+ * The control ISR writes the selected channels in a ring buffer every PWM period.
+ * When a trigger occurs, CAPTURE_DEPTH - CAPTURE_PRETRIG - 1 more samples are recorded and the buffer freezes.
+ * The buffer is dumped on the DEBUG_SERIAL_USARTx port on request and decoded with 03_Tools/capture_decode.py.
+ *
+ * Commands received on the DEBUG_SERIAL_USARTx port (single characters):
+ *   't'  manual trigger
+ *   'a'  re-arm after the buffer froze
+ *   'd'  dump the frozen buffer
+ *
+ * Dump format (little endian):
+ *   uint16_t start      CAPTURE_START_FRAME
+ *   uint16_t depth      number of samples
+ *   uint32_t chMask     CAPTURE_CHANNELS
+ *   uint8_t  nbCh       number of channels per sample
+ *   uint8_t  trigSrc    CAP_TRIG_xxx
+ *   uint16_t trigIdx    index of the trigger sample (= CAPTURE_PRETRIG)
+ *   uint16_t pwmFreq    sample rate [Hz]
+ *   int16_t  data[depth][nbCh]  oldest sample first, channels in increasing CAP_CH_xxx order
+ *   uint16_t crc        CRC-16/CCITT-FALSE over all previous bytes
+ */
+#define CAPTURE_START_FRAME     0xCAFE
+
+// Channel numbers, select them with the CAPTURE_CHANNELS bit mask in config.h
+#define CAP_CH_CUR_L_PHA_A      0     // phase and DC link currents [ADC counts]
+#define CAP_CH_CUR_L_PHA_B      1
+#define CAP_CH_CUR_R_PHA_B      2
+#define CAP_CH_CUR_R_PHA_C      3
+#define CAP_CH_CUR_L_DC         4
+#define CAP_CH_CUR_R_DC         5
+#define CAP_CH_HALL             6     // left hall ABC in bits 0..2, right hall ABC in bits 4..6
+#define CAP_CH_DC_L_PHA_A       7     // controller duty cycle outputs [-1000, 1000]
+#define CAP_CH_DC_L_PHA_B       8
+#define CAP_CH_DC_L_PHA_C       9
+#define CAP_CH_DC_R_PHA_A       10
+#define CAP_CH_DC_R_PHA_B       11
+#define CAP_CH_DC_R_PHA_C       12
+#define CAP_CH_N_MOT_L          13    // [rpm]
+#define CAP_CH_N_MOT_R          14
+#define CAP_CH_ANGLE_L          15    // electrical angle, fixdt(1,16,4) [deg]
+#define CAP_CH_ANGLE_R          16
+#define CAP_CH_COUNT            17
+
+#define CAP_CH_BIT(ch)          ((CAPTURE_CHANNELS >> (ch)) & 1)
+#define CAP_NB_CH               (CAP_CH_BIT(0)  + CAP_CH_BIT(1)  + CAP_CH_BIT(2)  + CAP_CH_BIT(3)  + CAP_CH_BIT(4)  + \
+                                 CAP_CH_BIT(5)  + CAP_CH_BIT(6)  + CAP_CH_BIT(7)  + CAP_CH_BIT(8)  + CAP_CH_BIT(9)  + \
+                                 CAP_CH_BIT(10) + CAP_CH_BIT(11) + CAP_CH_BIT(12) + CAP_CH_BIT(13) + CAP_CH_BIT(14) + \
+                                 CAP_CH_BIT(15) + CAP_CH_BIT(16))
+
+// Trigger sources
+#define CAP_TRIG_NONE           0
+#define CAP_TRIG_MANUAL         1     // 't' command
+#define CAP_TRIG_ERRCODE        2     // errCode_Left or errCode_Right changed
+#define CAP_TRIG_CURRENT        3     // DC link current above CAPTURE_TRIG_CURR
+#define CAP_TRIG_OVERRUN        4     // control ISR longer than one PWM period
+
+// Capture states
+#define CAP_ARMED               0     // recording, waiting for a trigger
+#define CAP_TRIGGERED           1     // recording the post-trigger samples
+#define CAP_FROZEN              2     // buffer complete, ready to be dumped
+
+void    Capture_Sample(void);
+void    Capture_Trigger(uint8_t source);
+uint8_t Capture_Process(void);
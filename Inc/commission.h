@@ -0,0 +1,85 @@
+/*
+* This file is part of the hoverboard-firmware-hack project.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stm32f1xx_hal.h"
+#include "config.h"
+#include "BLDC_controller.h"
+
+/* Commissioning routines, enabled with COMMISSION_ENABLE. LIFT THE WHEELS before starting them!
+ * They are started with the parameter protocol (PARAM_ID_TUNE, see param.h): WRITE starts a routine, STORE starts it and stores
+ * the results in Flash when it succeeds (the motors are disabled for the Flash write). READ returns COMM_STATE_xxx.
+ * While a routine runs, the control ISR drives both motors in VOLTAGE mode and the inputs are ignored.
+ *
+ * PI gain auto-tuning (relay feedback):
+ *   COMM_TUNE_CURR  the voltage target toggles between +/- TUNE_CURR_RELAY around the iq current 0 A: the wheels stay almost still
+ *   COMM_TUNE_SPEED the voltage target ramps up to the speed TUNE_N_REF (slowed down by the acceleration current), then toggles
+ *                   between bias +/- TUNE_SPD_RELAY around TUNE_N_REF. The bias follows the mean voltage of the last period, i.e.
+ *                   the voltage holding TUNE_N_REF. At the end the voltage ramps down to 0
+ * After TUNE_SETTLE_PER periods, the medians of the period and of the peak-to-peak amplitude over TUNE_MEAS_PER periods give the
+ * plant gain at the oscillation frequency fu. The current loop plant is taken as an integrator (R neglected: it only adds damping),
+ * the speed loop plant as first order with the static gain measured by the bias. The PI gains place the closed loop poles at the
+ * target bandwidth TUNE_xxx_BW (limited to fu / 4 for the current loop, fu / 3 for the speed loop) and damping TUNE_DAMPING.
+ * The gains of both motors are averaged, the current loop gains are applied to the d and q axis.
+ *
+ * Motor parameter identification, COMM_IDENT:
+ *   resistance  DC injection through one phase at IDENT_CURR / 2 and IDENT_CURR (the rotor aligns with the injection axis)
+ *   inductance  voltage steps between the two injection levels, L = R * 63 % rise time of the current
+ *   flux        back-EMF at the steady speed reached with a VOLTAGE mode ramp to TUNE_N_REF, from the duty cycles and currents
+ * The parameters of both motors are averaged and read with PARAM_ID_MOT_xxx. The current loop PI gains are derived from R and L
+ * for the bandwidth TUNE_CURR_BW (pole/zero cancellation) and applied like COMM_TUNE_CURR, R, L and the flux linkage replace MOT_R, MOT_L and MOT_FLUX.
+ *
+ * Hall sensor calibration, COMM_HALL_CAL: a current vector of IDENT_CURR rotates open loop (the hall sensors are not used), a few
+ * electrical revolutions forward then in reverse. The angle of the vector at each hall edge, averaged over both directions, gives
+ * the hall code to sector mapping and the angle offset of each edge for the angle estimation, per motor (any sensor order and
+ * placement). Run it first: the other routines need a correct hall angle.
+ */
+#define COMM_NONE               0
+#define COMM_TUNE_CURR          1     // current loops: cf_idKp, cf_idKi, cf_iqKp, cf_iqKi
+#define COMM_TUNE_SPEED         2     // speed loop: cf_nKp, cf_nKi
+#define COMM_IDENT              3     // motor parameters, current loops, decoupling constants (DECOUP_ENA)
+#define COMM_HALL_CAL           4     // hall sensor mapping and edge angles, see hallCalSet()
+#define COMM_COUNT              5
+
+// States, read with PARAM_ID_TUNE
+#define COMM_STATE_IDLE         0     // never started
+#define COMM_STATE_BUSY         1
+#define COMM_STATE_DONE         2     // results applied (and stored if requested)
+#define COMM_STATE_ERR_READY    3     // not started: motors disabled, motor error or wheels turning
+#define COMM_STATE_ERR_ABORT    4     // aborted: motors disabled, motor error, over current or injection current not reached
+#define COMM_STATE_ERR_TIMEOUT  5     // no relay oscillation
+#define COMM_STATE_ERR_RESULT   6     // oscillation, measurement or hall sectors not usable
+#define COMM_STATE_ERR_FLASH    7     // results applied but not stored
+
+#define COMM_MOTOR_LEFT         0
+#define COMM_MOTOR_RIGHT        1
+
+// Identified motor parameters
+#define COMM_PAR_R              0     // [mOhm] phase resistance
+#define COMM_PAR_L              1     // [uH] phase inductance
+#define COMM_PAR_FLUX           2     // [uWb] permanent magnet flux linkage (peak, per phase)
+#define COMM_PAR_COUNT          3
+
+uint8_t Commission_Start(uint8_t routine, uint8_t store);
+uint8_t Commission_State(void);
+int32_t Commission_MotorPar(uint8_t par);
+void    Commission_Step(uint8_t motor, ExtU *rtU, const ExtY *rtY);
+void    Commission_Output(uint8_t motor, int *u, int *v, int *w);
+void    Commission_Process(void);
@@ -25,4 +25,6 @@
 
 void setScopeChannel(uint8_t ch, int16_t val);
 void consoleScope(void);
-void consoleLog(char *message);
\ No newline at end of file
+void consoleLog(char *message);
+uint16_t consoleWrite(const uint8_t *data, uint16_t len);
+uint16_t consoleTxFree(void);
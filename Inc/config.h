@@ -3,8 +3,11 @@
 
 // ############################### DO-NOT-TOUCH SETTINGS ###############################
 
-#define PWM_FREQ            16000     // PWM frequency in Hz
+#define PWM_FREQ            16000     // PWM frequency in Hz (default). It can be changed at runtime and stored in Flash, see pwmFreqSet() in bldc.c
+#define PWM_FREQ_MIN        12000     // [Hz] minimum runtime PWM frequency
+#define PWM_FREQ_MAX        24000     // [Hz] maximum runtime PWM frequency. Do NOT set this higher than 24000: cf_speedCoef overflows
 #define DEAD_TIME              32     // PWM deadtime
+#define PWM_LOW_MIN (2*DEAD_TIME)     // Duty cycle distance to the PWM top of every phase: the low side pulse (2 * PWM_LOW_MIN - DEAD_TIME) recharges the bootstrap capacitor
 #define DELAY_IN_MAIN_LOOP      5     // in ms. default 5. it is independent of all the timing critical stuff. do not touch if you do not know what you are doing.
 #define TIMEOUT                 5     // number of wrong / missing input commands before emergency off
 #define A2BIT_CONV             50     // A to bit for current conversion on ADC. Example: 1 A = 50, 2 A = 100, etc
@@ -30,6 +33,22 @@
 // This parameter is used in setup.c
 #define ADC_TOTAL_CONV_TIME     (ADC_CLOCK_DIV * ADC_CONV_CLOCK_CYCLES) // = ((SystemCoreClock / ADC_CLOCK_HZ) * ADC_CONV_CLOCK_CYCLES), where ADC_CLOCK_HZ = SystemCoreClock/ADC_CLOCK_DIV
 
+// The currents are converted on the injected ADC group every PWM period. The housekeeping group (battery, temperature, ADC1/ADC2 inputs)
+// is started every ADC_HK_DIV PWM periods. It takes ~17 us because of the temperature sensor sampling time
+#define ADC_HK_DIV              (2)   // = 8 kHz housekeeping
+
+// Phase current oversampling: 0 = one current sample per PWM period (default), 1 = two samples per PWM period
+// The two samples are taken symmetrically around the PWM counter peak and averaged before the control step. The second injected sequence
+// can only start after the first one is complete, so the PWM margin grows by CURR_OS_DELTA: the maximum duty cycle decreases from 90% to ~79%
+#define CURR_OVERSAMPLE         0
+#define ADC_INJ_SEQ_TIME        (ADC_CLOCK_DIV * (ADC_CONV_TIME_1C5 + 2 * ADC_CONV_TIME_7C5))  // = 216 timer ticks for the 3 injected ranks, see setup.c
+#define CURR_OS_DELTA           (ADC_INJ_SEQ_TIME / 2 + 4)  // trigger distance to the counter peak
+#if (CURR_OVERSAMPLE == 1)
+#define ADC_INJ_TRIG_OFS        (CURR_OS_DELTA)             // injected ADC trigger: TIM8 CCR4 = ARR - ADC_INJ_TRIG_OFS
+#else
+#define ADC_INJ_TRIG_OFS        (1)
+#endif
+
 // ############################### GENERAL ###############################
 
 /* How to calibrate: connect GND and RX of a 3.3v uart-usb adapter to the right sensor board cable
@@ -82,6 +101,12 @@
 
 //#define DEBUG_SERIAL_SERVOTERM
 #define DEBUG_SERIAL_ASCII          // "1:345 2:1337 3:0 4:0 5:0 6:0 7:0 8:0\r\n"
+// #define DEBUG_ISR_LOAD           // debug values 7 and 8 show the motor control ISR cycles (last and max) instead of the temperature. Budget: 64 MHz / PWM_FREQ = 4000 cycles
+// #define CAPTURE_ENABLE           // in-RAM oscilloscope at PWM rate with trigger and dump (see capture.h). Needs DEBUG_SERIAL_USART2 or DEBUG_SERIAL_USART3
+#define CAPTURE_DEPTH           400         // [-] samples in the capture buffer (400 samples = 25 ms at 16 kHz)
+#define CAPTURE_PRETRIG         100         // [-] samples recorded before the trigger
+#define CAPTURE_CHANNELS        0x0001FFFF  // [-] capture channel bit mask, bit n selects channel CAP_CH_xxx = n in capture.h
+#define CAPTURE_TRIG_CURR       I_DC_MAX    // [A] DC link current trigger threshold
 
 
 // ############################### INPUT ###############################
@@ -95,20 +120,34 @@
 // #define CONTROL_SERIAL_USART2                           // left sensor board cable, disable if ADC or PPM is used! For Arduino control check the hoverSerial.ino
 // #define FEEDBACK_SERIAL_USART2                          // left sensor board cable, disable if ADC or PPM is used!
 // #define DEBUG_SERIAL_USART2                             // left sensor board cable, disable if ADC or PPM is used!
+// #define PARAM_SERIAL_USART2                             // left sensor board cable, disable if ADC or PPM is used! Parameter protocol, see param.h
 
 #define USART3_BAUD             38400                   // UART3 baud rate (short wired cable)
 #define USART3_WORDLENGTH       UART_WORDLENGTH_8B      // UART_WORDLENGTH_8B or UART_WORDLENGTH_9B
 // #define CONTROL_SERIAL_USART3                           // right sensor board cable, disable if I2C (nunchuck or lcd) is used! For Arduino control check the hoverSerial.ino
 // #define FEEDBACK_SERIAL_USART3                          // right sensor board cable, disable if I2C (nunchuck or lcd) is used!
 //#define DEBUG_SERIAL_USART3                             // right sensor board cable, disable if I2C (nunchuck or lcd) is used!
-
-#if defined(FEEDBACK_SERIAL_USART2) || defined(DEBUG_SERIAL_USART2)
-#define UART_DMA_CHANNEL DMA1_Channel7
-#endif
-
-#if defined(FEEDBACK_SERIAL_USART3) || defined(DEBUG_SERIAL_USART3)
-#define UART_DMA_CHANNEL DMA1_Channel2
-#endif
+// #define PARAM_SERIAL_USART3                             // right sensor board cable, disable if I2C (nunchuck or lcd) is used! Parameter protocol, see param.h
+
+// #define FEEDBACK_TELEMETRY                              // send the binary telemetry stream (see telemetry.h) on the FEEDBACK_SERIAL_USARTx port instead of the feedback struct. Needs a high baud rate, e.g. 460800
+#define TELEM_RATE              1000                    // [Hz] telemetry sample rate, max 1000
+#define TELEM_SAMPLES           10                      // [-] samples per telemetry frame
+#define TELEM_CHANNELS          0x0003FFFF              // [-] telemetry channel bit mask, bit n selects channel TELEM_CH_xxx = n in telemetry.h
+
+// ###### CONTROL VIA RS-485 BUS ######
+// Several boards on one half-duplex line, addressed by the host, see bus.h and bus_proto.h. Needs an RS-485 transceiver
+// on the left sensor cable. Use a high baud rate: at 115200 baud a broadcast command to 3 boards with their replies takes ~7 ms
+// #define CONTROL_BUS_USART2                              // left sensor board cable, disable if ADC or PPM is used! USART2 is used by the bus only
+#define BUS_ADDRESS             1                       // [-] node address, 1 to 8. Also the reply slot number
+#define BUS_GUARD_US            400                     // [us] guard time added to each reply slot and turnaround time. At least 2 housekeeping periods, see bus.h
+#define BUS_SYNC                1                       // [-] 1 = commands are applied by the next sync frame, on all boards at the same moment. 0 = on reception
+#define BUS_SYNC_DELAY_US       2000                    // [us] delay between the sync frame and the main loop iteration applying the commands. Longer than the reception latency plus the main loop processing time
+#define BUS_DE_PORT             GPIOB                   // transceiver driver enable (DE and /RE): PB10 on the right sensor board cable
+#define BUS_DE_PIN              GPIO_PIN_10
+
+// Both ports run concurrently and a port can combine several roles, see serial.h
+#define SERIAL_TX_BUF_SIZE      512                     // [bytes] TX ring buffer per port, power of 2. Messages that do not fit are dropped and counted
+#define SERIAL_RX_BUF_SIZE      128                     // [bytes] RX DMA buffer of the parameter protocol port
 
 // ###### CONTROL VIA RC REMOTE ######
 // left sensor board cable. Channel 1: steering, Channel 2: speed.
@@ -133,6 +172,19 @@
 #define ADC2_MID 2006         // mid ADC2-value while poti at minimum-position (ADC2_MIN - ADC2_MAX)
 #define ADC2_MAX 4095         // max ADC2-value while poti at maximum-position (0 - 4095)
 
+/* ADC input processing:
+ * The ADC1/ADC2 inputs are averaged over all the samples taken at the PWM frequency (no filter lag beyond the averaging window).
+ * Auto-calibration: hold the power button for ADC_CAL_HOLD_TIME until the long beep, release it, leave the potis in the resting position
+ * for 1 second, then sweep both potis several times over their full range during ADC_CAL_SWEEP_TIME. The learned values are stored
+ * in Flash and replace ADC1_MIN..ADC2_MAX above at every boot. Re-flashing the firmware does not erase them.
+ */
+#define ADC_AVG_SHIFT         5     // [-] ADC averaging: 2^5 = 32 samples @ 8 kHz (PWM_FREQ / ADC_HK_DIV) = 4 ms window. Keep the window below DELAY_IN_MAIN_LOOP
+#define ADC_DEADBAND          20    // [-] deadband around the resting position, in per mille of the full range [0, 1000]
+#define ADC_EXPO              0     // [%] expo curve: 0 = linear, 100 = cubic. Higher value == finer control around the resting position
+#define ADC_CAL_HOLD_TIME     5000  // [ms] power button hold time to enter the ADC auto-calibration
+#define ADC_CAL_SWEEP_TIME    20000 // [ms] duration of the ADC auto-calibration sweep
+#define ADC_CAL_MIN_RANGE     500   // [-] minimum learned range (max - min) for the calibration to be accepted
+
 // ###### CONTROL VIA NINTENDO NUNCHUCK ######
 /* left sensor board cable.
  * keep cable short, use shielded cable, use ferrits, stabalize voltage in nunchuck,
@@ -145,8 +197,13 @@
 // ############################### MOTOR CONTROL #########################
 // Control selections
 #define CTRL_TYP_SEL    2                       // [-] Control type selection: 0 = Commutation , 1 = Sinusoidal, 2 = FOC Field Oriented Control (default)
-#define CTRL_MOD_REQ    3                       // [-] Control mode request: 0 = Open mode, 1 = VOLTAGE mode (default), 2 = SPEED mode, 3 = TORQUE mode. Note: SPEED and TORQUE modes are only available for FOC!
+#define CTRL_MOD_REQ    3                       // [-] Control mode request: 0 = Open mode, 1 = VOLTAGE mode (default), 2 = SPEED mode, 3 = TORQUE mode, 4 = cascaded SPEED mode. Note: SPEED and TORQUE modes are only available for FOC!
 #define DIAG_ENA        1                       // [-] Motor Diagnostics enable flag: 0 = Disabled, 1 = Enabled (default)
+#if (CURR_OVERSAMPLE == 1)
+#define CURR_FILT_COEF  13107                   // [-] Phase current filter coefficient fixdt(0,16,16): 13107 = 0.2. Less filtering (and phase lag) is needed with the oversampled currents
+#else
+#define CURR_FILT_COEF  7864                    // [-] Phase current filter coefficient fixdt(0,16,16): 7864 = 0.12 (default). Higher value == less filtering, less phase lag
+#endif
 
 // Limitation settings
 #define I_MOT_MAX       10                      // [A] Maximum motor current limit
@@ -156,6 +213,17 @@
 #define N_MOT_MAX_TURBO 1450
 #define N_MOT_MAX_SLOW  350
 
+// Load adaptive PWM frequency: at high current and low speed the switching losses dominate the MOSFET heating, so the PWM frequency is lowered
+// to PWM_FREQ_LOAD. Above PWM_ADAPT_N_HI or below PWM_ADAPT_I_LO it goes back to the nominal (stored or PWM_FREQ) frequency
+#define PWM_FREQ_ADAPT  0                       // [-] 0 = fixed PWM frequency (default), 1 = load adaptive PWM frequency
+#define PWM_FREQ_LOAD   12000                   // [Hz] PWM frequency at high load. Must be within PWM_FREQ_MIN and PWM_FREQ_MAX
+#define PWM_ADAPT_I_HI  7                       // [A] switch to PWM_FREQ_LOAD above this motor current (filtered, both motors) ...
+#define PWM_ADAPT_I_LO  5                       // [A] ... and back below this current
+#define PWM_ADAPT_N_LO  200                     // [rpm] switch to PWM_FREQ_LOAD only below this speed ...
+#define PWM_ADAPT_N_HI  300                     // [rpm] ... and back above this speed
+#define PWM_ADAPT_HOLD  1000                    // [ms] minimum time between two frequency changes
+#define PWM_ADAPT_FILT  3276                    // [-] motor current filter coefficient fixdt(0,16,16): 3276 = 0.05 (~100 ms @ DELAY_IN_MAIN_LOOP)
+
 // Field Weakening / Phase Advance
 #define FIELD_WEAK_ENA  1                       // [-] Field Weakening / Phase Advance enable flag: 0 = Disabled (default), 1 = Enabled
 #define FIELD_WEAK_MAX  5                       // [A] Maximum Field Weakening D axis current (only for FOC). Higher current results in higher maximum speed.
@@ -163,6 +231,43 @@
 #define FIELD_WEAK_HI   1500                    // [-] Input target High threshold for reaching maximum Field Weakening / Phase Advance. Do NOT set this higher than 1500.
 #define FIELD_WEAK_LO   1000                    // [-] Input target Low threshold for starting Field Weakening / Phase Advance. Do NOT set this higher than 1000.
 
+// Overmodulation (only for FOC): the voltage limit circle is enlarged beyond the linear SVPWM range and the phase voltages are saturated to
+// the PWM range: the output follows the hexagon (115 %) and goes towards six-step (+10 % fundamental voltage). More voltage at top speed
+// without field weakening current, at the cost of 5th/7th harmonic current ripple. The duty cycles stay within the current measurement margin.
+// The VOLTAGE mode input scaling is unchanged: its full input is the linear limit
+#define OVERMOD_MAX     100                     // [%] Voltage limit relative to the linear range: 100 = Disabled (default), 200 = max
+
+// Current loop decoupling and back-EMF feedforward (only for FOC): w*L*i and w*psi are added to the d/q voltages of the current controllers
+// (TORQUE mode, the d axis also in SPEED mode), for a better current tracking at high speed with moderate gains. The motor constants stored by the identification (COMM_IDENT) replace these
+#define DECOUP_ENA      0                       // [-] Decoupling / back-EMF feedforward enable flag: 0 = Disabled (default), 1 = Enabled
+#define MOT_L           400                     // [uH] Motor phase inductance
+#define MOT_FLUX        16000                   // [uWb] Motor flux linkage (peak, per phase)
+
+// Cascaded SPEED mode (CTRL_MOD_REQ 4, only for FOC): the speed PI gives the torque current reference of the TORQUE mode, plus the
+// feedforward J / Kt * dn/dt of the input acceleration (rate limiter and filter output). The inertia gain J / Kt * 2pi/60 * 800 * 2^8
+// (bldc.c: 596 = 0.01 kg m^2 at 0.36 Nm/A, parameter protocol PARAM_ID_ACC_FF) can be adapted online. Field weakening follows the torque reference
+#define ACC_FF_ADAPT    0                       // [-] Inertia estimation rate: 0 = fixed inertia gain (default), 10000 = typical. Needs acceleration AND deceleration phases
+
+// Load torque disturbance observer of the SPEED modes (CTRL_MOD_REQ 2 and 4, only for FOC): the load current d = iq - J / Kt * dn/dt,
+// low pass filtered. J / Kt is the inertia gain of the cascaded SPEED mode. The speed PI only corrects the remaining error: less droop and
+// a faster recovery under load steps. SPEED mode: R * d is added to the voltage reference (MOT_R). Cascaded: d is added to the iq reference
+#define DOB_BW          0                       // [Hz] Observer bandwidth: 0 = Disabled (default), 5 = typical. Higher is stiffer but noisier
+#define MOT_R           250                     // [mOhm] Motor phase resistance. Too high is worse than too low
+
+// Dead time compensation: during the DEAD_TIME both switches of a half bridge are off and the phase current sets the phase voltage, the
+// voltage error (DEAD_TIME / 2 timer counts of the duty cycle, against the current) distorts the currents at low speed and light load
+// (5th/7th harmonics, torque ripple, noise). The duty cycles get DEAD_TIME / 2 in the direction of the measured phase current. Below
+// 2 * Coss * Vbat / dead time the current does not swing the phase node within the dead time: the compensation is linear in the current
+#define DT_COMP_ENA     0                       // [-] Dead time compensation enable flag: 0 = Disabled (default), 1 = Enabled
+#define DT_COMP_COSS    2000                    // [pF] Output capacitance of a half bridge node (MOSFETs, motor cable). Too high is worse than too low
+
+// Bus voltage normalization (only for FOC): the battery voltage is filtered every PWM period and the duty cycles are divided by its ratio
+// to the full battery voltage BAT_FULL. The controller voltages are relative to BAT_FULL: the current and speed loop gains, the feedforward
+// and the VOLTAGE mode speed stay the same from a full to an empty battery and through the voltage dips under load. The Vq voltage limit
+// follows the battery. The slow filtered battery voltage (BAT_FILT_COEF) still drives the battery level and the low battery warnings
+#define BAT_NORM_ENA    0                       // [-] Bus voltage normalization enable flag: 0 = Disabled (default), 1 = Enabled
+#define BAT_NORM_FILT   4096                    // [-] Battery voltage filter coefficient fixdt(0,16,16) per PWM period: 4096 = 1/16 (~1 ms @ 16 kHz)
+
 // Data checks - Do NOT touch
 #if (FIELD_WEAK_ENA == 0)
   #undef  FIELD_WEAK_HI                       
@@ -186,6 +291,26 @@
  */
 
 
+// ############################### COMMISSIONING ###############################
+/* PI gain auto-tuning, motor parameter identification and hall sensor calibration, see commission.h. LIFT THE WHEELS, then start them with the parameter
+ * protocol (PARAM_ID_TUNE), e.g. with 03_Tools/autotune.py. Try it first on the Linux port (04_Sim) with the inertia of your cart (-J) and your tuning settings.
+ * The stored gains and hall calibrations replace the BLDC_controller_data.c defaults at every boot.
+ */
+// #define COMMISSION_ENABLE                       // needs PARAM_SERIAL_USART2 or PARAM_SERIAL_USART3
+#define TUNE_CURR_BW    150                     // [Hz] current loop target bandwidth
+#define TUNE_SPD_BW     5                       // [Hz] speed loop target bandwidth
+#define TUNE_DAMPING    70                      // [%] closed loop damping ratio of both loops
+#define TUNE_CURR_RELAY 100                     // [-] current loop relay amplitude, VOLTAGE mode input [0, 1000]
+#define TUNE_CURR_HYST  200                     // [mA] current loop relay hysteresis
+#define TUNE_SPD_RELAY  40                      // [-] speed loop relay amplitude, VOLTAGE mode input [0, 1000]
+#define TUNE_SPD_HYST   5                       // [rpm] speed loop relay hysteresis
+#define TUNE_N_REF      150                     // [rpm] speed loop relay reference, speed of the flux linkage measurement
+#define TUNE_SETTLE_PER 4                       // [-] relay periods before the measurement
+#define TUNE_MEAS_PER   8                       // [-] relay periods measured
+#define IDENT_CURR      4                       // [A] motor identification: DC injection current, hall calibration: rotating current
+#define TUNE_TIMEOUT    20000                   // [ms] maximum duration of a routine
+
+
 // ############################### DRIVING BEHAVIOR ###############################
 
 /* Inputs:
@@ -227,6 +352,14 @@
 
 // ############################### VALIDATE SETTINGS ###############################
 
+#if (PWM_FREQ < PWM_FREQ_MIN) || (PWM_FREQ > PWM_FREQ_MAX) || (PWM_FREQ_MAX > 24000)
+  #error PWM_FREQ must be within PWM_FREQ_MIN and PWM_FREQ_MAX, PWM_FREQ_MAX must be at most 24000.
+#endif
+
+#if (PWM_FREQ_ADAPT == 1) && ((PWM_FREQ_LOAD < PWM_FREQ_MIN) || (PWM_FREQ_LOAD > PWM_FREQ_MAX) || (PWM_ADAPT_I_LO >= PWM_ADAPT_I_HI) || (PWM_ADAPT_N_LO >= PWM_ADAPT_N_HI))
+  #error PWM_FREQ_LOAD must be within PWM_FREQ_MIN and PWM_FREQ_MAX, PWM_ADAPT_I_LO/N_LO must be lower than PWM_ADAPT_I_HI/N_HI.
+#endif
+
 #if defined(CONTROL_SERIAL_USART2) && defined(CONTROL_SERIAL_USART3)
   #error CONTROL_SERIAL_USART2 and CONTROL_SERIAL_USART3 not allowed, choose one.
 #endif
@@ -235,34 +368,120 @@
   #error FEEDBACK_SERIAL_USART2 and FEEDBACK_SERIAL_USART3 not allowed, choose one.
 #endif
 
-#if defined(DEBUG_SERIAL_USART2) && defined(FEEDBACK_SERIAL_USART2)
-  #error DEBUG_SERIAL_USART2 and FEEDBACK_SERIAL_USART2 not allowed, choose one.
+#if defined(FEEDBACK_TELEMETRY) && !(defined(FEEDBACK_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART3))
+  #error FEEDBACK_TELEMETRY needs FEEDBACK_SERIAL_USART2 or FEEDBACK_SERIAL_USART3.
+#endif
+
+#if defined(FEEDBACK_TELEMETRY) && (TELEM_RATE > 1000 || TELEM_RATE > PWM_FREQ_MIN)
+  #error TELEM_RATE must be at most 1000 Hz.
+#endif
+
+#if defined(CAPTURE_ENABLE) && !(defined(DEBUG_SERIAL_USART2) || defined(DEBUG_SERIAL_USART3))
+  #error CAPTURE_ENABLE needs DEBUG_SERIAL_USART2 or DEBUG_SERIAL_USART3.
+#endif
+
+#if defined(CAPTURE_ENABLE) && ((defined(DEBUG_SERIAL_USART2) && defined(CONTROL_SERIAL_USART2)) || (defined(DEBUG_SERIAL_USART3) && defined(CONTROL_SERIAL_USART3)))
+  #error CAPTURE_ENABLE receives commands on the DEBUG_SERIAL_USARTx port, it cannot be the CONTROL_SERIAL_USARTx port.
+#endif
+
+#if defined(CAPTURE_ENABLE) && (CAPTURE_PRETRIG >= CAPTURE_DEPTH)
+  #error CAPTURE_PRETRIG must be lower than CAPTURE_DEPTH.
+#endif
+
+#if defined(CONTROL_BUS_USART2) && (defined(CONTROL_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART2) || defined(DEBUG_SERIAL_USART2) || defined(PARAM_SERIAL_USART2))
+  #error CONTROL_BUS_USART2 needs USART2 for itself, disable the other SERIAL_USART2 roles.
+#endif
+
+#if defined(CONTROL_BUS_USART2) && defined(CONTROL_SERIAL_USART3)
+  #error CONTROL_BUS_USART2 and CONTROL_SERIAL_USART3 not allowed, choose one.
 #endif
 
-#if defined(DEBUG_SERIAL_USART3) && defined(FEEDBACK_SERIAL_USART3)
-  #error DEBUG_SERIAL_USART3 and FEEDBACK_SERIAL_USART3 not allowed, choose one.
+// The default BUS_DE_PIN is PB10 on the right sensor board cable. Adapt this check if you move it
+#if defined(CONTROL_BUS_USART2) && \
+    (defined(CONTROL_SERIAL_USART3) || defined(FEEDBACK_SERIAL_USART3) || defined(DEBUG_SERIAL_USART3) || defined(PARAM_SERIAL_USART3) || defined(CONTROL_NUNCHUCK) || defined(DEBUG_I2C_LCD))
+  #error CONTROL_BUS_USART2 driver enable pin on the right sensor board cable: disable SERIAL_USART3, nunchuck and LCD or choose another BUS_DE_PIN.
+#endif
+
+#if defined(CONTROL_BUS_USART2) && (BUS_ADDRESS < 1 || BUS_ADDRESS > 8)
+  #error BUS_ADDRESS must be within 1 and 8.
+#endif
+
+#if defined(CONTROL_BUS_USART2) && (BUS_GUARD_US < 2 * 1000000 * ADC_HK_DIV / PWM_FREQ_MIN)
+  #error BUS_GUARD_US must be at least 2 housekeeping periods at PWM_FREQ_MIN, otherwise the replies can collide.
+#endif
+
+#if defined(COMMISSION_ENABLE) && !(defined(PARAM_SERIAL_USART2) || defined(PARAM_SERIAL_USART3))
+  #error COMMISSION_ENABLE needs PARAM_SERIAL_USART2 or PARAM_SERIAL_USART3.
+#endif
+
+#if defined(COMMISSION_ENABLE) && (CTRL_TYP_SEL != 2 || TUNE_SETTLE_PER < 1 || TUNE_MEAS_PER < 1)
+  #error COMMISSION_ENABLE needs the FOC control type, TUNE_SETTLE_PER and TUNE_MEAS_PER must be at least 1.
+#endif
+
+#if (MOT_L < 1 || MOT_L > 65535 || MOT_FLUX < 1 || MOT_FLUX > 65535 || MOT_R < 1 || MOT_R > 65535)
+  #error MOT_L, MOT_FLUX and MOT_R must be between 1 and 65535.
+#endif
+
+#if (CTRL_MOD_REQ > 4 || (CTRL_MOD_REQ == 4 && CTRL_TYP_SEL != 2) || ACC_FF_ADAPT < 0 || ACC_FF_ADAPT > 65535)
+  #error The cascaded SPEED mode needs the FOC control type, ACC_FF_ADAPT must be between 0 and 65535.
+#endif
+
+#if (OVERMOD_MAX < 100 || OVERMOD_MAX > 200)
+  #error OVERMOD_MAX must be between 100 and 200 %.
+#endif
+
+#if (DOB_BW < 0 || DOB_BW > 50)
+  #error DOB_BW must be between 0 and 50 Hz.
+#endif
+
+#if (DT_COMP_ENA == 1 && (DT_COMP_COSS < 1 || DT_COMP_COSS > 100000))
+  #error DT_COMP_COSS must be between 1 and 100000 pF.
+#endif
+
+#if (BAT_NORM_ENA == 1 && (CTRL_TYP_SEL != 2 || BAT_NORM_FILT < 1 || BAT_NORM_FILT > 65535))
+  #error BAT_NORM_ENA needs the FOC control type, BAT_NORM_FILT must be between 1 and 65535.
+#endif
+
+#if defined(COMMISSION_ENABLE) && (IDENT_CURR < 1 || IDENT_CURR > I_MOT_MAX / 2)
+  #error IDENT_CURR must be between 1 A and I_MOT_MAX / 2.
+#endif
+
+#if defined(PARAM_SERIAL_USART2) && defined(PARAM_SERIAL_USART3)
+  #error PARAM_SERIAL_USART2 and PARAM_SERIAL_USART3 not allowed, choose one.
+#endif
+
+#if (defined(PARAM_SERIAL_USART2) && defined(CONTROL_SERIAL_USART2)) || (defined(PARAM_SERIAL_USART3) && defined(CONTROL_SERIAL_USART3))
+  #error PARAM_SERIAL_USARTx and CONTROL_SERIAL_USARTx on the same port not allowed, both receive.
+#endif
+
+#if defined(CAPTURE_ENABLE) && ((defined(PARAM_SERIAL_USART2) && defined(DEBUG_SERIAL_USART2)) || (defined(PARAM_SERIAL_USART3) && defined(DEBUG_SERIAL_USART3)))
+  #error CAPTURE_ENABLE receives commands on the DEBUG_SERIAL_USARTx port, it cannot be the PARAM_SERIAL_USARTx port.
 #endif
 
 #if defined(DEBUG_SERIAL_USART2) && defined(DEBUG_SERIAL_USART3)
   #error DEBUG_SERIAL_USART2 and DEBUG_SERIAL_USART3 not allowed, choose one.
 #endif
 
-#if defined(CONTROL_ADC) && (defined(CONTROL_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART2) || defined(DEBUG_SERIAL_USART2))
+#if defined(CONTROL_ADC) && (defined(CONTROL_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART2) || defined(DEBUG_SERIAL_USART2) || defined(PARAM_SERIAL_USART2) || defined(CONTROL_BUS_USART2))
   #error CONTROL_ADC and SERIAL_USART2 not allowed. It is on the same cable.
 #endif
 
-#if (defined(DEBUG_SERIAL_USART2) || defined(CONTROL_SERIAL_USART2)) && defined(CONTROL_PPM)
+#if (defined(DEBUG_SERIAL_USART2) || defined(CONTROL_SERIAL_USART2) || defined(PARAM_SERIAL_USART2) || defined(CONTROL_BUS_USART2)) && defined(CONTROL_PPM)
   #error CONTROL_PPM and SERIAL_USART2 not allowed. It is on the same cable.
 #endif
 
-#if (defined(DEBUG_SERIAL_USART3) || defined(CONTROL_SERIAL_USART3)) && defined(CONTROL_NUNCHUCK)
+#if (defined(DEBUG_SERIAL_USART3) || defined(CONTROL_SERIAL_USART3) || defined(PARAM_SERIAL_USART3)) && defined(CONTROL_NUNCHUCK)
   #error CONTROL_NUNCHUCK and SERIAL_USART3 not allowed. It is on the same cable.
 #endif
 
-#if (defined(DEBUG_SERIAL_USART3) || defined(CONTROL_SERIAL_USART3)) && defined(DEBUG_I2C_LCD)
+#if (defined(DEBUG_SERIAL_USART3) || defined(CONTROL_SERIAL_USART3) || defined(PARAM_SERIAL_USART3)) && defined(DEBUG_I2C_LCD)
   #error DEBUG_I2C_LCD and SERIAL_USART3 not allowed. It is on the same cable.
 #endif
 
+#if defined(CONTROL_ADC) && ((1 << ADC_AVG_SHIFT) * 1000 * ADC_HK_DIV / PWM_FREQ_MIN > DELAY_IN_MAIN_LOOP)
+  #error ADC_AVG_SHIFT too high: the ADC averaging window must be shorter than DELAY_IN_MAIN_LOOP.
+#endif
+
 #if defined(CONTROL_PPM) && defined(CONTROL_ADC) && defined(CONTROL_NUNCHUCK) || defined(CONTROL_PPM) && defined(CONTROL_ADC) || defined(CONTROL_ADC) && defined(CONTROL_NUNCHUCK) || defined(CONTROL_PPM) && defined(CONTROL_NUNCHUCK)
   #error only 1 input method allowed. use CONTROL_PPM or CONTROL_ADC or CONTROL_NUNCHUCK.
 #endif
@@ -131,14 +131,11 @@
 #define YES 1
 #define ABS(a) (((a) < 0) ? -(a) : (a))
 #define LIMIT(x, lowhigh) (((x) > (lowhigh)) ? (lowhigh) : (((x) < (-lowhigh)) ? (-lowhigh) : (x)))
-#define SAT(x, lowhigh) (((x) > (lowhigh)) ? (1.0f) : (((x) < (-lowhigh)) ? (-1.0f) : (0.0f)))
-#define SAT2(x, low, high) (((x) > (high)) ? (1.0f) : (((x) < (low)) ? (-1.0f) : (0.0f)))
+#define SAT(x, lowhigh) (((x) > (lowhigh)) ? (1) : (((x) < (-lowhigh)) ? (-1) : (0)))
+#define SAT2(x, low, high) (((x) > (high)) ? (1) : (((x) < (low)) ? (-1) : (0)))
 #define STEP(from, to, step) (((from) < (to)) ? (MIN((from) + (step), (to))) : (MAX((from) - (step), (to))))
-#define DEG(a) ((a)*M_PI / 180.0f)
-#define RAD(a) ((a)*180.0f / M_PI)
-#define SIGN(a) (((a) < 0.0f) ? (-1.0f) : (((a) > 0.0f) ? (1.0f) : (0.0f)))
+#define SIGN(a) (((a) < 0) ? (-1) : (((a) > 0) ? (1) : (0)))
 #define CLAMP(x, low, high) (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
-#define SCALE(value, high, max) MIN(MAX(((max) - (value)) / ((max) - (high)), 0.0f), 1.0f)
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 #define MIN3(a, b, c) MIN(a, MIN(b, c))
@@ -162,3 +159,40 @@ void filtLowPass16(int16_t u, uint16_t coef, int16_t *y);
 void filtLowPass32(int32_t u, uint16_t coef, int32_t *y);
 void mixerFcn(int16_t rtu_speed, int16_t rtu_steer, int16_t *rty_speedR, int16_t *rty_speedL, int16_t speedCoefficient);
 void rateLimiter16(int16_t u, int16_t rate, int16_t *y);
+int16_t adcToCmd(uint16_t u, uint16_t min, uint16_t mid, uint16_t max, uint8_t midPot);
+int16_t inputShape(int16_t u, int16_t deadband, int16_t expo);
+
+// Define PWM frequency functions. Implementation is in bldc.c
+#define PWM_FREQ_REF    16000   // PWM frequency the controller parameters in BLDC_controller_data.c are designed for
+void     pwmFreqInit(uint16_t freq);
+uint8_t  pwmFreqSet(uint16_t freq);
+uint16_t pwmFreqGet(void);
+uint8_t  pwmFreqStore(uint16_t freq);   // Implementation is in main.c
+
+// Controller PI gains at PWM_FREQ_REF, in the format of BLDC_controller_data.c (the cascaded SPEED mode ones: see spdCascIn()). Implementation is in bldc.c
+#define CTRL_GAIN_ID_KP   0     // cf_idKp
+#define CTRL_GAIN_ID_KI   1     // cf_idKi
+#define CTRL_GAIN_IQ_KP   2     // cf_iqKp
+#define CTRL_GAIN_IQ_KI   3     // cf_iqKi
+#define CTRL_GAIN_N_KP    4     // cf_nKp
+#define CTRL_GAIN_N_KI    5     // cf_nKi
+#define CTRL_GAIN_NC_KP   6     // cascaded SPEED mode speed PI Kp fixdt(0,16,12)
+#define CTRL_GAIN_NC_KI   7     // Ki fixdt(0,16,16)
+#define CTRL_GAIN_ACC_FF  8     // inertia feedforward gain J / Kt fixdt(0,16,12) (not a PI gain, not rescaled). Setting it restarts the inertia estimation
+#define CTRL_GAIN_COUNT   9
+void     ctrlGainSet(uint8_t gain, uint16_t val);
+uint16_t ctrlGainGet(uint8_t gain);
+uint8_t  ctrlGainStore(uint8_t gain, uint16_t val);  // Implementation is in main.c
+uint16_t accFfEstGet(uint8_t motor);                 // inertia gain with the estimate of a motor (0 left, 1 right)
+
+// Hall sensor calibration of a motor (0 left, 1 right): sectors of the hall codes 0..7 and offsets of the 6 hall edges. Implementation is in bldc.c
+void     hallCalSet(uint8_t motor, const int8_t *hallToPos, const int16_t *ofs);
+uint8_t  hallCalStore(uint8_t motor, const int8_t *hallToPos, const int16_t *ofs);  // Implementation is in main.c
+
+// Motor constants of the current loop decoupling and back-EMF feedforward (DECOUP_ENA) and of the SPEED mode load feedforward (DOB_BW). Implementation is in bldc.c
+void     motConstSet(uint16_t l, uint16_t flux, uint16_t r);    // [uH], [uWb], [mOhm]
+void     decoupUpdate(void);
+uint8_t  motConstStore(uint16_t l, uint16_t flux, uint16_t r);  // Implementation is in main.c
+
+// Current band of the dead time compensation (DT_COMP_ENA) for the actual battery voltage. Implementation is in bldc.c
+void     dtCompUpdate(void);
@@ -0,0 +1,76 @@
+/*
+* This file is part of the hoverboard-firmware-hack project.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stm32f1xx_hal.h"
+
+/* EEPROM emulation in the last two Flash pages (see STM32F103RCTx_FLASH.ld and ST AN2594).
+ * Every variable is stored as a 32-bit record: [data (16 bit) | virtual address (16 bit)].
+ * New values are appended, the latest record of a virtual address is the valid one.
+ * When the active page is full, the latest values are copied to the other page.
+ *
+ * NOTE: Flash erase/program stalls the CPU (up to ~40 ms for a page erase).
+ *       Only write variables while the motors are disabled!
+ */
+#define EE_PAGE_SIZE          ((uint32_t)0x800)                   // 2 KByte pages on high-density devices
+#define EE_START_ADDRESS      ((uint32_t)0x0803F000)              // Last 4 KByte of the 256 KByte Flash
+#define EE_PAGE0_BASE         (EE_START_ADDRESS)
+#define EE_PAGE1_BASE         (EE_START_ADDRESS + EE_PAGE_SIZE)
+
+// Page status definitions
+#define EE_ERASED             ((uint16_t)0xFFFF)                  // Page is empty
+#define EE_RECEIVE_DATA       ((uint16_t)0xEEEE)                  // Page is marked to receive data
+#define EE_VALID_PAGE         ((uint16_t)0x0000)                  // Page containing valid data
+
+// Return codes
+#define EE_OK                 ((uint16_t)0x0000)
+#define EE_NOT_FOUND          ((uint16_t)0x0001)
+#define EE_NO_VALID_PAGE      ((uint16_t)0x00AB)
+#define EE_FLASH_ERROR        ((uint16_t)0x00AC)
+
+// Virtual addresses of the stored variables. Never reuse or renumber an address, only append new ones!
+#define EE_ADDR_ADC_CAL_VALID   ((uint16_t)0x0001)                // ADC calibration marker
+#define EE_ADDR_ADC1_MIN        ((uint16_t)0x0002)
+#define EE_ADDR_ADC1_MID        ((uint16_t)0x0003)
+#define EE_ADDR_ADC1_MAX        ((uint16_t)0x0004)
+#define EE_ADDR_ADC2_MIN        ((uint16_t)0x0005)
+#define EE_ADDR_ADC2_MID        ((uint16_t)0x0006)
+#define EE_ADDR_ADC2_MAX        ((uint16_t)0x0007)
+#define EE_ADDR_PWM_FREQ        ((uint16_t)0x0008)                // PWM frequency [Hz]
+#define EE_ADDR_ID_KP           ((uint16_t)0x0009)                // PI gains at PWM_FREQ_REF, see CTRL_GAIN_xxx in defines.h
+#define EE_ADDR_ID_KI           ((uint16_t)0x000A)
+#define EE_ADDR_IQ_KP           ((uint16_t)0x000B)
+#define EE_ADDR_IQ_KI           ((uint16_t)0x000C)
+#define EE_ADDR_N_KP            ((uint16_t)0x000D)
+#define EE_ADDR_N_KI            ((uint16_t)0x000E)
+#define EE_ADDR_HALL_L          ((uint16_t)0x000F)                // hall calibration, 8 variables per motor, see hallCalStore() in main.c
+#define EE_ADDR_HALL_R          ((uint16_t)0x0017)
+#define EE_ADDR_MOT_L           ((uint16_t)0x001F)                // [uH] motor constants of the decoupling, see motConstSet() in bldc.c
+#define EE_ADDR_MOT_FLUX        ((uint16_t)0x0020)                // [uWb]
+#define EE_ADDR_NC_KP           ((uint16_t)0x0021)                // cascaded SPEED mode gains, see CTRL_GAIN_xxx in defines.h
+#define EE_ADDR_NC_KI           ((uint16_t)0x0022)
+#define EE_ADDR_ACC_FF          ((uint16_t)0x0023)
+#define EE_ADDR_MOT_R           ((uint16_t)0x0024)                // [mOhm] motor constant of the SPEED mode load feedforward
+
+#define EE_NB_OF_VAR            (36)                              // Number of variables handled during a page transfer
+
+uint16_t EE_Init(void);
+uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t *Data);
+uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data);
@@ -0,0 +1,32 @@
+/*
+* This file is part of the hoverboard-firmware-hack project.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+/* Integer formatting without printf and without floating point.
+ * All functions write a zero terminated string to buf and return its length (without the zero).
+ * buf must hold at least FMT_BUF_SIZE characters, or width + 1 if width is larger.
+ */
+#define FMT_BUF_SIZE    13      // "-2147483648" plus a decimal point and the zero
+
+uint8_t fmtInt(char *buf, int32_t value);                                 // 1234 -> "1234"
+uint8_t fmtFixed(char *buf, int32_t value, uint8_t decimals);             // 1234, 2 -> "12.34", -5, 2 -> "-0.05"
+uint8_t fmtPad(char *buf, int32_t value, uint8_t width, char pad);        // 42, 5, ' ' -> "   42"
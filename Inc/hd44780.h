@@ -239,7 +239,31 @@ LCD_RESULT LCD_ShiftDisplay(LCD_PCF8574_HandleTypeDef* handle, uint8_t direction
 LCD_RESULT LCD_WriteNumber(LCD_PCF8574_HandleTypeDef* handle, unsigned long n, uint8_t base);
 
 
-LCD_RESULT LCD_WriteFloat(LCD_PCF8574_HandleTypeDef* handle, double number, uint8_t digits);
+/**
+ * Writes a signed integer to the LCD
+ * @param	handle - a pointer to the LCD handle
+ * @param	number - a number you want to write to the LCD
+ * @return	whether the function was successful or not
+ */
+LCD_RESULT LCD_WriteInt(LCD_PCF8574_HandleTypeDef* handle, int32_t number);
+
+/**
+ * Writes a signed integer right-aligned in a field of spaces, overwriting the previous value of the same field
+ * @param	handle - a pointer to the LCD handle
+ * @param	number - a number you want to write to the LCD
+ * @param	width - field width in characters, longer numbers are written completely
+ * @return	whether the function was successful or not
+ */
+LCD_RESULT LCD_WriteIntPad(LCD_PCF8574_HandleTypeDef* handle, int32_t number, uint8_t width);
+
+/**
+ * Writes a fixed-point number to the LCD, e.g. number = 1234 and digits = 2 writes "12.34"
+ * @param	handle - a pointer to the LCD handle
+ * @param	number - the number multiplied by 10^digits
+ * @param	digits - number of digits after the decimal point
+ * @return	whether the function was successful or not
+ */
+LCD_RESULT LCD_WriteFixed(LCD_PCF8574_HandleTypeDef* handle, int32_t number, uint8_t digits);
 
 /**
  * Sets the mode by which data is written to the LCD
@@ -0,0 +1,78 @@
+/*
+* This file is part of the hoverboard-firmware-hack project.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stm32f1xx_hal.h"
+#include "config.h"
+
+/* Parameter protocol, enabled with PARAM_SERIAL_USART2 or PARAM_SERIAL_USART3.
+ * Request and reply use the same 12 byte frame (little endian):
+ *   uint16_t start      PARAM_START_FRAME
+ *   uint8_t  cmd        PARAM_CMD_xxx, the reply has PARAM_CMD_REPLY set
+ *   uint8_t  id         PARAM_ID_xxx
+ *   int32_t  value      value to write / value read back
+ *   uint16_t status     0 in the request, PARAM_OK or PARAM_ERR_xxx in the reply
+ *   uint16_t crc        CRC-16/CCITT-FALSE over all previous bytes
+ * Every valid request gets a reply with the current value of the parameter. Frames with a wrong CRC are ignored.
+ * Writes take effect immediately but are lost at power off, except PARAM_CMD_STORE which also writes the Flash.
+ */
+#define PARAM_START_FRAME       0xABBA
+#define PARAM_FRAME_SIZE        12
+
+// Commands
+#define PARAM_CMD_READ          1
+#define PARAM_CMD_WRITE         2
+#define PARAM_CMD_STORE         3     // write and store in Flash, only with the motors disabled (except PARAM_ID_TUNE)
+#define PARAM_CMD_REPLY         0x80
+
+// Status codes
+#define PARAM_OK                0
+#define PARAM_ERR_ID            1     // unknown parameter
+#define PARAM_ERR_RANGE         2     // value out of range
+#define PARAM_ERR_READONLY      3     // parameter cannot be written
+#define PARAM_ERR_CMD           4     // unknown command, or STORE on a parameter that is not stored
+#define PARAM_ERR_FLASH         5     // Flash write failed or motors enabled
+
+// Parameters
+#define PARAM_ID_PWM_FREQ       0     // [Hz] RW, stored. PWM_FREQ_MIN to PWM_FREQ_MAX
+#define PARAM_ID_CTRL_MODE      1     // [-]  RW. 0 = Open, 1 = Voltage, 2 = Speed, 3 = Torque, 4 = cascaded Speed, see CTRL_MOD_REQ
+#define PARAM_ID_N_MAX          2     // [rpm] RW. 0 to N_MOT_MAX, both motors
+#define PARAM_ID_I_MAX          3     // [A]  RW. 0 to I_MOT_MAX, both motors
+#define PARAM_ID_BAT_VOLTAGE    4     // [V*100] R
+#define PARAM_ID_ERR_CODE       5     // [-]  R. errCode_Left | errCode_Right << 8
+#define PARAM_ID_ISR_CYCLES_MAX 6     // [cycles] RW. Write any value to reset the maximum
+#define PARAM_ID_TELEM_DROPS    7     // [-]  R. dropped telemetry frames
+#define PARAM_ID_ID_KP          8     // [-]  RW, stored. PI gains, format of BLDC_controller_data.c at 16 kHz (rescaled to the PWM frequency)
+#define PARAM_ID_ID_KI          9     //      Same order as CTRL_GAIN_xxx in defines.h. 0 to 65535
+#define PARAM_ID_IQ_KP          10
+#define PARAM_ID_IQ_KI          11
+#define PARAM_ID_N_KP           12
+#define PARAM_ID_N_KI           13
+#define PARAM_ID_TUNE           14    // [-]  RW, needs COMMISSION_ENABLE. Write/store COMM_xxx to start a routine, read COMM_STATE_xxx, see commission.h
+#define PARAM_ID_MOT_R          15    // [mOhm] R, needs COMMISSION_ENABLE. Identified motor parameters (COMM_IDENT), 0 before
+#define PARAM_ID_MOT_L          16    // [uH]   R
+#define PARAM_ID_MOT_FLUX       17    // [uWb]  R
+#define PARAM_ID_NC_KP          18    // [-]  RW, stored. Cascaded SPEED mode speed PI gains and inertia gain,
+#define PARAM_ID_NC_KI          19    //      same format and order as CTRL_GAIN_NC_KP..CTRL_GAIN_ACC_FF in defines.h. 0 to 65535
+#define PARAM_ID_ACC_FF         20
+#define PARAM_ID_ACC_FF_EST     21    // [-]  R. Inertia gain with the estimate of the left motor (ACC_FF_ADAPT), to be stored as PARAM_ID_ACC_FF
+#define PARAM_ID_COUNT          22
+
+void Param_Process(void);
@@ -0,0 +1,120 @@
+/*
+* This file is part of the hoverboard-firmware-hack project.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stm32f1xx_hal.h"
+#include "config.h"
+
+/* Serial ports. USART2 (left sensor cable) and USART3 (right sensor cable) run independently, each one with its
+ * own RX/TX DMA channels and any combination of the roles selected in config.h:
+ *   CONTROL_SERIAL_USARTx   RX: Serialcommand frames (HAL DMA reception, see main.c)
+ *   FEEDBACK_SERIAL_USARTx  TX: SerialFeedback frames, or the telemetry stream with FEEDBACK_TELEMETRY
+ *   DEBUG_SERIAL_USARTx     TX: console (scope, log), RX: capture commands with CAPTURE_ENABLE
+ *   PARAM_SERIAL_USARTx     RX/TX: parameter protocol, see param.h
+ *   CONTROL_BUS_USART2      RX/TX: RS-485 multi-drop bus node, see bus.h. It needs the port for itself
+ * A role can be assigned to one port only. The TX roles of a port share its TX ring buffer, except the telemetry
+ * stream which needs the TX DMA for itself.
+ */
+
+// ###### Derived port configuration ######
+#if defined(CONTROL_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART2) || defined(DEBUG_SERIAL_USART2) || defined(PARAM_SERIAL_USART2) || \
+    defined(CONTROL_BUS_USART2)
+  #define SERIAL_USART2
+#endif
+#if defined(CONTROL_SERIAL_USART3) || defined(FEEDBACK_SERIAL_USART3) || defined(DEBUG_SERIAL_USART3) || defined(PARAM_SERIAL_USART3)
+  #define SERIAL_USART3
+#endif
+
+#if defined(FEEDBACK_TELEMETRY) && defined(FEEDBACK_SERIAL_USART2)
+  #define SERIAL_USART2_TELEMETRY                         // the TX DMA is driven by telemetry.c
+#elif defined(FEEDBACK_SERIAL_USART2) || defined(DEBUG_SERIAL_USART2) || defined(PARAM_SERIAL_USART2) || defined(CONTROL_BUS_USART2)
+  #define SERIAL_USART2_TX_RING                           // the TX DMA is driven by the TX ring buffer
+#endif
+#if defined(FEEDBACK_TELEMETRY) && defined(FEEDBACK_SERIAL_USART3)
+  #define SERIAL_USART3_TELEMETRY
+#elif defined(FEEDBACK_SERIAL_USART3) || defined(DEBUG_SERIAL_USART3) || defined(PARAM_SERIAL_USART3)
+  #define SERIAL_USART3_TX_RING
+#endif
+
+#if defined(PARAM_SERIAL_USART2) || defined(CONTROL_BUS_USART2)
+  #define SERIAL_USART2_RX_BUF                            // circular RX DMA buffer read with Serial_Read()
+#endif
+#if defined(PARAM_SERIAL_USART3)
+  #define SERIAL_USART3_RX_BUF
+#endif
+
+#if defined(CONTROL_SERIAL_USART2) || defined(SERIAL_USART2_RX_BUF) || (defined(DEBUG_SERIAL_USART2) && defined(CAPTURE_ENABLE))
+  #define SERIAL_USART2_RX
+#endif
+#if defined(CONTROL_SERIAL_USART3) || defined(SERIAL_USART3_RX_BUF) || (defined(DEBUG_SERIAL_USART3) && defined(CAPTURE_ENABLE))
+  #define SERIAL_USART3_RX
+#endif
+
+#if (defined(SERIAL_USART2_TELEMETRY) && (defined(DEBUG_SERIAL_USART2) || defined(PARAM_SERIAL_USART2))) || \
+    (defined(SERIAL_USART3_TELEMETRY) && (defined(DEBUG_SERIAL_USART3) || defined(PARAM_SERIAL_USART3)))
+  #error FEEDBACK_TELEMETRY needs the TX of its port for itself: move DEBUG_SERIAL_USARTx or PARAM_SERIAL_USARTx to the other port.
+#endif
+
+typedef struct {
+  USART_TypeDef        *usart;
+  UART_HandleTypeDef   *huart;
+  DMA_Channel_TypeDef  *txDma;
+  DMA_Channel_TypeDef  *rxDma;
+  uint32_t              txIfcr;                     // DMA1->IFCR value clearing the TX channel flags
+  uint8_t              *txBuf;                      // TX ring buffer, SERIAL_TX_BUF_SIZE bytes. txHead and txTail are free running
+  volatile uint16_t     txHead;
+  volatile uint16_t     txTail;
+  volatile uint16_t     txChunk;                    // bytes being sent by the DMA, 0 = DMA idle
+  volatile uint16_t     txUsedMax;                  // maximum occupancy of the TX ring buffer [bytes]
+  volatile uint16_t     txOverflow;                 // number of messages dropped because the TX ring buffer was full
+  uint8_t              *rxBuf;                      // RX ring buffer written by the circular RX DMA (parameter protocol, bus)
+  uint16_t              rxTail;
+} SerialPort;
+
+extern SerialPort serialPort2;
+extern SerialPort serialPort3;
+
+// Port of each role
+#if defined(CONTROL_SERIAL_USART2)
+  #define SERIAL_PORT_CONTROL   (&serialPort2)
+#elif defined(CONTROL_SERIAL_USART3)
+  #define SERIAL_PORT_CONTROL   (&serialPort3)
+#endif
+#if defined(FEEDBACK_SERIAL_USART2)
+  #define SERIAL_PORT_FEEDBACK  (&serialPort2)
+#elif defined(FEEDBACK_SERIAL_USART3)
+  #define SERIAL_PORT_FEEDBACK  (&serialPort3)
+#endif
+#if defined(DEBUG_SERIAL_USART2)
+  #define SERIAL_PORT_DEBUG     (&serialPort2)
+#elif defined(DEBUG_SERIAL_USART3)
+  #define SERIAL_PORT_DEBUG     (&serialPort3)
+#endif
+#if defined(PARAM_SERIAL_USART2)
+  #define SERIAL_PORT_PARAM     (&serialPort2)
+#elif defined(PARAM_SERIAL_USART3)
+  #define SERIAL_PORT_PARAM     (&serialPort3)
+#endif
+
+void     Serial_Init(void);
+uint16_t Serial_Write(SerialPort *port, const uint8_t *data, uint16_t len);
+uint16_t Serial_TxFree(SerialPort *port);
+void     Serial_TxCplt(SerialPort *port);
+uint8_t  Serial_Read(SerialPort *port, uint8_t *data);
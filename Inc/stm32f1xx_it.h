@@ -56,6 +56,7 @@ void DebugMon_Handler(void);
 void PendSV_Handler(void);
 void SysTick_Handler(void);
 void DMA1_Channel1_IRQHandler(void);
+void ADC1_2_IRQHandler(void);
 void DMA2_Channel4_5_IRQHandler(void);
 
 #ifdef __cplusplus
@@ -0,0 +1,75 @@
+/*
+* This file is part of the hoverboard-firmware-hack project.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "stm32f1xx_hal.h"
+#include "config.h"
+#include "crc.h"
+
+/* Binary telemetry stream, enabled with FEEDBACK_TELEMETRY.
+ * The control ISR samples the selected channels at TELEM_RATE and packs TELEM_SAMPLES samples in a frame.
+ * Two frame buffers are used: one is filled while the DMA sends the other one. If the previous frame
+ * is still being sent when a frame is complete, the new frame is dropped and counted.
+ *
+ * Frame format (little endian):
+ *   uint16_t start      TELEM_START_FRAME
+ *   uint16_t seq        frame counter, also incremented for dropped frames
+ *   uint32_t chMask     TELEM_CHANNELS
+ *   uint8_t  nbCh       number of channels per sample
+ *   uint8_t  nbSmp      number of samples per frame
+ *   uint16_t dropCnt    total number of dropped frames
+ *   int16_t  data[nbSmp][nbCh]  channels in increasing TELEM_CH_xxx order
+ *   uint16_t crc        CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF) over all previous bytes
+ */
+#define TELEM_START_FRAME       0xABCD
+
+// Channel numbers, select them with the TELEM_CHANNELS bit mask in config.h
+#define TELEM_CH_N_MOT_L        0     // [rpm]
+#define TELEM_CH_N_MOT_R        1
+#define TELEM_CH_ANGLE_L        2     // electrical angle, fixdt(1,16,4) [deg]
+#define TELEM_CH_ANGLE_R        3
+#define TELEM_CH_CUR_L_PHA_A    4     // phase and DC link currents [ADC counts]
+#define TELEM_CH_CUR_L_PHA_B    5
+#define TELEM_CH_CUR_R_PHA_B    6
+#define TELEM_CH_CUR_R_PHA_C    7
+#define TELEM_CH_CUR_L_DC       8
+#define TELEM_CH_CUR_R_DC       9
+#define TELEM_CH_DC_L_PHA_A     10    // controller duty cycle outputs [-1000, 1000]
+#define TELEM_CH_DC_L_PHA_B     11
+#define TELEM_CH_DC_L_PHA_C     12
+#define TELEM_CH_DC_R_PHA_A     13
+#define TELEM_CH_DC_R_PHA_B     14
+#define TELEM_CH_DC_R_PHA_C     15
+#define TELEM_CH_ERR_CODE       16    // errCode_Left | errCode_Right << 8
+#define TELEM_CH_BAT_VOLTAGE    17    // filtered battery voltage [ADC counts]
+#define TELEM_CH_COUNT          18
+
+#define TELEM_CH_BIT(ch)        ((TELEM_CHANNELS >> (ch)) & 1)
+#define TELEM_NB_CH             (TELEM_CH_BIT(0)  + TELEM_CH_BIT(1)  + TELEM_CH_BIT(2)  + TELEM_CH_BIT(3)  + TELEM_CH_BIT(4)  + \
+                                 TELEM_CH_BIT(5)  + TELEM_CH_BIT(6)  + TELEM_CH_BIT(7)  + TELEM_CH_BIT(8)  + TELEM_CH_BIT(9)  + \
+                                 TELEM_CH_BIT(10) + TELEM_CH_BIT(11) + TELEM_CH_BIT(12) + TELEM_CH_BIT(13) + TELEM_CH_BIT(14) + \
+                                 TELEM_CH_BIT(15) + TELEM_CH_BIT(16) + TELEM_CH_BIT(17))
+
+#define TELEM_HEADER_SIZE       12
+#define TELEM_FRAME_SIZE        (TELEM_HEADER_SIZE + 2 * TELEM_SAMPLES * TELEM_NB_CH + 2)
+
+extern volatile uint16_t telemDropCnt;
+
+void     Telemetry_Sample(void);
@@ -26,6 +26,10 @@
 #include "defines.h"
 #include "setup.h"
 #include "config.h"
+#include "telemetry.h"
+#include "capture.h"
+#include "bus.h"
+#include "commission.h"
 
 // Matlab includes and defines - from auto-code generation
 // ###############################################################################
@@ -35,6 +39,9 @@
 extern RT_MODEL *const rtM_Left;
 extern RT_MODEL *const rtM_Right;
 
+extern P rtP_Left;                      /* Block parameters (auto storage) */
+extern P rtP_Right;                     /* Block parameters (auto storage) */
+
 extern DW rtDW_Left;                    /* Observable states */
 extern ExtU rtU_Left;                   /* External inputs */
 extern ExtY rtY_Left;                   /* External outputs */
@@ -44,7 +51,12 @@ extern ExtU rtU_Right;                  /* External inputs */
 extern ExtY rtY_Right;                  /* External outputs */
 // ###############################################################################
 
+#if (CURR_OVERSAMPLE == 1)
+static int16_t pwm_margin = 100 + CURR_OS_DELTA;  /* The two current samples are CURR_OS_DELTA before/after the single sample position */
+#else
 static int16_t pwm_margin = 100;        /* This margin allows to always have a window in the PWM signal for proper Phase currents measurement */
+#endif
+/* Only the measured phases (left A/B, right B/C) keep pwm_margin below the top of the PWM range, the others PWM_LOW_MIN, see pwmDutyFit() */
 
 extern uint8_t ctrlModReq;
 static int16_t curDC_max = (I_DC_MAX * A2BIT_CONV);
@@ -55,6 +67,8 @@ uint8_t errCode_Right = 0;
 
 volatile int pwml = 0;
 volatile int pwmr = 0;
+volatile int accl = 0;
+volatile int accr = 0;
 
 extern volatile adc_buf_t adc_buffer;
 
@@ -67,7 +81,57 @@ static uint32_t buzzerTimer = 0;
 uint8_t        enable       = 0;        // initially motors are disabled for SAFETY
 static uint8_t enableFin    = 0;
 
-static const uint16_t pwm_res  = 64000000 / 2 / PWM_FREQ; // = 2000
+#define PWM_RES_REF     (64000000 / 2 / PWM_FREQ_REF) // = 2000, the controller duty cycle outputs (+/-1000) are relative to this resolution
+#define DOB_W           (DOB_BW * 6283 / 1000)  // [rad/s] load observer bandwidth
+static uint16_t pwm_res   = 64000000 / 2 / PWM_FREQ;  // = 2000
+static int32_t  pwm_scale = ((64000000 / 2 / PWM_FREQ) << 14) / PWM_RES_REF;  // fixdt(1,32,14): duty cycle scaling to the actual pwm_res
+static uint16_t pwmFreq   = 0;                         // actual PWM frequency [Hz], 0 = parameters not yet scaled
+static volatile uint16_t pwmFreqReq = 0;               // requested PWM frequency [Hz], 0 = none until pwmFreqInit()
+static P        rtP_ref;                               // controller parameters at PWM_FREQ_REF
+static volatile uint8_t ctrlGainUpd = 0;               // new gains in rtP_ref, to be applied by the control ISR
+static uint16_t nCascKpRef = 8192;                     // cascaded SPEED mode at PWM_FREQ_REF: speed PI gains Kp fixdt(0,16,12) and
+static uint16_t nCascKiRef = 100;                      // Ki fixdt(0,16,16), inertia gain J / Kt fixdt(0,16,12), see spdCascIn()
+static uint16_t accFfRef   = 596;
+static uint16_t nCascKp    = 8192;                     // at the actual frequency, applied by the control ISR
+static uint16_t nCascKi    = 100;
+static uint16_t accFf      = 596;
+static uint16_t accAdapt   = ACC_FF_ADAPT;
+static int32_t  nCascInt[2] = {0, 0};                  // speed PI integrators, iq fixdt(1,32,20)
+static int32_t  accEst[2]   = {0, 0};                  // inertia estimates, correction of accFf with 12 more fractional bits
+static uint16_t motL      = MOT_L;                     // [uH] motor constants of the decoupling and back-EMF feedforward
+static uint16_t motFlux   = MOT_FLUX;                  // [uWb]
+static uint16_t motR      = MOT_R;                     // [mOhm]
+static int32_t  vdLin     = 15200;                     // linear voltage limit at the actual frequency, fixdt(1,16,4)
+static int32_t  vqMax     = 14400;                     // radius of the Vq_max circle at the actual frequency, fixdt(1,16,4)
+static uint16_t batNormRatio = 16384;                  // battery voltage relative to BAT_FULL, fixdt(0,16,14). 16384 without BAT_NORM_ENA
+#if (BAT_NORM_ENA == 1)
+static int16_t  batNormFixdt = (BAT_FULL) << 4;       // battery voltage ADC value filtered every PWM period, fixdt(1,16,4)
+#endif
+#if (BAT_NORM_ENA == 1 || DECOUP_ENA == 1 || DOB_BW > 0)
+static uint8_t  vqMaxCnt     = 0;                      // Vq_max table update divider
+#endif
+#if (DECOUP_ENA == 1)
+static uint16_t decoupL      = 0;                      // decoupling coefficients, see decoupUpdate()
+static uint16_t decoupBemf   = 0;
+#endif
+#if (DECOUP_ENA == 1 || DOB_BW > 0)
+static int16_t  vdFf[2]      = {0, 0};                 // dq voltage feedforward of the motors fixdt(1,16,4), see vFfUpdate()
+static int16_t  vqFf[2]      = {0, 0};
+#endif
+#if (DOB_BW > 0)
+static uint16_t dobFilt      = (DOB_W << 16) / PWM_FREQ;  // load observer low pass w * Ts at the actual frequency, fixdt(0,16,16)
+static uint16_t dobR         = 0;                      // load voltage coefficient, see decoupUpdate()
+static int32_t  dobIq[2]     = {0, 0};                 // Q iq and Q n, 16 more fractional bits than iq and n, see dobStep()
+static int32_t  dobN[2]      = {0, 0};
+static int16_t  dobD[2]      = {0, 0};                 // load current d, iq fixdt(1,16,4)
+#endif
+#if (DT_COMP_ENA == 1)
+static int16_t  dtCompBand = 1;                        // current band of the dead time compensation [A2BIT_CONV], see dtCompUpdate()
+#endif
+#ifdef FEEDBACK_TELEMETRY
+static uint16_t telemDiv  = PWM_FREQ / TELEM_RATE;       // telemetry sample rate divider
+static uint16_t telemCnt  = 0;
+#endif
 
 static uint16_t offsetcount = 0;
 static int16_t offsetrl1    = 2000;
@@ -80,15 +144,571 @@ static int16_t offsetdcr    = 2000;
 int16_t        batVoltage       = (400 * BAT_CELLS * BAT_CALIB_ADC) / BAT_CALIB_REAL_VOLTAGE;
 static int16_t batVoltageFixdt  = (400 * BAT_CELLS * BAT_CALIB_ADC) / BAT_CALIB_REAL_VOLTAGE << 4;  // Fixed-point filter output initialized at 400 V*100/cell = 4 V/cell converted to fixed-point
 
+#ifdef CONTROL_ADC
+volatile uint16_t adc1Avg       = 0;    // ADC1 input (l_tx2) averaged over 2^ADC_AVG_SHIFT samples
+volatile uint16_t adc2Avg       = 0;    // ADC2 input (l_rx2) averaged over 2^ADC_AVG_SHIFT samples
+static uint32_t adc1Sum         = 0;
+static uint32_t adc2Sum         = 0;
+static uint16_t adcAvgCnt       = 0;
+#endif
+static uint8_t  adcHkCnt        = 0;    // housekeeping ADC sequence divider
+
+volatile uint32_t isrCycles     = 0;    // motor control ISR duration in CPU cycles, over one PWM period (budget: 64 MHz / PWM_FREQ = 4000)
+volatile uint32_t isrCyclesMax  = 0;    // maximum of isrCycles
+#if (CURR_OVERSAMPLE == 1)
+static uint32_t isrCyclesAcc    = 0;
+static uint16_t currSmp[6];             // first current sample of the PWM period
+static uint8_t  currSmpFirst    = 0;    // currSmp holds the first sample of the actual PWM period
+#endif
+
+// =================================
+// Runtime PWM frequency
+// =================================
+/* Scale a controller parameter designed for PWM_FREQ_REF: the counters and time constants count ISR steps (proportional to the
+ * frequency), the gains and rates are applied every ISR step (inversely proportional to the frequency).
+ */
+static int32_t paramScale(int32_t x, uint16_t num, uint16_t den) {
+  int32_t tmp = (int32_t)(((int64_t)x * num + den / 2) / den);
+  return (x != 0 && tmp == 0) ? 1 : tmp;   // keep small gains active
+}
+
+/* Vq_max table of a motor, values and breakpoints: the circle of radius vqMax times the battery voltage ratio. The values are
+ * lowered by the q axis voltage feedforward, the PI output and the feedforward together stay within the circle */
+static void vqMaxScale(uint8_t motor) {
+  P       *rtP  = (motor == 0) ? &rtP_Left : &rtP_Right;
+  int32_t  gain = vqMax * batNormRatio / rtP_ref.Vd_max;  // fixdt(0,32,14) on the reference table
+  int32_t  ofs  = 0;
+
+  #if (DECOUP_ENA == 1 || DOB_BW > 0)
+  ofs = ABS(vqFf[motor]);
+  #endif
+  for (int i = 0; i < (int)(sizeof(rtP->Vq_max_M1) / sizeof(rtP->Vq_max_M1[0])); i++) {
+    rtP->Vq_max_M1[i] = (int16_T)MAX(((rtP_ref.Vq_max_M1[i] * gain) >> 14) - ofs, 0);
+    rtP->Vq_max_XA[i] = (int16_T)((rtP_ref.Vq_max_XA[i] * gain) >> 14);
+  }
+}
+
+static void pwmFreqParamScale(P *rtP, uint16_t freq) {
+  int32_t vMax;
+
+  // Independent of the frequency, copied for the gains set at runtime
+  rtP->cf_idKp          = rtP_ref.cf_idKp;
+  rtP->cf_iqKp          = rtP_ref.cf_iqKp;
+  rtP->cf_nKp           = rtP_ref.cf_nKp;
+  // Proportional to the frequency
+  rtP->cf_speedCoef     = (uint16_T)paramScale(rtP_ref.cf_speedCoef,    freq, PWM_FREQ_REF);
+  rtP->z_maxCntRst      = (int16_T) paramScale(rtP_ref.z_maxCntRst,     freq, PWM_FREQ_REF);
+  rtP->dz_cntTrnsDetHi  = (int16_T) paramScale(rtP_ref.dz_cntTrnsDetHi, freq, PWM_FREQ_REF);
+  rtP->dz_cntTrnsDetLo  = (int16_T) paramScale(rtP_ref.dz_cntTrnsDetLo, freq, PWM_FREQ_REF);
+  rtP->t_errQual        = (uint16_T)paramScale(rtP_ref.t_errQual,       freq, PWM_FREQ_REF);
+  rtP->t_errDequal      = (uint16_T)paramScale(rtP_ref.t_errDequal,     freq, PWM_FREQ_REF);
+  // Inversely proportional to the frequency
+  rtP->dV_openRate      = (int32_T) paramScale(rtP_ref.dV_openRate,     PWM_FREQ_REF, freq);
+  rtP->cf_idKi          = (uint16_T)paramScale(rtP_ref.cf_idKi,         PWM_FREQ_REF, freq);
+  rtP->cf_iqKi          = (uint16_T)paramScale(rtP_ref.cf_iqKi,         PWM_FREQ_REF, freq);
+  rtP->cf_nKi           = (uint16_T)paramScale(rtP_ref.cf_nKi,          PWM_FREQ_REF, freq);
+  rtP->cf_iqKiLimProt   = (uint16_T)paramScale(rtP_ref.cf_iqKiLimProt,  PWM_FREQ_REF, freq);
+  rtP->cf_nKiLimProt    = (uint16_T)paramScale(rtP_ref.cf_nKiLimProt,   PWM_FREQ_REF, freq);
+  rtP->cf_KbLimProt     = (uint16_T)paramScale(rtP_ref.cf_KbLimProt,    PWM_FREQ_REF, freq);
+  rtP->cf_currFilt      = (uint16_T)paramScale(rtP_ref.cf_currFilt,     PWM_FREQ_REF, freq);
+
+  // Linear voltage limit: the line voltage can use the PWM range minus the current measurement window of one phase, or the minimum
+  // low side time of the others if it is longer (pwmDutyFit()). These are times, their share of the range depends on the frequency.
+  // Vd_max and the Vq_max table scale with it. Overmodulation enlarges the Vq_max circle by OVERMOD_MAX, ovmClamp() saturates the
+  // phases to the linear range. Vd_max stays linear: it is also the VOLTAGE mode input scale, and Vd is small at top speed.
+  // The bus voltage normalization shrinks the Vq_max circle with the battery voltage, see ADC1_2_IRQHandler()
+  vMax = (PWM_RES_REF - (int32_t)MAX(pwm_margin, PWM_LOW_MIN) * PWM_RES_REF / (64000000 / 2 / freq)) << 3;  // fixdt(1,16,4), 15200 at 16 kHz
+  rtP->Vd_max = (int16_T)vMax;
+  vdLin       = vMax;
+  vqMax       = vMax * OVERMOD_MAX / 100;
+}
+
+/* Duty cycles of one motor in timer counts, with the low side window for the current measurement only on the measured phases:
+ * a measured phase above pwm_res - pwm_margin shifts the three phases down, the line voltages stay. Then saturated to the range.
+ * The other phases keep a low side pulse of PWM_LOW_MIN for the bootstrap capacitor: CCR = ARR would keep the high side on */
+static void pwmDutyFit(int *u, int *v, int *w, uint8_t measU, uint8_t measV, uint8_t measW) {
+  int hiU   = pwm_res - (measU ? pwm_margin : PWM_LOW_MIN);
+  int hiV   = pwm_res - (measV ? pwm_margin : PWM_LOW_MIN);
+  int hiW   = pwm_res - (measW ? pwm_margin : PWM_LOW_MIN);
+  int shift = MAX3(*u - hiU, *v - hiV, *w - hiW);
+
+  if (shift > 0) {
+    *u -= shift;
+    *v -= shift;
+    *w -= shift;
+  }
+  *u = CLAMP(*u, 0, hiU);
+  *v = CLAMP(*v, 0, hiV);
+  *w = CLAMP(*w, 0, hiW);
+}
+
+#if (OVERMOD_MAX > 100)
+/* Overmodulation: the FOC phase voltages (after the min-max injection) beyond the linear range are saturated to it, in timer counts
+ * around pwm_res / 2. Inside the linear range they pass unchanged, beyond it the output goes from the hexagon towards six-step.
+ * Block commutation is also used by FOC at low speed, it is not saturated */
+static void ovmClamp(const P *rtP, const DW *rtDW, int *u, int *v, int *w) {
+  int lo = MAX(pwm_margin, PWM_LOW_MIN) / 2;
+  int hi = pwm_res - lo;
+
+  if (rtP->z_ctrlTypSel != 2 || !rtDW->n_commDeacv_Mode || rtDW->dz_cntTrnsDet) {
+    return;
+  }
+  *u = CLAMP(*u, lo, hi);
+  *v = CLAMP(*v, lo, hi);
+  *w = CLAMP(*w, lo, hi);
+}
+#endif
+
+/* Called from the control ISR only, between two controller steps */
+static void pwmFreqApply(uint16_t freq) {
+  pwmFreq   = freq;
+  pwm_res   = 64000000 / 2 / freq;
+  pwm_scale = ((int32_t)pwm_res << 14) / PWM_RES_REF;
+
+  // ARR and CCR4 are preloaded: both timers switch at their next under/overflow, i.e. glitch-free at the PWM period boundary
+  RIGHT_TIM->ARR  = pwm_res;
+  LEFT_TIM->ARR   = pwm_res;
+  LEFT_TIM->CCR4  = pwm_res - ADC_INJ_TRIG_OFS;
+
+  #ifdef FEEDBACK_TELEMETRY
+  telemDiv  = freq / TELEM_RATE;
+  #endif
+
+  pwmFreqParamScale(&rtP_Left,  freq);
+  pwmFreqParamScale(&rtP_Right, freq);
+  nCascKp   = nCascKpRef;
+  nCascKi   = (uint16_t)paramScale(nCascKiRef,   PWM_FREQ_REF, freq);
+  accFf     = accFfRef;
+  accAdapt  = (uint16_t)paramScale(ACC_FF_ADAPT, PWM_FREQ_REF, freq);
+  #if (DOB_BW > 0)
+  dobFilt   = (uint16_t)((DOB_W << 16) / freq);
+  #endif
+  vqMaxScale(0);
+  vqMaxScale(1);
+}
+
+/* Capture the controller parameters (call it after the parameters are set in main) and request the initial PWM frequency */
+void pwmFreqInit(uint16_t freq) {
+  rtP_ref     = rtP_Left;
+  pwmFreq     = 0;
+  if (!pwmFreqSet(freq)) {
+    pwmFreqReq = PWM_FREQ;
+  }
+}
+
+/* Request a new PWM frequency. It is applied by the control ISR. Returns 0 if the frequency is out of range */
+uint8_t pwmFreqSet(uint16_t freq) {
+  if (freq < PWM_FREQ_MIN || freq > PWM_FREQ_MAX) {
+    return 0;
+  }
+  pwmFreqReq = freq;
+  return 1;
+}
+
+uint16_t pwmFreqGet(void) {
+  return pwmFreq;
+}
+
+/* Set a PI gain of both motors (see CTRL_GAIN_xxx in defines.h), designed for PWM_FREQ_REF. Call it after pwmFreqInit().
+ * The control ISR applies it with the PWM frequency scaling */
+void ctrlGainSet(uint8_t gain, uint16_t val) {
+  switch (gain) {
+    case CTRL_GAIN_ID_KP:   rtP_ref.cf_idKp     = val; break;
+    case CTRL_GAIN_ID_KI:   rtP_ref.cf_idKi     = val; break;
+    case CTRL_GAIN_IQ_KP:   rtP_ref.cf_iqKp     = val; break;
+    case CTRL_GAIN_IQ_KI:   rtP_ref.cf_iqKi     = val; break;
+    case CTRL_GAIN_N_KP:    rtP_ref.cf_nKp      = val; break;
+    case CTRL_GAIN_N_KI:    rtP_ref.cf_nKi      = val; break;
+    case CTRL_GAIN_NC_KP:   nCascKpRef          = val; break;
+    case CTRL_GAIN_NC_KI:   nCascKiRef          = val; break;
+    case CTRL_GAIN_ACC_FF:  accFfRef            = val; break;
+    default:                return;
+  }
+  ctrlGainUpd = 1;
+}
+
+uint16_t ctrlGainGet(uint8_t gain) {
+  switch (gain) {
+    case CTRL_GAIN_ID_KP:   return rtP_ref.cf_idKp;
+    case CTRL_GAIN_ID_KI:   return rtP_ref.cf_idKi;
+    case CTRL_GAIN_IQ_KP:   return rtP_ref.cf_iqKp;
+    case CTRL_GAIN_IQ_KI:   return rtP_ref.cf_iqKi;
+    case CTRL_GAIN_N_KP:    return rtP_ref.cf_nKp;
+    case CTRL_GAIN_N_KI:    return rtP_ref.cf_nKi;
+    case CTRL_GAIN_NC_KP:   return nCascKpRef;
+    case CTRL_GAIN_NC_KI:   return nCascKiRef;
+    case CTRL_GAIN_ACC_FF:  return accFfRef;
+  }
+  return 0;
+}
+
+/* Inertia gain of a motor including the online estimate (cascaded SPEED mode), in the format of CTRL_GAIN_ACC_FF */
+uint16_t accFfEstGet(uint8_t motor) {
+  return (uint16_t)CLAMP(accFf + (accEst[motor] >> 12), 0, 65535);
+}
+
+void motConstSet(uint16_t l, uint16_t flux, uint16_t r) {
+  motL    = l;
+  motFlux = flux;
+  motR    = r;
+}
+
+/* Decoupling and back-EMF feedforward coefficients for the actual battery voltage: the controller voltages are
+ * relative to it, Vd/Vq fixdt(1,16,4) = 32000 * sqrt(3) / 2 * V / Vbat (the modulator scales the phase voltages by 2 / sqrt(3)).
+ * With the bus voltage normalization (BAT_NORM_ENA) they are relative to the full battery voltage instead.
+ * Called from the main loop. With n_mot in rpm fixdt(1,16,4) and the currents in fixdt(1,16,4) of A2BIT_CONV per A,
+ * w = 2 pi / 960 * pp * n:
+ *   decoupBemf = w psi / n    fixdt(0,16,12), 74293  = 2 pi / 960 * 32000 * sqrt(3) / 2 * 2^12 * 100 / 10^6 * 1000
+ *   decoupL    = w L / (n i)  fixdt(0,16,28), 304305 = 2 pi / 960 * 2000 * sqrt(3) / 2 * 2^28 * 100 / 10^6
+ * and the load voltage feedforward of the SPEED mode (DOB_BW):
+ *   dobR       = R / i        fixdt(0,16,12), 709444 = 2000 * sqrt(3) / 2 * 2^12 * 100 / 1000
+ */
+void decoupUpdate(void) {
+  #if (BAT_NORM_ENA == 1)
+  uint64_t vBat = 420 * BAT_CELLS;                                                          // [V*100] BAT_FULL
+  #else
+  uint64_t vBat = (uint64_t)MAX(batVoltage, 1) * BAT_CALIB_REAL_VOLTAGE / BAT_CALIB_ADC;   // [V*100]
+  #endif
+  uint64_t pp   = (PWM_FREQ_REF * 10 + rtP_ref.cf_speedCoef / 2) / MAX(rtP_ref.cf_speedCoef, 1);  // pole pairs of the speed estimation
+
+  if (vBat == 0) {
+    return;
+  }
+  #if (DECOUP_ENA == 1)
+  decoupBemf           = (uint16_t)MIN(pp * motFlux * 74293 / (1000 * vBat), UINT16_MAX);
+  decoupL              = (uint16_t)MIN(pp * motL * 304305 / (A2BIT_CONV * vBat), UINT16_MAX);
+  #endif
+  #if (DOB_BW > 0)
+  dobR                 = (uint16_t)MIN(motR * 709444 / (A2BIT_CONV * vBat), UINT16_MAX);
+  #endif
+}
+
+#if (DT_COMP_ENA == 1)
+/* Current band of the dead time compensation for the actual battery voltage: a phase current below 2 Coss Vbat / Tdead charges
+ * the node capacitance without swinging it within the dead time. Called from the main loop.
+ *   [A2BIT_CONV] = 2 * Coss [pF] * Vbat [V*100] * A2BIT_CONV / (DEAD_TIME / 64 MHz) / 10^14
+ */
+void dtCompUpdate(void) {
+  uint64_t vBat = (uint64_t)MAX(batVoltage, 1) * BAT_CALIB_REAL_VOLTAGE / BAT_CALIB_ADC;   // [V*100]
+
+  dtCompBand = (int16_t)CLAMP(2ULL * DT_COMP_COSS * vBat * 64 * A2BIT_CONV / (DEAD_TIME * 100000000ULL), 1, INT16_MAX);
+}
+
+/* Dead time compensation of a phase in timer counts. The center aligned period is 2 * pwm_res timer ticks and the dead time delays
+ * the turn-on of the switch against the current: a current out of the bridge (> 0) loses DEAD_TIME ticks = DEAD_TIME / 2 counts
+ * of high side time, a current into the bridge gains them. Independent of the PWM frequency */
+static int dtComp(int16_t i) {
+  return CLAMP((int32_t)i * (DEAD_TIME / 2) / dtCompBand, -(DEAD_TIME / 2), DEAD_TIME / 2);
+}
+#endif
+
+/* Motor speed of the last controller step, rpm fixdt(1,16,4): its absolute value and its direction */
+static int32_t nMotFixdt(const DW *rtDW) {
+  return (rtDW->Divide11 < 0) ? -rtDW->UnitDelay4_DSTATE_e : rtDW->UnitDelay4_DSTATE_e;
+}
+
+// =================================
+// Cascaded SPEED mode
+// =================================
+/* Before the controller step of a motor: the cascaded SPEED mode (z_ctrlModReq 4) runs the controller in TORQUE mode. Its input
+ * target is replaced by the iq reference of the speed PI plus the inertia feedforward J / Kt * dn/dt of the input acceleration acc,
+ * from the speed, iq and iq limits of the previous step. The target and acc are scaled by n_max as in the SPEED mode. With DOB_BW
+ * the load current d of the observer is fed forward too. The PI integrator is limited to the iq limits minus the feedforward. It
+ * restarts outside of the TORQUE mode: motor disabled, mode change. The inertia estimate adapts J / Kt by the PI output (plus d)
+ * correlated with the acceleration, frozen at the iq limits */
+static void spdCascIn(uint8_t motor, ExtU *rtU, const P *rtP, const DW *rtDW, int acc) {
+  int32_t kN = (rtP->n_max << 5) / 125;                 // input target fixdt(1,16,4) to speed, fixdt(0,16,12) as in the controller
+  int32_t kI = MAX((rtP->i_max << 5) / 125, 1);         // to iq
+  int32_t lo = rtDW->Gain1;                             // iq limits
+  int32_t hi = rtDW->Divide1_a;
+  int32_t d  = 0;
+  int32_t dn, ff, err, pi, x;
+
+  if (rtU->z_ctrlModReq != 4) {
+    nCascInt[motor] = 0;
+    return;
+  }
+  rtU->z_ctrlModReq = 3;
+  if (rtDW->z_ctrlMod != 3) {                           // TORQUE mode not yet active
+    nCascInt[motor] = 0;
+    rtU->r_inpTgt   = 0;
+    return;
+  }
+  dn  = CLAMP((kN * acc) >> 12, -32767, 32767);         // dn/dt [rpm/s]
+  ff  = CLAMP((dn * CLAMP(accFf + (accEst[motor] >> 12), 0, 65535)) >> 8, lo, hi);
+  #if (DOB_BW > 0)
+  d   = dobD[motor];
+  ff  = CLAMP(ff + d, lo, hi);
+  #endif
+  err = CLAMP(((kN * CLAMP(rtU->r_inpTgt << 4, -16000, 16000)) >> 12) - nMotFixdt(rtDW), -32768, 32767);
+  nCascInt[motor] = (int32_t)CLAMP((int64_t)nCascInt[motor] + err * nCascKi, (int64_t)(lo - ff) * 65536, (int64_t)(hi - ff) * 65536);
+  pi  = CLAMP((nCascInt[motor] >> 16) + ((err * nCascKp) >> 12), lo - ff, hi - ff);
+
+  if (accAdapt != 0 && pi + ff < hi && pi + ff > lo) {
+    x             = CLAMP(((pi + d) * dn) >> 12, -32767, 32767);
+    accEst[motor] = CLAMP(accEst[motor] + ((x * accAdapt) >> 12), -((int32_t)accFf << 12), (65535 - (int32_t)accFf) << 12);
+  }
+  rtU->r_inpTgt   = (int16_T)(((pi + ff) << 8) / kI);
+}
+
+#if (DOB_BW > 0)
+// =================================
+// Load torque disturbance observer
+// =================================
+/* Load current of a motor after its controller step: d = Q iq - J / Kt * Q s n, Q = first order low pass with the bandwidth DOB_W,
+ * iq fixdt(1,16,4). J / Kt is the inertia gain of the cascaded SPEED mode with its estimate. From the filtered iq and the speed of
+ * the step, limited to the iq limits. Runs in the SPEED mode and in the cascaded SPEED mode. Outside of them (motor disabled, mode
+ * change) it restarts without load estimate and with Q n at the actual speed */
+static void dobStep(uint8_t motor, const P *rtP, const DW *rtDW, uint8_t modReq) {
+  int32_t n = nMotFixdt(rtDW);
+  int32_t x;
+
+  if (rtP->z_ctrlTypSel != 2 || !(rtDW->z_ctrlMod == 2 || (rtDW->z_ctrlMod == 3 && modReq == 4))) {
+    dobIq[motor] = 0;
+    dobN[motor]  = n * 65536;
+    dobD[motor]  = 0;
+    return;
+  }
+  x             = CLAMP(rtDW->Sum1[0] - (dobIq[motor] >> 16), -32767, 32767);
+  dobIq[motor] += x * dobFilt;
+  x             = CLAMP(n - (dobN[motor] >> 16), -32767, 32767);
+  dobN[motor]  += x * dobFilt;
+  x             = CLAMP((x * DOB_W) >> 4, -32767, 32767);   // Q s n = w (n - Q n) [rpm/s]
+  dobD[motor]   = (int16_t)CLAMP((dobIq[motor] >> 16) - ((x * accFfEstGet(motor)) >> 8), rtDW->Gain1, rtDW->Divide1_a);
+}
+#endif
+
+#if (DECOUP_ENA == 1 || DOB_BW > 0)
 // =================================
-// DMA interrupt frequency =~ 16 kHz
+// dq voltage feedforward
 // =================================
+/* Voltage feedforward of a motor after its controller step, fixdt(1,16,4), with the sinusoidal FOC commutation:
+ * - DECOUP_ENA: decoupling and back-EMF, Vd_ff = -w L iq in the SPEED and TORQUE modes, Vq_ff = w L id + w psi in the TORQUE mode
+ *   (the SPEED mode has no q axis current loop). From the speed and the filtered dq currents of the step
+ * - DOB_BW: load voltage Vq_ff = R d of the observer in the SPEED mode, the speed PI only corrects the remaining error
+ * Limited to 3/4 of the voltage limits: the PIs keep the rest. Their limits of the next steps are narrowed by the feedforward,
+ * Vd_max here and the Vq_max table in vqMaxScale(). The VOLTAGE mode has none: Vd_max is its input scale */
+static void vFfUpdate(uint8_t motor, P *rtP, const DW *rtDW) {
+  int32_t vqLim = ((vqMax * batNormRatio) >> 14) * 3 / 4;
+  #if (DECOUP_ENA == 1)
+  int32_t vdLim = vdLin * 3 / 4;
+  int32_t n     = nMotFixdt(rtDW);
+  int32_t x;
+  #endif
+
+  vdFf[motor] = 0;
+  vqFf[motor] = 0;
+  if (rtP->z_ctrlTypSel == 2 && rtDW->n_commDeacv_Mode && !rtDW->dz_cntTrnsDet && rtDW->z_ctrlMod >= 2) {   // SPEED, TORQUE
+    #if (DECOUP_ENA == 1)
+    x           = CLAMP((n * rtDW->Sum1[0]) >> 14, -32767, 32767);   // n iq, fixdt(1,16,-6)
+    vdFf[motor] = (int16_t)CLAMP(-((x * decoupL) >> 14), -vdLim, vdLim);
+    if (rtDW->z_ctrlMod != 2) {
+      x           = CLAMP((n * rtDW->Sum1[1]) >> 14, -32767, 32767); // n id
+      vqFf[motor] = (int16_t)CLAMP(((x * decoupL) >> 14) + ((n * decoupBemf) >> 12), -vqLim, vqLim);
+    }
+    #endif
+    #if (DOB_BW > 0)
+    if (rtDW->z_ctrlMod == 2) {
+      vqFf[motor] = (int16_t)CLAMP((dobD[motor] * dobR) >> 12, -vqLim, vqLim);
+    }
+    #endif
+  }
+  rtP->Vd_max = (int16_T)(vdLin - ABS(vdFf[motor]));
+}
+
+/* Add the feedforward to the controller outputs: inverse Park at the electrical angle of the step with the sin/cos tables of the
+ * controller (2 deg steps), Clarke and the output gain of the modulator, then the min-max injection is redone */
+static void vFfOut(uint8_t motor, const ExtY *rtY, int *u, int *v, int *w) {
+  int32_t vd = vdFf[motor];
+  int32_t vq = vqFf[motor];
+  int32_t k  = CLAMP(rtY->a_elecAngle >> 1, 0, 180);
+  int32_t a, b, z;
+
+  if (vd == 0 && vq == 0) {
+    return;
+  }
+  a   = ((vd * rtConstP.r_cos_M1_Table[k]) >> 14) - ((vq * rtConstP.r_sin_M1_Table[k]) >> 14);   // alpha
+  b   = ((vd * rtConstP.r_sin_M1_Table[k]) >> 14) + ((vq * rtConstP.r_cos_M1_Table[k]) >> 14);   // beta
+  b   = ((b * 14189) >> 14) - a / 2;                    // sqrt(3) / 2 beta - alpha / 2
+  *u += (a * 18919) >> 18;                              // 2 / sqrt(3), fixdt(1,16,4) to the duty cycle
+  *v += (b * 18919) >> 18;
+  *w += ((-a - b) * 18919) >> 18;
+  z   = (MAX3(*u, *v, *w) + MIN3(*u, *v, *w)) / 2;
+  *u -= z;
+  *v -= z;
+  *w -= z;
+}
+#endif
+
+// =================================
+// Hall sensor calibration
+// =================================
+/* The controller keeps its fixed table vec_hallToPos and its nominal 60 deg hall edges. The calibration is applied around it:
+ * the hall code is replaced by the code that the default table maps to the calibrated sector, and the edge offset
+ * rotates the measured currents by -ofs before the controller step and its sinusoidal outputs by +ofs after it.
+ * The offset of a sector is the one of its entering edge in forward rotation, of its leaving edge in reverse (Switch2_e) */
+static uint8_t hallCode[2][8]   = {{0, 1, 2, 3, 4, 5, 6, 7}, {0, 1, 2, 3, 4, 5, 6, 7}};  // code given to the controller per sensor code
+static int8_t  hallPos[2][8];           // calibrated sector of the sensor code
+static int16_t hallCos[2][6];           // cos and sin of the edge offsets, Q14
+static int16_t hallSin[2][6];
+static uint8_t hallOfsEna[2]    = {0, 0};
+static uint8_t hallIdx[2]       = {6, 6};   // edge offset of the actual controller step, 6 = none
+
+/* Rotate the phase values u, v, w (sum 0) by the angle of cos cs and sin sn, Q14. 9459 = 2^14 / sqrt(3), 28378 = sqrt(3) * 2^14 */
+static void phaseRotate(int *u, int *v, int *w, int32_t cs, int32_t sn) {
+  int32_t a  = (2 * *u - *v - *w) / 3;
+  int32_t b  = ((*v - *w) * 9459) >> 14;
+  int32_t a2 = (a * cs - b * sn) >> 14;
+  int32_t b2 = (((a * sn + b * cs) >> 14) * 28378) >> 14;   // sqrt(3) * beta
+
+  *u = a2;
+  *v = (b2 - a2) / 2;
+  *w = (-b2 - a2) / 2;
+}
+
+/* Before the controller step, after Commission_Step() (the commissioning reads the sensor codes) */
+static void hallCalIn(uint8_t motor, ExtU *rtU, const DW *rtDW) {
+  uint8_t code = (uint8_t)((rtU->b_hallA << 2) | (rtU->b_hallB << 1) | rtU->b_hallC);
+  uint8_t c    = hallCode[motor][code];
+  int     ia, ib, ic;
+
+  rtU->b_hallA   = (c >> 2) & 1;
+  rtU->b_hallB   = (c >> 1) & 1;
+  rtU->b_hallC   = c & 1;
+  hallIdx[motor] = 6;
+  if (!hallOfsEna[motor] || code == 0 || code == 7) {
+    return;
+  }
+  hallIdx[motor] = (rtDW->Switch2_e == 1) ? (uint8_t)hallPos[motor][code] : (uint8_t)((hallPos[motor][code] + 1) % 6);
+  ia = rtU->i_phaAB;
+  ib = rtU->i_phaBC;
+  ic = -ia - ib;
+  phaseRotate(&ia, &ib, &ic, hallCos[motor][hallIdx[motor]], -hallSin[motor][hallIdx[motor]]);
+  rtU->i_phaAB   = (int16_T)ia;
+  rtU->i_phaBC   = (int16_T)ib;
+}
+
+/* After the controller step: rotate the sinusoidal outputs (SIN, FOC) and redo the min-max injection. Block commutation is
+ * also used by SIN and FOC at low speed, it only needs the sector */
+static void hallCalOut(uint8_t motor, const P *rtP, const DW *rtDW, int *u, int *v, int *w) {
+  uint8_t k = hallIdx[motor];
+  int     z;
+
+  if (k > 5 || rtP->z_ctrlTypSel == 0 || !rtDW->n_commDeacv_Mode || rtDW->dz_cntTrnsDet) {
+    return;
+  }
+  phaseRotate(u, v, w, hallCos[motor][k], hallSin[motor][k]);
+  z   = (MAX3(*u, *v, *w) + MIN3(*u, *v, *w)) / 2;
+  *u -= z;
+  *v -= z;
+  *w -= z;
+}
+
+/* Set the hall calibration of a motor. Call it with the motor at rest: the control ISR uses the tables directly.
+ * hallToPos: sector of each hall code, in the format of vec_hallToPos. ofs: edge offsets fixdt(1,16,6) within +/- 30 deg.
+ * cos and sin by their series: x = ofs * pi / 180 / 64 * 2^14 rad = ofs * 4.468, Q14 */
+void hallCalSet(uint8_t motor, const int8_t *hallToPos, const int16_t *ofs) {
+  int32_t x, x2;
+  uint8_t ena = 0;
+
+  hallOfsEna[motor] = 0;
+  for (uint8_t c = 0; c < 8; c++) {
+    hallCode[motor][c] = c;
+    hallPos[motor][c]  = hallToPos[c];
+    for (uint8_t k = 1; k < 7 && c > 0 && c < 7; k++) {
+      if (rtConstP.vec_hallToPos_Value[k] == hallToPos[c]) {
+        hallCode[motor][c] = k;
+      }
+    }
+  }
+  for (uint8_t p = 0; p < 6; p++) {
+    x  = (int32_t)CLAMP(ofs[p], -23040 / 12, 23040 / 12) * 4468 / 1000;
+    x2 = (x * x) >> 14;
+    hallSin[motor][p] = (int16_t)((x * (16384 - x2 * (16384 - x2 / 20) / (6 * 16384))) >> 14);   // x (1 - x^2/6 (1 - x^2/20))
+    hallCos[motor][p] = (int16_t)(16384 - x2 * (16384 - x2 / 12) / (2 * 16384));             // 1 - x^2/2 (1 - x^2/12)
+    ena |= (ofs[p] != 0);
+  }
+  hallOfsEna[motor] = ena;
+}
+
+// =============================================================
+// Housekeeping DMA interrupt frequency =~ 16 kHz / ADC_HK_DIV
+// =============================================================
 void DMA1_Channel1_IRQHandler(void) {
 
   DMA1->IFCR = DMA_IFCR_CTCIF1;
+
+  #ifdef CONTROL_BUS_USART2
+  Bus_Tick();
+  #endif
+
+  #ifdef CONTROL_ADC
+  // Average the input ADCs over every sample instead of reading a single sample in the main loop
+  adc1Sum += adc_buffer.l_tx2;
+  adc2Sum += adc_buffer.l_rx2;
+  if (++adcAvgCnt >= (1 << ADC_AVG_SHIFT)) {
+    adc1Avg   = (uint16_t)(adc1Sum >> ADC_AVG_SHIFT);
+    adc2Avg   = (uint16_t)(adc2Sum >> ADC_AVG_SHIFT);
+    adc1Sum   = 0;
+    adc2Sum   = 0;
+    adcAvgCnt = 0;
+  }
+  #endif
+}
+
+// ==============================================================
+// ADC injected conversion interrupt frequency =~ 16 kHz
+// Runs right after the Phase current samples are taken
+// ==============================================================
+void ADC1_2_IRQHandler(void) {
+
+  uint32_t isrStart = DWT->CYCCNT;
+  ADC1->SR = ~ADC_SR_JEOC;   // clear the flag (rc_w0)
   // HAL_GPIO_WritePin(LED_PORT, LED_PIN, 1);
   // HAL_GPIO_TogglePin(LED_PORT, LED_PIN);
 
+  #if (CURR_OVERSAMPLE == 1)
+  // Two injected sequences per PWM period, triggered at ARR - CURR_OS_DELTA counting up and counting down.
+  // The counter peak (update event) lies between the first trigger and its end of conversion: UIF set = first sequence.
+  // The flag keeps the pairing right after a late ISR entry, a second sequence is only used after a first one
+  if (LEFT_TIM->SR & TIM_SR_UIF) {
+    LEFT_TIM->SR  = ~TIM_SR_UIF;   // clear the flag (rc_w0)
+    currSmpFirst  = 1;
+    currSmp[0]    = (uint16_t)ADC1->JDR1;
+    currSmp[1]    = (uint16_t)ADC1->JDR2;
+    currSmp[2]    = (uint16_t)ADC1->JDR3;
+    currSmp[3]    = (uint16_t)ADC2->JDR1;
+    currSmp[4]    = (uint16_t)ADC2->JDR2;
+    currSmp[5]    = (uint16_t)ADC2->JDR3;
+    isrCyclesAcc  = DWT->CYCCNT - isrStart;
+    return;
+  }
+  if (!currSmpFirst) {             // the first sequence of this period was missed
+    return;
+  }
+  currSmpFirst   = 0;
+  adc_buffer.dcr = (uint16_t)((currSmp[0] + ADC1->JDR1) >> 1);
+  adc_buffer.rl1 = (uint16_t)((currSmp[1] + ADC1->JDR2) >> 1);
+  adc_buffer.rr1 = (uint16_t)((currSmp[2] + ADC1->JDR3) >> 1);
+  adc_buffer.dcl = (uint16_t)((currSmp[3] + ADC2->JDR1) >> 1);
+  adc_buffer.rl2 = (uint16_t)((currSmp[4] + ADC2->JDR2) >> 1);
+  adc_buffer.rr2 = (uint16_t)((currSmp[5] + ADC2->JDR3) >> 1);
+  #else
+  // Copy the injected results to the ADC buffer: ADC1 = master, ADC2 = slave
+  adc_buffer.dcr = (uint16_t)ADC1->JDR1;
+  adc_buffer.rl1 = (uint16_t)ADC1->JDR2;
+  adc_buffer.rr1 = (uint16_t)ADC1->JDR3;
+  adc_buffer.dcl = (uint16_t)ADC2->JDR1;
+  adc_buffer.rl2 = (uint16_t)ADC2->JDR2;
+  adc_buffer.rr2 = (uint16_t)ADC2->JDR3;
+  #endif
+
+  // Start the housekeeping sequence (battery, temperature, ADC inputs). It is transferred by DMA1_Channel1
+  if (++adcHkCnt >= ADC_HK_DIV) {
+    adcHkCnt = 0;
+    ADC1->CR2 |= ADC_CR2_SWSTART;
+  }
+
   if(offsetcount < 2000) {  // calibrate ADC offsets
     offsetcount++;
     offsetrl1 = (adc_buffer.rl1 + offsetrl1) / 2;
@@ -151,6 +771,31 @@ void DMA1_Channel1_IRQHandler(void) {
   }
   OverrunFlag = true;
 
+  /* Apply a new PWM frequency or new controller gains between two controller steps */
+  if (pwmFreqReq != pwmFreq || (ctrlGainUpd && pwmFreq)) {
+    ctrlGainUpd = 0;
+    if (accFf != accFfRef) {                        // new inertia gain: restart the estimation from it
+      accEst[0] = 0;
+      accEst[1] = 0;
+    }
+    pwmFreqApply(pwmFreqReq);
+  }
+
+  /* Bus voltage normalization: the controller voltages are relative to the full battery. The duty cycle outputs are divided by the
+   * battery voltage ratio, and the Vq_max circle follows it. Vd_max stays, it is the VOLTAGE mode input scale (pwmFreqParamScale()) */
+  int32_t dutyScale = pwm_scale;
+  #if (BAT_NORM_ENA == 1)
+  filtLowPass16(adc_buffer.batt1, BAT_NORM_FILT, &batNormFixdt);
+  batNormRatio = (uint16_t)CLAMP(((int32_t)batNormFixdt << 10) / (BAT_FULL), 4096, 16384);   // 25 % .. 100 %
+  dutyScale    = (pwm_scale << 14) / batNormRatio;
+  #endif
+  /* The Vq_max table of one motor every 8 PWM periods: battery voltage ratio and q axis voltage feedforward */
+  #if (BAT_NORM_ENA == 1 || DECOUP_ENA == 1 || DOB_BW > 0)
+  if ((++vqMaxCnt & 0x07) == 0 && pwmFreq) {      // pwmFreq: rtP_ref is captured
+    vqMaxScale((vqMaxCnt & 0x08) ? 1 : 0);
+  }
+  #endif
+
   /* Make sure to stop BOTH motors in case of an error */
   enableFin = enable && !errCode_Left && !errCode_Right;
  
@@ -170,7 +815,12 @@ void DMA1_Channel1_IRQHandler(void) {
     rtU_Left.i_phaAB      = curL_phaA;
     rtU_Left.i_phaBC      = curL_phaB;
     rtU_Left.i_DCLink     = curL_DC;    
-    
+    spdCascIn(0, &rtU_Left, &rtP_Left, &rtDW_Left, accl);
+    #ifdef COMMISSION_ENABLE
+    Commission_Step(COMM_MOTOR_LEFT, &rtU_Left, &rtY_Left);
+    #endif
+    hallCalIn(0, &rtU_Left, &rtDW_Left);
+
     /* Step the controller */
     BLDC_controller_step(rtM_Left);
 
@@ -178,14 +828,37 @@ void DMA1_Channel1_IRQHandler(void) {
     ul            = rtY_Left.DC_phaA;
     vl            = rtY_Left.DC_phaB;
     wl            = rtY_Left.DC_phaC;
+    #if (DOB_BW > 0)
+    dobStep(0, &rtP_Left, &rtDW_Left, ctrlModReq);
+    #endif
+    #if (DECOUP_ENA == 1 || DOB_BW > 0)
+    vFfUpdate(0, &rtP_Left, &rtDW_Left);
+    vFfOut(0, &rtY_Left, &ul, &vl, &wl);
+    #endif
+    hallCalOut(0, &rtP_Left, &rtDW_Left, &ul, &vl, &wl);
+    #ifdef COMMISSION_ENABLE
+    Commission_Output(COMM_MOTOR_LEFT, &ul, &vl, &wl);
+    #endif
     errCode_Left  = rtY_Left.z_errCode;
   // motSpeedLeft = rtY_Left.n_mot;
   // motAngleLeft = rtY_Left.a_elecAngle;
 
     /* Apply commands */
-    LEFT_TIM->LEFT_TIM_U    = (uint16_t)CLAMP(ul + pwm_res / 2, pwm_margin, pwm_res-pwm_margin);
-    LEFT_TIM->LEFT_TIM_V    = (uint16_t)CLAMP(vl + pwm_res / 2, pwm_margin, pwm_res-pwm_margin);
-    LEFT_TIM->LEFT_TIM_W    = (uint16_t)CLAMP(wl + pwm_res / 2, pwm_margin, pwm_res-pwm_margin);
+    ul                      = ((ul * dutyScale) >> 14) + pwm_res / 2;  // scale to the actual PWM resolution and battery voltage
+    vl                      = ((vl * dutyScale) >> 14) + pwm_res / 2;
+    wl                      = ((wl * dutyScale) >> 14) + pwm_res / 2;
+    #if (OVERMOD_MAX > 100)
+    ovmClamp(&rtP_Left, &rtDW_Left, &ul, &vl, &wl);
+    #endif
+    #if (DT_COMP_ENA == 1)
+    ul                     += dtComp(curL_phaA);
+    vl                     += dtComp(curL_phaB);
+    wl                     += dtComp(-curL_phaA - curL_phaB);
+    #endif
+    pwmDutyFit(&ul, &vl, &wl, 1, 1, 0);                 // phase A and B currents measured
+    LEFT_TIM->LEFT_TIM_U    = (uint16_t)ul;
+    LEFT_TIM->LEFT_TIM_V    = (uint16_t)vl;
+    LEFT_TIM->LEFT_TIM_W    = (uint16_t)wl;
   // =================================================================
   
 
@@ -205,6 +878,11 @@ void DMA1_Channel1_IRQHandler(void) {
     rtU_Right.i_phaAB       = curR_phaB;
     rtU_Right.i_phaBC       = curR_phaC;
     rtU_Right.i_DCLink      = curR_DC;
+    spdCascIn(1, &rtU_Right, &rtP_Right, &rtDW_Right, accr);
+    #ifdef COMMISSION_ENABLE
+    Commission_Step(COMM_MOTOR_RIGHT, &rtU_Right, &rtY_Right);
+    #endif
+    hallCalIn(1, &rtU_Right, &rtDW_Right);
 
     /* Step the controller */
     BLDC_controller_step(rtM_Right);
@@ -213,19 +891,67 @@ void DMA1_Channel1_IRQHandler(void) {
     ur            = rtY_Right.DC_phaA;
     vr            = rtY_Right.DC_phaB;
     wr            = rtY_Right.DC_phaC;
+    #if (DOB_BW > 0)
+    dobStep(1, &rtP_Right, &rtDW_Right, ctrlModReq);
+    #endif
+    #if (DECOUP_ENA == 1 || DOB_BW > 0)
+    vFfUpdate(1, &rtP_Right, &rtDW_Right);
+    vFfOut(1, &rtY_Right, &ur, &vr, &wr);
+    #endif
+    hallCalOut(1, &rtP_Right, &rtDW_Right, &ur, &vr, &wr);
+    #ifdef COMMISSION_ENABLE
+    Commission_Output(COMM_MOTOR_RIGHT, &ur, &vr, &wr);
+    #endif
     errCode_Right = rtY_Right.z_errCode;
  // motSpeedRight = rtY_Right.n_mot;
  // motAngleRight = rtY_Right.a_elecAngle;
 
     /* Apply commands */
-    RIGHT_TIM->RIGHT_TIM_U  = (uint16_t)CLAMP(ur + pwm_res / 2, pwm_margin, pwm_res-pwm_margin);
-    RIGHT_TIM->RIGHT_TIM_V  = (uint16_t)CLAMP(vr + pwm_res / 2, pwm_margin, pwm_res-pwm_margin);
-    RIGHT_TIM->RIGHT_TIM_W  = (uint16_t)CLAMP(wr + pwm_res / 2, pwm_margin, pwm_res-pwm_margin);
+    ur                      = ((ur * dutyScale) >> 14) + pwm_res / 2;  // scale to the actual PWM resolution and battery voltage
+    vr                      = ((vr * dutyScale) >> 14) + pwm_res / 2;
+    wr                      = ((wr * dutyScale) >> 14) + pwm_res / 2;
+    #if (OVERMOD_MAX > 100)
+    ovmClamp(&rtP_Right, &rtDW_Right, &ur, &vr, &wr);
+    #endif
+    #if (DT_COMP_ENA == 1)
+    ur                     += dtComp(-curR_phaB - curR_phaC);
+    vr                     += dtComp(curR_phaB);
+    wr                     += dtComp(curR_phaC);
+    #endif
+    pwmDutyFit(&ur, &vr, &wr, 0, 1, 1);                 // phase B and C currents measured
+    RIGHT_TIM->RIGHT_TIM_U  = (uint16_t)ur;
+    RIGHT_TIM->RIGHT_TIM_V  = (uint16_t)vr;
+    RIGHT_TIM->RIGHT_TIM_W  = (uint16_t)wr;
   // =================================================================
 
+  #ifdef CAPTURE_ENABLE
+  Capture_Sample();
+  #endif
+
+  #ifdef FEEDBACK_TELEMETRY
+  if (++telemCnt >= telemDiv) {
+    telemCnt = 0;
+    Telemetry_Sample();
+  }
+  #endif
+
   /* Indicate task complete */
   OverrunFlag = false;
  
  // ###############################################################################
 
+  // Measure the ISR load. DWT->CYCCNT is enabled in main.c
+  #if (CURR_OVERSAMPLE == 1)
+  isrCycles     = isrCyclesAcc + (DWT->CYCCNT - isrStart);
+  #else
+  isrCycles     = DWT->CYCCNT - isrStart;
+  #endif
+  isrCyclesMax  = MAX(isrCyclesMax, isrCycles);
+
+  #ifdef CAPTURE_ENABLE
+  if (isrCycles > 2U * pwm_res) {   // longer than one PWM period (64 MHz / PWM frequency = 2 * pwm_res cycles)
+    Capture_Trigger(CAP_TRIG_OVERRUN);
+  }
+  #endif
+
 }
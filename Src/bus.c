@@ -0,0 +1,190 @@
+/*
+* This file implements the RS-485 bus node: half-duplex driver enable,
+* reception from the USART2 RX DMA buffer and slotted replies, see bus.h.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stm32f1xx_hal.h"
+#include "defines.h"
+#include "config.h"
+#include "bus.h"
+#include "serial.h"
+#include "BLDC_controller.h"
+#include "rtwtypes.h"
+
+#ifdef CONTROL_BUS_USART2
+
+extern ExtY rtY_Left;
+extern ExtY rtY_Right;
+extern uint8_t errCode_Left, errCode_Right;
+extern int16_t batVoltage;
+
+static BusNode           busNode;
+static uint8_t           busTxBuf[BUS_FRAME_SIZE(BUS_STATUS_LEN)];
+static volatile uint8_t  busTxActive  = 0;          // driver enabled, waiting for the end of the reply
+static volatile uint32_t busIdleStamp = 0;          // DWT->CYCCNT at the last idle line, one character after a frame
+static volatile uint8_t  busIdleNew   = 0;
+static uint32_t          cyclesPerUs;
+
+static volatile BusCmd   busCmd;                    // command for the main loop
+static volatile uint8_t  busCmdNew    = 0;
+#if (BUS_SYNC == 1)
+static BusCmd            busCmdLatched;             // command latched by the last sync, applied at busSyncAt
+static uint8_t           busCmdLatchedNew = 0;
+static volatile uint32_t busSyncAt;                 // start of the main loop iteration that applies the latched command
+static volatile uint8_t  busSyncReq   = 0;
+static uint32_t          busLoopAt;                 // start of the current main loop iteration
+#endif
+
+void Bus_Init(void) {
+  GPIO_InitTypeDef GPIO_InitStruct;
+
+  HAL_GPIO_WritePin(BUS_DE_PORT, BUS_DE_PIN, GPIO_PIN_RESET);
+  GPIO_InitStruct.Pin   = BUS_DE_PIN;
+  GPIO_InitStruct.Mode  = GPIO_MODE_OUTPUT_PP;
+  GPIO_InitStruct.Pull  = GPIO_NOPULL;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+  HAL_GPIO_Init(BUS_DE_PORT, &GPIO_InitStruct);
+
+  // The time base is the DWT cycle counter, enabled in main.c
+  cyclesPerUs = SystemCoreClock / 1000000;
+  busNodeInit(&busNode, BUS_ADDRESS, cyclesPerUs, BUS_SLOT_US * cyclesPerUs, BUS_GUARD_US * cyclesPerUs);
+
+  // Idle line interrupt: time stamp of the end of the received frames
+  USART2->CR1 |= USART_CR1_IDLEIE;
+  HAL_NVIC_SetPriority(USART2_IRQn, 1, 1);
+  HAL_NVIC_EnableIRQ(USART2_IRQn);
+
+  #if (BUS_SYNC == 1)
+  busLoopAt = DWT->CYCCNT;
+  #endif
+}
+
+void USART2_IRQHandler(void) {
+  if (USART2->SR & USART_SR_IDLE) {
+    (void)USART2->DR;                               // SR then DR read clears IDLE. The data is taken by the RX DMA
+    busIdleStamp  = DWT->CYCCNT;
+    busIdleNew    = 1;
+  }
+}
+
+/* Called from the housekeeping interrupt */
+void Bus_Tick(void) {
+  BusStatus status;
+  uint32_t  now = DWT->CYCCNT;
+  uint16_t  len;
+  uint8_t   c;
+
+  // Parse once the line is idle: all nodes use the same reference, the end of the frame
+  if (busIdleNew) {
+    busIdleNew = 0;
+    while (Serial_Read(&serialPort2, &c)) {
+      busNodeRx(&busNode, c, busIdleStamp);
+    }
+  }
+
+  if (busNode.cmdNew) {
+    busNode.cmdNew = 0;
+    #if (BUS_SYNC == 1)
+      busCmdLatched     = busNode.cmd;              // pending until the next sync
+      busCmdLatchedNew  = 1;
+    #else
+      busCmd            = busNode.cmd;
+      busCmdNew         = 1;
+    #endif
+  }
+
+  #if (BUS_SYNC == 1)
+  if (busNode.syncNew) {
+    busNode.syncNew = 0;
+    if (busCmdLatchedNew) {
+      busCmdLatchedNew  = 0;
+      busCmd            = busCmdLatched;
+      busSyncAt         = busNode.sync.localTicks + BUS_SYNC_DELAY_US * cyclesPerUs;
+      busSyncReq        = 1;
+    }
+  }
+  #endif
+
+  // Release the line once the last stop bit is out
+  if (busTxActive && serialPort2.txChunk == 0 && (USART2->SR & USART_SR_TC)) {
+    HAL_GPIO_WritePin(BUS_DE_PORT, BUS_DE_PIN, GPIO_PIN_RESET);
+    busTxActive = 0;
+  }
+
+  if (busNodeReplyDue(&busNode, now) && !busTxActive) {
+    status.speedL     = rtY_Left.n_mot;
+    status.speedR     = rtY_Right.n_mot;
+    status.batVoltage = batVoltage * BAT_CALIB_REAL_VOLTAGE / BAT_CALIB_ADC;
+    status.errCodeL   = errCode_Left;
+    status.errCodeR   = errCode_Right;
+    status.skewUs     = busNode.sync.skewUs;
+    status.driftPpm   = (int16_t)(busNode.sync.drift >> 8);
+    len = busNodeReply(&busNode, busTxBuf, &status);
+
+    HAL_GPIO_WritePin(BUS_DE_PORT, BUS_DE_PIN, GPIO_PIN_SET);
+    USART2->SR  = ~USART_SR_TC;                     // rc_w0: cleared here, set again after the last byte
+    busTxActive = 1;
+    Serial_Write(&serialPort2, busTxBuf, len);
+  }
+}
+
+#if (BUS_SYNC == 1)
+/* Replaces the main loop delay: the main loop iterations run every DELAY_IN_MAIN_LOOP ms of host time (the period
+ * is corrected with the drift estimate) and a sync moves them to BUS_SYNC_DELAY_US after the sync frame. So all
+ * boards take over the latched command in the same iteration, at the same moment */
+void Bus_WaitLoop(void) {
+  uint32_t period = DELAY_IN_MAIN_LOOP * 1000 * cyclesPerUs;
+  uint8_t  apply  = 0;
+
+  period    += (int32_t)((int64_t)period * busNode.sync.drift / 1000000) >> 8;
+  busLoopAt += period;                              // busLoopAt: start of the previous iteration
+
+  do {                                              // a sync received while waiting moves this iteration
+    __disable_irq();
+    if (busSyncReq) {
+      busSyncReq  = 0;
+      busLoopAt   = busSyncAt;
+      apply       = 1;
+    }
+    __enable_irq();
+  } while ((int32_t)(DWT->CYCCNT - busLoopAt) < 0);
+
+  if (apply) {
+    busCmdNew   = 1;
+  }
+  if ((uint32_t)(DWT->CYCCNT - busLoopAt) > period) {  // iteration overrun: restart the schedule
+    busLoopAt   = DWT->CYCCNT;
+  }
+}
+#endif
+
+/* Called from the main loop. Returns 1 and the last command if a new one was received.
+ * With BUS_SYNC, a command is new only in the main loop iteration aligned on the sync that applies it */
+uint8_t Bus_GetCmd(int16_t *steer, int16_t *speed) {
+  uint8_t isNew;
+
+  __disable_irq();
+  isNew           = busCmdNew;
+  *steer          = busCmd.steer;
+  *speed          = busCmd.speed;
+  busCmdNew       = 0;
+  __enable_irq();
+  return isNew;
+}
+
+#endif
@@ -0,0 +1,197 @@
+/*
+* This file implements the core of the multi-drop RS-485 bus protocol:
+* framing, addressing and reply slot scheduling, see bus_proto.h.
+* It has no hardware dependency and is also built by 03_Tools/bus_sim.c.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "bus_proto.h"
+#include "crc.h"
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+static uint16_t get16(const uint8_t *p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+#define CLAMP_I16(x)  ((x) < -32768 ? -32768 : ((x) > 32767 ? 32767 : (x)))
+
+/* Build a frame in buf, which must hold BUS_FRAME_SIZE(len) bytes. Returns the frame size */
+uint16_t busFrame(uint8_t *buf, uint8_t dst, uint8_t src, uint8_t type, const uint8_t *payload, uint8_t len) {
+  put16(&buf[0], BUS_START_FRAME);
+  buf[2] = dst;
+  buf[3] = src;
+  buf[4] = type;
+  buf[5] = len;
+  memcpy(&buf[BUS_HEADER_SIZE], payload, len);
+  put16(&buf[BUS_HEADER_SIZE + len], crc16(0xFFFF, buf, BUS_HEADER_SIZE + len));
+  return BUS_FRAME_SIZE(len);
+}
+
+/* Feed one received byte. Returns 1 when rx->buf holds a complete frame with a valid CRC */
+uint8_t busRx(BusRx *rx, uint8_t c) {
+  uint16_t size;
+
+  rx->buf[rx->len++] = c;
+
+  // Synchronize on the start frame, byte by byte
+  if ((rx->len == 1 && c != (BUS_START_FRAME & 0xFF)) ||
+      (rx->len == 2 && c != (BUS_START_FRAME >> 8))) {
+    rx->len    = (c == (BUS_START_FRAME & 0xFF));
+    rx->buf[0] = c;
+    return 0;
+  }
+  if (rx->len == BUS_HEADER_SIZE && rx->buf[5] > BUS_MAX_PAYLOAD) {
+    rx->len = 0;                                          // corrupted length: resynchronize
+    return 0;
+  }
+  if (rx->len < BUS_HEADER_SIZE) {
+    return 0;
+  }
+
+  size = BUS_FRAME_SIZE(rx->buf[5]);
+  if (rx->len < size) {
+    return 0;
+  }
+  rx->len = 0;
+  if (crc16(0xFFFF, rx->buf, size - 2) != get16(&rx->buf[size - 2])) {
+    rx->crcErr++;
+    return 0;
+  }
+  return 1;
+}
+
+void busStatusPack(uint8_t *p, const BusStatus *status) {
+  put16(&p[0], (uint16_t)status->speedL);
+  put16(&p[2], (uint16_t)status->speedR);
+  put16(&p[4], (uint16_t)status->batVoltage);
+  p[6] = status->errCodeL;
+  p[7] = status->errCodeR;
+  put16(&p[8],  (uint16_t)status->skewUs);
+  put16(&p[10], (uint16_t)status->driftPpm);
+}
+
+void busStatusUnpack(BusStatus *status, const uint8_t *p) {
+  status->speedL      = (int16_t)get16(&p[0]);
+  status->speedR      = (int16_t)get16(&p[2]);
+  status->batVoltage  = (int16_t)get16(&p[4]);
+  status->errCodeL    = p[6];
+  status->errCodeR    = p[7];
+  status->skewUs      = (int16_t)get16(&p[8]);
+  status->driftPpm    = (int16_t)get16(&p[10]);
+}
+
+/* ticksPerUs is the resolution of the now argument of busNodeRx() and busNodeReplyDue(), slotTicks and turnTicks
+ * are in the same unit */
+void busNodeInit(BusNode *node, uint8_t addr, uint32_t ticksPerUs, uint32_t slotTicks, uint32_t turnTicks) {
+  memset(node, 0, sizeof(*node));
+  node->addr        = addr;
+  node->ticksPerUs  = ticksPerUs;
+  node->slotTicks   = slotTicks;
+  node->turnTicks   = turnTicks;
+}
+
+/* Update the clock estimate with a sync received at local time now. The residual error of the prediction made
+ * with the drift estimate is the skew, it is integrated into the drift estimate */
+static void busSyncUpdate(BusNode *node, uint32_t hostUs, uint32_t now) {
+  BusSync *sync      = &node->sync;
+  int32_t  hostDelta = (int32_t)(hostUs - sync->hostUs);
+  int64_t  expected;
+  int32_t  err;
+
+  if (sync->count > 0 && hostDelta > 0 && hostDelta < BUS_SYNC_MAX_GAP_US) {
+    expected      = (int64_t)hostDelta * node->ticksPerUs;
+    expected     += (expected * sync->drift / 1000000) >> 8;
+    err           = (int32_t)((int64_t)(uint32_t)(now - sync->localTicks) - expected);
+    sync->skewUs  = (int16_t)CLAMP_I16(err / (int32_t)node->ticksPerUs);
+    sync->drift  += (int32_t)(((int64_t)err * 1000000 * 256 / ((int64_t)hostDelta * node->ticksPerUs)) >> BUS_DRIFT_FILT);
+  } else {
+    sync->skewUs  = 0;
+  }
+  sync->hostUs      = hostUs;
+  sync->localTicks  = now;
+  if (sync->count < 0xFFFF) {
+    sync->count++;
+  }
+}
+
+/* Feed one received byte, now is the time at which the byte was received */
+void busNodeRx(BusNode *node, uint8_t c, uint32_t now) {
+  const uint8_t *p = &node->rx.buf[BUS_HEADER_SIZE];
+  uint8_t dst, type, len;
+
+  if (!busRx(&node->rx, c)) {
+    return;
+  }
+  dst   = node->rx.buf[2];
+  type  = node->rx.buf[4];
+  len   = node->rx.buf[5];
+  if (node->rx.buf[3] != BUS_ADDR_HOST || (dst != node->addr && dst != BUS_ADDR_BROADCAST)) {
+    return;                                               // other node, or reply of another node
+  }
+  node->rxFrames++;
+
+  switch (type) {
+    case BUS_T_CMD:
+      if (dst == node->addr && len >= 4) {
+        node->cmd.steer   = (int16_t)get16(&p[0]);
+        node->cmd.speed   = (int16_t)get16(&p[2]);
+        node->cmdNew      = 1;
+      }
+      break;
+    case BUS_T_CMD_ALL:
+      if (len >= 4 * node->addr) {                        // nodes without an entry keep their command and do not reply
+        p                += 4 * (node->addr - 1);
+        node->cmd.steer   = (int16_t)get16(&p[0]);
+        node->cmd.speed   = (int16_t)get16(&p[2]);
+        node->cmdNew      = 1;
+        node->replyAt     = now + node->turnTicks + (node->addr - 1) * node->slotTicks;
+        node->replyPending = 1;
+      }
+      break;
+    case BUS_T_SYNC:
+      if (dst == BUS_ADDR_BROADCAST && len >= 4) {
+        busSyncUpdate(node, (uint32_t)get16(&p[0]) | ((uint32_t)get16(&p[2]) << 16), now);
+        node->syncNew     = 1;
+      }
+      break;
+    case BUS_T_POLL:
+      if (dst == node->addr) {
+        node->replyAt     = now + node->turnTicks;
+        node->replyPending = 1;
+      }
+      break;
+  }
+}
+
+/* Returns 1 once the scheduled reply must be sent, then build it with busNodeReply() */
+uint8_t busNodeReplyDue(BusNode *node, uint32_t now) {
+  return node->replyPending && (int32_t)(now - node->replyAt) >= 0;
+}
+
+/* Build the status reply in buf, BUS_FRAME_SIZE(BUS_STATUS_LEN) bytes. Returns the frame size */
+uint16_t busNodeReply(BusNode *node, uint8_t *buf, const BusStatus *status) {
+  uint8_t payload[BUS_STATUS_LEN];
+
+  node->replyPending = 0;
+  busStatusPack(payload, status);
+  return busFrame(buf, BUS_ADDR_HOST, node->addr, BUS_T_STATUS, payload, BUS_STATUS_LEN);
+}
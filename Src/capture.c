@@ -0,0 +1,257 @@
+/*
+* This file implements an in-RAM oscilloscope for the motor control signals.
+* The signals are recorded at PWM rate in a ring buffer, frozen by a trigger
+* and dumped on the debug serial port, see capture.h.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stm32f1xx_hal.h"
+#include "defines.h"
+#include "config.h"
+#include "capture.h"
+#include "telemetry.h"
+#include "comms.h"
+#include "serial.h"
+#include "BLDC_controller.h"
+#include "rtwtypes.h"
+
+#ifdef CAPTURE_ENABLE
+
+#define CAPTURE_USART           (SERIAL_PORT_DEBUG->usart)
+
+#if (CAP_NB_CH == 0) || (CAPTURE_DEPTH * CAP_NB_CH * 2 > 16384)
+  #error CAPTURE_CHANNELS must select at least one channel and the capture buffer (CAPTURE_DEPTH * channels * 2 bytes) must fit in 16 KByte.
+#endif
+
+#define CAP_HEADER_SIZE         14
+
+typedef struct {
+  uint16_t  start;
+  uint16_t  depth;
+  uint32_t  chMask;
+  uint8_t   nbCh;
+  uint8_t   trigSrc;
+  uint16_t  trigIdx;
+  uint16_t  pwmFreq;
+} CaptureHeader;
+
+extern ExtU rtU_Left;
+extern ExtU rtU_Right;
+extern ExtY rtY_Left;
+extern ExtY rtY_Right;
+extern int16_t curL_phaA, curL_phaB, curL_DC;
+extern int16_t curR_phaB, curR_phaC, curR_DC;
+extern uint8_t errCode_Left, errCode_Right;
+
+static int16_t          capBuf[CAPTURE_DEPTH][CAP_NB_CH];
+static volatile uint8_t capState    = CAP_ARMED;
+static volatile uint8_t capTrigReq  = CAP_TRIG_NONE;  // pending trigger, handled by the control ISR
+static uint8_t          capTrigSrc  = CAP_TRIG_NONE;
+static uint16_t         capIdx      = 0;              // next sample to write = oldest sample once the buffer is full
+static uint16_t         capCnt      = 0;              // number of valid samples
+static uint16_t         capPost     = 0;              // remaining samples after the trigger
+static uint8_t          capErrLeft  = 0;
+static uint8_t          capErrRight = 0;
+static const int16_t    capCurrTrig = CAPTURE_TRIG_CURR * A2BIT_CONV;
+
+static CaptureHeader    capHeader;
+static uint16_t         capCrc;
+static uint8_t          capDumpStep = 0;              // 0 = no dump in progress
+static uint16_t         capDumpPos  = 0;              // bytes of the current dump step already queued
+
+/* Called from the motor control ISR every PWM period */
+void Capture_Sample(void) {
+  int16_t *p;
+  uint8_t src;
+
+  if (capState == CAP_FROZEN) {
+    return;
+  }
+
+  p = capBuf[capIdx];
+  #if CAP_CH_BIT(CAP_CH_CUR_L_PHA_A)
+  *p++ = curL_phaA;
+  #endif
+  #if CAP_CH_BIT(CAP_CH_CUR_L_PHA_B)
+  *p++ = curL_phaB;
+  #endif
+  #if CAP_CH_BIT(CAP_CH_CUR_R_PHA_B)
+  *p++ = curR_phaB;
+  #endif
+  #if CAP_CH_BIT(CAP_CH_CUR_R_PHA_C)
+  *p++ = curR_phaC;
+  #endif
+  #if CAP_CH_BIT(CAP_CH_CUR_L_DC)
+  *p++ = curL_DC;
+  #endif
+  #if CAP_CH_BIT(CAP_CH_CUR_R_DC)
+  *p++ = curR_DC;
+  #endif
+  #if CAP_CH_BIT(CAP_CH_HALL)
+  *p++ = (int16_t)(rtU_Left.b_hallA  | (rtU_Left.b_hallB  << 1) | (rtU_Left.b_hallC  << 2) |
+                  (rtU_Right.b_hallA << 4) | (rtU_Right.b_hallB << 5) | (rtU_Right.b_hallC << 6));
+  #endif
+  #if CAP_CH_BIT(CAP_CH_DC_L_PHA_A)
+  *p++ = rtY_Left.DC_phaA;
+  #endif
+  #if CAP_CH_BIT(CAP_CH_DC_L_PHA_B)
+  *p++ = rtY_Left.DC_phaB;
+  #endif
+  #if CAP_CH_BIT(CAP_CH_DC_L_PHA_C)
+  *p++ = rtY_Left.DC_phaC;
+  #endif
+  #if CAP_CH_BIT(CAP_CH_DC_R_PHA_A)
+  *p++ = rtY_Right.DC_phaA;
+  #endif
+  #if CAP_CH_BIT(CAP_CH_DC_R_PHA_B)
+  *p++ = rtY_Right.DC_phaB;
+  #endif
+  #if CAP_CH_BIT(CAP_CH_DC_R_PHA_C)
+  *p++ = rtY_Right.DC_phaC;
+  #endif
+  #if CAP_CH_BIT(CAP_CH_N_MOT_L)
+  *p++ = rtY_Left.n_mot;
+  #endif
+  #if CAP_CH_BIT(CAP_CH_N_MOT_R)
+  *p++ = rtY_Right.n_mot;
+  #endif
+  #if CAP_CH_BIT(CAP_CH_ANGLE_L)
+  *p++ = rtY_Left.a_elecAngle;
+  #endif
+  #if CAP_CH_BIT(CAP_CH_ANGLE_R)
+  *p++ = rtY_Right.a_elecAngle;
+  #endif
+  (void)p;
+
+  if (++capIdx >= CAPTURE_DEPTH) {
+    capIdx = 0;
+  }
+  if (capCnt < CAPTURE_DEPTH) {
+    capCnt++;
+  }
+
+  if (capState == CAP_TRIGGERED) {
+    if (--capPost == 0) {
+      capState = CAP_FROZEN;
+    }
+    return;
+  }
+
+  // Armed: check the trigger sources
+  src = capTrigReq;
+  if (src == CAP_TRIG_NONE && (errCode_Left != capErrLeft || errCode_Right != capErrRight)) {
+    src = CAP_TRIG_ERRCODE;
+  }
+  if (src == CAP_TRIG_NONE && (ABS(curL_DC) >= capCurrTrig || ABS(curR_DC) >= capCurrTrig)) {
+    src = CAP_TRIG_CURRENT;
+  }
+  capErrLeft  = errCode_Left;
+  capErrRight = errCode_Right;
+
+  if (src != CAP_TRIG_NONE) {
+    if (capCnt > CAPTURE_PRETRIG) {                       // the trigger sample is the last one written
+      capTrigReq  = CAP_TRIG_NONE;
+      capTrigSrc  = src;
+      capPost     = CAPTURE_DEPTH - CAPTURE_PRETRIG - 1;
+      capState    = capPost ? CAP_TRIGGERED : CAP_FROZEN;
+    } else {
+      capTrigReq  = src;                                  // keep it until the pre-trigger samples are recorded
+    }
+  }
+}
+
+/* Request a trigger. Can be called from the main loop or from an interrupt */
+void Capture_Trigger(uint8_t source) {
+  if (capTrigReq == CAP_TRIG_NONE) {
+    capTrigReq = source;
+  }
+}
+
+static void capDumpStart(void) {
+  capHeader.start   = CAPTURE_START_FRAME;
+  capHeader.depth   = CAPTURE_DEPTH;
+  capHeader.chMask  = CAPTURE_CHANNELS;
+  capHeader.nbCh    = CAP_NB_CH;
+  capHeader.trigSrc = capTrigSrc;
+  capHeader.trigIdx = CAPTURE_PRETRIG;
+  capHeader.pwmFreq = pwmFreqGet();
+
+  capCrc      = crc16(0xFFFF, (const uint8_t *)&capHeader, CAP_HEADER_SIZE);
+  capCrc      = crc16(capCrc, (const uint8_t *)capBuf[capIdx], (CAPTURE_DEPTH - capIdx) * CAP_NB_CH * 2);
+  capCrc      = crc16(capCrc, (const uint8_t *)capBuf[0], capIdx * CAP_NB_CH * 2);
+  capDumpStep = 1;
+  capDumpPos  = 0;
+}
+
+/* Queue the next part of the current dump step in the console TX ring buffer. Returns 1 when the step is complete */
+static uint8_t capDumpSend(const void *data, uint16_t len) {
+  uint16_t n = MIN(len - capDumpPos, consoleTxFree());
+
+  if (n > 0 && consoleWrite((const uint8_t *)data + capDumpPos, n)) {
+    capDumpPos += n;
+  }
+  if (capDumpPos < len) {
+    return 0;
+  }
+  capDumpPos = 0;
+  return 1;
+}
+
+/* Called from the main loop: handles the commands and sends the dump in chunks.
+ * Returns 1 while a dump is in progress, the debug output must then stay off the serial port.
+ * The dump goes through the console TX ring buffer, a few hundred bytes per call */
+uint8_t Capture_Process(void) {
+  if (CAPTURE_USART->SR & USART_SR_RXNE) {
+    switch ((char)CAPTURE_USART->DR) {
+      case 't':
+        Capture_Trigger(CAP_TRIG_MANUAL);
+        break;
+      case 'a':
+        if (capState == CAP_FROZEN && capDumpStep == 0) {
+          capIdx      = 0;
+          capCnt      = 0;
+          capTrigReq  = CAP_TRIG_NONE;
+          capTrigSrc  = CAP_TRIG_NONE;
+          capState    = CAP_ARMED;
+        }
+        break;
+      case 'd':
+        if (capState == CAP_FROZEN && capDumpStep == 0) {
+          capDumpStart();
+        }
+        break;
+    }
+  }
+
+  switch (capDumpStep) {
+    case 1:
+      capDumpStep += capDumpSend(&capHeader, CAP_HEADER_SIZE);
+      break;
+    case 2:                                               // oldest samples up to the end of the buffer
+      capDumpStep += capDumpSend(capBuf[capIdx], (CAPTURE_DEPTH - capIdx) * CAP_NB_CH * 2);
+      break;
+    case 3:                                               // wrapped samples, if any
+      capDumpStep += (capIdx == 0) || capDumpSend(capBuf[0], capIdx * CAP_NB_CH * 2);
+      break;
+    case 4:
+      capDumpStep  = capDumpSend(&capCrc, 2) ? 0 : 4;
+      break;
+  }
+  return capDumpStep != 0;
+}
+
+#endif
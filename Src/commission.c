@@ -0,0 +1,778 @@
+/*
+* This file implements the commissioning routines: the PI gain auto-tuning
+* of the current and speed loops with a relay excitation, the motor
+* parameter identification and the hall sensor calibration, see commission.h.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "stm32f1xx_hal.h"
+#include "defines.h"
+#include "config.h"
+#include "commission.h"
+#include "BLDC_controller.h"
+#include "rtwtypes.h"
+
+#ifdef COMMISSION_ENABLE
+
+// Motor states, written by the control ISR while the routine runs
+#define COMM_M_OFF              0     // inputs not overridden
+#define COMM_M_SETTLE           1     // VOLTAGE mode with a zero target
+#define COMM_M_RAMP             2     // voltage ramp up to TUNE_N_REF
+#define COMM_M_HOLD             3     // input held: relay bias, settled speed
+#define COMM_M_RELAY            4
+#define COMM_M_STOP             5     // input ramp down to 0
+#define COMM_M_DONE             6
+#define COMM_M_FAIL             7     // over current, injection current not reached
+#define COMM_M_INJECT           8     // identification: DC injection at IDENT_CURR / 2, then IDENT_CURR
+#define COMM_M_STEP             9     // identification: voltage steps between the two injection levels
+#define COMM_M_FLUX             10    // identification: steady speed, back-EMF measurement
+#define COMM_M_HALL             11    // hall calibration: current vector rotating open loop
+
+#define COMM_SETTLE_TIME        300   // [ms] VOLTAGE mode settling time
+#define COMM_RAMP_DIV           16    // [-] input ramps: 1 input step every COMM_RAMP_DIV PWM periods (~1 per ms)
+#define COMM_N_STILL            20    // [rpm] the routines only start with the wheels at rest
+#define COMM_MEAS_LOG2          13    // [-] identification: 2^13 PWM periods averaged (0.5 s at 16 kHz)
+#define COMM_INJ_MAX            250   // [-] identification: injection voltage limit in DC_phaX units [-1000, 1000]
+#define COMM_STEPS              8     // [-] identification: inductance voltage steps
+#define COMM_HALL_FREQ          2     // [Hz] hall calibration: electrical frequency of the rotating current vector
+#define COMM_HALL_REVS          4     // [-] hall calibration: electrical revolutions in each direction
+#define COMM_HALL_DEB           20    // [deg] hall calibration: minimum field rotation between two edges (bouncing hall signals)
+#define COMM_ANG_360            23040 // 360 deg in fixdt(1,16,6), the unit of the controller angle
+#define COMM_HALL_ANG           0     // [fixdt(1,16,6)] controller angle of the rotor aligned with the current vector at 0
+
+typedef struct {
+  volatile uint8_t state;
+  uint16_t  cnt;                      // PWM periods in the current state or relay period
+  int16_t   inp;                      // VOLTAGE mode input target [-1000, 1000]
+  int16_t   bias;                     // relay bias
+  int8_t    out;                      // relay output +1 / -1
+  uint8_t   per;                      // relay periods completed
+  int16_t   yMin, yMax;               // relay period extrema
+  int32_t   uSum, ySum;               // relay period sums of inp and y
+  // TUNE_MEAS_PER measured periods
+  uint16_t  nPer[TUNE_MEAS_PER];      // PWM periods
+  uint16_t  ppPer[TUNE_MEAS_PER];     // peak-to-peak amplitudes
+  int32_t   uSumT, ySumT;             // sums of inp and y
+  // Motor identification
+  int32_t   vAcc;                     // injection current regulator, Q10
+  int16_t   vInj;                     // injection voltage of the phase of i_phaAB, in DC_phaX units
+  int16_t   iPrev;                    // injection phase current of the previous period
+  int16_t   iCross;                   // inductance step: 63 % of the current step
+  int8_t    dir;                      // inductance step: current direction, 0 when the crossing was found
+  uint8_t   steps;                    // inductance steps measured
+  int32_t   vSum[2], iSum[2];         // injection levels: sums of vInj and of the current
+  uint32_t  tauSum;                   // inductance steps: 63 % rise times, Q8 [PWM periods]
+  int64_t   vv, ii, vi, vxi;          // back-EMF: sums of 9 |V|^2, 9 |I|^2, 9 V.I and 9 / sqrt(3) V x I (alpha/beta frame)
+  int32_t   nSum;                     // back-EMF: sum of n_mot
+  // Hall calibration
+  uint32_t  ang;                      // angle of the current vector, Q8 fixdt(1,16,6)
+  int16_t   vPha[3];                  // phase voltages in DC_phaX units
+  uint8_t   hall;                     // hall code of the previous period
+  uint16_t  edgeCnt;                  // PWM periods since the last recorded edge
+  int16_t   eRef[8];                  // first angle recorded for each edge
+  int32_t   eSum[2][8];               // forward / reverse sums of the edge angles relative to eRef
+  uint8_t   eCnt[2][8];               // forward / reverse edges recorded
+} CommMotor;
+
+extern uint8_t enable;
+extern int16_t batVoltage;
+extern uint8_t errCode_Left, errCode_Right;
+extern P rtP_Left;
+extern ExtY rtY_Left;
+extern ExtY rtY_Right;
+
+static CommMotor         commMot[2];
+static volatile uint8_t  commRoutine  = COMM_NONE;
+static uint8_t           commState    = COMM_STATE_IDLE;
+static uint8_t           commStore    = 0;
+static uint32_t          commTick     = 0;
+static int16_t           commRef, commRelay, commHyst;  // relay reference, amplitude and hysteresis of the running routine
+static uint16_t          commSettle;                    // COMM_SETTLE_TIME in PWM periods
+static const int16_t     commCurrMax  = I_MOT_MAX * A2BIT_CONV;
+static int32_t           commMotPar[COMM_PAR_COUNT];    // identified motor parameters, mean of both motors
+static uint32_t          commHallStep;                  // hall calibration: angle step per PWM period, Q8
+static uint16_t          commHallRot, commHallDeb;      // hall calibration: PWM periods of one direction, of COMM_HALL_DEB
+
+// =================================
+// Control ISR
+// =================================
+static void relayPeriodStart(CommMotor *m, int16_t y) {
+  m->cnt  = 0;
+  m->yMin = m->yMax = y;
+  m->uSum = m->ySum = 0;
+}
+
+static void relayPeriodEnd(CommMotor *m, int16_t y) {
+  if (m->per >= TUNE_SETTLE_PER) {
+    m->nPer[m->per - TUNE_SETTLE_PER]  = m->cnt;
+    m->ppPer[m->per - TUNE_SETTLE_PER] = (uint16_t)(m->yMax - m->yMin);
+    m->uSumT  += m->uSum;
+    m->ySumT  += m->ySum;
+  }
+  if (commRoutine == COMM_TUNE_SPEED && m->per > 0) {   // the first period is partial
+    m->bias = (int16_t)(m->uSum / m->cnt);        // mean voltage of the period: holds the speed reference
+  }
+  if (++m->per >= TUNE_SETTLE_PER + TUNE_MEAS_PER) {
+    m->cnt   = 0;
+    m->inp   = m->bias;
+    m->state = COMM_M_STOP;
+    return;
+  }
+  relayPeriodStart(m, y);
+}
+
+/* Phase currents. Left motor: i_phaAB = phase A, i_phaBC = phase B. Right motor: i_phaAB = phase B, i_phaBC = phase C */
+static void phaseCurrents(uint8_t motor, const ExtU *rtU, int32_t *ia, int32_t *ib, int32_t *ic) {
+  if (motor == COMM_MOTOR_LEFT) {
+    *ia = rtU->i_phaAB;
+    *ib = rtU->i_phaBC;
+    *ic = -*ia - *ib;
+  } else {
+    *ib = rtU->i_phaAB;
+    *ic = rtU->i_phaBC;
+    *ia = -*ib - *ic;
+  }
+}
+
+/* Angle difference in fixdt(1,16,6), wrapped to [-180, 180[ deg */
+static int32_t angWrap(int32_t a) {
+  a %= COMM_ANG_360;
+  if (a >= COMM_ANG_360 / 2) {
+    a -= COMM_ANG_360;
+  } else if (a < -COMM_ANG_360 / 2) {
+    a += COMM_ANG_360;
+  }
+  return a;
+}
+
+/* Identification: accumulate the back-EMF measurement. The duty cycles are the outputs of the previous step, the currents
+ * were measured during the PWM period that applied them */
+static void fluxSample(uint8_t motor, CommMotor *m, const ExtU *rtU, const ExtY *rtY) {
+  int32_t ia, ib, ic, va, vb;
+
+  phaseCurrents(motor, rtU, &ia, &ib, &ic);
+  va = 2 * rtY->DC_phaA - rtY->DC_phaB - rtY->DC_phaC;  // 3 V alpha, the common mode drops out
+  vb = rtY->DC_phaB - rtY->DC_phaC;                     // sqrt(3) V beta
+  ia = 2 * ia - ib - ic;
+  ib = ib - ic;
+  m->vv  += va * va + 3 * vb * vb;
+  m->ii  += ia * ia + 3 * ib * ib;
+  m->vi  += va * ia + 3 * vb * ib;
+  m->vxi += va * ib - vb * ia;
+  m->nSum += rtY->n_mot;
+}
+
+/* Identification: the voltage steps between the two injection levels, the current crosses 63 % of its step after L / R */
+static void stepSample(CommMotor *m, int16_t i) {
+  uint8_t lvl;
+  int16_t iEnd;
+
+  if (m->cnt == 0) {                              // down to level 0 on even steps, up to level 1 on odd steps
+    lvl       = m->per & 1;
+    iEnd      = (int16_t)(m->iSum[lvl] >> COMM_MEAS_LOG2);
+    m->vInj   = (int16_t)(m->vSum[lvl] >> COMM_MEAS_LOG2);
+    m->iCross = (int16_t)(i + (iEnd - i) * 632 / 1000);
+    m->dir    = (iEnd > i) ? 1 : -1;
+  } else if (m->dir && (i - m->iCross) * m->dir >= 0) {
+    // Counted from the PWM period that applied the step, linear interpolation between the two samples
+    m->tauSum += (uint32_t)((m->cnt - 1) * 256 + (m->iCross - m->iPrev) * 256 / (i - m->iPrev));
+    m->steps++;
+    m->dir    = 0;
+  }
+  m->iPrev = i;
+  if (++m->cnt >= commSettle / 4) {
+    m->cnt = 0;
+    if (++m->per >= COMM_STEPS) {
+      m->vInj  = 0;
+      m->inp   = 0;
+      m->state = COMM_M_RAMP;
+    }
+  }
+}
+
+/* Hall calibration: the current vector is regulated to IDENT_CURR along its axis and rotates at COMM_HALL_FREQ, forward then in
+ * reverse. m->per: 0 alignment at 0 deg, 1 forward rotation, 2 hold, 3 reverse rotation. The rotor follows the vector with a load
+ * angle. The angle of each hall edge is recorded in both directions, keyed by the hall code the edge enters in forward rotation.
+ * The first quarter revolution of each direction is skipped: the load angle changes its sign */
+static void hallSample(uint8_t motor, CommMotor *m, const ExtU *rtU) {
+  int32_t ia, ib, ic, cs, sn, i, va, t;
+  int16_t a   = (int16_t)(m->ang >> 8);
+  uint8_t hall, dir, key;
+
+  // Table of the controller: cos and sin of (angle + 30 deg) in 2 deg steps (nearest, 360 deg included), Q14. 28378 = sqrt(3) * 2^14
+  cs = rtConstP.r_cos_M1_Table[(a + 64) >> 7];
+  sn = rtConstP.r_sin_M1_Table[(a + 64) >> 7];
+  phaseCurrents(motor, rtU, &ia, &ib, &ic);
+  i  = ((2 * ia - ib - ic) * cs + (((ib - ic) * 28378) >> 14) * sn) / (3 << 14);
+
+  m->vAcc += IDENT_CURR * A2BIT_CONV - i;         // slow integral current regulator, as the DC injection
+  m->vInj  = (int16_t)(m->vAcc >> 10);
+  if (ABS(m->vInj) > COMM_INJ_MAX) {
+    m->vInj  = 0;
+    m->state = COMM_M_FAIL;
+    return;
+  }
+  va = (m->vInj * cs) >> 14;
+  t  = (((m->vInj * sn) >> 14) * 28378) >> 14;
+  m->vPha[0] = (int16_t)va;
+  m->vPha[1] = (int16_t)((t - va) / 2);
+  m->vPha[2] = (int16_t)((-t - va) / 2);
+
+  hall = (uint8_t)((rtU->b_hallA << 2) | (rtU->b_hallB << 1) | rtU->b_hallC);
+  if ((m->per & 1) && m->cnt >= commHallRot / (4 * COMM_HALL_REVS) && hall != m->hall && m->edgeCnt >= commHallDeb &&
+      hall > 0 && hall < 7 && m->hall > 0 && m->hall < 7) {
+    dir = (m->per == 3);
+    key = dir ? m->hall : hall;
+    if (m->eCnt[0][key] == 0 && m->eCnt[1][key] == 0) {
+      m->eRef[key] = a;
+    }
+    m->eSum[dir][key] += angWrap(a - m->eRef[key]);
+    m->eCnt[dir][key]++;
+    m->edgeCnt = 0;
+  }
+  m->hall = hall;
+  if (m->edgeCnt < UINT16_MAX) {
+    m->edgeCnt++;
+  }
+
+  if (m->per & 1) {
+    m->ang = (m->ang + (m->per == 1 ? commHallStep : ((uint32_t)COMM_ANG_360 << 8) - commHallStep)) % ((uint32_t)COMM_ANG_360 << 8);
+  }
+  if (++m->cnt >= ((m->per & 1) ? commHallRot : commSettle)) {
+    m->cnt = 0;
+    if (++m->per >= 4) {
+      m->vInj  = 0;
+      m->vPha[0] = m->vPha[1] = m->vPha[2] = 0;
+      m->state = COMM_M_DONE;
+    }
+  }
+}
+
+/* Called from the control ISR for each motor, before the controller step: overrides the mode and the input target.
+ * The measurements are the outputs of the previous step */
+void Commission_Step(uint8_t motor, ExtU *rtU, const ExtY *rtY) {
+  CommMotor *m = &commMot[motor];
+  int16_t    y, i;
+  uint8_t    inj;
+
+  if (m->state == COMM_M_OFF) {
+    return;
+  }
+
+  y = (commRoutine == COMM_TUNE_CURR) ? rtY->r_devSignal1 : rtY->n_mot;
+  i = rtU->i_phaAB;                               // identification: current of the injection phase
+  // The injection bypasses the controller: check its phase current as well
+  inj = (m->state == COMM_M_INJECT || m->state == COMM_M_STEP || m->state == COMM_M_HALL);
+  if ((ABS(rtY->r_devSignal1) > commCurrMax || (inj && ABS(i) > commCurrMax)) && m->state != COMM_M_FAIL) {
+    m->state = COMM_M_FAIL;
+    m->inp   = 0;
+  }
+
+  switch (m->state) {
+    case COMM_M_SETTLE:
+      if (++m->cnt >= commSettle) {
+        m->cnt   = 0;
+        if (commRoutine == COMM_IDENT) {
+          m->state = COMM_M_INJECT;
+        } else if (commRoutine == COMM_HALL_CAL) {
+          m->hall  = (uint8_t)((rtU->b_hallA << 2) | (rtU->b_hallB << 1) | rtU->b_hallC);
+          m->state = COMM_M_HALL;
+        } else {
+          m->state = (commRoutine == COMM_TUNE_SPEED) ? COMM_M_RAMP : COMM_M_RELAY;
+          relayPeriodStart(m, y);
+        }
+      }
+      break;
+
+    case COMM_M_INJECT:                           // slow integral current regulator, then the mean voltage and current
+      m->vAcc += (m->per ? IDENT_CURR * A2BIT_CONV : IDENT_CURR * A2BIT_CONV / 2) - i;
+      m->vInj  = (int16_t)(m->vAcc >> 10);
+      if (ABS(m->vInj) > COMM_INJ_MAX) {          // phase open or resistance too high
+        m->vInj  = 0;
+        m->state = COMM_M_FAIL;
+        break;
+      }
+      if (m->cnt >= commSettle) {                 // the rotor aligned with the injection axis and the current settled
+        m->vSum[m->per] += m->vInj;
+        m->iSum[m->per] += i;
+      }
+      if (++m->cnt >= commSettle + (1U << COMM_MEAS_LOG2)) {
+        m->cnt = 0;
+        if (++m->per >= 2) {
+          m->per   = 0;
+          m->iPrev = i;
+          m->state = COMM_M_STEP;
+        }
+      }
+      break;
+
+    case COMM_M_STEP:
+      stepSample(m, i);
+      break;
+
+    case COMM_M_HALL:
+      hallSample(motor, m, rtU);
+      break;
+
+    case COMM_M_RAMP:
+      if (y >= commRef) {
+        m->cnt   = 0;
+        m->state = COMM_M_HOLD;
+      } else if (++m->cnt >= COMM_RAMP_DIV && ABS(rtY->r_devSignal1) < commCurrMax / 2) {
+        m->cnt   = 0;                             // the ramp waits while the acceleration current is high
+        m->inp   = MIN(m->inp + 1, 1000);
+      }
+      break;
+
+    case COMM_M_HOLD:                             // the speed lags the ramp: scale the input to the settled speed
+      if (++m->cnt >= commSettle) {
+        m->cnt   = 0;
+        if (commRoutine == COMM_IDENT) {
+          m->bias  = m->inp;                      // held input of the back-EMF measurement
+          m->state = COMM_M_FLUX;
+        } else {
+          m->bias  = (int16_t)((int32_t)m->inp * commRef / MAX(y, 1));
+          m->state = COMM_M_RELAY;
+          relayPeriodStart(m, y);
+        }
+      }
+      break;
+
+    case COMM_M_FLUX:                             // same input as HOLD, steady speed
+      fluxSample(motor, m, rtU, rtY);
+      if (++m->cnt >= (1U << COMM_MEAS_LOG2)) {
+        m->cnt   = 0;
+        m->state = COMM_M_STOP;
+      }
+      break;
+
+    case COMM_M_RELAY:                            // a period ends at each switch to +1
+      if (y < commRef - commHyst && m->out < 0) {
+        m->out = 1;
+        relayPeriodEnd(m, y);
+      } else if (y > commRef + commHyst && m->out > 0) {
+        m->out = -1;
+      }
+      if (m->state != COMM_M_RELAY) {
+        break;
+      }
+      m->inp   = (int16_t)CLAMP(m->bias + m->out * commRelay, -1000, 1000);
+      m->yMin  = MIN(m->yMin, y);
+      m->yMax  = MAX(m->yMax, y);
+      m->uSum += m->inp;
+      m->ySum += y;
+      if (m->cnt < UINT16_MAX) {
+        m->cnt++;
+      }
+      break;
+
+    case COMM_M_STOP:                             // a step to 0 would brake the wheels with the full back-EMF
+      if (m->inp == 0) {
+        m->state = COMM_M_DONE;
+      } else if (++m->cnt >= COMM_RAMP_DIV) {
+        m->cnt   = 0;
+        m->inp  -= SIGN(m->inp);
+      }
+      break;
+
+    default:                                      // DONE or FAIL: hold the zero target until the routine ends
+      m->inp = 0;
+      break;
+  }
+
+  rtU->z_ctrlModReq = 1;                          // VOLTAGE mode
+  rtU->r_inpTgt     = m->inp;
+}
+
+/* Called from the control ISR for each motor, after the controller step: the identification injects its voltage through
+ * the phase of i_phaAB (left motor phase A, right motor phase B), the two other phases take half of it each. The hall
+ * calibration applies its rotating voltage vector */
+void Commission_Output(uint8_t motor, int *u, int *v, int *w) {
+  CommMotor *m = &commMot[motor];
+  int       *pha[3] = {u, v, w};
+
+  if (m->state == COMM_M_HALL) {
+    *u = m->vPha[0];
+    *v = m->vPha[1];
+    *w = m->vPha[2];
+    return;
+  }
+  if (m->state != COMM_M_INJECT && m->state != COMM_M_STEP) {
+    return;
+  }
+  *u = *v = *w = -m->vInj / 2;
+  *pha[motor == COMM_MOTOR_LEFT ? 0 : 1] = m->vInj;
+}
+
+// =================================
+// Gain computation
+// =================================
+static uint32_t isqrt64(uint64_t x) {
+  uint64_t res = 0, bit = (uint64_t)1 << 62;
+
+  while (bit > x) {
+    bit >>= 2;
+  }
+  while (bit) {
+    if (x >= res + bit) {
+      x   -= res + bit;
+      res  = (res >> 1) + bit;
+    } else {
+      res >>= 1;
+    }
+    bit >>= 2;
+  }
+  return (uint32_t)res;
+}
+
+/* Median of the measured periods: a glitch of the measurement (speed estimation) only spoils one period */
+static uint32_t median(const uint16_t *x) {
+  uint16_t s[TUNE_MEAS_PER], v;
+  uint8_t  i, j;
+
+  for (i = 0; i < TUNE_MEAS_PER; i++) {           // insertion sort
+    v = x[i];
+    for (j = i; j > 0 && s[j - 1] > v; j--) {
+      s[j] = s[j - 1];
+    }
+    s[j] = v;
+  }
+  return ((uint32_t)s[(TUNE_MEAS_PER - 1) / 2] + s[TUNE_MEAS_PER / 2] + 1) / 2;
+}
+
+static uint16_t gainClamp(int64_t x) {
+  return (uint16_t)CLAMP(x, 1, UINT16_MAX);
+}
+
+/* PI gains of one motor, in the format of BLDC_controller_data.c at PWM_FREQ_REF. Returns 0 if the oscillation is not usable.
+ * The relay point gives the ultimate gain Ku = 4 d / (pi a) (d relay amplitude, a half peak-to-peak) at fu = fs / period,
+ * with the medians of the period and of the peak-to-peak amplitude.
+ * sK is the gain of the plant inverse at fu in the controller units (Vq per error), Q16:
+ *   current loop, integrator plant: sK = Ku
+ *   speed loop, first order plant K / (tau s + 1): x = K Ku, sK = sqrt(x^2 - 1) / K, and 1/K is subtracted from Kp
+ * The bandwidth bw is limited to fu / 4 (current loop: dead time) or fu / 3 (speed loop: current loop and speed estimation lag).
+ * With r = bw / fu: Kp = 2 zeta r sK - 1/K, Ki = 2 pi bw r sK [1/s]
+ */
+static uint8_t gainCompute(const CommMotor *m, uint16_t bw, uint16_t *kp, uint16_t *ki) {
+  const int64_t vdMax = rtP_Left.Vd_max;          // VOLTAGE mode: Vq = r_inpTgt * Vd_max / 1000 in fixdt(1,16,4)
+  int64_t  sK, invK = 0, xq, t;
+  uint32_t fs   = pwmFreqGet();                   // fu = fs / n
+  uint32_t n    = median(m->nPer);
+  uint32_t pp   = median(m->ppPer);
+  uint32_t div  = (commRoutine == COMM_TUNE_CURR) ? 4 : 3;
+
+  if (n == 0 || pp == 0 || fs == 0) {
+    return 0;
+  }
+
+  if (commRoutine == COMM_TUNE_CURR) {
+    // 166886 = 8 / pi * 2^16. The y (iq) is in fixdt(1,16,4) >> 4, Vq in fixdt(1,16,4): Vd_max / 16000 per input unit
+    sK = (int64_t)commRelay * vdMax * 166886 / (16000LL * pp);
+  } else {
+    if (m->uSumT <= 0 || m->ySumT <= 0) {
+      return 0;
+    }
+    xq = (int64_t)commRelay * m->ySumT * 166886 / ((int64_t)pp * m->uSumT);
+    if (xq <= 72090) {                            // x <= 1.1: no lag beyond the first order, nothing to tune for
+      return 0;
+    }
+    sK   = (int64_t)isqrt64((uint64_t)(xq * xq - ((int64_t)1 << 32))) * m->uSumT * vdMax / (16000LL * m->ySumT);
+    invK = ((int64_t)m->uSumT << 16) * vdMax / (16000LL * m->ySumT);
+  }
+
+  bw  = (uint16_t)MIN(bw, fs / (div * n));        // at most fu / div
+  if (bw == 0) {
+    return 0;
+  }
+  // Kp <= 0: the plant alone is faster than bw, the minimum Kp only raises the damping
+  *kp = gainClamp(((4096LL * 2 * TUNE_DAMPING * bw * n * sK) / (100LL * fs) - 4096 * invK) >> 16);
+  t   = (int64_t)bw * bw * n * sK / fs;
+  *ki = gainClamp(t * 411775 / (65536LL * PWM_FREQ_REF));     // 411775 = 2 pi * 2^16
+  return 1;
+}
+
+static uint8_t tuneFinish(void) {
+  uint16_t kpL, kiL, kpR, kiR, kp, ki;
+  uint16_t bw = (commRoutine == COMM_TUNE_CURR) ? TUNE_CURR_BW : TUNE_SPD_BW;
+  uint8_t  ok = 1;
+
+  if (!gainCompute(&commMot[COMM_MOTOR_LEFT], bw, &kpL, &kiL) || !gainCompute(&commMot[COMM_MOTOR_RIGHT], bw, &kpR, &kiR)) {
+    return COMM_STATE_ERR_RESULT;
+  }
+  kp = (uint16_t)((kpL + kpR + 1) / 2);
+  ki = (uint16_t)((kiL + kiR + 1) / 2);
+
+  if (commRoutine == COMM_TUNE_CURR) {
+    ctrlGainSet(CTRL_GAIN_ID_KP, kp);
+    ctrlGainSet(CTRL_GAIN_ID_KI, ki);
+    ctrlGainSet(CTRL_GAIN_IQ_KP, kp);
+    ctrlGainSet(CTRL_GAIN_IQ_KI, ki);
+  } else {
+    ctrlGainSet(CTRL_GAIN_N_KP, kp);
+    ctrlGainSet(CTRL_GAIN_N_KI, ki);
+  }
+
+  if (commStore) {
+    enable = 0;                                   // the control ISR switches the bridges off before the Flash write stalls the CPU
+    HAL_Delay(2);
+    if (commRoutine == COMM_TUNE_CURR) {
+      ok = ctrlGainStore(CTRL_GAIN_ID_KP, kp) && ctrlGainStore(CTRL_GAIN_ID_KI, ki) &&
+           ctrlGainStore(CTRL_GAIN_IQ_KP, kp) && ctrlGainStore(CTRL_GAIN_IQ_KI, ki);
+    } else {
+      ok = ctrlGainStore(CTRL_GAIN_N_KP, kp) && ctrlGainStore(CTRL_GAIN_N_KI, ki);
+    }
+  }
+  return ok ? COMM_STATE_DONE : COMM_STATE_ERR_FLASH;
+}
+
+/* Motor parameters of one motor and the current loop PI gains derived from them. Returns 0 if a measurement is not usable.
+ *   R    two injection levels: R = dV / dI, the constant voltage errors (dead time, switch drops) cancel out
+ *   L    L = R tau, tau the mean 63 % rise time of the current steps
+ *   psi  |E| / w_el at the steady speed, E = V - (R + j w_el L) I from the duty cycles and the phase currents
+ * The phase voltage is DC_phaX * Vbat / 2000 (BAT_FULL with BAT_NORM_ENA), the pole pairs are those of the speed estimation (cf_speedCoef).
+ * The held VOLTAGE mode input gives the Vq scale kV (volts per Vq), the PI gains cancel the R/L pole:
+ * Kp = 2 pi bw L / kV, Ki = 2 pi bw R / kV
+ */
+static uint8_t identCompute(const CommMotor *m, int32_t *par, uint16_t *kp, uint16_t *ki) {
+  const int64_t N     = 1 << COMM_MEAS_LOG2;
+  const int64_t vdMax = rtP_Left.Vd_max;
+  #if (BAT_NORM_ENA == 1)
+  int64_t  vBat = 420 * BAT_CELLS;                // [V*100] BAT_FULL, the duty cycles are relative to it
+  #else
+  int64_t  vBat = (int64_t)batVoltage * BAT_CALIB_REAL_VOLTAGE / BAT_CALIB_ADC;  // [V*100]
+  #endif
+  int64_t  fs   = pwmFreqGet();
+  int64_t  pp   = (fs * 10 + rtP_Left.cf_speedCoef / 2) / MAX(rtP_Left.cf_speedCoef, 1);
+  int64_t  r, l, x, vv, e, vQ4;
+
+  if (m->iSum[1] <= m->iSum[0] || m->steps < COMM_STEPS / 2 || m->nSum <= 0 || m->bias <= 0 || vBat <= 0 || pp <= 0) {
+    return 0;
+  }
+  r = ((int64_t)m->vSum[1] - m->vSum[0]) * vBat / (4 * ((int64_t)m->iSum[1] - m->iSum[0]));   // [mOhm]
+  l = r * (m->tauSum / m->steps) * 1000 / (256 * fs);                                         // [uH]
+  x = (int64_t)m->nSum * pp * l * 411775 / (60000LL * 65536 * N);                             // w_el L [mOhm]
+  if (r <= 0 || l <= 0) {
+    return 0;
+  }
+
+  // 9 |E|^2 [mV^2]. V [mV] = DC_phaX * vBat / 200, I [mA] = 20 * counts; 56756 = sqrt(3) * 2^15
+  vv = m->vv / N;
+  e  = vv * vBat * vBat / 40000 - 2 * vBat * (r * (m->vi / N) - x * ((m->vxi * 56756 >> 15) / N)) / 10000 +
+       (r * r + x * x) * (m->ii / N) / 2500;
+  if (e <= 0) {
+    return 0;
+  }
+  e  = isqrt64((uint64_t)(e * 1000000 / 9));                                                 // |E| [uV]
+
+  par[COMM_PAR_R]    = (int32_t)r;
+  par[COMM_PAR_L]    = (int32_t)l;
+  par[COMM_PAR_FLUX] = (int32_t)(e * 60 * 65536 * N / (411775LL * m->nSum * pp));              // [uWb] = |E| / w_el
+
+  // |V| [DC_phaX units * 16] at the held input, VOLTAGE mode Vq = bias * Vd_max / 16000
+  vQ4 = isqrt64((uint64_t)(vv * 256 / 9));
+  if (vQ4 == 0) {
+    return 0;
+  }
+  *kp = gainClamp(411775LL * TUNE_CURR_BW * l * m->bias * vdMax / (4000000LL * vQ4 * vBat));
+  *ki = gainClamp(411775LL * TUNE_CURR_BW * r * m->bias * vdMax / (250LL * vQ4 * vBat * PWM_FREQ_REF));
+  return 1;
+}
+
+static uint8_t identFinish(void) {
+  int32_t  parL[COMM_PAR_COUNT], parR[COMM_PAR_COUNT];
+  uint16_t kpL, kiL, kpR, kiR, kp, ki;
+  uint8_t  ok = 1;
+
+  if (!identCompute(&commMot[COMM_MOTOR_LEFT], parL, &kpL, &kiL) || !identCompute(&commMot[COMM_MOTOR_RIGHT], parR, &kpR, &kiR)) {
+    return COMM_STATE_ERR_RESULT;
+  }
+  for (uint8_t i = 0; i < COMM_PAR_COUNT; i++) {
+    commMotPar[i] = (parL[i] + parR[i] + 1) / 2;
+  }
+  kp = (uint16_t)((kpL + kpR + 1) / 2);
+  ki = (uint16_t)((kiL + kiR + 1) / 2);
+
+  ctrlGainSet(CTRL_GAIN_ID_KP, kp);
+  ctrlGainSet(CTRL_GAIN_ID_KI, ki);
+  ctrlGainSet(CTRL_GAIN_IQ_KP, kp);
+  ctrlGainSet(CTRL_GAIN_IQ_KI, ki);
+  motConstSet((uint16_t)CLAMP(commMotPar[COMM_PAR_L], 1, UINT16_MAX), (uint16_t)CLAMP(commMotPar[COMM_PAR_FLUX], 1, UINT16_MAX),
+              (uint16_t)CLAMP(commMotPar[COMM_PAR_R], 1, UINT16_MAX));
+  if (commStore) {
+    enable = 0;                                   // the control ISR switches the bridges off before the Flash write stalls the CPU
+    HAL_Delay(2);
+    ok = ctrlGainStore(CTRL_GAIN_ID_KP, kp) && ctrlGainStore(CTRL_GAIN_ID_KI, ki) &&
+         ctrlGainStore(CTRL_GAIN_IQ_KP, kp) && ctrlGainStore(CTRL_GAIN_IQ_KI, ki) &&
+         motConstStore((uint16_t)CLAMP(commMotPar[COMM_PAR_L], 1, UINT16_MAX), (uint16_t)CLAMP(commMotPar[COMM_PAR_FLUX], 1, UINT16_MAX),
+                       (uint16_t)CLAMP(commMotPar[COMM_PAR_R], 1, UINT16_MAX));
+  }
+  return ok ? COMM_STATE_DONE : COMM_STATE_ERR_FLASH;
+}
+
+/* Hall mapping and edge offsets of one motor, in the format of hallCalSet(). Returns 0 if an edge is missing or the
+ * hall sectors are not usable. The mean of the forward and reverse angles of an edge cancels the load angle and the hysteresis
+ * of the sensor. The sector of a hall code is the angle of its forward entering edge rounded to 60 deg, its offset is the
+ * deviation of the edge from the sector start. The sector widths must be 60 deg +/- 30 deg */
+static uint8_t hallCompute(const CommMotor *m, int8_t *hallToPos, int16_t *ofs) {
+  int32_t e;
+  uint8_t c, p, used = 0;
+
+  hallToPos[0] = hallToPos[7] = 0;                // invalid codes: broken sensor wire
+  for (c = 1; c < 7; c++) {
+    if (m->eCnt[0][c] == 0 || m->eCnt[1][c] == 0) {
+      return 0;
+    }
+    e = m->eRef[c] + (m->eSum[0][c] / m->eCnt[0][c] + m->eSum[1][c] / m->eCnt[1][c]) / 2 + COMM_HALL_ANG;
+    e = (e % COMM_ANG_360 + COMM_ANG_360) % COMM_ANG_360;
+    p = (uint8_t)(((e + COMM_ANG_360 / 12) / (COMM_ANG_360 / 6)) % 6);
+    if (used & (1U << p)) {
+      return 0;
+    }
+    used        |= 1U << p;
+    hallToPos[c] = (int8_t)p;
+    ofs[p]       = (int16_t)angWrap(e - p * (COMM_ANG_360 / 6));
+  }
+  for (p = 0; p < 6; p++) {
+    if (ABS(ofs[(p + 1) % 6] - ofs[p]) > COMM_ANG_360 / 12) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static uint8_t hallFinish(void) {
+  int8_t  map[2][8];
+  int16_t ofs[2][6];
+  uint8_t ok = 1;
+
+  if (!hallCompute(&commMot[COMM_MOTOR_LEFT], map[0], ofs[0]) || !hallCompute(&commMot[COMM_MOTOR_RIGHT], map[1], ofs[1])) {
+    return COMM_STATE_ERR_RESULT;
+  }
+  hallCalSet(COMM_MOTOR_LEFT,  map[0], ofs[0]);
+  hallCalSet(COMM_MOTOR_RIGHT, map[1], ofs[1]);
+  if (commStore) {
+    enable = 0;                                   // the control ISR switches the bridges off before the Flash write stalls the CPU
+    HAL_Delay(2);
+    ok = hallCalStore(COMM_MOTOR_LEFT, map[0], ofs[0]) && hallCalStore(COMM_MOTOR_RIGHT, map[1], ofs[1]);
+  }
+  return ok ? COMM_STATE_DONE : COMM_STATE_ERR_FLASH;
+}
+
+// =================================
+// Main loop
+// =================================
+static void commStop(uint8_t state) {
+  commMot[COMM_MOTOR_LEFT].state  = COMM_M_OFF;
+  commMot[COMM_MOTOR_RIGHT].state = COMM_M_OFF;
+  commState = state;
+}
+
+/* Start a commissioning routine, COMM_NONE aborts the running one. Returns 0 for an unknown routine */
+uint8_t Commission_Start(uint8_t routine, uint8_t store) {
+  if (routine >= COMM_COUNT) {
+    return 0;
+  }
+  if (commState == COMM_STATE_BUSY) {
+    commStop(COMM_STATE_ERR_ABORT);
+  }
+  if (routine == COMM_NONE) {
+    return 1;
+  }
+  if (!enable || errCode_Left || errCode_Right || ABS(rtY_Left.n_mot) > COMM_N_STILL || ABS(rtY_Right.n_mot) > COMM_N_STILL) {
+    commState = COMM_STATE_ERR_READY;
+    return 1;
+  }
+
+  commRoutine = routine;
+  commStore   = store;
+  commSettle  = (uint16_t)((uint32_t)pwmFreqGet() * COMM_SETTLE_TIME / 1000);
+  commHallStep = ((uint32_t)COMM_ANG_360 << 8) * COMM_HALL_FREQ / pwmFreqGet();
+  commHallRot  = (uint16_t)((uint32_t)pwmFreqGet() * COMM_HALL_REVS / COMM_HALL_FREQ);
+  commHallDeb  = (uint16_t)((uint32_t)pwmFreqGet() * COMM_HALL_DEB / (360 * COMM_HALL_FREQ));
+  if (routine == COMM_TUNE_CURR) {
+    commRef   = 0;
+    commRelay = TUNE_CURR_RELAY;
+    commHyst  = TUNE_CURR_HYST * A2BIT_CONV / 1000;
+  } else {                                        // speed tuning, identification
+    commRef   = TUNE_N_REF;
+    commRelay = TUNE_SPD_RELAY;
+    commHyst  = TUNE_SPD_HYST;
+  }
+  for (uint8_t i = 0; i < 2; i++) {
+    CommMotor *m = &commMot[i];
+    m->cnt    = 0;
+    m->inp    = 0;
+    m->bias   = 0;
+    m->out    = 1;
+    m->per    = 0;
+    m->uSumT  = m->ySumT  = 0;
+    m->vAcc   = 0;
+    m->vInj   = 0;
+    m->dir    = 0;
+    m->steps  = 0;
+    m->vSum[0] = m->vSum[1] = m->iSum[0] = m->iSum[1] = 0;
+    m->tauSum = 0;
+    m->vv     = m->ii = m->vi = m->vxi = 0;
+    m->nSum   = 0;
+    m->ang    = 0;
+    m->edgeCnt = 0;
+    memset(m->eSum, 0, sizeof(m->eSum));
+    memset(m->eCnt, 0, sizeof(m->eCnt));
+  }
+  commTick  = HAL_GetTick();
+  commState = COMM_STATE_BUSY;
+  commMot[COMM_MOTOR_LEFT].state  = COMM_M_SETTLE;  // the ISR starts with these writes
+  commMot[COMM_MOTOR_RIGHT].state = COMM_M_SETTLE;
+  return 1;
+}
+
+uint8_t Commission_State(void) {
+  return commState;
+}
+
+/* Identified motor parameter COMM_PAR_xxx, 0 before the first identification */
+int32_t Commission_MotorPar(uint8_t par) {
+  return (par < COMM_PAR_COUNT) ? commMotPar[par] : 0;
+}
+
+/* Called from the main loop: supervises the running routine and computes its results */
+void Commission_Process(void) {
+  uint8_t stL, stR;
+
+  if (commState != COMM_STATE_BUSY) {
+    return;
+  }
+
+  stL = commMot[COMM_MOTOR_LEFT].state;
+  stR = commMot[COMM_MOTOR_RIGHT].state;
+  if (!enable || errCode_Left || errCode_Right || stL == COMM_M_FAIL || stR == COMM_M_FAIL) {
+    commStop(COMM_STATE_ERR_ABORT);
+  } else if (stL == COMM_M_DONE && stR == COMM_M_DONE) {
+    if (commRoutine == COMM_IDENT) {
+      commStop(identFinish());
+    } else if (commRoutine == COMM_HALL_CAL) {
+      commStop(hallFinish());
+    } else {
+      commStop(tuneFinish());
+    }
+  } else if (HAL_GetTick() - commTick > TUNE_TIMEOUT) {
+    commStop(COMM_STATE_ERR_TIMEOUT);
+  }
+}
+
+#endif
@@ -1,24 +1,41 @@
-#include <stdio.h>
 #include <string.h>
 #include "stm32f1xx_hal.h"
 #include "defines.h"
 #include "setup.h"
 #include "config.h"
 #include "comms.h"
+#include "serial.h"
+#include "format.h"
 
-extern UART_HandleTypeDef huart2;
-extern UART_HandleTypeDef huart3;
-
-static volatile uint8_t uart_buf[100];
 static volatile int16_t ch_buf[8];
 //volatile char char_buf[300];
 
+/* Queue len bytes on the debug port. The message is either queued completely or dropped and counted.
+ * Can be called from the main loop and from interrupts. Returns len if queued, 0 if dropped */
+uint16_t consoleWrite(const uint8_t *data, uint16_t len) {
+  #if defined(DEBUG_SERIAL_USART2) || defined(DEBUG_SERIAL_USART3)
+    return Serial_Write(SERIAL_PORT_DEBUG, data, len);
+  #else
+    return 0;
+  #endif
+}
+
+/* Free space in the debug port TX ring buffer [bytes] */
+uint16_t consoleTxFree(void) {
+  #if defined(DEBUG_SERIAL_USART2) || defined(DEBUG_SERIAL_USART3)
+    return Serial_TxFree(SERIAL_PORT_DEBUG);
+  #else
+    return 0;
+  #endif
+}
+
 void setScopeChannel(uint8_t ch, int16_t val) {
   ch_buf[ch] = val;
 }
 
 void consoleScope(void) {
   #if defined DEBUG_SERIAL_SERVOTERM && (defined DEBUG_SERIAL_USART2 || defined DEBUG_SERIAL_USART3)
+    uint8_t uart_buf[10];
     uart_buf[0] = 0xff;
     uart_buf[1] = CLAMP(ch_buf[0]+127, 0, 255);
     uart_buf[2] = CLAMP(ch_buf[1]+127, 0, 255);
@@ -30,38 +47,28 @@ void consoleScope(void) {
     uart_buf[8] = CLAMP(ch_buf[7]+127, 0, 255);
     uart_buf[9] = '\n';
 
-    if(UART_DMA_CHANNEL->CNDTR == 0) {
-      UART_DMA_CHANNEL->CCR &= ~DMA_CCR_EN;
-      UART_DMA_CHANNEL->CNDTR = 10;
-      UART_DMA_CHANNEL->CMAR  = (uint32_t)uart_buf;
-      UART_DMA_CHANNEL->CCR |= DMA_CCR_EN;
-    }
+    consoleWrite(uart_buf, 10);
   #endif
 
   #if defined DEBUG_SERIAL_ASCII && (defined DEBUG_SERIAL_USART2 || defined DEBUG_SERIAL_USART3)
-    // memset((void *)(uintptr_t)uart_buf, 0, sizeof(uart_buf));
-    int strLength;
-    strLength = sprintf((char *)(uintptr_t)uart_buf,
-                "1:%i 2:%i 3:%i 4:%i 5:%i 6:%i 7:%i 8:%i\r\n",
-                ch_buf[0], ch_buf[1], ch_buf[2], ch_buf[3], ch_buf[4], ch_buf[5], ch_buf[6], ch_buf[7]);
-
-    if(UART_DMA_CHANNEL->CNDTR == 0) {
-      UART_DMA_CHANNEL->CCR    &= ~DMA_CCR_EN;
-      UART_DMA_CHANNEL->CNDTR   = strLength;
-      UART_DMA_CHANNEL->CMAR    = (uint32_t)uart_buf;
-      UART_DMA_CHANNEL->CCR    |= DMA_CCR_EN;
+    // "1:345 2:1337 3:0 4:0 5:0 6:0 7:0 8:0\r\n"
+    char uart_buf[8 * (3 + FMT_BUF_SIZE) + 2];
+    uint8_t strLength = 0;
+    for (uint8_t i = 0; i < 8; i++) {
+      uart_buf[strLength++] = '1' + i;
+      uart_buf[strLength++] = ':';
+      strLength            += fmtInt(&uart_buf[strLength], ch_buf[i]);
+      uart_buf[strLength++] = (i < 7) ? ' ' : '\r';
     }
+    uart_buf[strLength++] = '\n';
+
+    consoleWrite((uint8_t *)uart_buf, strLength);
   #endif
 }
 
 void consoleLog(char *message)
 {
   #if defined DEBUG_SERIAL_ASCII && (defined DEBUG_SERIAL_USART2 || defined DEBUG_SERIAL_USART3)
-    if(UART_DMA_CHANNEL->CNDTR == 0) {
-      UART_DMA_CHANNEL->CCR    &= ~DMA_CCR_EN;
-      UART_DMA_CHANNEL->CNDTR   = strlen((char *)(uintptr_t)message);
-      UART_DMA_CHANNEL->CMAR    = (uint32_t)message;
-      UART_DMA_CHANNEL->CCR    |= DMA_CCR_EN;
-    }
+    consoleWrite((uint8_t *)message, strlen(message));
   #endif
 }
@@ -0,0 +1,179 @@
+/*
+* This file implements a small EEPROM emulation in the internal Flash,
+* used to store calibration data that must survive a power cycle.
+* It is a simplified version of the algorithm described in ST AN2594.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stm32f1xx_hal.h"
+#include "eeprom.h"
+
+#define EE_PAGE_STATUS(page)    (*(__IO uint16_t *)(page))
+#define EE_RECORD(addr)         (*(__IO uint32_t *)(addr))
+#define EE_OTHER_PAGE(page)     (((page) == EE_PAGE0_BASE) ? EE_PAGE1_BASE : EE_PAGE0_BASE)
+
+static uint16_t EE_ErasePage(uint32_t page) {
+  FLASH_EraseInitTypeDef erase;
+  uint32_t pageError;
+
+  erase.TypeErase   = FLASH_TYPEERASE_PAGES;
+  erase.Banks       = FLASH_BANK_1;
+  erase.PageAddress = page;
+  erase.NbPages     = 1;
+
+  if (HAL_FLASHEx_Erase(&erase, &pageError) != HAL_OK) {
+    return EE_FLASH_ERROR;
+  }
+  return EE_OK;
+}
+
+static uint16_t EE_SetPageStatus(uint32_t page, uint16_t status) {
+  if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, page, status) != HAL_OK) {
+    return EE_FLASH_ERROR;
+  }
+  return EE_OK;
+}
+
+static uint16_t EE_Format(void) {
+  if (EE_ErasePage(EE_PAGE0_BASE) != EE_OK || EE_ErasePage(EE_PAGE1_BASE) != EE_OK) {
+    return EE_FLASH_ERROR;
+  }
+  return EE_SetPageStatus(EE_PAGE0_BASE, EE_VALID_PAGE);
+}
+
+/* Returns the base address of the page holding the valid data, 0 if none */
+static uint32_t EE_FindValidPage(void) {
+  if (EE_PAGE_STATUS(EE_PAGE0_BASE) == EE_VALID_PAGE) {
+    return EE_PAGE0_BASE;
+  }
+  if (EE_PAGE_STATUS(EE_PAGE1_BASE) == EE_VALID_PAGE) {
+    return EE_PAGE1_BASE;
+  }
+  return 0;
+}
+
+/* Search the latest record of a virtual address in a page */
+static uint16_t EE_ReadFromPage(uint32_t page, uint16_t VirtAddress, uint16_t *Data) {
+  uint32_t addr;
+
+  for (addr = page + EE_PAGE_SIZE - 4; addr >= page + 4; addr -= 4) {
+    if ((uint16_t)(EE_RECORD(addr) >> 16) == VirtAddress) {
+      *Data = (uint16_t)EE_RECORD(addr);
+      return EE_OK;
+    }
+  }
+  return EE_NOT_FOUND;
+}
+
+/* Append a record in the first free slot of a page. Returns EE_NOT_FOUND if the page is full */
+static uint16_t EE_AppendToPage(uint32_t page, uint16_t VirtAddress, uint16_t Data) {
+  uint32_t addr;
+
+  for (addr = page + 4; addr < page + EE_PAGE_SIZE; addr += 4) {
+    if (EE_RECORD(addr) == 0xFFFFFFFF) {
+      if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, addr, Data) != HAL_OK ||
+          HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, addr + 2, VirtAddress) != HAL_OK) {
+        return EE_FLASH_ERROR;
+      }
+      return EE_OK;
+    }
+  }
+  return EE_NOT_FOUND;
+}
+
+/* Copy the latest value of every variable to the other page, starting with the new value */
+static uint16_t EE_PageTransfer(uint32_t oldPage, uint16_t VirtAddress, uint16_t Data) {
+  uint32_t newPage = EE_OTHER_PAGE(oldPage);
+  uint16_t varAddr, varData, status;
+
+  if (EE_SetPageStatus(newPage, EE_RECEIVE_DATA) != EE_OK) {
+    return EE_FLASH_ERROR;
+  }
+  if ((status = EE_AppendToPage(newPage, VirtAddress, Data)) != EE_OK) {
+    return status;
+  }
+  for (varAddr = 1; varAddr <= EE_NB_OF_VAR; varAddr++) {
+    if (varAddr != VirtAddress && EE_ReadFromPage(oldPage, varAddr, &varData) == EE_OK) {
+      if ((status = EE_AppendToPage(newPage, varAddr, varData)) != EE_OK) {
+        return status;
+      }
+    }
+  }
+  if (EE_ErasePage(oldPage) != EE_OK) {
+    return EE_FLASH_ERROR;
+  }
+  return EE_SetPageStatus(newPage, EE_VALID_PAGE);
+}
+
+/* Restore the pages to a known good state after a reset (e.g. power loss during a page transfer) */
+uint16_t EE_Init(void) {
+  uint16_t status0, status1, status = EE_OK;
+
+  HAL_FLASH_Unlock();
+
+  status0 = EE_PAGE_STATUS(EE_PAGE0_BASE);
+  status1 = EE_PAGE_STATUS(EE_PAGE1_BASE);
+
+  if (status0 == EE_VALID_PAGE && status1 != EE_VALID_PAGE) {
+    if (status1 != EE_ERASED) {           // Interrupted transfer: page 0 still holds all data
+      status = EE_ErasePage(EE_PAGE1_BASE);
+    }
+  } else if (status1 == EE_VALID_PAGE && status0 != EE_VALID_PAGE) {
+    if (status0 != EE_ERASED) {           // Interrupted transfer: page 1 still holds all data
+      status = EE_ErasePage(EE_PAGE0_BASE);
+    }
+  } else if (status0 == EE_RECEIVE_DATA && status1 == EE_ERASED) {
+    status = EE_SetPageStatus(EE_PAGE0_BASE, EE_VALID_PAGE);  // Transfer complete, old page already erased
+  } else if (status1 == EE_RECEIVE_DATA && status0 == EE_ERASED) {
+    status = EE_SetPageStatus(EE_PAGE1_BASE, EE_VALID_PAGE);  // Transfer complete, old page already erased
+  } else {
+    status = EE_Format();                 // First use or invalid state
+  }
+
+  HAL_FLASH_Lock();
+  return status;
+}
+
+uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t *Data) {
+  uint32_t page = EE_FindValidPage();
+
+  if (page == 0) {
+    return EE_NO_VALID_PAGE;
+  }
+  return EE_ReadFromPage(page, VirtAddress, Data);
+}
+
+uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data) {
+  uint32_t page = EE_FindValidPage();
+  uint16_t status, oldData;
+
+  if (page == 0) {
+    return EE_NO_VALID_PAGE;
+  }
+  if (EE_ReadFromPage(page, VirtAddress, &oldData) == EE_OK && oldData == Data) {
+    return EE_OK;                         // Nothing to do, save a Flash write cycle
+  }
+
+  HAL_FLASH_Unlock();
+  status = EE_AppendToPage(page, VirtAddress, Data);
+  if (status == EE_NOT_FOUND) {           // Page full
+    status = EE_PageTransfer(page, VirtAddress, Data);
+  }
+  HAL_FLASH_Lock();
+
+  return status;
+}
@@ -0,0 +1,75 @@
+/*
+* This file implements small integer to text conversions for the debug
+* outputs (serial console and LCD), replacing sprintf and the double
+* arithmetic of the LCD driver.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "format.h"
+
+/* Write the decimal digits of value in reverse order, at least minDigits digits. Returns the number of digits */
+static uint8_t fmtDigitsRev(char *rev, uint32_t value, uint8_t minDigits) {
+  uint8_t n = 0;
+
+  do {
+    uint32_t q = value / 10;                // the compiler turns the division by a constant into a multiplication
+    rev[n++]   = (char)('0' + (value - q * 10));
+    value      = q;
+  } while (value || n < minDigits);
+  return n;
+}
+
+uint8_t fmtFixed(char *buf, int32_t value, uint8_t decimals) {
+  char     rev[11];
+  uint32_t mag = (value < 0) ? -(uint32_t)value : (uint32_t)value;
+  uint8_t  len = 0;
+  uint8_t  n;
+
+  if (decimals > 9) {
+    decimals = 9;
+  }
+  if (value < 0) {
+    buf[len++] = '-';
+  }
+  n = fmtDigitsRev(rev, mag, decimals + 1);  // at least one digit before the decimal point
+  while (n > 0) {
+    if (n == decimals) {
+      buf[len++] = '.';
+    }
+    buf[len++] = rev[--n];
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+uint8_t fmtInt(char *buf, int32_t value) {
+  return fmtFixed(buf, value, 0);
+}
+
+uint8_t fmtPad(char *buf, int32_t value, uint8_t width, char pad) {
+  char    tmp[FMT_BUF_SIZE];
+  uint8_t n = fmtInt(tmp, value);
+  uint8_t len = 0;
+
+  while (len + n < width) {
+    buf[len++] = pad;
+  }
+  for (uint8_t i = 0; i <= n; i++) {        // including the zero
+    buf[len + i] = tmp[i];
+  }
+  return len + n;
+}
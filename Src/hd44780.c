@@ -6,6 +6,7 @@
  */
 
 #include "hd44780.h"
+#include "format.h"
 
 uint32_t PCF8574_Type0Pins[8] = { 4, 5, 6, 7, 0, 1, 2, 3 };
 uint8_t LCDerrorFlag = 0;
@@ -342,39 +343,29 @@ LCD_RESULT LCD_WriteNumber(LCD_PCF8574_HandleTypeDef* handle, unsigned long n,
 	return LCD_WriteString(handle, str);
 }
 
-LCD_RESULT LCD_WriteFloat(LCD_PCF8574_HandleTypeDef* handle, double number,
-		uint8_t digits) {
-	// Handle negative numbers
-	if (number < 0.0) {
-		LCD_WriteString(handle,"-");
-		number = -number;
-	}
+LCD_RESULT LCD_WriteInt(LCD_PCF8574_HandleTypeDef* handle, int32_t number) {
+	char buf[FMT_BUF_SIZE];
 
-	// Round correctly so that print(1.999, 2) prints as "2.00"
-	double rounding = 0.5;
-	for (uint8_t i = 0; i < digits; ++i)
-		rounding /= 10.0;
+	fmtInt(buf, number);
+	return LCD_WriteString(handle, buf);
+}
 
-	number += rounding;
+LCD_RESULT LCD_WriteIntPad(LCD_PCF8574_HandleTypeDef* handle, int32_t number,
+		uint8_t width) {
+	char buf[FMT_BUF_SIZE];
 
-	// Extract the integer part of the number and print it
-	unsigned long int_part = (unsigned long) number;
-	double remainder = number - (double) int_part;
-	LCD_WriteNumber(handle,int_part,10);
+	if (width > FMT_BUF_SIZE - 1)
+		width = FMT_BUF_SIZE - 1;
+	fmtPad(buf, number, width, ' ');
+	return LCD_WriteString(handle, buf);
+}
 
-	// Print the decimal point, but only if there are digits beyond
-	if (digits > 0) {
-		LCD_WriteString(handle,".");
-	}
+LCD_RESULT LCD_WriteFixed(LCD_PCF8574_HandleTypeDef* handle, int32_t number,
+		uint8_t digits) {
+	char buf[FMT_BUF_SIZE];
 
-	// Extract digits from the remainder one at a time
-	while (digits-- > 0) {
-		remainder *= 10.0;
-		int toPrint = (int)(remainder);
-		LCD_WriteNumber(handle,toPrint,10);
-		remainder -= toPrint;
-	}
-	return LCD_OK;
+	fmtFixed(buf, number, digits);
+	return LCD_WriteString(handle, buf);
 }
 
 LCD_RESULT LCD_EntryModeSet(LCD_PCF8574_HandleTypeDef* handle,
@@ -27,6 +27,12 @@
 #include "config.h"
 #include "comms.h"
 #include "hd44780.h"
+#include "eeprom.h"
+#include "capture.h"
+#include "serial.h"
+#include "param.h"
+#include "bus.h"
+#include "commission.h"
 
 // Matlab includes and defines - from auto-code generation
 // ###############################################################################
@@ -62,9 +68,6 @@ extern ADC_HandleTypeDef hadc2;
 extern volatile adc_buf_t adc_buffer;
 LCD_PCF8574_HandleTypeDef lcd;
 extern I2C_HandleTypeDef hi2c2;
-extern UART_HandleTypeDef huart2;
-extern UART_HandleTypeDef huart3;
-static UART_HandleTypeDef huart;
 
 #if defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)
 typedef struct{
@@ -74,11 +77,13 @@ typedef struct{
   uint16_t  checksum;
 } Serialcommand;
 static volatile Serialcommand command;
+#endif
+#if defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3) || defined(CONTROL_BUS_USART2)
 static int16_t timeoutCnt   = 0;  // Timeout counter for Rx Serial command
 #endif
 static uint8_t timeoutFlag  = 0;  // Timeout Flag for Rx Serial command: 0 = OK, 1 = Problem detected (line disconnected or wrong Rx data)
 
-#if defined(FEEDBACK_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART3)
+#if (defined(FEEDBACK_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART3)) && !defined(FEEDBACK_TELEMETRY)
 typedef struct{
   uint16_t  start;
   int16_t   cmd1;
@@ -109,9 +114,13 @@ static int16_t steerFixdt;              // local fixed-point variable for steeri
 static int16_t speedFixdt;              // local fixed-point variable for speed low-pass filter
 static int16_t steerRateFixdt;          // local fixed-point variable for steering rate limiter
 static int16_t speedRateFixdt;          // local fixed-point variable for speed rate limiter
+static int16_t speedFixdtPrev;          // filtered speed and steer of the previous loop, for the acceleration reference
+static int16_t steerFixdtPrev;
 
 extern volatile int pwml;               // global variable for pwm left. -1000 to 1000
 extern volatile int pwmr;               // global variable for pwm right. -1000 to 1000
+extern volatile int accl;               // global variable for the acceleration reference left [pwm/s], cascaded SPEED mode
+extern volatile int accr;               // global variable for the acceleration reference right [pwm/s]
 
 extern uint8_t buzzerFreq;              // global variable for the buzzer pitch. can be 1, 2, 3, 4, 5, 6, 7...
 extern uint8_t buzzerPattern;           // global variable for the buzzer pattern. can be 1, 2, 3, 4, 5, 6, 7...
@@ -119,6 +128,8 @@ extern uint8_t buzzerPattern;           // global variable for the buzzer patter
 extern uint8_t enable;                  // global variable for motor enable
 
 extern volatile uint32_t timeout;       // global variable for timeout
+extern volatile uint32_t isrCycles;     // motor control ISR duration in CPU cycles
+extern volatile uint32_t isrCyclesMax;  // maximum motor control ISR duration in CPU cycles
 extern int16_t batVoltage;              // global variable for battery voltage
 
 static uint32_t inactivity_timeout_counter;
@@ -127,13 +138,27 @@ extern uint8_t nunchuck_data[6];
 #ifdef CONTROL_PPM
 extern volatile uint16_t ppm_captured_value[PPM_NUM_CHANNELS+1];
 #endif
+#ifdef CONTROL_ADC
+extern volatile uint16_t adc1Avg;       // ADC1 input averaged in the DMA interrupt
+extern volatile uint16_t adc2Avg;       // ADC2 input averaged in the DMA interrupt
+
+#define ADC_CAL_MARKER  0xAD1C          // marks a valid ADC calibration in the EEPROM emulation
+static uint16_t adc1Min = ADC1_MIN;     // ADC calibration: compile-time defaults, overwritten by the values stored in Flash
+static uint16_t adc1Mid = ADC1_MID;
+static uint16_t adc1Max = ADC1_MAX;
+static uint16_t adc2Min = ADC2_MIN;
+static uint16_t adc2Mid = ADC2_MID;
+static uint16_t adc2Max = ADC2_MAX;
+#endif
 
 #define SPEED_MODE_FAST 0
 #define SPEED_MODE_SLOW 1
 #define SPEED_MODE_TURBO 2
 //uint8_t goSlow = false;                 // Slow mode
 uint8_t speedMode = SPEED_MODE_FAST;
-const int32_t throttle_mid = ADC1_MIN + ((ADC1_MAX - ADC1_MIN) / 2);
+#ifdef CONTROL_ADC
+static uint16_t throttle_mid = ADC1_MIN + ((ADC1_MAX - ADC1_MIN) / 2);
+#endif
 
 void poweroff(void) {
   //  if (abs(speed) < 20) {  // wait for the speed to drop, then shut down -> this is commented out for SAFETY reasons
@@ -149,6 +174,220 @@ void poweroff(void) {
   //  }
 }
 
+/* Set a new PWM frequency and store it in Flash. Only call this with the motors disabled: writing the Flash stalls the CPU */
+uint8_t pwmFreqStore(uint16_t freq) {
+  if (enable || !pwmFreqSet(freq)) {
+    return 0;
+  }
+  return EE_WriteVariable(EE_ADDR_PWM_FREQ, freq) == EE_OK;
+}
+
+static const uint16_t ctrlGainAddr[CTRL_GAIN_COUNT] = {EE_ADDR_ID_KP, EE_ADDR_ID_KI, EE_ADDR_IQ_KP, EE_ADDR_IQ_KI, EE_ADDR_N_KP, EE_ADDR_N_KI,
+                                                       EE_ADDR_NC_KP, EE_ADDR_NC_KI, EE_ADDR_ACC_FF};
+
+/* Set a PI gain and store it in Flash. Only call this with the motors disabled: writing the Flash stalls the CPU */
+uint8_t ctrlGainStore(uint8_t gain, uint16_t val) {
+  if (enable || gain >= CTRL_GAIN_COUNT) {
+    return 0;
+  }
+  ctrlGainSet(gain, val);
+  return EE_WriteVariable(ctrlGainAddr[gain], val) == EE_OK;
+}
+
+/* Load the PI gains from Flash (auto-tuning or parameter protocol). Keep the BLDC_controller_data.c defaults if nothing was stored */
+static void ctrlGainLoad(void) {
+  uint16_t val;
+
+  for (uint8_t i = 0; i < CTRL_GAIN_COUNT; i++) {
+    if (EE_ReadVariable(ctrlGainAddr[i], &val) == EE_OK) {
+      ctrlGainSet(i, val);
+    }
+  }
+}
+
+/* Set the hall calibration of a motor and store it in Flash: the sectors of the hall codes 0..7 packed in 4 bits (2 variables),
+ * then the 6 edge offsets. Only call this with the motors disabled: writing the Flash stalls the CPU */
+uint8_t hallCalStore(uint8_t motor, const int8_t *hallToPos, const int16_t *ofs) {
+  uint16_t addr = (motor == 0) ? EE_ADDR_HALL_L : EE_ADDR_HALL_R;
+  uint16_t val[8];
+
+  if (enable) {
+    return 0;
+  }
+  hallCalSet(motor, hallToPos, ofs);
+  for (uint8_t i = 0; i < 8; i++) {
+    val[i] = (i < 2) ? (uint16_t)((hallToPos[4 * i] & 0xF) | (hallToPos[4 * i + 1] & 0xF) << 4 |
+                                  (hallToPos[4 * i + 2] & 0xF) << 8 | (hallToPos[4 * i + 3] & 0xF) << 12)
+                     : (uint16_t)ofs[i - 2];
+    if (EE_WriteVariable(addr + i, val[i]) != EE_OK) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Load the hall calibrations from Flash (commissioning). Keep the defaults (vec_hallToPos, no offsets) if nothing valid was stored:
+ * the codes 1..6 must map to the 6 sectors, the offsets must be within +/- 30 deg */
+static void hallCalLoad(void) {
+  int8_t   hallToPos[8];
+  int16_t  ofs[6];
+  uint16_t val;
+  uint8_t  used;
+
+  for (uint8_t motor = 0; motor < 2; motor++) {
+    uint16_t addr = (motor == 0) ? EE_ADDR_HALL_L : EE_ADDR_HALL_R;
+    uint8_t  ok   = 1;
+    for (uint8_t i = 0; i < 8 && ok; i++) {
+      ok = (EE_ReadVariable(addr + i, &val) == EE_OK);
+      if (i < 2) {
+        for (uint8_t j = 0; j < 4; j++) {
+          hallToPos[4 * i + j] = (int8_t)((val >> (4 * j)) & 0xF);
+        }
+      } else {
+        ofs[i - 2] = (int16_t)val;
+        ok = ok && ABS(ofs[i - 2]) <= 23040 / 12;   // fixdt(1,16,6)
+      }
+    }
+    used = 0;
+    for (uint8_t i = 1; i < 7 && ok; i++) {
+      ok    = hallToPos[i] < 6 && !(used & (1U << hallToPos[i]));
+      used |= 1U << hallToPos[i];
+    }
+    if (ok) {
+      hallCalSet(motor, hallToPos, ofs);
+    }
+  }
+}
+
+/* Set the motor constants of the decoupling and store them in Flash. Only call this with the motors disabled: writing the Flash stalls the CPU */
+uint8_t motConstStore(uint16_t l, uint16_t flux, uint16_t r) {
+  if (enable) {
+    return 0;
+  }
+  motConstSet(l, flux, r);
+  return EE_WriteVariable(EE_ADDR_MOT_L, l) == EE_OK && EE_WriteVariable(EE_ADDR_MOT_FLUX, flux) == EE_OK &&
+         EE_WriteVariable(EE_ADDR_MOT_R, r) == EE_OK;
+}
+
+/* Load the motor constants from Flash (motor identification). Keep MOT_L, MOT_FLUX and MOT_R if nothing was stored */
+static void motConstLoad(void) {
+  uint16_t l, flux, r;
+
+  if (EE_ReadVariable(EE_ADDR_MOT_L, &l) == EE_OK && EE_ReadVariable(EE_ADDR_MOT_FLUX, &flux) == EE_OK && l && flux) {
+    if (EE_ReadVariable(EE_ADDR_MOT_R, &r) != EE_OK || r == 0) {
+      r = MOT_R;                                  // stored before MOT_R was added
+    }
+    motConstSet(l, flux, r);
+  }
+}
+
+#if (PWM_FREQ_ADAPT == 1)
+/* Load adaptive PWM frequency: lower the frequency at high current and low speed, go back to the nominal frequency
+ * for a quiet, low-ripple operation. The switching itself is done glitch-free by the control ISR, see pwmFreqSet() in bldc.c
+ */
+static void pwmFreqAdapt(void) {
+  static int16_t  iqFixdt     = 0;        // filtered motor current fixdt(1,16,4)
+  static uint16_t pwmFreqNom  = PWM_FREQ; // nominal PWM frequency
+  static uint8_t  highLoad    = 0;
+  static uint32_t holdTick    = 0;
+  int16_t iq, n;
+
+  iq = MAX(ABS(rtY_Left.r_devSignal1), ABS(rtY_Right.r_devSignal1));
+  n  = MAX(ABS(rtY_Left.n_mot), ABS(rtY_Right.n_mot));
+  filtLowPass16(iq, PWM_ADAPT_FILT, &iqFixdt);
+
+  if (!highLoad) {
+    pwmFreqNom = pwmFreqGet();            // follow the frequency selected by the user
+  }
+  if (pwmFreqNom == 0 || HAL_GetTick() - holdTick < PWM_ADAPT_HOLD) {
+    return;
+  }
+
+  if (!highLoad && iqFixdt > (PWM_ADAPT_I_HI * A2BIT_CONV) << 4 && n < PWM_ADAPT_N_LO) {
+    highLoad = pwmFreqSet(PWM_FREQ_LOAD);
+    holdTick = HAL_GetTick();
+  } else if (highLoad && (iqFixdt < (PWM_ADAPT_I_LO * A2BIT_CONV) << 4 || n > PWM_ADAPT_N_HI)) {
+    pwmFreqSet(pwmFreqNom);
+    highLoad = 0;
+    holdTick = HAL_GetTick();
+  }
+}
+#endif
+
+#ifdef CONTROL_ADC
+/* Load the ADC calibration from Flash. Keep the config.h values if nothing was learned yet */
+static void adcCalibLoad(void) {
+  uint16_t marker, val;
+
+  if (EE_ReadVariable(EE_ADDR_ADC_CAL_VALID, &marker) != EE_OK || marker != ADC_CAL_MARKER) {
+    return;
+  }
+  if (EE_ReadVariable(EE_ADDR_ADC1_MIN, &val) == EE_OK) adc1Min = val;
+  if (EE_ReadVariable(EE_ADDR_ADC1_MID, &val) == EE_OK) adc1Mid = val;
+  if (EE_ReadVariable(EE_ADDR_ADC1_MAX, &val) == EE_OK) adc1Max = val;
+  if (EE_ReadVariable(EE_ADDR_ADC2_MIN, &val) == EE_OK) adc2Min = val;
+  if (EE_ReadVariable(EE_ADDR_ADC2_MID, &val) == EE_OK) adc2Mid = val;
+  if (EE_ReadVariable(EE_ADDR_ADC2_MAX, &val) == EE_OK) adc2Max = val;
+  throttle_mid = adc1Min + ((adc1Max - adc1Min) / 2);
+}
+
+/* Learn min/mid/max of both ADC inputs: mid is taken in the resting position, min/max during the sweep.
+ * A channel is only updated if the swept range is large enough, so a button on ADC2 can be left untouched.
+ * Only call this with the motors disabled: writing the Flash stalls the CPU.
+ */
+static void adcCalibrate(void) {
+  uint16_t a1Min = 4095, a1Max = 0, a2Min = 4095, a2Max = 0;
+  uint16_t a1Mid, a2Mid;
+  uint8_t  adc1Ok, adc2Ok;
+
+  consoleLog("-- ADC calibration --\r\n");
+  buzzerPattern = 0;
+  buzzerFreq    = 8;                      // resting position: leave the potis untouched
+  HAL_Delay(1000);
+  a1Mid         = adc1Avg;
+  a2Mid         = adc2Avg;
+  buzzerFreq    = 0;
+
+  for (uint32_t t = 0; t < ADC_CAL_SWEEP_TIME; t += DELAY_IN_MAIN_LOOP) {
+    HAL_Delay(DELAY_IN_MAIN_LOOP);
+    a1Min = MIN(a1Min, adc1Avg);
+    a1Max = MAX(a1Max, adc1Avg);
+    a2Min = MIN(a2Min, adc2Avg);
+    a2Max = MAX(a2Max, adc2Avg);
+    if (t % 500 == 0) {
+      HAL_GPIO_TogglePin(LED_PORT, LED_PIN);
+    }
+  }
+
+  adc1Ok = (a1Max - a1Min >= ADC_CAL_MIN_RANGE);
+  adc2Ok = (a2Max - a2Min >= ADC_CAL_MIN_RANGE);
+  if (adc1Ok) {
+    adc1Min = a1Min; adc1Mid = CLAMP(a1Mid, a1Min, a1Max); adc1Max = a1Max;
+    EE_WriteVariable(EE_ADDR_ADC1_MIN, adc1Min);
+    EE_WriteVariable(EE_ADDR_ADC1_MID, adc1Mid);
+    EE_WriteVariable(EE_ADDR_ADC1_MAX, adc1Max);
+  }
+  if (adc2Ok) {
+    adc2Min = a2Min; adc2Mid = CLAMP(a2Mid, a2Min, a2Max); adc2Max = a2Max;
+    EE_WriteVariable(EE_ADDR_ADC2_MIN, adc2Min);
+    EE_WriteVariable(EE_ADDR_ADC2_MID, adc2Mid);
+    EE_WriteVariable(EE_ADDR_ADC2_MAX, adc2Max);
+  }
+  throttle_mid = adc1Min + ((adc1Max - adc1Min) / 2);
+
+  if (adc1Ok || adc2Ok) {
+    EE_WriteVariable(EE_ADDR_ADC_CAL_VALID, ADC_CAL_MARKER);
+    consoleLog("-- ADC calibration saved --\r\n");
+    buzzerFreq = 6; HAL_Delay(100);       // 2 rising beeps: calibration saved
+    buzzerFreq = 4; HAL_Delay(100);
+  } else {
+    consoleLog("-- ADC calibration failed --\r\n");
+    buzzerFreq = 12; HAL_Delay(1000);     // long low beep: range too small, nothing saved
+  }
+  buzzerFreq = 0;
+}
+#endif
+
 
 int main(void) {
 
@@ -173,6 +412,10 @@ int main(void) {
 
   SystemClock_Config();
 
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;   // enable the DWT cycle counter for the ISR load measurement
+  DWT->CYCCNT       = 0;
+  DWT->CTRL        |= DWT_CTRL_CYCCNTENA_Msk;
+
   __HAL_RCC_DMA1_CLK_DISABLE();
   MX_GPIO_Init();
   MX_TIM_Init();
@@ -193,6 +436,7 @@ int main(void) {
   rtP_Left.b_selPhaABCurrMeas   = 1;            // Left motor measured current phases = {iA, iB} -> do NOT change
   rtP_Left.z_ctrlTypSel         = CTRL_TYP_SEL;
   rtP_Left.b_diagEna            = DIAG_ENA; 
+  rtP_Left.cf_currFilt          = CURR_FILT_COEF;
   rtP_Left.i_max                = (I_MOT_MAX * A2BIT_CONV) << 4;        // fixdt(1,16,4)
   rtP_Left.n_max                = N_MOT_MAX << 4;                       // fixdt(1,16,4)
   rtP_Left.b_fieldWeakEna       = FIELD_WEAK_ENA; 
@@ -204,6 +448,7 @@ int main(void) {
   rtP_Right.b_selPhaABCurrMeas  = 0;            // Left motor measured current phases = {iB, iC} -> do NOT change
   rtP_Right.z_ctrlTypSel        = CTRL_TYP_SEL;
   rtP_Right.b_diagEna           = DIAG_ENA; 
+  rtP_Right.cf_currFilt         = CURR_FILT_COEF;
   rtP_Right.i_max               = (I_MOT_MAX * A2BIT_CONV) << 4;        // fixdt(1,16,4)
   rtP_Right.n_max               = N_MOT_MAX << 4;                       // fixdt(1,16,4)
   rtP_Right.b_fieldWeakEna      = FIELD_WEAK_ENA; 
@@ -230,6 +475,19 @@ int main(void) {
 
 // ###############################################################################
 
+  EE_Init();
+  #ifdef CONTROL_ADC
+    adcCalibLoad();
+  #endif
+
+  /* PWM frequency: stored value, or PWM_FREQ. The time dependent controller parameters are rescaled accordingly */
+  uint16_t pwmFreqStored = PWM_FREQ;
+  EE_ReadVariable(EE_ADDR_PWM_FREQ, &pwmFreqStored);
+  pwmFreqInit(pwmFreqStored);
+  ctrlGainLoad();
+  hallCalLoad();
+  motConstLoad();
+
   for (int i = 8; i >= 0; i--) {
     buzzerFreq = (uint8_t)i;
     HAL_Delay(100);
@@ -239,11 +497,11 @@ int main(void) {
   HAL_GPIO_WritePin(LED_PORT, LED_PIN, 1);
 
   #ifdef CONTROL_ADC
-    button2 = (uint8_t)(adc_buffer.l_rx2 > 2000);  // ADC2 - my button
+    button2 = (uint8_t)(adc2Avg > 2000);  // ADC2 - my button
 
     if (button2) {
       speedMode = SPEED_MODE_FAST;
-      if (adc_buffer.l_tx2 > throttle_mid) { // throttle held down
+      if (adc1Avg > throttle_mid) { // throttle held down
         speedMode = SPEED_MODE_TURBO;
         rtP_Left.n_max = N_MOT_MAX_TURBO << 4; 
         rtP_Right.n_max = N_MOT_MAX_TURBO << 4;
@@ -264,16 +522,12 @@ int main(void) {
     Nunchuck_Init();
   #endif
 
-  #if defined(CONTROL_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART2) || defined(DEBUG_SERIAL_USART2)
-    UART2_Init();
-    huart = huart2;
-  #endif
-  #if defined(CONTROL_SERIAL_USART3) || defined(FEEDBACK_SERIAL_USART3) || defined(DEBUG_SERIAL_USART3)
-    UART3_Init();
-    huart = huart3;
+  Serial_Init();
+  #ifdef CONTROL_BUS_USART2
+    Bus_Init();
   #endif
   #if defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)
-    HAL_UART_Receive_DMA(&huart, (uint8_t *)&command, sizeof(command));
+    HAL_UART_Receive_DMA(SERIAL_PORT_CONTROL->huart, (uint8_t *)&command, sizeof(command));
   #endif
 
 
@@ -331,7 +585,7 @@ int main(void) {
   #endif
 
   #ifdef CONTROL_ADC
-    while (adc_buffer.l_tx2 > throttle_mid) {
+    while (adc1Avg > throttle_mid) {
         HAL_Delay(100);
     }
   #endif
@@ -339,6 +593,8 @@ int main(void) {
 
   int16_t lastSpeedL = 0, lastSpeedR = 0;
   int16_t speedL = 0, speedR = 0;
+  int32_t accSpeed, accSteer, accL, accR;
+  uint32_t accTick, accDt, accTickPrev = DWT->CYCCNT;
 
   int16_t board_temp_adcFixdt = adc_buffer.temp << 4;  // Fixed-point filter output initialized with current ADC converted to fixed-point
   int16_t board_temp_adcFilt  = adc_buffer.temp;
@@ -346,7 +602,11 @@ int main(void) {
 
 
   while(1) {
+    #if defined(CONTROL_BUS_USART2) && (BUS_SYNC == 1)
+    Bus_WaitLoop();                 // main loop paced by the bus sync, see bus.h
+    #else
     HAL_Delay(DELAY_IN_MAIN_LOOP); //delay in ms
+    #endif
 
     #ifdef CONTROL_NUNCHUCK
       Nunchuck_Read();
@@ -361,32 +621,28 @@ int main(void) {
       cmd1 = CLAMP((ppm_captured_value[0] - INPUT_MID) * 2, INPUT_MIN, INPUT_MAX);
       cmd2 = CLAMP((ppm_captured_value[1] - INPUT_MID) * 2, INPUT_MIN, INPUT_MAX);
       button1 = ppm_captured_value[5] > INPUT_MID;
-      float scale = ppm_captured_value[2] / 1000.0f;
     #endif
 
     #ifdef CONTROL_ADC
-      // ADC values range: 0-4095, see ADC-calibration in config.h
+      // ADC values range: 0-4095, averaged in the DMA interrupt, see ADC-calibration in config.h
       #ifdef ADC1_MID_POT // ADC1 - speed -> cmd2 (default cmd1)
-        cmd2 = CLAMP((adc_buffer.l_tx2 - ADC1_MID) * INPUT_MAX / (ADC1_MAX - ADC1_MID), 0, INPUT_MAX) 
-              -CLAMP((ADC1_MID - adc_buffer.l_tx2) * INPUT_MAX / (ADC1_MID - ADC1_MIN), 0, INPUT_MAX);    // ADC1        
+        cmd2 = inputShape(adcToCmd(adc1Avg, adc1Min, adc1Mid, adc1Max, 1), ADC_DEADBAND, ADC_EXPO) * INPUT_MAX / 1000;   // ADC1
       #else
+        cmd2 = inputShape(adcToCmd(adc1Avg, adc1Min, adc1Mid, adc1Max, 0), ADC_DEADBAND, ADC_EXPO);                      // ADC1
         if (speedMode == SPEED_MODE_TURBO) {
-            cmd2 = CLAMP((adc_buffer.l_tx2 - ADC1_MIN) * INPUT_MAX / (ADC1_MAX - ADC1_MIN), 0, INPUT_MAX);    // ADC1
-        } else {
-            cmd2 = CLAMP((adc_buffer.l_tx2 - ADC1_MIN) * 1000 / (ADC1_MAX - ADC1_MIN), 0, 1000);    // ADC1
+            cmd2 = cmd2 * INPUT_MAX / 1000;
         }
       #endif
 
       #ifdef ADC2_MID_POT // ADC2 - steer/button
-        cmd1 = CLAMP((adc_buffer.l_rx2 - ADC2_MID) * INPUT_MAX / (ADC2_MAX - ADC2_MID), 0, INPUT_MAX)  
-              -CLAMP((ADC2_MID - adc_buffer.l_rx2) * INPUT_MAX / (ADC2_MID - ADC2_MIN), 0, INPUT_MAX);    // ADC2        
+        cmd1 = inputShape(adcToCmd(adc2Avg, adc2Min, adc2Mid, adc2Max, 1), ADC_DEADBAND, ADC_EXPO) * INPUT_MAX / 1000;   // ADC2
       #else
-        cmd1 = CLAMP((adc_buffer.l_rx2 - ADC2_MIN) * INPUT_MAX / (ADC2_MAX - ADC2_MIN), 0, INPUT_MAX);    // ADC2
+        cmd1 = inputShape(adcToCmd(adc2Avg, adc2Min, adc2Mid, adc2Max, 0), ADC_DEADBAND, ADC_EXPO) * INPUT_MAX / 1000;   // ADC2
       #endif  
 
       // use ADCs as button inputs:
-      button1 = (uint8_t)(adc_buffer.l_tx2 > 2000);  // ADC1
-      button2 = (uint8_t)(adc_buffer.l_rx2 > 2000);  // ADC2 - my button
+      button1 = (uint8_t)(adc1Avg > 2000);  // ADC1
+      button2 = (uint8_t)(adc2Avg > 2000);  // ADC2 - my button
 
       static uint8_t doBrake = false;
       doBrake = false;
@@ -441,8 +697,8 @@ int main(void) {
         // Check the received Start Frame. If it is NOT OK, most probably we are out-of-sync.
         // Try to re-sync by reseting the DMA
         if (command.start != START_FRAME && command.start != 0xFFFF) {
-          HAL_UART_DMAStop(&huart);                
-          HAL_UART_Receive_DMA(&huart, (uint8_t *)&command, sizeof(command));
+          HAL_UART_DMAStop(SERIAL_PORT_CONTROL->huart);
+          HAL_UART_Receive_DMA(SERIAL_PORT_CONTROL->huart, (uint8_t *)&command, sizeof(command));
         }
       }       
 
@@ -457,6 +713,34 @@ int main(void) {
 
     #endif
 
+    #ifdef CONTROL_BUS_USART2
+      int16_t busSteer, busSpeed;
+
+      // Commands are received by Bus_Tick() in the housekeeping interrupt, the timeout handling is the same as above
+      if (Bus_GetCmd(&busSteer, &busSpeed)) {
+        if (timeoutFlag) {
+          if (timeoutCnt-- <= 0)
+            timeoutFlag   = 0;
+        } else {
+          cmd1            = CLAMP(busSteer, INPUT_MIN, INPUT_MAX);
+          cmd2            = CLAMP(busSpeed, INPUT_MIN, INPUT_MAX);
+          timeoutCnt      = 0;
+        }
+      } else if (timeoutCnt++ >= SERIAL_TIMEOUT) {
+        timeoutFlag       = 1;
+        timeoutCnt        = SERIAL_TIMEOUT;
+      }
+
+      if (timeoutFlag) {                        // In case of timeout bring the system to a Safe State
+        ctrlModReq  = 0;
+        cmd1        = 0;
+        cmd2        = 0;
+      } else {
+        ctrlModReq  = ctrlModReqRaw;
+      }
+      timeout = 0;
+    #endif
+
 
     // ####### MOTOR ENABLING: Only if the initial input is very small (for SAFETY) #######
     if (enable == 0 && (cmd1 > -50 && cmd1 < 50) && (cmd2 > -50 && cmd2 < 50)){
@@ -499,29 +783,80 @@ int main(void) {
         mixerFcn(speedFixdt, steerFixdt, &speedR, &speedL, SPEED_COEFFICIENT);
     }
 
+    // ####### ACCELERATION REFERENCE #######
+    // Rate of the mixer outputs [pwm/s], from the rate limited and filtered speed and steer (fixdt(1,16,4) per loop) and the measured
+    // loop period: the loop takes longer than DELAY_IN_MAIN_LOOP. 0 at the input limits
+    accTick  = DWT->CYCCNT;
+    accDt    = MAX(accTick - accTickPrev, 1);
+    accSpeed = (speedFixdt - speedFixdtPrev) * (int16_t)(speedMode == SPEED_MODE_TURBO ? SPEED_COEFFICIENT_TURBO : SPEED_COEFFICIENT);
+    accSteer = (steerFixdt - steerFixdtPrev) * (int16_t)STEER_COEFFICIENT;
+    accL     = (int32_t)(((int64_t)(accSpeed + accSteer) * (SystemCoreClock >> 4) / accDt) >> 14);
+    accR     = (int32_t)(((int64_t)(accSpeed - accSteer) * (SystemCoreClock >> 4) / accDt) >> 14);
+    accL     = (speedL > INPUT_MIN && speedL < INPUT_MAX) ? CLAMP(accL, -32767, 32767) : 0;
+    accR     = (speedR > INPUT_MIN && speedR < INPUT_MAX) ? CLAMP(accR, -32767, 32767) : 0;
+    speedFixdtPrev = speedFixdt;
+    steerFixdtPrev = steerFixdt;
+    accTickPrev    = accTick;
+
     // ####### SET OUTPUTS (if the target change is less than +/- 50) #######
     if ((speedL > lastSpeedL-50 && speedL < lastSpeedL+50) && (speedR > lastSpeedR-50 && speedR < lastSpeedR+50) && timeout < TIMEOUT) {
       #ifdef INVERT_R_DIRECTION
         pwmr = speedR;
+        accr = accR;
       #else
         pwmr = -speedR;
+        accr = -accR;
       #endif
       #ifdef INVERT_L_DIRECTION
         pwml = -speedL;
+        accl = -accL;
       #else
         pwml = speedL;
+        accl = accL;
       #endif
+    } else {
+      accl = 0;
+      accr = 0;
     }
 
     lastSpeedL = speedL;
     lastSpeedR = speedR;
 
+    // ####### LOAD ADAPTIVE PWM FREQUENCY #######
+    #if (PWM_FREQ_ADAPT == 1)
+      pwmFreqAdapt();
+    #endif
 
     // ####### CALC BOARD TEMPERATURE #######
     filtLowPass16(adc_buffer.temp, TEMP_FILT_COEF, &board_temp_adcFixdt);
     board_temp_adcFilt  = board_temp_adcFixdt >> 4;  // convert fixed-point to integer
     board_temp_deg_c    = (TEMP_CAL_HIGH_DEG_C - TEMP_CAL_LOW_DEG_C) * (board_temp_adcFilt - TEMP_CAL_LOW_ADC) / (TEMP_CAL_HIGH_ADC - TEMP_CAL_LOW_ADC) + TEMP_CAL_LOW_DEG_C;
 
+    // ####### DECOUPLING / BACK-EMF / LOAD FEEDFORWARD #######
+    #if (DECOUP_ENA == 1 || DOB_BW > 0)
+      decoupUpdate();                 // the coefficients follow the battery voltage
+    #endif
+
+    // ####### DEAD TIME COMPENSATION #######
+    #if (DT_COMP_ENA == 1)
+      dtCompUpdate();                 // the current band follows the battery voltage
+    #endif
+
+    // ####### CAPTURE COMMANDS AND DUMP #######
+    #ifdef CAPTURE_ENABLE
+      uint8_t captureDumping = Capture_Process();
+    #endif
+
+    // ####### PARAMETER PROTOCOL #######
+    #if defined(PARAM_SERIAL_USART2) || defined(PARAM_SERIAL_USART3)
+      Param_Process();
+    #endif
+
+    // ####### COMMISSIONING ROUTINES #######
+    #ifdef COMMISSION_ENABLE
+      Commission_Process();
+    #endif
+
     serialSendCounter++;              // Increment the counter
     if (serialSendCounter > 20) {     // Send data every 100 ms = 20 * 5 ms, where 5 ms is approximately the main loop duration
       serialSendCounter = 0;          // Reset the counter
@@ -529,19 +864,14 @@ int main(void) {
     #ifdef DEBUG_I2C_LCD
       static uint8_t LCDCounter = 0;
       if (LCDCounter % 10 == 0 && enable) { // Update LCD every second
-        // Clear first row
-        LCD_SetLocation(&lcd, 0, 0);
-        LCD_WriteString(&lcd, "                ");
-        LCD_SetLocation(&lcd, 0, 1);
-        LCD_WriteString(&lcd, "                ");
-
+        // Fixed width fields overwrite the previous values: no clearing of the rows
         // speedR and speedL -1000 to 1000, display as percentage
         LCD_SetLocation(&lcd, 0, 0);
         LCD_WriteString(&lcd, "L");
-        LCD_WriteFloat(&lcd, (double) (speedL/10), 0);
+        LCD_WriteIntPad(&lcd, speedL/10, 4);
         LCD_SetLocation(&lcd, 5, 0);
         LCD_WriteString(&lcd, "R");
-        LCD_WriteFloat(&lcd, (double) (speedR/10), 0);
+        LCD_WriteIntPad(&lcd, speedR/10, 4);
 
         // Battery percentage
         int16_t batPercentage = 100 * batVoltage / (BAT_FULL);
@@ -549,20 +879,18 @@ int main(void) {
           batPercentage = 100;
         if (batPercentage < 0)
           batPercentage = 0;
-        if (batPercentage < 100)
-          LCD_SetLocation(&lcd, 12, 0);
-        else
-          LCD_SetLocation(&lcd, 11, 0);
-
+        LCD_SetLocation(&lcd, 11, 0);
         LCD_WriteString(&lcd, "\x02"); // Battery icon
-        // batVoltage * BAT_CALIB_REAL_VOLTAGE / BAT_CALIB_ADC gives voltage x100
-        LCD_WriteFloat(&lcd, batPercentage, 0);
+        LCD_WriteIntPad(&lcd, batPercentage, 3);
         LCD_WriteString(&lcd, "%");
 
+        // Battery voltage: batVoltage * BAT_CALIB_REAL_VOLTAGE / BAT_CALIB_ADC gives voltage x100, displayed with one decimal
+        LCD_SetLocation(&lcd, 0, 1);
+        LCD_WriteFixed(&lcd, (int32_t)batVoltage * BAT_CALIB_REAL_VOLTAGE / BAT_CALIB_ADC / 10, 1);
+        LCD_WriteString(&lcd, "V ");
+
         LCD_SetLocation(&lcd, 10, 1);
-        LCD_WriteFloat(&lcd, (int16_t) cmd2, 0);
-        //LCD_SetLocation(&lcd, 0, 1);
-        //LCD_WriteFloat(&lcd, cmd2, 0);
+        LCD_WriteIntPad(&lcd, cmd2, 6);
       }
       LCDCounter++;
     #endif
@@ -570,20 +898,33 @@ int main(void) {
     // ####### DEBUG SERIAL OUT #######
     #if defined(DEBUG_SERIAL_USART2) || defined(DEBUG_SERIAL_USART3)
       #ifdef CONTROL_ADC
-        setScopeChannel(0, (int16_t)adc_buffer.l_tx2);        // 1: ADC1
-        setScopeChannel(1, (int16_t)adc_buffer.l_rx2);        // 2: ADC2
+        setScopeChannel(0, (int16_t)adc1Avg);                 // 1: ADC1
+        setScopeChannel(1, (int16_t)adc2Avg);                 // 2: ADC2
       #endif
       setScopeChannel(2, (int16_t)speedR);                    // 1: output command: [-1000, 1000]
       setScopeChannel(3, (int16_t)speedL);                    // 2: output command: [-1000, 1000]
       setScopeChannel(4, (int16_t)adc_buffer.batt1);          // 5: for battery voltage calibration
       setScopeChannel(5, (int16_t)(batVoltage * BAT_CALIB_REAL_VOLTAGE / BAT_CALIB_ADC)); // 6: for verifying battery voltage calibration
+      #ifdef DEBUG_ISR_LOAD
+      setScopeChannel(6, (int16_t)isrCycles);                 // 7: motor control ISR cycles per PWM period
+      setScopeChannel(7, (int16_t)isrCyclesMax);              // 8: maximum motor control ISR cycles per PWM period
+      #else
       setScopeChannel(6, (int16_t)board_temp_adcFilt);        // 7: for board temperature calibration
       setScopeChannel(7, (int16_t)board_temp_deg_c);          // 8: for verifying board temperature calibration
+      #endif
+      #ifdef CAPTURE_ENABLE
+      if (!captureDumping)                                    // the capture dump owns the serial port
+      #endif
       consoleScope();
+    #endif
 
     // ####### FEEDBACK SERIAL OUT #######
-    #elif defined(FEEDBACK_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART3)
-      if(UART_DMA_CHANNEL->CNDTR == 0) {
+    // The telemetry stream (FEEDBACK_TELEMETRY) is sent from the motor control ISR
+    #if (defined(FEEDBACK_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART3)) && !defined(FEEDBACK_TELEMETRY)
+      #if defined(CAPTURE_ENABLE) && ((defined(DEBUG_SERIAL_USART2) && defined(FEEDBACK_SERIAL_USART2)) || (defined(DEBUG_SERIAL_USART3) && defined(FEEDBACK_SERIAL_USART3)))
+      if (!captureDumping)                                    // the capture dump owns the serial port
+      #endif
+      {
         Feedback.start	        = (uint16_t)START_FRAME;
         Feedback.cmd1           = (int16_t)cmd1;
         Feedback.cmd2           = (int16_t)cmd2;
@@ -596,10 +937,7 @@ int main(void) {
         Feedback.checksum       = (uint16_t)(Feedback.start ^ Feedback.cmd1 ^ Feedback.cmd2 ^ Feedback.speedR ^ Feedback.speedL
                                   ^ Feedback.speedR_meas ^ Feedback.speedL_meas ^ Feedback.batVoltage ^ Feedback.boardTemp); 
 
-        UART_DMA_CHANNEL->CCR  &= ~DMA_CCR_EN;
-        UART_DMA_CHANNEL->CNDTR = sizeof(Feedback);
-        UART_DMA_CHANNEL->CMAR  = (uint32_t)&Feedback;
-        UART_DMA_CHANNEL->CCR  |= DMA_CCR_EN;          
+        Serial_Write(SERIAL_PORT_FEEDBACK, (const uint8_t *)&Feedback, sizeof(Feedback));
       }
     #endif      
     }    
@@ -608,7 +946,25 @@ int main(void) {
     // ####### POWEROFF BY POWER-BUTTON #######
     if (HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN)) {
       enable = 0;                                             // disable motors
-      while (HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN)) {}    // wait until button is released
+      #ifdef CONTROL_ADC
+      uint32_t buttonPressTick = HAL_GetTick();
+      uint8_t  adcCalReq = 0;
+      #endif
+      while (HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN)) {     // wait until button is released
+        #ifdef CONTROL_ADC
+        if (!adcCalReq && HAL_GetTick() - buttonPressTick > ADC_CAL_HOLD_TIME) {
+          adcCalReq     = 1;                                  // long press: beep until released, then calibrate instead of poweroff
+          buzzerPattern = 0;
+          buzzerFreq    = 5;
+        }
+        #endif
+      }
+      #ifdef CONTROL_ADC
+      if (adcCalReq) {
+        buzzerFreq = 0;
+        adcCalibrate();
+      } else
+      #endif
       if(__HAL_RCC_GET_FLAG(RCC_FLAG_SFTRST)) {               // do not power off after software reset (from a programmer/debugger)
         __HAL_RCC_CLEAR_RESET_FLAGS();                        // clear reset flags
       } else {
@@ -811,6 +1167,46 @@ void mixerFcn(int16_t rtu_speed, int16_t rtu_steer, int16_t *rty_speedR, int16_t
   *rty_speedL = CLAMP(*rty_speedL, INPUT_MIN, INPUT_MAX);
 }
 
+// ===========================================================
+  /* adcToCmd(u, min, mid, max, midPot);
+  * Inputs:       u                 = uint16 [0, 4095]
+  * Outputs:      cmd               = int16: midPot = 0 -> [0, 1000], midPot = 1 -> [-1000, 1000]
+  * Parameters:   min, mid, max     = ADC calibration values, min < mid < max for midPot = 1, min < max otherwise
+  */
+int16_t adcToCmd(uint16_t u, uint16_t min, uint16_t mid, uint16_t max, uint8_t midPot)
+{
+  int32_t tmp;
+
+  if (midPot) {
+    tmp = CLAMP(((int32_t)u - mid) * 1000 / MAX(max - mid, 1), 0, 1000)
+         -CLAMP(((int32_t)mid - u) * 1000 / MAX(mid - min, 1), 0, 1000);
+  } else {
+    tmp = CLAMP(((int32_t)u - min) * 1000 / MAX(max - min, 1), 0, 1000);
+  }
+
+  return (int16_t)tmp;
+}
+
+// ===========================================================
+  /* inputShape(u, deadband, expo);
+  * Inputs:       u         = int16 [-1000, 1000]
+  * Outputs:      y         = int16 [-1000, 1000]
+  * Parameters:   deadband  = [0, 999]: inputs below the deadband give 0, the rest is rescaled to keep the full output range
+  *               expo      = [0, 100] %: y = (1 - expo) * x + expo * x^3, with x normalized to 1
+  */
+int16_t inputShape(int16_t u, int16_t deadband, int16_t expo)
+{
+  int32_t x = ABS(u);
+
+  if (x <= deadband) {
+    return 0;
+  }
+  x = MIN((x - deadband) * 1000 / (1000 - deadband), 1000);
+  x = (x * (100 - expo) + ((x * x / 1000) * x / 1000) * expo) / 100;
+
+  return (int16_t)((u < 0) ? -x : x);
+}
+
 // ===========================================================
   /* rateLimiter16(int16_t u, int16_t rate, int16_t *y);
   * Inputs:       u     = int16
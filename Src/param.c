@@ -0,0 +1,245 @@
+/*
+* This file implements the parameter protocol: read, write and store
+* selected runtime parameters over a serial port, see param.h.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "stm32f1xx_hal.h"
+#include "defines.h"
+#include "config.h"
+#include "param.h"
+#include "serial.h"
+#include "telemetry.h"
+#include "crc.h"
+#include "commission.h"
+#include "BLDC_controller.h"
+#include "rtwtypes.h"
+
+#if defined(PARAM_SERIAL_USART2) || defined(PARAM_SERIAL_USART3)
+
+typedef struct {
+  uint16_t  start;
+  uint8_t   cmd;
+  uint8_t   id;
+  int32_t   value;
+  uint16_t  status;
+  uint16_t  crc;
+} ParamFrame;
+
+extern P rtP_Left;
+extern P rtP_Right;
+extern uint8_t ctrlModReqRaw;
+extern uint8_t ctrlModReq;
+extern uint8_t errCode_Left, errCode_Right;
+extern int16_t batVoltage;
+extern volatile uint32_t isrCyclesMax;
+
+static ParamFrame paramFrame;
+static uint8_t    paramLen = 0;                 // bytes of paramFrame received so far
+
+static int32_t paramRead(uint8_t id) {
+  switch (id) {
+    case PARAM_ID_PWM_FREQ:       return pwmFreqGet();
+    case PARAM_ID_CTRL_MODE:      return ctrlModReqRaw;
+    case PARAM_ID_N_MAX:          return rtP_Left.n_max >> 4;
+    case PARAM_ID_I_MAX:          return (rtP_Left.i_max >> 4) / A2BIT_CONV;
+    case PARAM_ID_BAT_VOLTAGE:    return batVoltage * BAT_CALIB_REAL_VOLTAGE / BAT_CALIB_ADC;
+    case PARAM_ID_ERR_CODE:       return errCode_Left | (errCode_Right << 8);
+    case PARAM_ID_ISR_CYCLES_MAX: return isrCyclesMax;
+    #ifdef FEEDBACK_TELEMETRY
+    case PARAM_ID_TELEM_DROPS:    return telemDropCnt;
+    #else
+    case PARAM_ID_TELEM_DROPS:    return 0;
+    #endif
+    case PARAM_ID_ID_KP:
+    case PARAM_ID_ID_KI:
+    case PARAM_ID_IQ_KP:
+    case PARAM_ID_IQ_KI:
+    case PARAM_ID_N_KP:
+    case PARAM_ID_N_KI:           return ctrlGainGet(id - PARAM_ID_ID_KP);
+    case PARAM_ID_NC_KP:
+    case PARAM_ID_NC_KI:
+    case PARAM_ID_ACC_FF:         return ctrlGainGet(id - PARAM_ID_NC_KP + CTRL_GAIN_NC_KP);
+    case PARAM_ID_ACC_FF_EST:     return accFfEstGet(0);
+    #ifdef COMMISSION_ENABLE
+    case PARAM_ID_TUNE:           return Commission_State();
+    case PARAM_ID_MOT_R:
+    case PARAM_ID_MOT_L:
+    case PARAM_ID_MOT_FLUX:       return Commission_MotorPar(id - PARAM_ID_MOT_R);
+    #else
+    case PARAM_ID_TUNE:
+    case PARAM_ID_MOT_R:
+    case PARAM_ID_MOT_L:
+    case PARAM_ID_MOT_FLUX:       return 0;
+    #endif
+  }
+  return 0;
+}
+
+static uint16_t paramWrite(uint8_t id, int32_t value) {
+  switch (id) {
+    case PARAM_ID_PWM_FREQ:
+      return pwmFreqSet((uint16_t)CLAMP(value, 0, 65535)) ? PARAM_OK : PARAM_ERR_RANGE;
+    case PARAM_ID_CTRL_MODE:
+      if (value < 0 || value > 4) {
+        return PARAM_ERR_RANGE;
+      }
+      ctrlModReqRaw = (uint8_t)value;
+      ctrlModReq    = (uint8_t)value;           // the serial timeout handling in main.c still forces 0 when needed
+      return PARAM_OK;
+    case PARAM_ID_N_MAX:                        // the limits can be lowered at runtime, not raised above config.h
+      if (value < 0 || value > N_MOT_MAX) {
+        return PARAM_ERR_RANGE;
+      }
+      rtP_Left.n_max  = (int16_t)(value << 4);  // fixdt(1,16,4)
+      rtP_Right.n_max = (int16_t)(value << 4);
+      return PARAM_OK;
+    case PARAM_ID_I_MAX:
+      if (value < 0 || value > I_MOT_MAX) {
+        return PARAM_ERR_RANGE;
+      }
+      rtP_Left.i_max  = (int16_t)((value * A2BIT_CONV) << 4);   // fixdt(1,16,4)
+      rtP_Right.i_max = (int16_t)((value * A2BIT_CONV) << 4);
+      return PARAM_OK;
+    case PARAM_ID_ISR_CYCLES_MAX:
+      isrCyclesMax = 0;
+      return PARAM_OK;
+    case PARAM_ID_ID_KP:
+    case PARAM_ID_ID_KI:
+    case PARAM_ID_IQ_KP:
+    case PARAM_ID_IQ_KI:
+    case PARAM_ID_N_KP:
+    case PARAM_ID_N_KI:
+      if (value < 0 || value > 65535) {
+        return PARAM_ERR_RANGE;
+      }
+      ctrlGainSet(id - PARAM_ID_ID_KP, (uint16_t)value);
+      return PARAM_OK;
+    case PARAM_ID_NC_KP:
+    case PARAM_ID_NC_KI:
+    case PARAM_ID_ACC_FF:
+      if (value < 0 || value > 65535) {
+        return PARAM_ERR_RANGE;
+      }
+      ctrlGainSet(id - PARAM_ID_NC_KP + CTRL_GAIN_NC_KP, (uint16_t)value);
+      return PARAM_OK;
+    case PARAM_ID_TUNE:
+      #ifdef COMMISSION_ENABLE
+      return Commission_Start((uint8_t)CLAMP(value, 0, 255), 0) ? PARAM_OK : PARAM_ERR_RANGE;
+      #else
+      return PARAM_ERR_READONLY;
+      #endif
+    case PARAM_ID_BAT_VOLTAGE:
+    case PARAM_ID_ERR_CODE:
+    case PARAM_ID_TELEM_DROPS:
+    case PARAM_ID_MOT_R:
+    case PARAM_ID_MOT_L:
+    case PARAM_ID_MOT_FLUX:
+    case PARAM_ID_ACC_FF_EST:
+      return PARAM_ERR_READONLY;
+  }
+  return PARAM_ERR_ID;
+}
+
+static uint16_t paramStore(uint8_t id, int32_t value) {
+  switch (id) {
+    case PARAM_ID_PWM_FREQ:
+      if (value < PWM_FREQ_MIN || value > PWM_FREQ_MAX) {
+        return PARAM_ERR_RANGE;
+      }
+      return pwmFreqStore((uint16_t)value) ? PARAM_OK : PARAM_ERR_FLASH;
+    case PARAM_ID_ID_KP:
+    case PARAM_ID_ID_KI:
+    case PARAM_ID_IQ_KP:
+    case PARAM_ID_IQ_KI:
+    case PARAM_ID_N_KP:
+    case PARAM_ID_N_KI:
+      if (value < 0 || value > 65535) {
+        return PARAM_ERR_RANGE;
+      }
+      return ctrlGainStore(id - PARAM_ID_ID_KP, (uint16_t)value) ? PARAM_OK : PARAM_ERR_FLASH;
+    case PARAM_ID_NC_KP:
+    case PARAM_ID_NC_KI:
+    case PARAM_ID_ACC_FF:
+      if (value < 0 || value > 65535) {
+        return PARAM_ERR_RANGE;
+      }
+      return ctrlGainStore(id - PARAM_ID_NC_KP + CTRL_GAIN_NC_KP, (uint16_t)value) ? PARAM_OK : PARAM_ERR_FLASH;
+    #ifdef COMMISSION_ENABLE
+    case PARAM_ID_TUNE:                         // the results are stored when the routine succeeds
+      return Commission_Start((uint8_t)CLAMP(value, 0, 255), 1) ? PARAM_OK : PARAM_ERR_RANGE;
+    #endif
+  }
+  return PARAM_ERR_CMD;
+}
+
+static void paramExecute(void) {
+  uint16_t status;
+
+  if (paramFrame.id >= PARAM_ID_COUNT) {
+    status = PARAM_ERR_ID;
+  } else {
+    switch (paramFrame.cmd) {
+      case PARAM_CMD_READ:
+        status = PARAM_OK;
+        break;
+      case PARAM_CMD_WRITE:
+        status = paramWrite(paramFrame.id, paramFrame.value);
+        break;
+      case PARAM_CMD_STORE:
+        status = paramStore(paramFrame.id, paramFrame.value);
+        break;
+      default:
+        status = PARAM_ERR_CMD;
+        break;
+    }
+  }
+
+  paramFrame.cmd   |= PARAM_CMD_REPLY;
+  paramFrame.value  = paramRead(paramFrame.id);
+  paramFrame.status = status;
+  paramFrame.crc    = crc16(0xFFFF, (const uint8_t *)&paramFrame, PARAM_FRAME_SIZE - 2);
+  Serial_Write(SERIAL_PORT_PARAM, (const uint8_t *)&paramFrame, PARAM_FRAME_SIZE);
+}
+
+/* Called from the main loop: parses the received bytes and answers the complete requests */
+void Param_Process(void) {
+  uint8_t *buf = (uint8_t *)&paramFrame;
+  uint8_t  c;
+
+  while (Serial_Read(SERIAL_PORT_PARAM, &c)) {
+    buf[paramLen++] = c;
+
+    // Synchronize on the start frame, byte by byte
+    if ((paramLen == 1 && c != (PARAM_START_FRAME & 0xFF)) ||
+        (paramLen == 2 && c != (PARAM_START_FRAME >> 8))) {
+      paramLen = (c == (PARAM_START_FRAME & 0xFF));
+      buf[0]   = c;
+      continue;
+    }
+
+    if (paramLen == PARAM_FRAME_SIZE) {
+      paramLen = 0;
+      if (crc16(0xFFFF, buf, PARAM_FRAME_SIZE - 2) == paramFrame.crc) {
+        paramExecute();
+      }
+    }
+  }
+}
+
+#endif
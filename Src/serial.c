@@ -0,0 +1,183 @@
+/*
+* This file implements the serial ports: TX ring buffers chained by the
+* DMA transfer complete interrupt and circular RX DMA buffers, one set
+* per USART, see serial.h.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "stm32f1xx_hal.h"
+#include "defines.h"
+#include "setup.h"
+#include "config.h"
+#include "serial.h"
+
+#if (SERIAL_TX_BUF_SIZE & (SERIAL_TX_BUF_SIZE - 1)) || (SERIAL_TX_BUF_SIZE < 128)
+  #error SERIAL_TX_BUF_SIZE must be a power of 2, at least 128.
+#endif
+
+extern UART_HandleTypeDef huart2;
+extern UART_HandleTypeDef huart3;
+
+#ifdef SERIAL_USART2_TX_RING
+static uint8_t txBuf2[SERIAL_TX_BUF_SIZE];
+#endif
+#ifdef SERIAL_USART2_RX_BUF
+static uint8_t rxBuf2[SERIAL_RX_BUF_SIZE];
+#endif
+#ifdef SERIAL_USART3_TX_RING
+static uint8_t txBuf3[SERIAL_TX_BUF_SIZE];
+#endif
+#ifdef SERIAL_USART3_RX_BUF
+static uint8_t rxBuf3[SERIAL_RX_BUF_SIZE];
+#endif
+
+SerialPort serialPort2 = {
+  .usart  = USART2,
+  .huart  = &huart2,
+  .txDma  = DMA1_Channel7,
+  .rxDma  = DMA1_Channel6,
+  .txIfcr = DMA_IFCR_CTCIF7 | DMA_IFCR_CHTIF7 | DMA_IFCR_CGIF7,
+  #ifdef SERIAL_USART2_TX_RING
+  .txBuf  = txBuf2,
+  #endif
+  #ifdef SERIAL_USART2_RX_BUF
+  .rxBuf  = rxBuf2,
+  #endif
+};
+
+SerialPort serialPort3 = {
+  .usart  = USART3,
+  .huart  = &huart3,
+  .txDma  = DMA1_Channel2,
+  .rxDma  = DMA1_Channel3,
+  .txIfcr = DMA_IFCR_CTCIF2 | DMA_IFCR_CHTIF2 | DMA_IFCR_CGIF2,
+  #ifdef SERIAL_USART3_TX_RING
+  .txBuf  = txBuf3,
+  #endif
+  #ifdef SERIAL_USART3_RX_BUF
+  .rxBuf  = rxBuf3,
+  #endif
+};
+
+#if defined(SERIAL_USART2_RX_BUF) || defined(SERIAL_USART3_RX_BUF)
+/* Start the circular RX DMA. The channel is configured by UARTx_Init() */
+static void serialRxStart(SerialPort *port) {
+  port->rxDma->CCR   &= ~DMA_CCR_EN;
+  port->rxDma->CPAR   = (uint32_t)&port->usart->DR;
+  port->rxDma->CMAR   = (uint32_t)port->rxBuf;
+  port->rxDma->CNDTR  = SERIAL_RX_BUF_SIZE;
+  port->rxDma->CCR   |= DMA_CCR_EN;
+  port->usart->CR3   |= USART_CR3_DMAR;
+  port->rxTail        = 0;
+}
+#endif
+
+void Serial_Init(void) {
+  #ifdef SERIAL_USART2
+    UART2_Init();
+  #endif
+  #ifdef SERIAL_USART3
+    UART3_Init();
+  #endif
+  #ifdef SERIAL_USART2_RX_BUF
+    serialRxStart(&serialPort2);
+  #endif
+  #ifdef SERIAL_USART3_RX_BUF
+    serialRxStart(&serialPort3);
+  #endif
+}
+
+/* Start the DMA on the next contiguous chunk. Call it with the interrupts disabled */
+static void serialTxStart(SerialPort *port) {
+  uint16_t used = port->txHead - port->txTail;
+  uint16_t idx  = port->txTail & (SERIAL_TX_BUF_SIZE - 1);
+
+  port->txChunk = MIN(used, SERIAL_TX_BUF_SIZE - idx);
+  if (port->txChunk == 0) {
+    return;
+  }
+  port->txDma->CCR   &= ~DMA_CCR_EN;
+  port->txDma->CNDTR  = port->txChunk;
+  port->txDma->CMAR   = (uint32_t)&port->txBuf[idx];
+  port->txDma->CCR   |= DMA_CCR_EN;
+}
+
+/* Called from the TX DMA transfer complete interrupt of the port */
+void Serial_TxCplt(SerialPort *port) {
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+  DMA1->IFCR     = port->txIfcr;
+  port->txTail  += port->txChunk;
+  serialTxStart(port);
+  __set_PRIMASK(primask);
+}
+
+/* Queue len bytes for transmission. The message is either queued completely or dropped and counted.
+ * Can be called from the main loop and from interrupts. Returns len if queued, 0 if dropped */
+uint16_t Serial_Write(SerialPort *port, const uint8_t *data, uint16_t len) {
+  uint32_t primask = __get_PRIMASK();
+  uint16_t used, idx, n;
+
+  if (port->txBuf == NULL) {
+    return 0;
+  }
+
+  __disable_irq();
+  used = port->txHead - port->txTail;
+  if (len > SERIAL_TX_BUF_SIZE - used) {
+    port->txOverflow++;
+    __set_PRIMASK(primask);
+    return 0;
+  }
+  idx = port->txHead & (SERIAL_TX_BUF_SIZE - 1);
+  n   = MIN(len, SERIAL_TX_BUF_SIZE - idx);
+  memcpy(&port->txBuf[idx], data, n);
+  memcpy(&port->txBuf[0], data + n, len - n);
+  port->txHead   += len;
+  port->txUsedMax = MAX(port->txUsedMax, used + len);
+  if (port->txChunk == 0) {
+    serialTxStart(port);
+  }
+  __set_PRIMASK(primask);
+  return len;
+}
+
+/* Free space in the TX ring buffer [bytes] */
+uint16_t Serial_TxFree(SerialPort *port) {
+  if (port->txBuf == NULL) {
+    return 0;
+  }
+  return SERIAL_TX_BUF_SIZE - (uint16_t)(port->txHead - port->txTail);
+}
+
+/* Read one byte from the RX DMA buffer. Returns 0 if there is none */
+uint8_t Serial_Read(SerialPort *port, uint8_t *data) {
+  uint16_t head;
+
+  if (port->rxBuf == NULL) {
+    return 0;
+  }
+  head = SERIAL_RX_BUF_SIZE - port->rxDma->CNDTR;     // circular mode: CNDTR is in [1, SERIAL_RX_BUF_SIZE]
+  if (port->rxTail == head) {
+    return 0;
+  }
+  *data         = port->rxBuf[port->rxTail];
+  port->rxTail  = (port->rxTail + 1) % SERIAL_RX_BUF_SIZE;
+  return 1;
+}
@@ -37,6 +37,7 @@ pb10 usart3 dma1 channel2/3
 
 #include "defines.h"
 #include "config.h"
+#include "serial.h"
 
 TIM_HandleTypeDef htim_right;
 TIM_HandleTypeDef htim_left;
@@ -53,7 +54,7 @@ DMA_HandleTypeDef hdma_usart3_tx;
 volatile adc_buf_t adc_buffer;
 
 
-#if defined(CONTROL_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART2) || defined(DEBUG_SERIAL_USART2)
+#ifdef SERIAL_USART2
 void UART2_Init(void) {
 
   /* The code below is commented out - otwerwise Serial Receive does not work */
@@ -81,14 +82,14 @@ void UART2_Init(void) {
   huart2.Init.Parity        = UART_PARITY_NONE;
   huart2.Init.HwFlowCtl     = UART_HWCONTROL_NONE;
   huart2.Init.OverSampling  = UART_OVERSAMPLING_16;
-  #if defined(CONTROL_SERIAL_USART2)
+  #ifdef SERIAL_USART2_RX
     huart2.Init.Mode        = UART_MODE_TX_RX;
-  #elif defined(DEBUG_SERIAL_USART2)
+  #else
     huart2.Init.Mode        = UART_MODE_TX;
   #endif
   HAL_UART_Init(&huart2);
 
-  #if defined(FEEDBACK_SERIAL_USART2) || defined(DEBUG_SERIAL_USART2)
+  #if defined(SERIAL_USART2_TX_RING) || defined(SERIAL_USART2_TELEMETRY)
     USART2->CR3 |= USART_CR3_DMAT;  // | USART_CR3_DMAR | USART_CR3_OVRDIS;
   #endif
 
@@ -99,11 +100,13 @@ void UART2_Init(void) {
   GPIO_InitStruct.Speed     = GPIO_SPEED_FREQ_HIGH;
   HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
 
-  #ifdef CONTROL_SERIAL_USART2
+  #ifdef SERIAL_USART2_RX
     GPIO_InitStruct.Pin     = GPIO_PIN_3;
     GPIO_InitStruct.Mode    = GPIO_MODE_INPUT; //GPIO_MODE_AF_PP;
     HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+  #endif
 
+  #if defined(CONTROL_SERIAL_USART2) || defined(SERIAL_USART2_RX_BUF)
     /* Peripheral DMA init*/
     hdma_usart2_rx.Instance                 = DMA1_Channel6;
     hdma_usart2_rx.Init.Direction           = DMA_PERIPH_TO_MEMORY;
@@ -114,7 +117,9 @@ void UART2_Init(void) {
     hdma_usart2_rx.Init.Mode                = DMA_CIRCULAR; //DMA_NORMAL;
     hdma_usart2_rx.Init.Priority            = DMA_PRIORITY_LOW;
     HAL_DMA_Init(&hdma_usart2_rx);
-    __HAL_LINKDMA(&huart2, hdmarx, hdma_usart2_rx);
+  #endif
+  #ifdef CONTROL_SERIAL_USART2
+    __HAL_LINKDMA(&huart2, hdmarx, hdma_usart2_rx);       // the RX buffer DMA is started by Serial_Init()
   #endif
 
   hdma_usart2_tx.Instance                   = DMA1_Channel7;
@@ -130,16 +135,21 @@ void UART2_Init(void) {
   #ifdef CONTROL_SERIAL_USART2
     __HAL_LINKDMA(&huart2, hdmatx, hdma_usart2_tx);
   #endif
-  #if defined(FEEDBACK_SERIAL_USART2) || defined(DEBUG_SERIAL_USART2)
+  #if defined(SERIAL_USART2_TX_RING) || defined(SERIAL_USART2_TELEMETRY)
     DMA1_Channel7->CPAR     = (uint32_t) & (USART2->DR);
     DMA1_Channel7->CNDTR    = 0;
     DMA1->IFCR              = DMA_IFCR_CTCIF7 | DMA_IFCR_CHTIF7 | DMA_IFCR_CGIF7;
   #endif
+  #ifdef SERIAL_USART2_TX_RING
+    DMA1_Channel7->CCR     |= DMA_CCR_TCIE;                     // chain the TX ring buffer chunks, see Serial_TxCplt()
+    HAL_NVIC_SetPriority(DMA1_Channel7_IRQn, 2, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Channel7_IRQn);
+  #endif
 
 }
 #endif
 
-#if defined(CONTROL_SERIAL_USART3) || defined(FEEDBACK_SERIAL_USART3) || defined(DEBUG_SERIAL_USART3)
+#ifdef SERIAL_USART3
 void UART3_Init(void) {
 
   /* The code below is commented out - otwerwise Serial Receive does not work */
@@ -167,14 +177,14 @@ void UART3_Init(void) {
   huart3.Init.Parity          = UART_PARITY_NONE;
   huart3.Init.HwFlowCtl       = UART_HWCONTROL_NONE;
   huart3.Init.OverSampling    = UART_OVERSAMPLING_16;
-  #if defined(CONTROL_SERIAL_USART3)
+  #ifdef SERIAL_USART3_RX
     huart3.Init.Mode          = UART_MODE_TX_RX;
-  #elif defined(DEBUG_SERIAL_USART3)
+  #else
     huart3.Init.Mode          = UART_MODE_TX;
   #endif
   HAL_UART_Init(&huart3);
 
-  #if defined(FEEDBACK_SERIAL_USART3) || defined(DEBUG_SERIAL_USART3)
+  #if defined(SERIAL_USART3_TX_RING) || defined(SERIAL_USART3_TELEMETRY)
     USART3->CR3 |= USART_CR3_DMAT;  // | USART_CR3_DMAR | USART_CR3_OVRDIS;
   #endif
 
@@ -185,11 +195,13 @@ void UART3_Init(void) {
   GPIO_InitStruct.Speed       = GPIO_SPEED_FREQ_HIGH;
   HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
 
-  #ifdef CONTROL_SERIAL_USART3
+  #ifdef SERIAL_USART3_RX
     GPIO_InitStruct.Pin       = GPIO_PIN_11;
     GPIO_InitStruct.Mode      = GPIO_MODE_INPUT;
     HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+  #endif
 
+  #if defined(CONTROL_SERIAL_USART3) || defined(SERIAL_USART3_RX_BUF)
     /* Peripheral DMA init*/
     hdma_usart3_rx.Instance                   = DMA1_Channel3;
     hdma_usart3_rx.Init.Direction             = DMA_PERIPH_TO_MEMORY;
@@ -200,7 +212,9 @@ void UART3_Init(void) {
     hdma_usart3_rx.Init.Mode                  = DMA_CIRCULAR; //DMA_NORMAL;
     hdma_usart3_rx.Init.Priority              = DMA_PRIORITY_LOW;
     HAL_DMA_Init(&hdma_usart3_rx);
-    __HAL_LINKDMA(&huart3, hdmarx, hdma_usart3_rx);
+  #endif
+  #ifdef CONTROL_SERIAL_USART3
+    __HAL_LINKDMA(&huart3, hdmarx, hdma_usart3_rx);       // the RX buffer DMA is started by Serial_Init()
   #endif
 
   hdma_usart3_tx.Instance                     = DMA1_Channel2;
@@ -216,10 +230,15 @@ void UART3_Init(void) {
   #ifdef CONTROL_SERIAL_USART3
     __HAL_LINKDMA(&huart3, hdmatx, hdma_usart3_tx);
   #endif
-  #if defined(FEEDBACK_SERIAL_USART3) || defined(DEBUG_SERIAL_USART3)
+  #if defined(SERIAL_USART3_TX_RING) || defined(SERIAL_USART3_TELEMETRY)
     DMA1_Channel2->CPAR     = (uint32_t) & (USART3->DR);
     DMA1_Channel2->CNDTR    = 0;
     DMA1->IFCR              = DMA_IFCR_CTCIF2 | DMA_IFCR_CHTIF2 | DMA_IFCR_CGIF2;
+  #endif
+  #ifdef SERIAL_USART3_TX_RING
+    DMA1_Channel2->CCR     |= DMA_CCR_TCIE;                     // chain the TX ring buffer chunks, see Serial_TxCplt()
+    HAL_NVIC_SetPriority(DMA1_Channel2_IRQn, 2, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Channel2_IRQn);
   #endif  
 }
 #endif
@@ -442,7 +461,7 @@ void MX_TIM_Init(void) {
   htim_right.Init.Period            = 64000000 / 2 / PWM_FREQ;
   htim_right.Init.ClockDivision     = TIM_CLOCKDIVISION_DIV1;
   htim_right.Init.RepetitionCounter = 0;
-  htim_right.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+  htim_right.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;   // the PWM frequency can be changed at runtime at the period boundary
   HAL_TIM_PWM_Init(&htim_right);
 
   sMasterConfig.MasterOutputTrigger = TIM_TRGO_ENABLE;
@@ -471,11 +490,15 @@ void MX_TIM_Init(void) {
 
   htim_left.Instance               = LEFT_TIM;
   htim_left.Init.Prescaler         = 0;
+  #if (CURR_OVERSAMPLE == 1)
+  htim_left.Init.CounterMode       = TIM_COUNTERMODE_CENTERALIGNED3;  // compare events when counting up AND down: 2 current samples per period
+  #else
   htim_left.Init.CounterMode       = TIM_COUNTERMODE_CENTERALIGNED1;
+  #endif
   htim_left.Init.Period            = 64000000 / 2 / PWM_FREQ;
   htim_left.Init.ClockDivision     = TIM_CLOCKDIVISION_DIV1;
   htim_left.Init.RepetitionCounter = 0;
-  htim_left.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+  htim_left.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;
   HAL_TIM_PWM_Init(&htim_left);
 
   sMasterConfig.MasterOutputTrigger = TIM_TRGO_UPDATE;
@@ -501,6 +524,13 @@ void MX_TIM_Init(void) {
   HAL_TIM_PWM_ConfigChannel(&htim_left, &sConfigOC, TIM_CHANNEL_2);
   HAL_TIM_PWM_ConfigChannel(&htim_left, &sConfigOC, TIM_CHANNEL_3);
 
+  // Channel 4 has no output pin, it only triggers the injected ADC conversions (Phase and DC Link currents).
+  // The compare event in center-aligned mode 1 comes when counting down, so ARR - 1 triggers right after the counter peak (LOW-FET ON region)
+  // In center-aligned mode 3 it comes counting up and down: ARR - CURR_OS_DELTA gives two triggers around the counter peak
+  sConfigOC.OCMode       = TIM_OCMODE_PWM2;
+  sConfigOC.Pulse        = 64000000 / 2 / PWM_FREQ - ADC_INJ_TRIG_OFS;
+  HAL_TIM_PWM_ConfigChannel(&htim_left, &sConfigOC, TIM_CHANNEL_4);
+
   sBreakDeadTimeConfig.OffStateRunMode  = TIM_OSSR_ENABLE;
   sBreakDeadTimeConfig.OffStateIDLEMode = TIM_OSSI_ENABLE;
   sBreakDeadTimeConfig.LockLevel        = TIM_LOCKLEVEL_OFF;
@@ -519,6 +549,7 @@ void MX_TIM_Init(void) {
   HAL_TIMEx_PWMN_Start(&htim_left, TIM_CHANNEL_1);
   HAL_TIMEx_PWMN_Start(&htim_left, TIM_CHANNEL_2);
   HAL_TIMEx_PWMN_Start(&htim_left, TIM_CHANNEL_3);  
+  HAL_TIM_PWM_Start(&htim_left, TIM_CHANNEL_4);
 
   HAL_TIM_PWM_Start(&htim_right, TIM_CHANNEL_1);
   HAL_TIM_PWM_Start(&htim_right, TIM_CHANNEL_2);
@@ -527,14 +558,22 @@ void MX_TIM_Init(void) {
   HAL_TIMEx_PWMN_Start(&htim_right, TIM_CHANNEL_2);
   HAL_TIMEx_PWMN_Start(&htim_right, TIM_CHANNEL_3);
 
-  htim_left.Instance->RCR = 1;
+  // Update event at every under/overflow, same as TIM1: a new ARR (runtime PWM frequency) is loaded at the same point of the period by both timers
+  htim_left.Instance->RCR = 0;
 
   __HAL_TIM_ENABLE(&htim_right);
 }
 
+/* ADC1 init function
+ * The ADCs run in combined injected simultaneous + regular simultaneous mode:
+ * - injected group: Phase and DC Link currents, triggered by TIM8 CC4 once per PWM period. The JEOC interrupt runs the motor control.
+ * - regular group:  battery voltage, temperature and the ADC1/ADC2 inputs (housekeeping). Started by software every ADC_HK_DIV
+ *                   PWM periods from the motor control interrupt and transferred by DMA into adc_buffer.
+ */
 void MX_ADC1_Init(void) {
   ADC_MultiModeTypeDef multimode;
   ADC_ChannelConfTypeDef sConfig;
+  ADC_InjectionConfTypeDef sConfigInjected;
 
   __HAL_RCC_ADC1_CLK_ENABLE();
 
@@ -542,65 +581,78 @@ void MX_ADC1_Init(void) {
   hadc1.Init.ScanConvMode          = ADC_SCAN_ENABLE;
   hadc1.Init.ContinuousConvMode    = DISABLE;
   hadc1.Init.DiscontinuousConvMode = DISABLE;
-  hadc1.Init.ExternalTrigConv      = ADC_EXTERNALTRIGCONV_T8_TRGO;
+  hadc1.Init.ExternalTrigConv      = ADC_SOFTWARE_START;
   hadc1.Init.DataAlign             = ADC_DATAALIGN_RIGHT;
-  hadc1.Init.NbrOfConversion       = 5;
+  hadc1.Init.NbrOfConversion       = 2;
   HAL_ADC_Init(&hadc1);
-  /**Enable or disable the remapping of ADC1_ETRGREG:
-    * ADC1 External Event regular conversion is connected to TIM8 TRG0
+  /**Enable or disable the remapping of ADC1_ETRGINJ:
+    * ADC1 External Event injected conversion is connected to TIM8 Channel 4
     */
-  __HAL_AFIO_REMAP_ADC1_ETRGREG_ENABLE();
+  __HAL_AFIO_REMAP_ADC1_ETRGINJ_ENABLE();
 
   /**Configure the ADC multi-mode
     */
-  multimode.Mode = ADC_DUALMODE_REGSIMULT;
+  multimode.Mode = ADC_DUALMODE_REGSIMULT_INJECSIMULT;
   HAL_ADCEx_MultiModeConfigChannel(&hadc1, &multimode);
 
-  sConfig.SamplingTime = ADC_SAMPLETIME_1CYCLE_5;
-  sConfig.Channel = ADC_CHANNEL_11;  // pc1 left cur  ->  right
-  sConfig.Rank    = 1;
-  HAL_ADC_ConfigChannel(&hadc1, &sConfig);
+  sConfigInjected.InjectedNbrOfConversion       = 3;
+  sConfigInjected.InjectedDiscontinuousConvMode = DISABLE;
+  sConfigInjected.AutoInjectedConv              = DISABLE;
+  sConfigInjected.ExternalTrigInjecConv         = ADC_EXTERNALTRIGINJECCONV_T8_CC4;
+  sConfigInjected.InjectedOffset                = 0;
 
-  // sConfig.SamplingTime = ADC_SAMPLETIME_1CYCLE_5;
-  sConfig.SamplingTime = ADC_SAMPLETIME_7CYCLES_5;
-  sConfig.Channel = ADC_CHANNEL_0;  // pa0 right a   ->  left
-  sConfig.Rank    = 2;
-  HAL_ADC_ConfigChannel(&hadc1, &sConfig);
+  sConfigInjected.InjectedSamplingTime = ADC_SAMPLETIME_1CYCLE_5;
+  sConfigInjected.InjectedChannel = ADC_CHANNEL_11;  // pc1 left cur  ->  right
+  sConfigInjected.InjectedRank    = ADC_INJECTED_RANK_1;
+  HAL_ADCEx_InjectedConfigChannel(&hadc1, &sConfigInjected);
 
-  sConfig.Channel = ADC_CHANNEL_14;  // pc4 left b   -> right
-  sConfig.Rank    = 3;
-  HAL_ADC_ConfigChannel(&hadc1, &sConfig);
+  // sConfigInjected.InjectedSamplingTime = ADC_SAMPLETIME_1CYCLE_5;
+  sConfigInjected.InjectedSamplingTime = ADC_SAMPLETIME_7CYCLES_5;
+  sConfigInjected.InjectedChannel = ADC_CHANNEL_0;  // pa0 right a   ->  left
+  sConfigInjected.InjectedRank    = ADC_INJECTED_RANK_2;
+  HAL_ADCEx_InjectedConfigChannel(&hadc1, &sConfigInjected);
+
+  sConfigInjected.InjectedChannel = ADC_CHANNEL_14;  // pc4 left b   -> right
+  sConfigInjected.InjectedRank    = ADC_INJECTED_RANK_3;
+  HAL_ADCEx_InjectedConfigChannel(&hadc1, &sConfigInjected);
 
+  sConfig.SamplingTime = ADC_SAMPLETIME_7CYCLES_5;
   sConfig.Channel = ADC_CHANNEL_12;  // pc2 vbat
-  sConfig.Rank    = 4;
+  sConfig.Rank    = 1;
   HAL_ADC_ConfigChannel(&hadc1, &sConfig);
 
   //temperature requires at least 17.1uS sampling time
   sConfig.SamplingTime = ADC_SAMPLETIME_239CYCLES_5;
   sConfig.Channel = ADC_CHANNEL_TEMPSENSOR;  // internal temp
-  sConfig.Rank    = 5;
+  sConfig.Rank    = 2;
   HAL_ADC_ConfigChannel(&hadc1, &sConfig);
 
-  hadc1.Instance->CR2 |= ADC_CR2_DMA | ADC_CR2_TSVREFE;
+  hadc1.Instance->CR2 |= ADC_CR2_DMA | ADC_CR2_TSVREFE | ADC_CR2_EXTTRIG | ADC_CR2_JEXTTRIG;
 
   __HAL_ADC_ENABLE(&hadc1);
 
   __HAL_RCC_DMA1_CLK_ENABLE();
 
   DMA1_Channel1->CCR   = 0;
-  DMA1_Channel1->CNDTR = 5;
+  DMA1_Channel1->CNDTR = 2;
   DMA1_Channel1->CPAR  = (uint32_t) & (ADC1->DR);
-  DMA1_Channel1->CMAR  = (uint32_t)&adc_buffer;
+  DMA1_Channel1->CMAR  = (uint32_t)&adc_buffer.batt1;
   DMA1_Channel1->CCR   = DMA_CCR_MSIZE_1 | DMA_CCR_PSIZE_1 | DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_TCIE;
   DMA1_Channel1->CCR |= DMA_CCR_EN;
 
-  HAL_NVIC_SetPriority(DMA1_Channel1_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(DMA1_Channel1_IRQn, 1, 0);   // housekeeping, must NOT preempt the motor control
   HAL_NVIC_EnableIRQ(DMA1_Channel1_IRQn);
+
+  __HAL_ADC_CLEAR_FLAG(&hadc1, ADC_FLAG_JEOC);
+  __HAL_ADC_ENABLE_IT(&hadc1, ADC_IT_JEOC);
+  HAL_NVIC_SetPriority(ADC1_2_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(ADC1_2_IRQn);
 }
 
 /* ADC2 init function */
 void MX_ADC2_Init(void) {
   ADC_ChannelConfTypeDef sConfig;
+  ADC_InjectionConfTypeDef sConfigInjected;
 
   __HAL_RCC_ADC2_CLK_ENABLE();
 
@@ -614,34 +666,41 @@ void MX_ADC2_Init(void) {
   hadc2.Init.DiscontinuousConvMode = DISABLE;
   hadc2.Init.ExternalTrigConv      = ADC_SOFTWARE_START;
   hadc2.Init.DataAlign             = ADC_DATAALIGN_RIGHT;
-  hadc2.Init.NbrOfConversion       = 5;
+  hadc2.Init.NbrOfConversion       = 2;
   HAL_ADC_Init(&hadc2);
 
- 
-  sConfig.SamplingTime = ADC_SAMPLETIME_1CYCLE_5;
-  sConfig.Channel = ADC_CHANNEL_10;  // pc0 right cur   -> left
-  sConfig.Rank    = 1;
-  HAL_ADC_ConfigChannel(&hadc2, &sConfig);
+  sConfigInjected.InjectedNbrOfConversion       = 3;
+  sConfigInjected.InjectedDiscontinuousConvMode = DISABLE;
+  sConfigInjected.AutoInjectedConv              = DISABLE;
+  sConfigInjected.ExternalTrigInjecConv         = ADC_INJECTED_SOFTWARE_START;  // slave: triggered together with ADC1
+  sConfigInjected.InjectedOffset                = 0;
 
-  // sConfig.SamplingTime = ADC_SAMPLETIME_1CYCLE_5;
-  sConfig.SamplingTime = ADC_SAMPLETIME_7CYCLES_5;
-  sConfig.Channel = ADC_CHANNEL_13;  // pc3 right b   -> left
-  sConfig.Rank    = 2;
-  HAL_ADC_ConfigChannel(&hadc2, &sConfig);
+  sConfigInjected.InjectedSamplingTime = ADC_SAMPLETIME_1CYCLE_5;
+  sConfigInjected.InjectedChannel = ADC_CHANNEL_10;  // pc0 right cur   -> left
+  sConfigInjected.InjectedRank    = ADC_INJECTED_RANK_1;
+  HAL_ADCEx_InjectedConfigChannel(&hadc2, &sConfigInjected);
 
-  sConfig.Channel = ADC_CHANNEL_15;  // pc5 left c   -> right
-  sConfig.Rank    = 3;
-  HAL_ADC_ConfigChannel(&hadc2, &sConfig);
+  // sConfigInjected.InjectedSamplingTime = ADC_SAMPLETIME_1CYCLE_5;
+  sConfigInjected.InjectedSamplingTime = ADC_SAMPLETIME_7CYCLES_5;
+  sConfigInjected.InjectedChannel = ADC_CHANNEL_13;  // pc3 right b   -> left
+  sConfigInjected.InjectedRank    = ADC_INJECTED_RANK_2;
+  HAL_ADCEx_InjectedConfigChannel(&hadc2, &sConfigInjected);
 
+  sConfigInjected.InjectedChannel = ADC_CHANNEL_15;  // pc5 left c   -> right
+  sConfigInjected.InjectedRank    = ADC_INJECTED_RANK_3;
+  HAL_ADCEx_InjectedConfigChannel(&hadc2, &sConfigInjected);
+
+  sConfig.SamplingTime = ADC_SAMPLETIME_7CYCLES_5;
   sConfig.Channel = ADC_CHANNEL_2;  // pa2 uart-l-tx
-  sConfig.Rank    = 4;
+  sConfig.Rank    = 1;
   HAL_ADC_ConfigChannel(&hadc2, &sConfig);
 
   sConfig.SamplingTime = ADC_SAMPLETIME_239CYCLES_5;
   sConfig.Channel = ADC_CHANNEL_3;  // pa3 uart-l-rx
-  sConfig.Rank    = 5;
+  sConfig.Rank    = 2;
   HAL_ADC_ConfigChannel(&hadc2, &sConfig);
 
-  hadc2.Instance->CR2 |= ADC_CR2_DMA;
+  // Dual mode: the slave converts on the triggers of ADC1 only if its external triggers are enabled too (EXTSEL/JEXTSEL = software start)
+  hadc2.Instance->CR2 |= ADC_CR2_DMA | ADC_CR2_EXTTRIG | ADC_CR2_JEXTTRIG;
   __HAL_ADC_ENABLE(&hadc2);
 }
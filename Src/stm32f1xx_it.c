@@ -35,6 +35,7 @@
 #include "stm32f1xx.h"
 #include "stm32f1xx_it.h"
 #include "config.h"
+#include "serial.h"
 
 extern DMA_HandleTypeDef hdma_i2c2_rx;
 extern DMA_HandleTypeDef hdma_i2c2_tx;
@@ -238,6 +239,14 @@ void DMA1_Channel6_IRQHandler(void)
   /* USER CODE END DMA1_Channel4_IRQn 1 */
 }
 
+#endif
+
+#if defined(SERIAL_USART2_TX_RING)
+void DMA1_Channel7_IRQHandler(void)
+{
+  Serial_TxCplt(&serialPort2);
+}
+#elif defined(CONTROL_SERIAL_USART2)
 /**
 * @brief This function handles DMA1 channel5 global interrupt.
 */
@@ -253,6 +262,13 @@ void DMA1_Channel7_IRQHandler(void)
 }
 #endif
 
+#ifdef SERIAL_USART3_TX_RING
+void DMA1_Channel2_IRQHandler(void)
+{
+  Serial_TxCplt(&serialPort3);
+}
+#endif
+
 /******************************************************************************/
 /* STM32F1xx Peripheral Interrupt Handlers                                    */
 /* Add here the Interrupt Handlers for the used peripherals.                  */
@@ -0,0 +1,164 @@
+/*
+* This file implements the binary telemetry stream.
+* The selected channels are sampled in the motor control ISR and sent
+* with the DMA in double buffered frames, see telemetry.h.
+*
+* Copyright (C) 2019-2020 Emanuel FERU <aerdronix@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stm32f1xx_hal.h"
+#include "defines.h"
+#include "config.h"
+#include "telemetry.h"
+#include "serial.h"
+#include "BLDC_controller.h"
+#include "rtwtypes.h"
+
+#ifdef FEEDBACK_TELEMETRY
+
+#define TELEM_DMA_CHANNEL       (SERIAL_PORT_FEEDBACK->txDma)
+#if defined(FEEDBACK_SERIAL_USART2)
+  #define TELEM_BAUD            USART2_BAUD
+#elif defined(FEEDBACK_SERIAL_USART3)
+  #define TELEM_BAUD            USART3_BAUD
+#endif
+
+#if (TELEM_NB_CH == 0) || (TELEM_SAMPLES * TELEM_NB_CH > 1000)
+  #error TELEM_CHANNELS must select at least one channel and TELEM_SAMPLES * channels must be at most 1000.
+#endif
+
+// A frame must be sent faster than the next one is filled: 10 bits per byte, 20% margin
+#if (TELEM_FRAME_SIZE * 10 * TELEM_RATE / TELEM_SAMPLES * 12 / 10 > TELEM_BAUD)
+  #error Telemetry bandwidth exceeds the USART baud rate: increase the baud rate, reduce TELEM_RATE or the number of channels, or increase TELEM_SAMPLES.
+#endif
+
+typedef struct {
+  uint16_t  start;
+  uint16_t  seq;
+  uint32_t  chMask;
+  uint8_t   nbCh;
+  uint8_t   nbSmp;
+  uint16_t  dropCnt;
+  int16_t   data[TELEM_SAMPLES * TELEM_NB_CH + 1];    // samples followed by the CRC
+} TelemFrame;
+
+extern ExtY rtY_Left;
+extern ExtY rtY_Right;
+extern int16_t curL_phaA, curL_phaB, curL_DC;
+extern int16_t curR_phaB, curR_phaC, curR_DC;
+extern uint8_t errCode_Left, errCode_Right;
+extern int16_t batVoltage;
+
+volatile uint16_t telemDropCnt  = 0;    // number of frames dropped because the previous frame was still being sent
+static TelemFrame telemBuf[2];
+static uint8_t    telemFill     = 0;    // buffer being filled, the other one may be in use by the DMA
+static uint16_t   telemIdx      = 0;    // next data index in the buffer being filled
+static uint16_t   telemSeq      = 0;
+static uint16_t   telemCrc;
+
+/* Called from the motor control ISR at TELEM_RATE */
+void Telemetry_Sample(void) {
+  TelemFrame *frame = &telemBuf[telemFill];
+  int16_t *p;
+
+  if (telemIdx == 0) {
+    frame->start    = TELEM_START_FRAME;
+    frame->seq      = telemSeq++;
+    frame->chMask   = TELEM_CHANNELS;
+    frame->nbCh     = TELEM_NB_CH;
+    frame->nbSmp    = TELEM_SAMPLES;
+    frame->dropCnt  = telemDropCnt;
+    telemCrc        = crc16(0xFFFF, (const uint8_t *)frame, TELEM_HEADER_SIZE);
+  }
+
+  p = &frame->data[telemIdx];
+  #if TELEM_CH_BIT(TELEM_CH_N_MOT_L)
+  *p++ = rtY_Left.n_mot;
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_N_MOT_R)
+  *p++ = rtY_Right.n_mot;
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_ANGLE_L)
+  *p++ = rtY_Left.a_elecAngle;
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_ANGLE_R)
+  *p++ = rtY_Right.a_elecAngle;
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_CUR_L_PHA_A)
+  *p++ = curL_phaA;
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_CUR_L_PHA_B)
+  *p++ = curL_phaB;
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_CUR_R_PHA_B)
+  *p++ = curR_phaB;
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_CUR_R_PHA_C)
+  *p++ = curR_phaC;
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_CUR_L_DC)
+  *p++ = curL_DC;
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_CUR_R_DC)
+  *p++ = curR_DC;
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_DC_L_PHA_A)
+  *p++ = rtY_Left.DC_phaA;
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_DC_L_PHA_B)
+  *p++ = rtY_Left.DC_phaB;
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_DC_L_PHA_C)
+  *p++ = rtY_Left.DC_phaC;
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_DC_R_PHA_A)
+  *p++ = rtY_Right.DC_phaA;
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_DC_R_PHA_B)
+  *p++ = rtY_Right.DC_phaB;
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_DC_R_PHA_C)
+  *p++ = rtY_Right.DC_phaC;
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_ERR_CODE)
+  *p++ = (int16_t)(errCode_Left | (errCode_Right << 8));
+  #endif
+  #if TELEM_CH_BIT(TELEM_CH_BAT_VOLTAGE)
+  *p++ = batVoltage;
+  #endif
+  (void)p;
+
+  telemCrc  = crc16(telemCrc, (const uint8_t *)&frame->data[telemIdx], 2 * TELEM_NB_CH);
+  telemIdx += TELEM_NB_CH;
+  if (telemIdx < TELEM_SAMPLES * TELEM_NB_CH) {
+    return;
+  }
+
+  // Frame complete
+  frame->data[telemIdx] = (int16_t)telemCrc;
+  telemIdx = 0;
+  if (TELEM_DMA_CHANNEL->CNDTR == 0) {                  // previous frame is sent: send this one and fill the other buffer
+    TELEM_DMA_CHANNEL->CCR   &= ~DMA_CCR_EN;
+    TELEM_DMA_CHANNEL->CNDTR  = TELEM_FRAME_SIZE;
+    TELEM_DMA_CHANNEL->CMAR   = (uint32_t)frame;
+    TELEM_DMA_CHANNEL->CCR   |= DMA_CCR_EN;
+    telemFill ^= 1;
+  } else {                                              // both buffers busy: drop this frame and refill it
+    telemDropCnt++;
+  }
+}
+
+#endif